@@ -4,9 +4,18 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#define _GNU_SOURCE // For memfd_create, struct ucred, vmsplice, cpu_set_t, and pipe2.
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -14,7 +23,12 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -137,6 +151,8 @@ typedef struct bh_pcie_device_t {
   char* tlb; // 2 MiB window into device memory, configured using tlb_reconfigure.
   size_t host_page_size;
   size_t total_mmap_size;
+  int numa_node; // NUMA node that the device is attached to, or -1 if unknown.
+  char pci_address[16]; // Domain:bus:device.function, as used in sysfs paths.
 } bh_pcie_device_t;
 
 #define PCI_VENDOR_ID_TENSTORRENT 0x1E52
@@ -168,6 +184,20 @@ static uintptr_t parse_small_int(const char* str) {
   }
 }
 
+static int read_small_sysfs_int(const char* path) {
+  // Returns -1 if the file doesn't exist or doesn't contain an integer.
+  char buf[32];
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) return -1;
+  buf[n] = '\0';
+  char* end;
+  long v = strtol(buf, &end, 10);
+  return end == buf ? -1 : (int)v;
+}
+
 static bh_pcie_device_t* open_bh_pcie_device(const char* device_fn) {
   // If passed an integer or an empty string, form a more useful path.
   char device_fn_buf[20];
@@ -249,6 +279,17 @@ static bh_pcie_device_t* open_bh_pcie_device(const char* device_fn) {
   result->tlb = (char*)memory + header_size + bar0_size;
   result->host_page_size = (size_t)page;
   result->total_mmap_size = total_mmap_size;
+
+  // Find the NUMA node that the device is attached to (pci_domain requires tt-kmd 1.23 or later; assume 0 before that).
+  {
+    char numa_path[64];
+    unsigned bdf = dev_info.out.bus_dev_fn;
+    bool have_domain = dev_info.out.output_size_bytes >= sizeof(dev_info.out);
+    sprintf(result->pci_address, "%04x:%02x:%02x.%u", have_domain ? (unsigned)dev_info.out.pci_domain & 0xffff : 0u,
+      (bdf >> 8) & 0xff, (bdf >> 3) & 0x1f, bdf & 7);
+    sprintf(numa_path, "/sys/bus/pci/devices/%s/numa_node", result->pci_address);
+    result->numa_node = read_small_sysfs_int(numa_path);
+  }
   return result;
 }
 
@@ -303,7 +344,7 @@ typedef struct pinned_host_buffer_t {
   uint64_t noc_addr;
 } pinned_host_buffer_t;
 
-static void allocate_host_buffer(bh_pcie_device_t* device, pinned_host_buffer_t* buf) {
+static bool try_allocate_host_buffer(bh_pcie_device_t* device, pinned_host_buffer_t* buf) {
   // Caller has set buf->size, this function populates buf->host_ptr and buf->noc_addr.
 
   // Try doing a regular allocation and pinning it.
@@ -320,7 +361,7 @@ static void allocate_host_buffer(bh_pcie_device_t* device, pinned_host_buffer_t*
       if (ioctl(device->fd, TENSTORRENT_IOCTL_PIN_PAGES, &pin_req) >= 0) {
         buf->host_ptr = memory;
         buf->noc_addr = pin_req.out.noc_address;
-        return;
+        return true;
       }
       munmap(memory, buf->size);
     }
@@ -332,7 +373,7 @@ static void allocate_host_buffer(bh_pcie_device_t* device, pinned_host_buffer_t*
       if (ioctl(device->fd, TENSTORRENT_IOCTL_PIN_PAGES, &pin_req) >= 0) {
         buf->host_ptr = memory;
         buf->noc_addr = pin_req.out.noc_address;
-        return;
+        return true;
       }
       munmap(memory, buf->size);
     }
@@ -349,14 +390,309 @@ static void allocate_host_buffer(bh_pcie_device_t* device, pinned_host_buffer_t*
       if (memory != MAP_FAILED) {
         buf->host_ptr = memory;
         buf->noc_addr = dma_req.out.noc_address;
-        return;
+        return true;
       }
     }
   }
   // Out of options.
+  return false;
+}
+
+static int allocate_shared_host_buffer(bh_pcie_device_t* device, pinned_host_buffer_t* buf) {
+  // As per allocate_host_buffer, but the memory is backed by a memfd (which is returned), so
+  // that other processes can map it. DMA allocations cannot be shared in this way, so this
+  // requires either an IOMMU or a huge page size matching buf->size.
+  struct tenstorrent_pin_pages_extended pin_req;
+  memset(&pin_req, 0, sizeof(pin_req));
+  pin_req.in.output_size_bytes = sizeof(pin_req.out);
+  pin_req.in.flags = TENSTORRENT_PIN_PAGES_NOC_DMA | TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN;
+  pin_req.in.size = buf->size;
+  const unsigned memfd_flags[2] = {
+    MFD_CLOEXEC,
+    MFD_CLOEXEC | MFD_HUGETLB | (__builtin_ctzll(buf->size) << MAP_HUGE_SHIFT), // MFD_HUGE_SHIFT == MAP_HUGE_SHIFT
+  };
+  for (unsigned i = 0; i < 2; ++i) {
+    int fd = memfd_create("ethdump_h_ring", memfd_flags[i]);
+    if (fd < 0) continue;
+    if (ftruncate(fd, buf->size) == 0) {
+      void* memory = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (memory != MAP_FAILED) {
+        pin_req.in.virtual_address = (uint64_t)(uintptr_t)memory;
+        if (ioctl(device->fd, TENSTORRENT_IOCTL_PIN_PAGES, &pin_req) >= 0) {
+          buf->host_ptr = memory;
+          buf->noc_addr = pin_req.out.noc_address;
+          return fd;
+        }
+        munmap(memory, buf->size);
+      }
+    }
+    close(fd);
+  }
+  FATAL("Could not allocate and pin a shareable host buffer of %llu bytes (this requires an IOMMU, or huge pages of that size)", (long long unsigned)buf->size);
+}
+
+// Pinned memory arena:
+// Pinning is done in large regions, which are then carved up into blocks. This avoids
+// spending a whole page, a pin ioctl, and an IOMMU mapping on every 64-byte metadata
+// block, and means that starting additional rings (or restarting them) doesn't go through
+// the allocation fallback chain again. The NoC address of a block is the NoC address of
+// its region plus the offset of the block within the region. Regions are kept for the
+// lifetime of the arena; freed blocks go back into the arena for reuse.
+
+#define ARENA_MAX_REGIONS 16
+#define ARENA_MAX_EXTENTS 256
+#define ARENA_REGION_SIZE (2u << 20) // Smallest region size to try first; matches the usual huge page size.
+#define ARENA_MIN_ALIGN 64
+
+typedef struct arena_extent_t {
+  uint32_t region;
+  uint32_t offset;
+  uint32_t size;
+} arena_extent_t;
+
+typedef struct pinned_arena_t {
+  bh_pcie_device_t* device;
+  uint32_t num_regions;
+  uint32_t num_free;
+  pinned_host_buffer_t regions[ARENA_MAX_REGIONS];
+  arena_extent_t free[ARENA_MAX_EXTENTS]; // Sorted by (region, offset), with adjacent extents coalesced.
+} pinned_arena_t;
+
+static pinned_arena_t* pinned_arena_create(bh_pcie_device_t* device) {
+  pinned_arena_t* arena = calloc(1, sizeof(pinned_arena_t));
+  if (!arena) FATAL("Could not allocate memory for pinned arena");
+  arena->device = device;
+  return arena;
+}
+
+static void pinned_arena_insert_free(pinned_arena_t* arena, arena_extent_t e) {
+  if (!e.size) return;
+  uint32_t i = 0;
+  while (i < arena->num_free && (arena->free[i].region < e.region || (arena->free[i].region == e.region && arena->free[i].offset < e.offset))) ++i;
+  arena_extent_t* prev = i ? &arena->free[i - 1] : NULL;
+  arena_extent_t* next = i < arena->num_free ? &arena->free[i] : NULL;
+  if (prev && (prev->region != e.region || prev->offset + prev->size != e.offset)) prev = NULL;
+  if (next && (next->region != e.region || e.offset + e.size != next->offset)) next = NULL;
+  if (prev && next) {
+    prev->size += e.size + next->size;
+    memmove(next, next + 1, (arena->num_free - i - 1) * sizeof(arena_extent_t));
+    arena->num_free -= 1;
+  } else if (prev) {
+    prev->size += e.size;
+  } else if (next) {
+    next->offset = e.offset;
+    next->size += e.size;
+  } else {
+    if (arena->num_free >= ARENA_MAX_EXTENTS) FATAL("Pinned arena is too fragmented");
+    memmove(&arena->free[i + 1], &arena->free[i], (arena->num_free - i) * sizeof(arena_extent_t));
+    arena->free[i] = e;
+    arena->num_free += 1;
+  }
+}
+
+static bool pinned_arena_add_region(pinned_arena_t* arena, uint64_t min_size) {
+  // Tries to pin a new region of at least min_size bytes. Larger regions are preferred (so that
+  // later allocations can share them), but if that fails, smaller ones are tried.
+  if (arena->num_regions >= ARENA_MAX_REGIONS) return false;
+  uint64_t size = min_size <= ARENA_REGION_SIZE ? ARENA_REGION_SIZE : 2ull << (63 - __builtin_clzll(min_size - 1));
+  if (size > 0x80000000u) return false;
+  pinned_host_buffer_t* region = &arena->regions[arena->num_regions];
+  for (;;) {
+    region->size = size;
+    if (try_allocate_host_buffer(arena->device, region)) break;
+    size >>= 1;
+    if (size < min_size || size < arena->device->host_page_size) return false;
+  }
+  arena_extent_t e = {arena->num_regions++, 0, (uint32_t)size};
+  pinned_arena_insert_free(arena, e);
+  return true;
+}
+
+static bool pinned_arena_try_alloc(pinned_arena_t* arena, pinned_host_buffer_t* buf) {
+  // Blocks are aligned to their size (rounded up to a power of two), so rings never straddle a
+  // huge page boundary unnecessarily, and metadata blocks get a cache line each.
+  uint64_t align = buf->size <= ARENA_MIN_ALIGN ? ARENA_MIN_ALIGN : 2ull << (63 - __builtin_clzll(buf->size - 1));
+  uint64_t size = (buf->size + ARENA_MIN_ALIGN - 1) & ~(uint64_t)(ARENA_MIN_ALIGN - 1);
+  for (uint32_t i = 0; i < arena->num_free; ++i) {
+    arena_extent_t e = arena->free[i];
+    uint64_t start = (e.offset + align - 1) & ~(align - 1);
+    if (start + size > (uint64_t)e.offset + e.size) continue;
+    memmove(&arena->free[i], &arena->free[i + 1], (arena->num_free - i - 1) * sizeof(arena_extent_t));
+    arena->num_free -= 1;
+    arena_extent_t before = {e.region, e.offset, (uint32_t)(start - e.offset)};
+    arena_extent_t after = {e.region, (uint32_t)(start + size), (uint32_t)(e.offset + e.size - start - size)};
+    pinned_arena_insert_free(arena, before);
+    pinned_arena_insert_free(arena, after);
+    const pinned_host_buffer_t* region = &arena->regions[e.region];
+    buf->host_ptr = (char*)region->host_ptr + start;
+    buf->noc_addr = region->noc_addr + start;
+    return true;
+  }
+  return false;
+}
+
+static void pinned_arena_alloc(pinned_arena_t* arena, pinned_host_buffer_t* buf) {
+  // Caller has set buf->size, this function populates buf->host_ptr and buf->noc_addr.
+  if (pinned_arena_try_alloc(arena, buf)) return;
+  if (pinned_arena_add_region(arena, buf->size) && pinned_arena_try_alloc(arena, buf)) return;
   FATAL("Could not allocate and pin a host buffer of %llu bytes", (long long unsigned)buf->size);
 }
 
+static void pinned_arena_free(pinned_arena_t* arena, const pinned_host_buffer_t* buf) {
+  for (uint32_t r = 0; r < arena->num_regions; ++r) {
+    const pinned_host_buffer_t* region = &arena->regions[r];
+    uintptr_t offset = (uintptr_t)buf->host_ptr - (uintptr_t)region->host_ptr;
+    if (offset < region->size) {
+      arena_extent_t e = {r, (uint32_t)offset, (uint32_t)((buf->size + ARENA_MIN_ALIGN - 1) & ~(uint64_t)(ARENA_MIN_ALIGN - 1))};
+      pinned_arena_insert_free(arena, e);
+      return;
+    }
+  }
+  FATAL("Buffer was not allocated from this pinned arena");
+}
+
+static void pinned_arena_reserve(pinned_arena_t* arena, uint64_t size) {
+  // Optionally called up front to ensure that size contiguous bytes are available, so that
+  // several subsequent allocations can share one region. Not fatal if this isn't possible;
+  // subsequent allocations will get their own regions instead.
+  pinned_host_buffer_t probe;
+  probe.size = size;
+  if (pinned_arena_try_alloc(arena, &probe)
+  || (pinned_arena_add_region(arena, size) && pinned_arena_try_alloc(arena, &probe))) {
+    pinned_arena_free(arena, &probe);
+  }
+}
+
+static void pinned_arena_destroy(pinned_arena_t* arena) {
+  // The device must no longer be writing to any of the blocks.
+  for (uint32_t r = 0; r < arena->num_regions; ++r) {
+    munmap(arena->regions[r].host_ptr, arena->regions[r].size);
+  }
+  free(arena);
+}
+
+// NUMA and CPU placement:
+// The device is attached to one particular NUMA node, and the host ring is written by the device
+// and read by the poller, so both the ring and the poller should live on that node.
+
+// Inlined copy of what we need from linux/mempolicy.h:
+#define MPOL_DEFAULT   0
+#define MPOL_PREFERRED 1
+#define MPOL_F_NODE    (1 << 0)
+#define MPOL_F_ADDR    (1 << 1)
+
+static void parse_cpulist(const char* str, cpu_set_t* set) {
+  // Parses something like "0-3,8-11" into set, stopping at the first thing which doesn't fit.
+  CPU_ZERO(set);
+  for (const char* p = str; *p;) {
+    char* end;
+    long lo = strtol(p, &end, 10);
+    if (end == p || lo < 0) break;
+    long hi = lo;
+    if (*end == '-') hi = strtol(end + 1, &end, 10);
+    for (long c = lo; c <= hi && c < CPU_SETSIZE; ++c) CPU_SET((int)c, set);
+    p = *end == ',' ? end + 1 : end;
+    if (*p == '\n') break;
+  }
+}
+
+static bool read_cpulist(const char* path, cpu_set_t* set) {
+  // Parses a file containing something like "0-3,8-11" into set. Returns false if the file doesn't exist.
+  char buf[4096];
+  CPU_ZERO(set);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n < 0) return false;
+  buf[n] = '\0';
+  parse_cpulist(buf, set);
+  return true;
+}
+
+static void bind_memory_to_node(int node) {
+  // Until unbind_memory, prefer allocating memory for this thread on the given node.
+  unsigned long mask[4] = {0};
+  if (node < 0 || node >= (int)(sizeof(mask) * 8)) return;
+  mask[node / (sizeof(long) * 8)] |= 1ul << (node % (sizeof(long) * 8));
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8) != 0) {
+    fprintf(stderr, "WARNING: Could not set memory policy to prefer NUMA node %d (errno %d)\n", node, errno);
+  }
+}
+
+static void unbind_memory(void) {
+  syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+}
+
+static void warn_if_not_on_node(const pinned_host_buffer_t* buf, int node, const char* what) {
+  // Buffers which can't be queried (e.g. DMA buffers) are assumed to be placed by the kernel
+  // driver, which allocates them near the device.
+  int actual = -1;
+  if (node < 0) return;
+  if (syscall(SYS_get_mempolicy, &actual, NULL, 0, buf->host_ptr, MPOL_F_NODE | MPOL_F_ADDR) != 0) return;
+  if (actual != node) {
+    fprintf(stderr, "WARNING: %s is on NUMA node %d, but the device is attached to NUMA node %d\n", what, actual, node);
+  }
+}
+
+static bool read_node_cpulist(int node, cpu_set_t* set) {
+  char path[64];
+  sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+  return node >= 0 && read_cpulist(path, set);
+}
+
+static int choose_cpu_near_device(bh_pcie_device_t* device, const cpu_set_t* exclude) {
+  // Returns a CPU on the device's NUMA node (preferring CPUs listed in /sys/devices/system/cpu/isolated,
+  // and the highest-numbered CPU otherwise), other than those in exclude, or -1 if there isn't one.
+  int node = device->numa_node;
+  cpu_set_t allowed, node_cpus, isolated, candidates;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) CPU_ZERO(&allowed);
+  if (!read_node_cpulist(node, &node_cpus)) return -1; // Nothing known about topology, so leave it to the scheduler.
+  CPU_AND(&node_cpus, &node_cpus, &allowed);
+  if (CPU_COUNT(&node_cpus) == 0) {
+    fprintf(stderr, "WARNING: None of the CPUs on NUMA node %d (where the device is attached) are available to this process\n", node);
+    return -1;
+  }
+  if (exclude) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, exclude)) CPU_CLR(cpu, &node_cpus);
+    }
+    if (CPU_COUNT(&node_cpus) == 0) return -1;
+  }
+  bool any_isolated = read_cpulist("/sys/devices/system/cpu/isolated", &isolated) && CPU_COUNT(&isolated);
+  CPU_AND(&candidates, &node_cpus, &isolated);
+  if (!any_isolated || CPU_COUNT(&candidates) == 0) {
+    if (any_isolated) {
+      fprintf(stderr, "WARNING: This machine has isolated CPUs, but none of them are on NUMA node %d (where the device is attached)\n", node);
+    }
+    candidates = node_cpus;
+  }
+  int cpu;
+  for (cpu = CPU_SETSIZE - 1; !CPU_ISSET(cpu, &candidates); --cpu) {}
+  return cpu;
+}
+
+static void pin_thread_near_device(bh_pcie_device_t* device, int cpu) {
+  // Pins the calling thread to the given CPU, or if cpu is negative, to the CPU which choose_cpu_near_device picks.
+  cpu_set_t chosen;
+  if (cpu >= 0) {
+    cpu_set_t allowed, node_cpus;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) CPU_ZERO(&allowed);
+    if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) FATAL("CPU %d is not available to this process", cpu);
+    if (read_node_cpulist(device->numa_node, &node_cpus) && !CPU_ISSET(cpu, &node_cpus)) {
+      fprintf(stderr, "WARNING: CPU %d is not on NUMA node %d, which is where the device is attached\n", cpu, device->numa_node);
+    }
+  } else {
+    cpu = choose_cpu_near_device(device, NULL);
+    if (cpu < 0) return;
+  }
+  CPU_ZERO(&chosen);
+  CPU_SET(cpu, &chosen);
+  if (sched_setaffinity(0, sizeof(chosen), &chosen) != 0) {
+    fprintf(stderr, "WARNING: Could not pin poller to CPU %d (errno %d)\n", cpu, errno);
+  }
+}
+
 // Definitions for Ethernet tile address space:
 
 #define ETH_BOOT_PARAMS_ADDR                    0x0007C000
@@ -387,11 +723,13 @@ static void allocate_host_buffer(bh_pcie_device_t* device, pinned_host_buffer_t*
 #define NOC_AT_LEN_BE_1_OFFSET      0x024
 #define NOC_BRCST_EXCLUDE_OFFSET    0x02C
 #define NOC_L1_ACC_AT_INSTRN_OFFSET 0x030
+#define NOC_CMD_CTRL_OFFSET         0x040
 #define NOC_ENDPOINT_ID_OFFSET      0x048
 #define NIU_CFG_0_OFFSET            0x100
 #define ROUTER_CFG_2_OFFSET         0x10C // Has no hardware-defined meaning; we repurpose it for a host-to-device mailbox.
 #define ROUTER_CFG_4_OFFSET         0x114 // Has no hardware-defined meaning; we repurpose it for host informing device of its read pointer.
 #define NOC_ID_LOGICAL_OFFSET       0x148
+#define NIU_MST_WRITE_REQS_OUTGOING_ID_OFFSET 0x280
 
 // Offsets from TXQ_ADDR:
 #define ETH_TXQ_CTRL_OFFSET                0x00
@@ -408,6 +746,7 @@ static void allocate_host_buffer(bh_pcie_device_t* device, pinned_host_buffer_t*
 #define ETH_RXQ_BUF_SIZE_WORDS_OFFSET      0x10
 #define ETH_RXQ_HDR_CTRL_OFFSET            0x18
 #define ETH_RXQ_PACKET_DROP_CNT_OFFSET     0x4C
+#define ETH_RXQ_OUTSTANDING_WR_CNT_OFFSET  0x50
 
 // Offsets from TXPKT_CFG_ADDR:
 #define TXPKT_CFG_INSERT_CTL_OFFSET    0x00
@@ -456,46 +795,133 @@ static bool is_endpoint_id_ethernet(uint32_t endpoint_id) {
   return (uint16_t)(endpoint_id >> 8) == 0x0200;
 }
 
-static void print_hwinfo(bh_pcie_device_t* device) {
-  printf("|Tile|NoC #0  |Logical  |Port   |Training    |Serdes          |MAC Address      |\n");
-  printf("|----|--------|---------|-------|------------|----------------|-----------------|\n");
+// Everything we want to know about a tile is read up front: a handful of NIU registers, then
+// the whole of the boot parameters and boot results as one bulk copy through the TLB window,
+// rather than a separate UC read for each field as it is printed.
+
+#define HWINFO_BOOT_PARAMS_WORDS  38
+#define HWINFO_BOOT_RESULTS_WORDS 248
+#define HWINFO_MAX_TILES          14
+
+typedef struct hwinfo_tile_t {
+  uint8_t x;
+  uint8_t y;
+  uint32_t endpoint_id;
+  uint32_t niu_cfg_0;
+  uint32_t noc_id_logical;
+  uint32_t boot_params[HWINFO_BOOT_PARAMS_WORDS];
+  uint32_t boot_results[HWINFO_BOOT_RESULTS_WORDS];
+} hwinfo_tile_t;
+
+typedef struct hwinfo_t {
+  unsigned num_tiles;
+  hwinfo_tile_t tiles[HWINFO_MAX_TILES];
+} hwinfo_t;
+
+static void tlb_read_block(bh_pcie_device_t* device, uint64_t addr, void* dst, size_t size) {
+  if ((addr & 0x1fffff) + size > (1u << 21)) FATAL("Read of %u bytes at 0x%llx crosses a TLB window", (unsigned)size, (long long unsigned)addr);
+  memcpy(dst, set_tlb_addr(device, addr), size);
+}
+
+static void read_hwinfo(bh_pcie_device_t* device, hwinfo_t* info) {
+  info->num_tiles = 0;
   for (unsigned x = 1, y = 1; x <= 16; ++x) {
     if (x == 8 || x == 9) continue;
     set_tlb_xy(device, x, y);
     uint32_t endpoint_id = tlb_read_u32(device, NIU_ADDR(0) + NOC_ENDPOINT_ID_OFFSET);
     if (!is_endpoint_id_ethernet(endpoint_id)) continue;
-    uint32_t niu_cfg_0 = tlb_read_u32(device, NIU_ADDR(0) + NIU_CFG_0_OFFSET);
-    printf("|E%-3u|X=%-2u,Y=%u|", (unsigned)(endpoint_id & 0xff), x, y);
-    if (niu_cfg_0 & NIU_CFG_0_HARVESTED) {
+    hwinfo_tile_t* tile = &info->tiles[info->num_tiles++];
+    memset(tile, 0, sizeof(*tile));
+    tile->x = x;
+    tile->y = y;
+    tile->endpoint_id = endpoint_id;
+    tile->niu_cfg_0 = tlb_read_u32(device, NIU_ADDR(0) + NIU_CFG_0_OFFSET);
+    if (tile->niu_cfg_0 & NIU_CFG_0_HARVESTED) continue;
+    tile->noc_id_logical = tlb_read_u32(device, NIU_ADDR(0) + NOC_ID_LOGICAL_OFFSET);
+    tlb_read_block(device, ETH_BOOT_PARAMS_ADDR, tile->boot_params, sizeof(tile->boot_params));
+    tlb_read_block(device, ETH_BOOT_RESULTS_ADDR, tile->boot_results, sizeof(tile->boot_results));
+  }
+}
+
+static bool hwinfo_is_harvested(const hwinfo_tile_t* tile) {
+  return (tile->niu_cfg_0 & NIU_CFG_0_HARVESTED) != 0;
+}
+
+static const char* hwinfo_port_status_name(const hwinfo_tile_t* tile) {
+  static const char* port_status_meanings[] = {"Unknown", "Up", "Down", "No"};
+  uint32_t port_status = tile->boot_results[1];
+  return port_status < sizeof(port_status_meanings)/sizeof(*port_status_meanings) ? port_status_meanings[port_status] : NULL;
+}
+
+static uint32_t hwinfo_train_status(const hwinfo_tile_t* tile) {
+  return tile->boot_results[1] == 0 ? 0 : tile->boot_results[2];
+}
+
+static const char* hwinfo_train_status_name(const hwinfo_tile_t* tile) {
+  static const char* train_status_meanings[] = {"In Progress", "Skipped", "Complete", "Int Loopback", "Ext Loopback", "Timeout (EQ)", "Timeout (AN)", "Timeout (CL)", "Timeout (BL)", "Timeout (LU)", "Timeout (CI)"};
+  uint32_t train_status = hwinfo_train_status(tile);
+  return train_status < sizeof(train_status_meanings)/sizeof(*train_status_meanings) ? train_status_meanings[train_status] : NULL;
+}
+
+static bool hwinfo_has_serdes(const hwinfo_tile_t* tile) {
+  uint32_t serdes_postcode = tile->boot_results[32];
+  return serdes_postcode >= 0xC0DE1000 && serdes_postcode <= 0xC0DEFFFF;
+}
+
+static bool hwinfo_mac_address(const hwinfo_tile_t* tile, uint8_t mac[6]) {
+  // No port -> no MAC address.
+  if (tile->boot_results[1] == 3) return false;
+  uint32_t mac_major;
+  uint32_t mac_minor;
+  if (tile->boot_results[247] == 1) {
+    // Tile has attempted chip info exchange with its peer, and we can snoop
+    // the MAC address from said information buffer.
+    mac_major = tile->boot_results[243];
+    mac_minor = tile->boot_results[244];
+  } else {
+    // Copy of the current firmware logic for choosing a MAC address.
+    uint32_t logical_id = __builtin_popcount(tile->boot_params[0] & ((1u << (tile->endpoint_id & 0x1f)) - 1));
+    mac_major = tile->boot_params[36];
+    mac_minor = tile->boot_params[37] + logical_id;
+  }
+  mac[0] = (uint8_t)(mac_major >> 16); mac[1] = (uint8_t)(mac_major >> 8); mac[2] = (uint8_t)(mac_major >> 0);
+  mac[3] = (uint8_t)(mac_minor >> 16); mac[4] = (uint8_t)(mac_minor >> 8); mac[5] = (uint8_t)(mac_minor >> 0);
+  return true;
+}
+
+static void print_hwinfo(bh_pcie_device_t* device) {
+  hwinfo_t info;
+  read_hwinfo(device, &info);
+  printf("|Tile|NoC #0  |Logical  |Port   |Training    |Serdes          |MAC Address      |\n");
+  printf("|----|--------|---------|-------|------------|----------------|-----------------|\n");
+  for (unsigned i = 0; i < info.num_tiles; ++i) {
+    const hwinfo_tile_t* tile = &info.tiles[i];
+    printf("|E%-3u|X=%-2u,Y=%u|", (unsigned)(tile->endpoint_id & 0xff), tile->x, tile->y);
+    if (hwinfo_is_harvested(tile)) {
       printf("Harvested|N/A    |N/A         |N/A             |N/A              |\n");
       continue;
     }
-    unsigned noc_id_logical_xy = tlb_read_u32(device, NIU_ADDR(0) + NOC_ID_LOGICAL_OFFSET) & 0xfff;
+    unsigned noc_id_logical_xy = tile->noc_id_logical & 0xfff;
     printf("X=%-2u,Y=%-2u|", noc_id_logical_xy & 0x3fu, noc_id_logical_xy >> 6);
-    volatile uint32_t* boot_results = (volatile uint32_t*)set_tlb_addr(device, ETH_BOOT_RESULTS_ADDR);
-    uint32_t port_status = boot_results[1];
-    static const char* port_status_meanings[] = {"Unknown", "Up", "Down", "No"};
-    if (port_status < sizeof(port_status_meanings)/sizeof(*port_status_meanings)) {
-      printf("%-7s|", port_status_meanings[port_status]);
+    const char* port_status = hwinfo_port_status_name(tile);
+    if (port_status) {
+      printf("%-7s|", port_status);
     } else {
-      printf("Status %u|", (unsigned)port_status);
+      printf("Status %u|", (unsigned)tile->boot_results[1]);
     }
-    uint32_t train_status = port_status == 0 ? 0 : boot_results[2];
-    static const char* train_status_meanings[] = {"In Progress", "Skipped", "Complete", "Int Loopback", "Ext Loopback", "Timeout (EQ)", "Timeout (AN)", "Timeout (CL)", "Timeout (BL)", "Timeout (LU)", "Timeout (CI)"};
-    if (train_status < sizeof(train_status_meanings)/sizeof(*train_status_meanings)) {
-      printf("%-12s|", train_status_meanings[train_status]);
+    const char* train_status = hwinfo_train_status_name(tile);
+    if (train_status) {
+      printf("%-12s|", train_status);
     } else {
-      printf("Status %-5u|", train_status);
+      printf("Status %-5u|", (unsigned)hwinfo_train_status(tile));
     }
-    uint32_t serdes_postcode = boot_results[32];
-    if (serdes_postcode >= 0xC0DE1000 && serdes_postcode <= 0xC0DEFFFF) {
-      uint32_t serdes_inst = boot_results[33];
-      uint32_t serdes_lanes = boot_results[34];
+    if (hwinfo_has_serdes(tile)) {
+      uint32_t serdes_lanes = tile->boot_results[34];
       const char* lanes_prefix = " lanes ";
-      printf("#%u", serdes_inst);
-      for (unsigned i = 0; i < 8; ++i) {
-        if (serdes_lanes & (1u << i)) {
-          printf("%s%u", lanes_prefix, i);
+      printf("#%u", (unsigned)tile->boot_results[33]);
+      for (unsigned j = 0; j < 8; ++j) {
+        if (serdes_lanes & (1u << j)) {
+          printf("%s%u", lanes_prefix, j);
           lanes_prefix = ",";
         }
       }
@@ -503,30 +929,53 @@ static void print_hwinfo(bh_pcie_device_t* device) {
     } else {
       printf("N/A             |");
     }
-    if (port_status == 3) {
-      // No port -> no MAC address.
-      printf("N/A              |");
+    uint8_t mac[6];
+    if (hwinfo_mac_address(tile, mac)) {
+      printf("%02x:%02x:%02x:%02x:%02x:%02x|", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
     } else {
-      uint32_t mac_major;
-      uint32_t mac_minor;
-      if (boot_results[247] == 1) {
-        // Tile has attempted chip info exchange with its peer, and we can snoop
-        // the MAC address from said information buffer.
-        mac_major = boot_results[243];
-        mac_minor = boot_results[244];
+      printf("N/A              |");
+    }
+    printf("\n");
+  }
+}
+
+static void print_hwinfo_json(FILE* f, const hwinfo_t* info) {
+  fprintf(f, "[");
+  for (unsigned i = 0; i < info->num_tiles; ++i) {
+    const hwinfo_tile_t* tile = &info->tiles[i];
+    fprintf(f, "%s\n    {\"tile\": %u, \"noc0_x\": %u, \"noc0_y\": %u, \"harvested\": %s", i ? "," : "",
+      (unsigned)(tile->endpoint_id & 0xff), tile->x, tile->y, hwinfo_is_harvested(tile) ? "true" : "false");
+    if (!hwinfo_is_harvested(tile)) {
+      unsigned noc_id_logical_xy = tile->noc_id_logical & 0xfff;
+      const char* port_status = hwinfo_port_status_name(tile);
+      const char* train_status = hwinfo_train_status_name(tile);
+      fprintf(f, ", \"logical_x\": %u, \"logical_y\": %u", noc_id_logical_xy & 0x3fu, noc_id_logical_xy >> 6);
+      fprintf(f, ", \"port\": \"%s\", \"port_status\": %u", port_status ? port_status : "Unknown", (unsigned)tile->boot_results[1]);
+      fprintf(f, ", \"training\": \"%s\", \"train_status\": %u", train_status ? train_status : "Unknown", (unsigned)hwinfo_train_status(tile));
+      if (hwinfo_has_serdes(tile)) {
+        uint32_t serdes_lanes = tile->boot_results[34];
+        fprintf(f, ", \"serdes\": %u, \"lanes\": [", (unsigned)tile->boot_results[33]);
+        const char* sep = "";
+        for (unsigned j = 0; j < 8; ++j) {
+          if (serdes_lanes & (1u << j)) {
+            fprintf(f, "%s%u", sep, j);
+            sep = ", ";
+          }
+        }
+        fprintf(f, "]");
+      } else {
+        fprintf(f, ", \"serdes\": null, \"lanes\": []");
+      }
+      uint8_t mac[6];
+      if (hwinfo_mac_address(tile, mac)) {
+        fprintf(f, ", \"mac\": \"%02x:%02x:%02x:%02x:%02x:%02x\"", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
       } else {
-        // Copy of the current firmware logic for choosing a MAC address.
-        volatile uint32_t* boot_params = (volatile uint32_t*)set_tlb_addr(device, ETH_BOOT_PARAMS_ADDR);
-        uint32_t logical_id = __builtin_popcount(boot_params[0] & ((1u << (endpoint_id & 0x1f)) - 1));
-        mac_major = boot_params[36];
-        mac_minor = boot_params[37] + logical_id;
+        fprintf(f, ", \"mac\": null");
       }
-      printf("%02x:%02x:%02x:%02x:%02x:%02x|",
-        (uint8_t)(mac_major >> 16), (uint8_t)(mac_major >> 8), (uint8_t)(mac_major >> 0),
-        (uint8_t)(mac_minor >> 16), (uint8_t)(mac_minor >> 8), (uint8_t)(mac_minor >> 0));
     }
-    printf("\n");
+    fprintf(f, "}");
   }
+  fprintf(f, "\n  ]");
 }
 
 static void print_tx_headers(bh_pcie_device_t* device) {
@@ -560,6 +1009,24 @@ static void print_tx_headers(bh_pcie_device_t* device) {
   }
 }
 
+static bool ethernet_x_is_usable(bh_pcie_device_t* device, unsigned x) {
+  // Non-fatal version of the checks in set_ethernet_x, which leaves the TLB pointing where it was.
+  unsigned y;
+  if ((1 <= x && x <= 7) || (10 <= x && x <= 16)) {
+    y = 1;
+  } else if (20 <= x && x <= 31) {
+    y = 25;
+  } else {
+    return false;
+  }
+  uint32_t c1 = device->tlb_cfg[1];
+  set_tlb_xy(device, x, y);
+  bool usable = is_endpoint_id_ethernet(tlb_read_u32(device, NIU_ADDR(0) + NOC_ENDPOINT_ID_OFFSET))
+    && !(tlb_read_u32(device, NIU_ADDR(0) + NIU_CFG_0_OFFSET) & NIU_CFG_0_HARVESTED);
+  set_tlb_xy(device, (c1 >> 11) & 0x3f, (c1 >> 17) & 0x3f);
+  return usable;
+}
+
 static void set_ethernet_x(bh_pcie_device_t* device, unsigned x) {
   unsigned y;
   if ((1 <= x && x <= 7) || (10 <= x && x <= 16)) {
@@ -580,580 +1047,5083 @@ static void set_ethernet_x(bh_pcie_device_t* device, unsigned x) {
   }
 }
 
+// Minimal RV32 instruction emitter:
+// Just enough of RV32I (plus the Zba sh3add and Zbb minu instructions) to generate the
+// code below, with labels which can be referenced by branches before they are placed.
+
+#define RV_MAX_CODE_WORDS 384
+#define RV_MAX_LABELS     48
+#define RV_MAX_FIXUPS     96
+
+enum {
+  RV_ZERO = 0, RV_RA = 1, RV_SP = 2, RV_GP = 3, RV_TP = 4, RV_T0 = 5, RV_T1 = 6, RV_T2 = 7, RV_S0 = 8, RV_S1 = 9,
+  RV_A0 = 10, RV_A1 = 11, RV_A2 = 12, RV_A3 = 13, RV_A4 = 14, RV_A5 = 15, RV_A6 = 16, RV_A7 = 17,
+  RV_S2 = 18, RV_S3 = 19, RV_S4 = 20, RV_S5 = 21, RV_S6 = 22, RV_S7 = 23, RV_S8 = 24, RV_S9 = 25, RV_S10 = 26,
+  RV_S11 = 27, RV_T3 = 28, RV_T4 = 29, RV_T5 = 30, RV_T6 = 31,
+};
+
+typedef struct rv_emitter_t {
+  uint32_t num_words;
+  uint32_t num_fixups;
+  uint32_t labels[RV_MAX_LABELS]; // Byte offset of each label, or UINT32_MAX if not yet placed.
+  struct {
+    uint32_t at;
+    uint32_t label;
+  } fixups[RV_MAX_FIXUPS];
+  uint32_t code[RV_MAX_CODE_WORDS];
+} rv_emitter_t;
+
+static void rv_init(rv_emitter_t* e) {
+  e->num_words = 0;
+  e->num_fixups = 0;
+  memset(e->labels, 0xff, sizeof(e->labels));
+}
+
+static void rv_emit(rv_emitter_t* e, uint32_t insn) {
+  if (e->num_words >= RV_MAX_CODE_WORDS) FATAL("Generated RV32 code is too large");
+  e->code[e->num_words++] = insn;
+}
+
+static void rv_label(rv_emitter_t* e, uint32_t label) {
+  e->labels[label] = e->num_words * 4;
+}
+
+static void rv_ref(rv_emitter_t* e, uint32_t label) {
+  // The instruction about to be emitted needs its offset field filling in with label.
+  if (e->num_fixups >= RV_MAX_FIXUPS) FATAL("Generated RV32 code has too many branches");
+  e->fixups[e->num_fixups].at = e->num_words;
+  e->fixups[e->num_fixups].label = label;
+  e->num_fixups += 1;
+}
+
+static void rv_finish(rv_emitter_t* e) {
+  // Resolve all branch and jump targets.
+  for (uint32_t i = 0; i < e->num_fixups; ++i) {
+    uint32_t at = e->fixups[i].at;
+    uint32_t target = e->labels[e->fixups[i].label];
+    if (target == UINT32_MAX) FATAL("Generated RV32 code references an unplaced label");
+    uint32_t insn = e->code[at];
+    uint32_t off = target - at * 4;
+    if ((insn & 0x7f) == 0x6f) {
+      if ((int32_t)off < -(1 << 20) || (int32_t)off >= (1 << 20)) FATAL("Generated RV32 jump is out of range");
+      insn |= (off & 0x100000) << 11 | (off & 0x7fe) << 20 | (off & 0x800) << 9 | (off & 0xff000);
+    } else {
+      if ((int32_t)off < -(1 << 12) || (int32_t)off >= (1 << 12)) FATAL("Generated RV32 branch is out of range");
+      insn |= (off & 0x1000) << 19 | (off & 0x7e0) << 20 | (off & 0x1e) << 7 | (off & 0x800) >> 4;
+    }
+    e->code[at] = insn;
+  }
+}
+
+static void rv_r(rv_emitter_t* e, uint32_t funct7, uint32_t funct3, uint32_t rd, uint32_t rs1, uint32_t rs2) {
+  rv_emit(e, funct7 << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | 0x33);
+}
+
+static void rv_i(rv_emitter_t* e, uint32_t opcode, uint32_t funct3, uint32_t rd, uint32_t rs1, int32_t imm) {
+  if (imm < -2048 || imm > 2047) FATAL("Generated RV32 immediate %d is out of range", (int)imm);
+  rv_emit(e, (uint32_t)imm << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode);
+}
+
+static void rv_add (rv_emitter_t* e, uint32_t rd, uint32_t rs1, uint32_t rs2) { rv_r(e, 0x00, 0, rd, rs1, rs2); }
+static void rv_sub (rv_emitter_t* e, uint32_t rd, uint32_t rs1, uint32_t rs2) { rv_r(e, 0x20, 0, rd, rs1, rs2); }
+static void rv_sltu(rv_emitter_t* e, uint32_t rd, uint32_t rs1, uint32_t rs2) { rv_r(e, 0x00, 3, rd, rs1, rs2); }
+static void rv_xor (rv_emitter_t* e, uint32_t rd, uint32_t rs1, uint32_t rs2) { rv_r(e, 0x00, 4, rd, rs1, rs2); }
+static void rv_or  (rv_emitter_t* e, uint32_t rd, uint32_t rs1, uint32_t rs2) { rv_r(e, 0x00, 6, rd, rs1, rs2); }
+static void rv_and (rv_emitter_t* e, uint32_t rd, uint32_t rs1, uint32_t rs2) { rv_r(e, 0x00, 7, rd, rs1, rs2); }
+static void rv_minu(rv_emitter_t* e, uint32_t rd, uint32_t rs1, uint32_t rs2) { rv_r(e, 0x05, 5, rd, rs1, rs2); }
+static void rv_sh3add(rv_emitter_t* e, uint32_t rd, uint32_t rs1, uint32_t rs2) { rv_r(e, 0x10, 6, rd, rs1, rs2); }
+
+static void rv_addi(rv_emitter_t* e, uint32_t rd, uint32_t rs1, int32_t imm) { rv_i(e, 0x13, 0, rd, rs1, imm); }
+static void rv_slli(rv_emitter_t* e, uint32_t rd, uint32_t rs1, uint32_t sh) { rv_i(e, 0x13, 1, rd, rs1, (int32_t)(sh & 31)); }
+static void rv_srli(rv_emitter_t* e, uint32_t rd, uint32_t rs1, uint32_t sh) { rv_i(e, 0x13, 5, rd, rs1, (int32_t)(sh & 31)); }
+static void rv_andi(rv_emitter_t* e, uint32_t rd, uint32_t rs1, int32_t imm) { rv_i(e, 0x13, 7, rd, rs1, imm); }
+static void rv_lw  (rv_emitter_t* e, uint32_t rd, int32_t imm, uint32_t rs1) { rv_i(e, 0x03, 2, rd, rs1, imm); }
+static void rv_lbu (rv_emitter_t* e, uint32_t rd, int32_t imm, uint32_t rs1) { rv_i(e, 0x03, 4, rd, rs1, imm); }
+static void rv_mv  (rv_emitter_t* e, uint32_t rd, uint32_t rs1) { rv_addi(e, rd, rs1, 0); }
+
+static void rv_sw(rv_emitter_t* e, uint32_t rs2, int32_t imm, uint32_t rs1) {
+  if (imm < -2048 || imm > 2047) FATAL("Generated RV32 immediate %d is out of range", (int)imm);
+  rv_emit(e, ((uint32_t)imm >> 5) << 25 | rs2 << 20 | rs1 << 15 | 2u << 12 | ((uint32_t)imm & 0x1f) << 7 | 0x23);
+}
+
+static void rv_branch(rv_emitter_t* e, uint32_t funct3, uint32_t rs1, uint32_t rs2, uint32_t label) {
+  rv_ref(e, label);
+  rv_emit(e, rs2 << 20 | rs1 << 15 | funct3 << 12 | 0x63);
+}
+
+static void rv_beq (rv_emitter_t* e, uint32_t rs1, uint32_t rs2, uint32_t label) { rv_branch(e, 0, rs1, rs2, label); }
+static void rv_bne (rv_emitter_t* e, uint32_t rs1, uint32_t rs2, uint32_t label) { rv_branch(e, 1, rs1, rs2, label); }
+static void rv_blt (rv_emitter_t* e, uint32_t rs1, uint32_t rs2, uint32_t label) { rv_branch(e, 4, rs1, rs2, label); }
+static void rv_bge (rv_emitter_t* e, uint32_t rs1, uint32_t rs2, uint32_t label) { rv_branch(e, 5, rs1, rs2, label); }
+static void rv_bltu(rv_emitter_t* e, uint32_t rs1, uint32_t rs2, uint32_t label) { rv_branch(e, 6, rs1, rs2, label); }
+static void rv_bgeu(rv_emitter_t* e, uint32_t rs1, uint32_t rs2, uint32_t label) { rv_branch(e, 7, rs1, rs2, label); }
+
+static void rv_j(rv_emitter_t* e, uint32_t label) {
+  rv_ref(e, label);
+  rv_emit(e, 0x6f);
+}
+
+static void rv_fence(rv_emitter_t* e) {
+  rv_emit(e, 0x0000000f);
+}
+
+static void rv_rdcycle(rv_emitter_t* e, uint32_t rd) {
+  rv_emit(e, 0xc0002073 | rd << 7); // csrrs rd, cycle, x0
+}
+
+static void rv_li(rv_emitter_t* e, uint32_t rd, uint32_t value) {
+  int32_t lo = (int32_t)(value << 20) >> 20;
+  uint32_t hi = value - (uint32_t)lo;
+  if (hi) {
+    rv_emit(e, hi | rd << 7 | 0x37); // lui rd, hi
+    if (lo) rv_addi(e, rd, rd, lo);
+  } else {
+    rv_addi(e, rd, RV_ZERO, lo);
+  }
+}
+
 // RISCV machine code to run on Ethernet tile:
 // This consumes data from an RX queue, and uses an NIU to shuttle the contents
 // to a ring buffer somewhere in host memory. Most configuration is performed by
-// the host prior to running this code on the device.
-
-static const uint32_t rv_code[] = {
-                          // init:
-  0x00000297, 0x18828293, //   la t0, fn_arguments
-  0x0002a503,             //   lw a0, 0(t0) # h_ring_base_lo
-  0x0042a583,             //   lw a1, 4(t0) # h_ring_base_hi
-  0x0082a603,             //   lw a2, 8(t0) # h_ring_size
-  0x00c2a683,             //   lw a3, 12(t0) # metadata_ptr
-  0x0102a703,             //   lw a4, 16(t0) # e_ring_mask
-  0x0142a783,             //   lw a5, 20(t0) # initial_drop_count
-  0x0182a803,             //   lw a6, 24(t0) # rxq_addr
-  0x01c2a883,             //   lw a7, 28(t0) # niu2_addr
-  0xffb02137,             //   li sp, 0xFFB02000
-  0xfee12e23,             //   sw a4, -4(sp) # Put something non-zero at -4(sp)
-  0xffc10b93,             //   addi s7, sp, -4 # Point tx_pending_flag_ptr at something non-zero (so that we don't take the tx_complete jump)
-  0x00170c13,             //   addi s8, a4, 1 # e_ring_size = e_ring_mask + 1
-  0xfff60c93,             //   addi s9, a2, -1 # h_ring_mask = h_ring_size - 1
-  0x00003d37,             //   li s10, 12288 # Set noc_transaction_size_limit (the true limit for misaligned transfers is just shy of 16 KiB, this is a safe underapproximation)
-  0x0280006f,             //   j done_e_ring_has_new_or_pending_data
-                          // spin_loop:
-                          //   # NB: t0, t1, t2, t3 set by loads just before `j spin_loop` (so that we utilise the load latency to perform the jump)
-  0x12029263,             //   bne t0, x0, service_mailbox # Mailbox request from host? (NB: Branch target consumes t0)
-                          // done_service_mailbox:
-  0x0f336263,             //   bltu t1, s3, disable_wrap_mode # RXQ has wrapped?
-                          // done_disable_wrap_mode:
-  0x0a0e0263,             //   beq t3, x0, tx_complete # NoC transmit finished?
-                          // done_tx_complete:
-  0x00739393,             //   slli t2, t2, 7 # Want to multiply by 96, but mul by 128 is faster, and is a safe overapproximation
-  0x41430333,             //   sub t1, t1, s4
-  0x40730333,             //   sub t1, t1, t2 # t1 = (RXQ->ETH_RXQ_BUF_PTR - RXQ->ETH_RXQ_OUTSTANDING_WR_CNT * 128) - e_ring_front_ptr
-                          // shift_fixup_0:
-  0x00031293,             //   slli t0, t1, 0 # 0 is subject of fixup; once fixed, will move MSB of e_ring_mask to sign bit
-  0x02504063,             //   bgt t0, x0, e_ring_has_new_data # New data in RXQ? (NB: Branch target consumes t1)
-  0x035a1263,             //   bne s4, s5, e_ring_has_pending_data # Any data available to send to host?
-                          // done_e_ring_has_new_or_pending_data:
-  0x90c8a283,             //   lw t0, -1780(a7) # t0 = NIU->ROUTER_CFG_2 (using this as a mailbox)
-  0x00882303,             //   lw t1, 0x08(a6)  # t1 = RXQ->ETH_RXQ_BUF_PTR
-  0x05082383,             //   lw t2, 0x50(a6)  # t2 = RXQ->ETH_RXQ_OUTSTANDING_WR_CNT
-  0x000bae03,             //   lw t3, 0(s7)     # t3 = *tx_pending_flag_ptr
-  0x9148a903,             //   lw s2, -1772(a7) # h_ring_tail_ptr = NIU->ROUTER_CFG_4 (host writes here)
-  0xfc9ff06f,             //   j spin_loop
-                          // e_ring_has_new_data:
-  0x006a0a33,             //   add s4, s4, t1 # e_ring_front_ptr = RXQ->ETH_RXQ_BUF_PTR - RXQ->ETH_RXQ_OUTSTANDING_WR_CNT * 128
-  0x00ea7a33,             //   and s4, s4, a4 # e_ring_front_ptr &= e_ring_mask
-                          // e_ring_has_pending_data:
-  0xff6a90e3,             //   bne s5, s6, done_e_ring_has_new_or_pending_data # Already have a transfer leaving L1?
-  0x40960333,             //   sub t1, a2, s1
-  0x01230333,             //   add t1, t1, s2 # t1 = h_ring_size - (h_ring_next_ptr - h_ring_tail_ptr)
-  0x415a03b3,             //   sub t2, s4, s5
-  0x0a735333,             //   minu t1, t1, t2 # t1 = minu(t1, e_ring_front_ptr - e_ring_next_ptr)
-  0xfc0306e3,             //   beq t1, x0, done_e_ring_has_new_or_pending_data # Ring full?
-  0x415c03b3,             //   sub t2, s8, s5
-  0x0a735333,             //   minu t1, t1, t2 # t1 = minu(t1, e_ring_size - e_ring_next_ptr)
-  0x0194f2b3,             //   and t0, s1, s9 # t0 = h_ring_next_ptr & h_ring_mask
-  0x0ba35333,             //   minu t1, t1, s10 # t1 = minu(t1, noc_transaction_size_limit)
-  0x006484b3,             //   add s1, s1, t1 # h_ring_next_ptr += t1
-  0x0096a023,             //   sw s1, 0(a3) # metadata_ptr->h_ring_next_ptr = h_ring_next_ptr
-  0x8158a023,             //   sw s5, -2048(a7) # NIU->NOC_TARG_ADDR_LO = e_ring_next_ptr (assuming ring base is 0)
-  0x8268a023,             //   sw t1, -2016(a7) # NIU->NOC_AT_LEN_BE = t1
-  0x00a282b3,             //   add t0, t0, a0 # t0 += h_ring_base_lo
-  0x8058a623,             //   sw t0, -2036(a7) # NIU->NOC_RET_ADDR_LO
-  0x00a2b2b3,             //   sltu t0, t0, a0 # t0 = carry bit from prior addition
-  0x00b282b3,             //   add t0, t0, a1 # t0 += h_ring_base_hi
-  0x8058a823,             //   sw t0, -2032(a7) # NIU->NOC_RET_ADDR_MID
-  0x84e8a023,             //   sw a4, -1984(a7) # NIU->NOC_CMD_CTRL = e_ring_mask (all we need is the low bit set)
-  0x04e8a023,             //   sw a4, 0x40(a7) # NIU2->NOC_CMD_CTRL = e_ring_mask (all we need is the low bit set)
-  0x0408a003,             //   lw x0, 0x40(a7) # Ensure that the NOC_CMD_CTRL store is sent out before any future NIU_MST_WRITE_REQS_OUTGOING_ID load
-  0x006a8ab3,             //   add s5, s5, t1 # e_ring_next_ptr += t1
-  0x00eafab3,             //   and s5, s5, a4 # e_ring_next_ptr &= e_ring_mask
-  0xa8088b93,             //   addi s7, a7, -1408 # tx_pending_flag_ptr = &NIU->NIU_MST_WRITE_REQS_OUTGOING_ID(0)
-  0xf7dff06f,             //   j done_e_ring_has_new_or_pending_data
-                          // tx_complete:
-  0xffc10b93,             //   addi s7, sp, -4 # Point tx_pending_flag_ptr at something non-zero (so that we don't take the tx_complete jump again)
-  0x015b42b3,             //   xor t0, s6, s5 # t0 = e_ring_tail_ptr ^ e_ring_next_ptr
-  0x000a8b13,             //   mv s6, s5 # e_ring_tail_ptr = e_ring_next_ptr
-                          // shift_fixup_1:
-  0x00029293,             //   slli t0, t0, 0 # 0 is subject of fixup; once fixed, will move MSB of e_ring_mask to sign bit
-  0xf402d8e3,             //   bge t0, x0, done_tx_complete # Still consuming same half of RXQ?
-                          //   # Have changed which half we're consuming
-  0x004c5293,             //   srli t0, s8, 4
-  0x00582823,             //   sw t0, 0x10(a6) # RXQ->ETH_RXQ_BUF_SIZE_WORDS = e_ring_size >> 4
-  0x2002e9b3,             //   sh3add s3, t0, x0
-  0x0159f9b3,             //   and s3, s3, s5 # e_ring_wrap_thr = e_ring_next_ptr & (e_ring_size >> 1)
-                          // shift_fixup_2:
-  0x0009d293,             //   srli t0, s3, 0 # 0 is subject of fixup; once fixed, will move MSB of e_ring_mask to 4
-  0x00582023,             //   sw t0, 0x00(a6) # RXQ->ETH_RXQ_CTRL = e_ring_wrap_thr ? 4 : 0
-  0x00082003,             //   lw x0, 0x00(a6) # Ensure that the ETH_RXQ_CTRL store is sent out before the ETH_RXQ_PACKET_DROP_CNT load
-  0x04c82283,             //   lw t0, 0x4C(a6) # t0 = RXQ->ETH_RXQ_PACKET_DROP_CNT
-  0xf2f286e3,             //   beq t0, a5, done_tx_complete # Still haven't dropped anything?
-  0x0240006f,             //   j err_overflow
-                          // disable_wrap_mode: # Preserves t1, t2, t3
-                          //   # RXQ has wrapped, disable wrapping mode until we're ready for it to wrap again
-  0x00082023,             //   sw x0, 0x00(a6) # RXQ->ETH_RXQ_CTRL = 0 (i.e. raw RX mode, wrapping disabled)
-  0xfffb0293,             //   addi t0, s6, -1
-  0x0042d293,             //   srli t0, t0, 4
-  0x00582823,             //   sw t0, 0x10(a6) # RXQ->ETH_RXQ_BUF_SIZE_WORDS = (e_ring_tail_ptr - 1) >> 4
-  0x01082003,             //   lw x0, 0x10(a6) # Ensure that the ETH_RXQ_BUF_SIZE_WORDS store is sent out before the ETH_RXQ_PACKET_DROP_CNT load
-  0x04c82283,             //   lw t0, 0x4C(a6) # t0 = RXQ->ETH_RXQ_PACKET_DROP_CNT
-  0x00000993,             //   mv s3, x0 # e_ring_wrap_thr = 0 (no longer checking for wrap)
-  0xf0f282e3,             //   beq t0, a5, done_disable_wrap_mode # Still haven't dropped anything?
-                          // err_overflow:
-  0x00100293,             //   li t0, 1
-  0x0056a423,             //   sw t0, 8(a3) # metadata_ptr->error = t0
-                          // err_overflow_spin:
-  0xa808a283,             //   lw t0, -1408(a7) # t0 = NIU->NIU_MST_WRITE_REQS_OUTGOING_ID(0)
-  0x0000000f,             //   fence
-  0xfe029ce3,             //   bne t0, x0, err_overflow_spin
-  0x04e8a023,             //   sw a4, 0x40(a7) # NIU2->NOC_CMD_CTRL = e_ring_mask (all we need is the low bit set)
-                          // finished:
-  0x0000006f,             //   j finished
-                          // service_mailbox:
-  0x0056a223,             //   sw t0, 4(a3) # metadata_ptr->mailbox_echo = t0
-  0x9008a623,             //   sw x0, -1780(a7) # NIU->ROUTER_CFG_2 = 0 (clearing mailbox)
-                          // service_mailbox_spin:
-  0xa808a283,             //   lw t0, -1408(a7) # t0 = NIU->NIU_MST_WRITE_REQS_OUTGOING_ID(0)
-  0x0000000f,             //   fence
-  0xfe029ce3,             //   bne t0, x0, service_mailbox_spin
-  0x04e8a023,             //   sw a4, 0x40(a7) # NIU2->NOC_CMD_CTRL = e_ring_mask (all we need is the low bit set)
-  0x0408a003,             //   lw x0, 0x40(a7) # Ensure that the NOC_CMD_CTRL store is sent out before any future NIU_MST_WRITE_REQS_OUTGOING_ID load
-  0xec5ff06f              //   j done_service_mailbox
-                          // fn_arguments:
-};
-#define label_init 0x0
-#define label_spin_loop 0x44
-#define label_done_service_mailbox 0x48
-#define label_done_disable_wrap_mode 0x4c
-#define label_done_tx_complete 0x50
-#define label_shift_fixup_0 0x5c
-#define label_done_e_ring_has_new_or_pending_data 0x68
-#define label_e_ring_has_new_data 0x80
-#define label_e_ring_has_pending_data 0x88
-#define label_tx_complete 0xf0
-#define label_shift_fixup_1 0xfc
-#define label_shift_fixup_2 0x114
-#define label_disable_wrap_mode 0x12c
-#define label_err_overflow 0x14c
-#define label_err_overflow_spin 0x154
-#define label_finished 0x164
-#define label_service_mailbox 0x168
-#define label_service_mailbox_spin 0x170
-#define label_fn_arguments 0x188
-
-typedef struct rv_code_arguments_t {
+// the host prior to running this code on the device. The code is generated for
+// each configuration, so that everything the host knows in advance (ring sizes
+// and addresses) is folded into immediates, and work which the configuration
+// makes redundant is left out of the per-transfer path.
+
+typedef struct rv_shuttle_config_t {
   uint64_t h_ring_noc_addr;
   uint32_t h_ring_size;
   uint32_t h_meta_addr;
-  uint32_t e_ring_mask;
+  uint32_t e_ring_size;
   uint32_t initial_drop_count;
   uint32_t rxq_addr;
   uint32_t niu_addr;
-} rv_code_arguments_t;
+  uint32_t coalesce_bytes;  // Wait for at least this much contiguous data before starting a transfer, or 0 to never wait.
+  uint32_t coalesce_cycles; // ... unless the oldest unsent data has been waiting for at least this many cycles.
+  uint32_t sample_mode;     // One of ETHDUMP_SAMPLE_*.
+  uint32_t sample_interval; // For ETHDUMP_SAMPLE_COUNT and ETHDUMP_SAMPLE_FLOW: keep 1 in this many frames (or flows).
+  uint32_t sample_cycles;   // For ETHDUMP_SAMPLE_RATE: keep at most one frame per this many cycles...
+  uint32_t sample_burst_cycles; // ... with bursts of up to this many cycles' worth of frames.
+} rv_shuttle_config_t;
 
-// Minimal pcap file writer:
+// Values for rv_shuttle_config_t::sample_mode:
+#define ETHDUMP_SAMPLE_NONE  0 // Every frame is sent to the host.
+#define ETHDUMP_SAMPLE_COUNT 1 // Deterministic 1-in-N: the first frame is kept, then every Nth after it.
+#define ETHDUMP_SAMPLE_FLOW  2 // 1-in-N of flows, by a symmetric hash of the addresses and ports.
+#define ETHDUMP_SAMPLE_RATE  3 // Token bucket: at most a fixed number of frames per second.
 
-#define PCAP_WRITER_NUM_IOVS 20
+enum {
+  label_spin_loop,
+  label_done_service_mailbox,
+  label_done_disable_wrap_mode,
+  label_done_tx_complete,
+  label_done_e_ring_has_new_or_pending_data,
+  label_e_ring_has_new_data,
+  label_e_ring_has_pending_data,
+  label_keep_coalesce_start,
+  label_done_coalesce,
+  label_sample_next,
+  label_sample_keep,
+  label_sample_skip,
+  label_sample_done,
+  label_sample_skip_in_flight,
+  label_sample_keep_coalesce_start,
+  label_hash_ipv4,
+  label_hash_ipv6,
+  label_hash_ipv4_addrs,
+  label_hash_ipv6_addrs,
+  label_hash_done,
+  label_hash_vlan,
+  label_hash_vlan_tag,
+  label_hash_no_vlan,
+  label_hash_loop_0, // One for each call to rv_gen_hash_pairs.
+  label_hash_loop_1,
+  label_hash_loop_2,
+  label_hash_loop_3,
+  label_hash_loop_4,
+  label_hash_ports_0, // One for each call to rv_gen_hash_ports.
+  label_hash_ports_1,
+  label_tx_complete,
+  label_disable_wrap_mode,
+  label_err_overflow,
+  label_err_overflow_spin,
+  label_finished,
+  label_service_mailbox,
+  label_service_mailbox_spin,
+};
 
-typedef struct pcap_writer_t {
-  int fd;
-  int iovcnt;
-  size_t total_pkt_count;
-  size_t total_byte_count;
-  struct iovec iovs[PCAP_WRITER_NUM_IOVS];
-  uint32_t pkt_hdrs[PCAP_WRITER_NUM_IOVS * 4];
-} pcap_writer_t;
+#define RV_CYCLES_PER_SECOND 1350000000u // RISCV E1 runs at 1.35 GHz.
+#define NOC_TRANSACTION_SIZE_LIMIT 12288 // The true limit for misaligned transfers is just shy of 16 KiB, this is a safe underapproximation.
 
-static void flush_packets(pcap_writer_t* writer) {
-  int fd = writer->fd;
-  struct iovec* iovs = writer->iovs;
-  int iovcnt = writer->iovcnt;
-  writer->iovcnt = 0;
-  for (;;) {
-    ssize_t n = writev(fd, iovs, iovcnt);
-    if (n > 0) {
-      writer->total_byte_count += n;
-      while (iovs->iov_len <= (size_t)n) {
-        if (--iovcnt == 0) return;
-        n -= iovs->iov_len;
-        ++iovs;
-      }
-      iovs->iov_len -= n;
-      iovs->iov_base = (char*)iovs->iov_base + n;
-    } else if (n == 0 || errno != EINTR) {
-      FATAL("Could not write to output file");
-    }
-  }
+// Device-side sampling needs to look at frames in the device ring, which wraps at any byte.
+static void rv_gen_ring_lbu(rv_emitter_t* e, uint32_t rd, uint32_t base, int32_t offset) {
+  rv_addi(e, rd, base, offset);
+  rv_and(e, rd, rd, RV_A4);             // rd &= e_ring_mask
+  rv_lbu(e, rd, 0, rd);                 // rd = e_ring[(base + offset) & e_ring_mask]
 }
 
-static void pcap_writer_init(pcap_writer_t* writer, const char* filename) {
-  int fd = open(filename, O_CLOEXEC | O_CREAT | O_TRUNC | O_WRONLY, 0644);
-  if (fd < 0) FATAL("Could not open path '%s' for pcap writing", filename);
-  writer->fd = fd;
-  writer->total_byte_count = 0;
-  writer->total_pkt_count = 0;
-
-  uint32_t* pcap_hdr = writer->pkt_hdrs;
-  pcap_hdr[0] = 0xA1B23C4D; // Magic number for pcap with timestamps in nanoseconds
-  pcap_hdr[1] = 2 + (2 << 16); // Version 2.2
-  pcap_hdr[2] = 0; // Timezone correction
-  pcap_hdr[3] = 0; // Timestamp accuracy
-  pcap_hdr[4] = (1 << 14) - 1; // Maximum capture length
-  pcap_hdr[5] = 1; // Ethernet
-  writer->iovs[0].iov_base = pcap_hdr;
-  writer->iovs[0].iov_len = sizeof(uint32_t) * 6;
-  writer->iovcnt = 1;
-  flush_packets(writer);
+static void rv_gen_hash_pairs(rv_emitter_t* e, uint32_t label, uint32_t distance, uint32_t count) {
+  // Folds count bytes starting at t3 into the hash in t1, each xored with the byte distance
+  // later (e.g. source address with destination address), so that the hash is symmetric.
+  // Clobbers t0, t3, t6, ra.
+  rv_li(e, RV_RA, count);
+  rv_label(e, label);
+  rv_gen_ring_lbu(e, RV_T6, RV_T3, 0);
+  rv_gen_ring_lbu(e, RV_T0, RV_T3, distance);
+  rv_xor(e, RV_T6, RV_T6, RV_T0);
+  rv_slli(e, RV_T0, RV_T1, 8);
+  rv_srli(e, RV_T1, RV_T1, 24);
+  rv_or(e, RV_T1, RV_T1, RV_T0);        // t1 = rotl(t1, 8)
+  rv_xor(e, RV_T1, RV_T1, RV_T6);
+  rv_addi(e, RV_T3, RV_T3, 1);
+  rv_addi(e, RV_RA, RV_RA, -1);
+  rv_bne(e, RV_RA, RV_ZERO, label);
 }
 
-static uint32_t append_packets(pcap_writer_t* writer, pinned_host_buffer_t* h_ring, uint32_t read_ptr, uint32_t write_ptr) {
-  uint8_t* ring_contents = (uint8_t*)h_ring->host_ptr;
-  uint32_t ring_size = h_ring->size;
-  int iovcnt = writer->iovcnt;
-  while (iovcnt <= (PCAP_WRITER_NUM_IOVS-3) && (write_ptr - read_ptr) >= sizeof(uint32_t)) { // 3 IOVs is the maximum we'll need to write a frame, and 4 bytes is minimum we'll need to read one.
-    // Read the frame metadata.
-    uint32_t frame_info;
-    uint32_t read_ptr_masked = read_ptr & (ring_size - 1);
-    if (read_ptr_masked <= ring_size - sizeof(frame_info)) {
-      // Metadata does not straddle a ring wrap; this should compile to a simple unaligned load.
-      memcpy(&frame_info, ring_contents + read_ptr_masked, sizeof(frame_info));
-    } else {
-      // Metadata straddles a ring wrap; perform aligned loads from either end of the
-      // ring, and then shift bits around to get what we're after.
-      uint32_t end = *(volatile uint32_t*)(ring_contents + ring_size - sizeof(uint32_t));
-      uint32_t start = *(volatile uint32_t*)ring_contents;
-      uint32_t shift = (ring_size - read_ptr_masked) * __CHAR_BIT__;
-      end >>= (0u - shift) & 31;
-      start <<= shift;
-      frame_info = end + start;
-    }
-    frame_info = __builtin_bswap32(frame_info);
-    if ((frame_info & 0xe0880000) != 0u || (frame_info & 0xfffff) < 14u) {
-      FATAL("Ring is corrupt at read pointer 0x%x / write pointer 0x%x, as hardware metadata for a ring entry should never be 0x%08x", read_ptr, write_ptr, frame_info);
-    }
-    uint32_t frame_length = frame_info & 0x3fff;
-    if (write_ptr - read_ptr < sizeof(frame_info) + frame_length) {
-      // Frame only partially present; don't read it yet.
-      break;
-    }
+static void rv_gen_hash_ports(rv_emitter_t* e, uint32_t label, uint32_t label_pairs, uint32_t label_addrs) {
+  // With the protocol number in t6 and the L4 header in t3, folds in the ports if the
+  // protocol is TCP, UDP, or SCTP, then continues at label_addrs (which must be placed next).
+  rv_addi(e, RV_T0, RV_T6, -6);
+  rv_beq(e, RV_T0, RV_ZERO, label);     // TCP?
+  rv_addi(e, RV_T0, RV_T6, -17);
+  rv_beq(e, RV_T0, RV_ZERO, label);     // UDP?
+  rv_addi(e, RV_T0, RV_T6, -132);
+  rv_bne(e, RV_T0, RV_ZERO, label_addrs); // Not SCTP either?
+  rv_label(e, label);
+  rv_gen_hash_pairs(e, label_pairs, 2, 2);
+}
 
-    // Consume the frame metadata.
-    read_ptr += sizeof(frame_info);
-    read_ptr_masked = read_ptr & (ring_size - 1);
+static void rv_gen_ring_be16(rv_emitter_t* e, uint32_t rd, uint32_t base, int32_t offset) {
+  // Clobbers t0.
+  rv_gen_ring_lbu(e, rd, base, offset);
+  rv_slli(e, rd, rd, 8);
+  rv_gen_ring_lbu(e, RV_T0, base, offset + 1);
+  rv_or(e, rd, rd, RV_T0);
+}
 
-    // Form the pcap per-packet header.
-    struct timespec ts;
-    if (clock_gettime(CLOCK_REALTIME, &ts) != 0) {
-      FATAL("Could not query time using clock_gettime");
-    }
-    uint32_t* pkt_hdr = writer->pkt_hdrs + iovcnt * 4;
-    pkt_hdr[0] = ts.tv_sec;
-    pkt_hdr[1] = ts.tv_nsec;
-    pkt_hdr[2] = frame_length;
-    pkt_hdr[3] = frame_length;
+static void rv_gen_sample(rv_emitter_t* e, const rv_shuttle_config_t* cfg) {
+  // Walks frames from e_ring_sampled_ptr (s0) up to e_ring_front_ptr, deciding whether each
+  // is kept (in which case s0 advances past it, and it'll be sent to the host along with the
+  // rest of [e_ring_next_ptr, s0)) or skipped (in which case both s0 and e_ring_next_ptr
+  // advance past it, without sending it anywhere). A frame can only be skipped once everything
+  // before it has been sent, so the decision is made without side effects, and only committed
+  // once it is acted upon. On exit, t0, t1, t2, t3, t6, and (for ETHDUMP_SAMPLE_FLOW) ra are clobbered.
+  bool coalesce = cfg->coalesce_bytes != 0;
+  uint32_t e_ring_log2 = __builtin_ctz(cfg->e_ring_size);
+  rv_label(e, label_sample_next);
+  rv_sub(e, RV_T1, RV_S4, RV_S0);
+  rv_and(e, RV_T1, RV_T1, RV_A4);       // t1 = (e_ring_front_ptr - e_ring_sampled_ptr) & e_ring_mask
+  rv_addi(e, RV_T0, RV_T1, -4);
+  rv_blt(e, RV_T0, RV_ZERO, label_sample_done); // Not even the hardware metadata of the next frame yet?
+  rv_gen_ring_lbu(e, RV_T2, RV_S0, 2);
+  rv_andi(e, RV_T2, RV_T2, 0x3f);
+  rv_slli(e, RV_T2, RV_T2, 8);
+  rv_gen_ring_lbu(e, RV_T0, RV_S0, 3);
+  rv_or(e, RV_T2, RV_T2, RV_T0);
+  rv_addi(e, RV_T2, RV_T2, 4);          // t2 = frame length (from big-endian hardware metadata) + 4 bytes of hardware metadata
+  rv_bltu(e, RV_T1, RV_T2, label_sample_done); // Whole frame not yet present?
 
-    // Usually require just one IOV for the header and one for the contents...
-    struct iovec* iov = writer->iovs + iovcnt;
-    iov[0].iov_base = pkt_hdr;
-    iov[0].iov_len = sizeof(uint32_t) * 4;
-    iov[1].iov_base = ring_contents + read_ptr_masked;
-    iov[1].iov_len = frame_length;
-    iovcnt += 2;
-    read_ptr += frame_length;
-    writer->total_pkt_count += 1;
-    if (read_ptr_masked > ring_size - frame_length) {
-      // ... but if it straddles a ring wrap, need one more.
-      uint32_t avail = ring_size - read_ptr_masked;
-      iov[1].iov_len = avail;
-      iov[2].iov_base = ring_contents;
-      iov[2].iov_len = frame_length - avail;
-      ++iovcnt;
-    }
-  }
-  writer->iovcnt = iovcnt;
-  return read_ptr;
-}
+  switch (cfg->sample_mode) {
+  case ETHDUMP_SAMPLE_COUNT:
+    rv_bne(e, RV_RA, RV_ZERO, label_sample_skip); // countdown != 0?
+    rv_li(e, RV_RA, cfg->sample_interval - 1); // countdown = sample_interval - 1
+    break;
+  case ETHDUMP_SAMPLE_RATE:
+    rv_rdcycle(e, RV_T0);
+    rv_lw(e, RV_T1, -12, RV_SP);
+    rv_sw(e, RV_T0, -12, RV_SP);          // last_refill = now
+    rv_sub(e, RV_T1, RV_T0, RV_T1);       // t1 = now - last_refill
+    rv_li(e, RV_T0, cfg->sample_burst_cycles);
+    rv_sub(e, RV_T0, RV_T0, RV_RA);
+    rv_minu(e, RV_T1, RV_T1, RV_T0);
+    rv_add(e, RV_RA, RV_RA, RV_T1);       // tokens = min(tokens + t1, sample_burst_cycles)
+    rv_li(e, RV_T0, cfg->sample_cycles);
+    rv_bltu(e, RV_RA, RV_T0, label_sample_skip); // Not enough tokens for a frame?
+    rv_sub(e, RV_RA, RV_RA, RV_T0);       // tokens -= sample_cycles
+    break;
+  case ETHDUMP_SAMPLE_FLOW:
+    // Hash the flow key of the frame, and keep it if the hash falls in the lowest 1/sample_interval
+    // of the range. Register usage: t1 = hash, t2 = start of Ethernet header (plus 4 bytes for
+    // each VLAN tag, so that the EtherType is at t2 + 12), t3 = cursor. The fields hashed are the
+    // same as those which parse_flow_key puts in a flow_key_t, bar the VLAN ID.
+    rv_sw(e, RV_T2, -16, RV_SP);          // Spill frame length
+    rv_add(e, RV_T3, RV_S0, RV_T2);       // t3 = end of frame (not masked, like t2)
+    rv_addi(e, RV_T2, RV_S0, 4);          // Skip hardware metadata
+    rv_label(e, label_hash_vlan);
+    rv_gen_ring_be16(e, RV_T6, RV_T2, 12); // t6 = EtherType
+    rv_li(e, RV_T0, 0x8100);
+    rv_beq(e, RV_T6, RV_T0, label_hash_vlan_tag); // IEEE 802.1Q VLAN tag?
+    rv_li(e, RV_T0, 0x88a8);
+    rv_bne(e, RV_T6, RV_T0, label_hash_no_vlan); // Nor an IEEE 802.1ad service tag?
+    rv_label(e, label_hash_vlan_tag);
+    rv_addi(e, RV_T0, RV_T2, 14 + 4);
+    rv_bltu(e, RV_T3, RV_T0, label_hash_no_vlan); // Tag runs off the end of the frame?
+    rv_addi(e, RV_T2, RV_T2, 4);
+    rv_j(e, label_hash_vlan);
+    rv_label(e, label_hash_no_vlan);
+    rv_mv(e, RV_T1, RV_T6);               // hash = EtherType
+    rv_li(e, RV_T0, 0x0800);
+    rv_beq(e, RV_T6, RV_T0, label_hash_ipv4);
+    rv_li(e, RV_T0, 0x86dd);
+    rv_beq(e, RV_T6, RV_T0, label_hash_ipv6);
+    rv_addi(e, RV_T3, RV_S0, 4);          // t3 = start of Ethernet header, regardless of VLAN tags
+    rv_gen_hash_pairs(e, label_hash_loop_0, 6, 6); // Neither IPv4 nor IPv6: hash the MAC addresses
+    rv_j(e, label_hash_done);
 
-// Device configuration:
+    rv_label(e, label_hash_ipv4);
+    rv_gen_ring_lbu(e, RV_T6, RV_T2, 14 + 9);
+    rv_xor(e, RV_T1, RV_T1, RV_T6);       // hash ^= protocol
+    rv_gen_ring_lbu(e, RV_T3, RV_T2, 14 + 6);
+    rv_andi(e, RV_T3, RV_T3, 0x1f);
+    rv_gen_ring_lbu(e, RV_T0, RV_T2, 14 + 7);
+    rv_or(e, RV_T0, RV_T0, RV_T3);        // t0 = fragment offset
+    rv_bne(e, RV_T0, RV_ZERO, label_hash_ipv4_addrs); // Only the first fragment carries ports
+    rv_gen_ring_lbu(e, RV_T3, RV_T2, 14);
+    rv_andi(e, RV_T3, RV_T3, 15);
+    rv_slli(e, RV_T3, RV_T3, 2);
+    rv_add(e, RV_T3, RV_T3, RV_T2);
+    rv_addi(e, RV_T3, RV_T3, 14);         // t3 = start of L4 header (as per IHL)
+    rv_gen_hash_ports(e, label_hash_ports_0, label_hash_loop_1, label_hash_ipv4_addrs);
+    rv_label(e, label_hash_ipv4_addrs);
+    rv_addi(e, RV_T3, RV_T2, 14 + 12);
+    rv_gen_hash_pairs(e, label_hash_loop_2, 4, 4);
+    rv_j(e, label_hash_done);
 
-#define MILLISECONDS(x) ((x) * 1000000ull)
+    rv_label(e, label_hash_ipv6);
+    rv_gen_ring_lbu(e, RV_T6, RV_T2, 14 + 6);
+    rv_xor(e, RV_T1, RV_T1, RV_T6);       // hash ^= next header
+    rv_addi(e, RV_T3, RV_T2, 14 + 40);    // t3 = start of L4 header (assuming no extension headers)
+    rv_gen_hash_ports(e, label_hash_ports_1, label_hash_loop_3, label_hash_ipv6_addrs);
+    rv_label(e, label_hash_ipv6_addrs);
+    rv_addi(e, RV_T3, RV_T2, 14 + 8);
+    rv_gen_hash_pairs(e, label_hash_loop_4, 16, 16);
 
-static uint64_t host_nanos64() {
-  struct timespec ts;
-  if (clock_gettime(CLOCK_REALTIME, &ts) != 0) {
-    FATAL("Could not query time using clock_gettime");
+    rv_label(e, label_hash_done);
+    rv_srli(e, RV_T0, RV_T1, 16);
+    rv_xor(e, RV_T1, RV_T1, RV_T0);
+    rv_slli(e, RV_T0, RV_T1, 3);
+    rv_add(e, RV_T1, RV_T1, RV_T0);
+    rv_srli(e, RV_T0, RV_T1, 11);
+    rv_xor(e, RV_T1, RV_T1, RV_T0);
+    rv_slli(e, RV_T0, RV_T1, 15);
+    rv_add(e, RV_T1, RV_T1, RV_T0);       // Mix the hash without needing a multiplier
+    rv_lw(e, RV_T2, -16, RV_SP);          // Reload frame length
+    rv_li(e, RV_T0, (uint32_t)(0x100000000ull / cfg->sample_interval));
+    rv_bgeu(e, RV_T1, RV_T0, label_sample_skip); // Flow not in the sampled part of the hash range?
+    break;
   }
-  return ts.tv_sec * MILLISECONDS(1000u) + ts.tv_nsec;
-}
+  rv_label(e, label_sample_keep);
+  if (coalesce) {
+    rv_bne(e, RV_S0, RV_S5, label_sample_keep_coalesce_start); // Already had unsent data?
+    rv_rdcycle(e, RV_S11);              // coalesce_start = now
+    rv_label(e, label_sample_keep_coalesce_start);
+  }
+  rv_add(e, RV_S0, RV_S0, RV_T2);
+  rv_and(e, RV_S0, RV_S0, RV_A4);       // e_ring_sampled_ptr = (e_ring_sampled_ptr + t2) & e_ring_mask
+  rv_j(e, label_sample_next);
 
-static void configure_rx_for_training(bh_pcie_device_t* device) {
-  tlb_write_u32(device, RXCLASS_MAC_RX_ROUTING_ADDR, RXCLASS_MAC_RX_ROUTING_FROM_MAC);
-  tlb_write_u32(device, RXCLASS_NO_MATCH_ACTIONS_ADDR, 0);
-  tlb_write_u32(device, RXCLASS_USER_DEFINED_ETHERTYPE_ADDR(0), 0);
-  tlb_write_u32(device, RXCLASS_USER_DEFINED_ETHERTYPE_ADDR(1), 0);
+  rv_label(e, label_sample_skip);
+  rv_bne(e, RV_S0, RV_S5, label_sample_done); // Kept frames before this one still need sending first?
+  // tx_complete only notices e_ring_tail_ptr changing halves if it moves into the other half at most
+  // once, so skipping stops while e_ring_next_ptr is in the other half, until tx_complete catches up.
+  rv_xor(e, RV_T0, RV_S5, RV_S6);
+  rv_slli(e, RV_T0, RV_T0, 32 - e_ring_log2); // Move MSB of e_ring_mask to sign bit
+  rv_blt(e, RV_T0, RV_ZERO, label_sample_done); // Not in the same half as e_ring_tail_ptr?
+  if (cfg->sample_mode == ETHDUMP_SAMPLE_COUNT) rv_addi(e, RV_RA, RV_RA, -1); // countdown -= 1
+  rv_lw(e, RV_T0, 20, RV_A3);
+  rv_addi(e, RV_T0, RV_T0, 1);
+  rv_sw(e, RV_T0, 20, RV_A3);           // metadata_ptr->sampled_out_count += 1
+  rv_bne(e, RV_S5, RV_S6, label_sample_skip_in_flight); // Transfer leaving L1? (its completion will release this frame too)
+  rv_addi(e, RV_S7, RV_SP, -8);         // Point tx_pending_flag_ptr at zero, so that this frame is released via tx_complete
+  rv_label(e, label_sample_skip_in_flight);
+  rv_add(e, RV_S0, RV_S0, RV_T2);
+  rv_and(e, RV_S0, RV_S0, RV_A4);       // e_ring_sampled_ptr = (e_ring_sampled_ptr + t2) & e_ring_mask
+  rv_mv(e, RV_S5, RV_S0);               // e_ring_next_ptr = e_ring_sampled_ptr
+  rv_j(e, label_sample_next);
+  rv_label(e, label_sample_done);
 }
 
-static void wait_for_ethernet_training_complete(bh_pcie_device_t* device, const uint8_t* new_loopback_mode) {
-  volatile uint32_t* boot_results = (volatile uint32_t*)set_tlb_addr(device, ETH_BOOT_RESULTS_ADDR);
-  uint32_t port_status = boot_results[1];
-  if (port_status >= 3) {
-    FATAL("Selected Ethernet tile does not have an Ethernet port (status %u); try a different one", (unsigned)port_status);
+static void rv_gen_shuttle(rv_emitter_t* e, const rv_shuttle_config_t* cfg) {
+  // Register usage:
+  //   a0 = h_ring_base_lo, a1 = h_ring_base_hi, a2 = h_ring_size, a3 = metadata_ptr, a4 = e_ring_mask,
+  //   a5 = initial_drop_count, a6 = rxq_addr, a7 = niu2_addr (and niu_addr is a7 - 0x800),
+  //   s1 = h_ring_next_ptr, s2 = h_ring_tail_ptr, s3 = e_ring_wrap_thr, s4 = e_ring_front_ptr,
+  //   s5 = e_ring_next_ptr, s6 = e_ring_tail_ptr, s7 = tx_pending_flag_ptr, s8 = e_ring_size,
+  //   s9 = h_ring_mask, s10 = noc_transaction_size_limit, s11 = coalesce_start (cycle count),
+  //   t4 = coalesce_bytes, t5 = coalesce_cycles, gp = transfer_count, tp = deadline_count,
+  //   s0 = e_ring_sampled_ptr, ra = countdown (ETHDUMP_SAMPLE_COUNT) or tokens (ETHDUMP_SAMPLE_RATE).
+  // With sampling, only [e_ring_next_ptr, e_ring_sampled_ptr) is known to consist of kept frames,
+  // so transfers stop there rather than at e_ring_front_ptr.
+  // Constants which fit in an immediate, or which are zero, don't get a register.
+  rv_init(e);
+  uint32_t e_ring_log2 = __builtin_ctz(cfg->e_ring_size);
+  uint32_t h_ring_mask = cfg->h_ring_size - 1;
+  uint32_t h_ring_base_lo = (uint32_t)cfg->h_ring_noc_addr;
+  uint32_t h_ring_base_hi = (uint32_t)(cfg->h_ring_noc_addr >> 32);
+  int32_t niu = -0x800; // Offset from a7 to niu_addr.
+  // If the host ring is aligned to its size, adding an offset within the ring to its base never
+  // carries, so NOC_RET_ADDR_MID is a constant (set once), and NOC_RET_ADDR_LO is a bitwise or.
+  bool h_ring_aligned = (h_ring_base_lo & h_ring_mask) == 0;
+  // Every transfer is bounded by the sizes of both rings, so the NoC limit only matters if both are larger.
+  bool need_noc_limit = cfg->e_ring_size > NOC_TRANSACTION_SIZE_LIMIT && cfg->h_ring_size > NOC_TRANSACTION_SIZE_LIMIT;
+  uint32_t drop_count_reg = cfg->initial_drop_count ? RV_A5 : RV_ZERO;
+  bool coalesce = cfg->coalesce_bytes != 0;
+  bool sample = cfg->sample_mode != ETHDUMP_SAMPLE_NONE;
+  uint32_t sendable_end_reg = sample ? RV_S0 : RV_S4;
+
+  // init:
+  if (h_ring_base_lo) rv_li(e, RV_A0, h_ring_base_lo);
+  if (h_ring_aligned) {
+    rv_li(e, RV_T0, h_ring_base_hi);
+  } else {
+    rv_li(e, RV_A1, h_ring_base_hi);
+  }
+  rv_li(e, RV_A2, cfg->h_ring_size);
+  rv_li(e, RV_A3, cfg->h_meta_addr);
+  rv_li(e, RV_A4, cfg->e_ring_size - 1);
+  if (cfg->initial_drop_count) rv_li(e, RV_A5, cfg->initial_drop_count);
+  rv_li(e, RV_A6, cfg->rxq_addr);
+  rv_li(e, RV_A7, cfg->niu_addr - niu);
+  if (h_ring_aligned) rv_sw(e, RV_T0, niu + NOC_RET_ADDR_MID_OFFSET, RV_A7); // NIU->NOC_RET_ADDR_MID = h_ring_base_hi
+  rv_li(e, RV_SP, 0xFFB02000);
+  rv_sw(e, RV_A4, -4, RV_SP);           // Put something non-zero at -4(sp)
+  rv_addi(e, RV_S7, RV_SP, -4);         // Point tx_pending_flag_ptr at something non-zero (so that we don't take the tx_complete jump)
+  rv_li(e, RV_S8, cfg->e_ring_size);
+  rv_li(e, RV_S9, h_ring_mask);
+  if (need_noc_limit) rv_li(e, RV_S10, NOC_TRANSACTION_SIZE_LIMIT);
+  if (coalesce) {
+    rv_li(e, RV_T4, cfg->coalesce_bytes);
+    rv_li(e, RV_T5, cfg->coalesce_cycles);
+  }
+  static const uint8_t ptr_regs[] = {RV_S1, RV_S2, RV_S3, RV_S4, RV_S5, RV_S6, RV_GP, RV_TP, RV_S0};
+  for (uint32_t i = 0; i < sizeof(ptr_regs) - !sample; ++i) {
+    rv_mv(e, ptr_regs[i], RV_ZERO);     // All pointers and counters start at zero
+  }
+  if (sample) {
+    rv_sw(e, RV_ZERO, -8, RV_SP);       // Put zero at -8(sp)
+    if (cfg->sample_mode == ETHDUMP_SAMPLE_COUNT) {
+      rv_mv(e, RV_RA, RV_ZERO);         // countdown = 0 (so the first frame is kept)
+    } else if (cfg->sample_mode == ETHDUMP_SAMPLE_RATE) {
+      rv_li(e, RV_RA, cfg->sample_burst_cycles); // tokens = sample_burst_cycles
+      rv_rdcycle(e, RV_T0);
+      rv_sw(e, RV_T0, -12, RV_SP);      // last_refill = now
+    }
+  }
+  rv_j(e, label_done_e_ring_has_new_or_pending_data);
+
+  rv_label(e, label_spin_loop);
+  // NB: t0, t1, t2, t3 set by loads just before `j spin_loop` (so that we utilise the load latency to perform the jump)
+  rv_bne(e, RV_T0, RV_ZERO, label_service_mailbox); // Mailbox request from host? (NB: Branch target consumes t0)
+  rv_label(e, label_done_service_mailbox);
+  rv_bltu(e, RV_T1, RV_S3, label_disable_wrap_mode); // RXQ has wrapped?
+  rv_label(e, label_done_disable_wrap_mode);
+  rv_beq(e, RV_T3, RV_ZERO, label_tx_complete); // NoC transmit finished?
+  rv_label(e, label_done_tx_complete);
+  rv_slli(e, RV_T2, RV_T2, 7);          // Want to multiply by 96, but mul by 128 is faster, and is a safe overapproximation
+  rv_sub(e, RV_T1, RV_T1, RV_S4);
+  rv_sub(e, RV_T1, RV_T1, RV_T2);       // t1 = (RXQ->ETH_RXQ_BUF_PTR - RXQ->ETH_RXQ_OUTSTANDING_WR_CNT * 128) - e_ring_front_ptr
+  rv_slli(e, RV_T0, RV_T1, 32 - e_ring_log2); // Move MSB of e_ring_mask to sign bit
+  rv_blt(e, RV_ZERO, RV_T0, label_e_ring_has_new_data); // New data in RXQ? (NB: Branch target consumes t1)
+  rv_bne(e, RV_S4, RV_S5, label_e_ring_has_pending_data); // Any data available to send to host?
+  rv_label(e, label_done_e_ring_has_new_or_pending_data);
+  rv_lw(e, RV_T0, niu + ROUTER_CFG_2_OFFSET, RV_A7); // t0 = NIU->ROUTER_CFG_2 (using this as a mailbox)
+  rv_lw(e, RV_T1, ETH_RXQ_BUF_PTR_OFFSET, RV_A6); // t1 = RXQ->ETH_RXQ_BUF_PTR
+  rv_lw(e, RV_T2, ETH_RXQ_OUTSTANDING_WR_CNT_OFFSET, RV_A6); // t2 = RXQ->ETH_RXQ_OUTSTANDING_WR_CNT
+  rv_lw(e, RV_T3, 0, RV_S7);            // t3 = *tx_pending_flag_ptr
+  rv_lw(e, RV_S2, niu + ROUTER_CFG_4_OFFSET, RV_A7); // h_ring_tail_ptr = NIU->ROUTER_CFG_4 (host writes here)
+  rv_j(e, label_spin_loop);
+
+  rv_label(e, label_e_ring_has_new_data);
+  if (coalesce && !sample) {
+    rv_bne(e, RV_S4, RV_S5, label_keep_coalesce_start); // Already had unsent data?
+    rv_rdcycle(e, RV_S11);              // coalesce_start = now
+    rv_label(e, label_keep_coalesce_start);
+  }
+  rv_add(e, RV_S4, RV_S4, RV_T1);       // e_ring_front_ptr = RXQ->ETH_RXQ_BUF_PTR - RXQ->ETH_RXQ_OUTSTANDING_WR_CNT * 128
+  rv_and(e, RV_S4, RV_S4, RV_A4);       // e_ring_front_ptr &= e_ring_mask
+  rv_label(e, label_e_ring_has_pending_data);
+  if (sample) rv_gen_sample(e, cfg);
+  rv_bne(e, RV_S5, RV_S6, label_done_e_ring_has_new_or_pending_data); // Already have a transfer leaving L1?
+  rv_sub(e, RV_T1, RV_A2, RV_S1);
+  rv_add(e, RV_T1, RV_T1, RV_S2);       // t1 = h_ring_size - (h_ring_next_ptr - h_ring_tail_ptr)
+  rv_sub(e, RV_T2, sendable_end_reg, RV_S5);
+  rv_minu(e, RV_T1, RV_T1, RV_T2);      // t1 = minu(t1, e_ring_front_ptr (or e_ring_sampled_ptr) - e_ring_next_ptr)
+  rv_beq(e, RV_T1, RV_ZERO, label_done_e_ring_has_new_or_pending_data); // Ring full?
+  if (coalesce) {
+    // NB: If e_ring_front_ptr has wrapped, t2 is huge, so the data up to the end of the ring is sent straight away.
+    rv_bgeu(e, RV_T2, RV_T4, label_done_coalesce); // Enough data for an efficient transfer?
+    rv_rdcycle(e, RV_T6);
+    rv_sub(e, RV_T6, RV_T6, RV_S11);
+    rv_bltu(e, RV_T6, RV_T5, label_done_e_ring_has_new_or_pending_data); // Wait for more, unless the deadline has passed
+    rv_addi(e, RV_TP, RV_TP, 1);        // deadline_count += 1
+    rv_label(e, label_done_coalesce);
+  }
+  rv_sub(e, RV_T2, RV_S8, RV_S5);
+  rv_minu(e, RV_T1, RV_T1, RV_T2);      // t1 = minu(t1, e_ring_size - e_ring_next_ptr)
+  rv_and(e, RV_T0, RV_S1, RV_S9);       // t0 = h_ring_next_ptr & h_ring_mask
+  if (sample) {
+    // Skipping frames means that host ring offsets no longer track device ring offsets, so
+    // the end of the device ring no longer implies the end of the host ring.
+    rv_sub(e, RV_T2, RV_A2, RV_T0);
+    rv_minu(e, RV_T1, RV_T1, RV_T2);    // t1 = minu(t1, h_ring_size - t0)
+  }
+  if (need_noc_limit) rv_minu(e, RV_T1, RV_T1, RV_S10); // t1 = minu(t1, noc_transaction_size_limit)
+  rv_add(e, RV_S1, RV_S1, RV_T1);       // h_ring_next_ptr += t1
+  rv_sw(e, RV_S1, 0, RV_A3);            // metadata_ptr->h_ring_next_ptr = h_ring_next_ptr
+  rv_addi(e, RV_GP, RV_GP, 1);          // transfer_count += 1
+  rv_sw(e, RV_GP, 12, RV_A3);           // metadata_ptr->transfer_count = transfer_count
+  if (coalesce) rv_sw(e, RV_TP, 16, RV_A3); // metadata_ptr->deadline_count = deadline_count
+  rv_sw(e, RV_S5, niu + NOC_TARG_ADDR_LO_OFFSET, RV_A7); // NIU->NOC_TARG_ADDR_LO = e_ring_next_ptr (assuming ring base is 0)
+  rv_sw(e, RV_T1, niu + NOC_AT_LEN_BE_OFFSET, RV_A7); // NIU->NOC_AT_LEN_BE = t1
+  if (h_ring_aligned) {
+    if (h_ring_base_lo) rv_or(e, RV_T0, RV_T0, RV_A0); // t0 |= h_ring_base_lo
+    rv_sw(e, RV_T0, niu + NOC_RET_ADDR_LO_OFFSET, RV_A7); // NIU->NOC_RET_ADDR_LO
+  } else {
+    rv_add(e, RV_T0, RV_T0, RV_A0);     // t0 += h_ring_base_lo
+    rv_sw(e, RV_T0, niu + NOC_RET_ADDR_LO_OFFSET, RV_A7); // NIU->NOC_RET_ADDR_LO
+    rv_sltu(e, RV_T0, RV_T0, RV_A0);    // t0 = carry bit from prior addition
+    rv_add(e, RV_T0, RV_T0, RV_A1);     // t0 += h_ring_base_hi
+    rv_sw(e, RV_T0, niu + NOC_RET_ADDR_MID_OFFSET, RV_A7); // NIU->NOC_RET_ADDR_MID
+  }
+  rv_sw(e, RV_A4, niu + NOC_CMD_CTRL_OFFSET, RV_A7); // NIU->NOC_CMD_CTRL = e_ring_mask (all we need is the low bit set)
+  rv_sw(e, RV_A4, NOC_CMD_CTRL_OFFSET, RV_A7); // NIU2->NOC_CMD_CTRL = e_ring_mask (all we need is the low bit set)
+  rv_lw(e, RV_ZERO, NOC_CMD_CTRL_OFFSET, RV_A7); // Ensure that the NOC_CMD_CTRL store is sent out before any future NIU_MST_WRITE_REQS_OUTGOING_ID load
+  rv_add(e, RV_S5, RV_S5, RV_T1);       // e_ring_next_ptr += t1
+  rv_and(e, RV_S5, RV_S5, RV_A4);       // e_ring_next_ptr &= e_ring_mask
+  rv_addi(e, RV_S7, RV_A7, niu + NIU_MST_WRITE_REQS_OUTGOING_ID_OFFSET); // tx_pending_flag_ptr = &NIU->NIU_MST_WRITE_REQS_OUTGOING_ID(0)
+  rv_j(e, label_done_e_ring_has_new_or_pending_data);
+
+  rv_label(e, label_tx_complete);
+  rv_addi(e, RV_S7, RV_SP, -4);         // Point tx_pending_flag_ptr at something non-zero (so that we don't take the tx_complete jump again)
+  rv_xor(e, RV_T0, RV_S6, RV_S5);       // t0 = e_ring_tail_ptr ^ e_ring_next_ptr
+  rv_mv(e, RV_S6, RV_S5);               // e_ring_tail_ptr = e_ring_next_ptr
+  rv_slli(e, RV_T0, RV_T0, 32 - e_ring_log2); // Move MSB of e_ring_mask to sign bit
+  rv_bge(e, RV_T0, RV_ZERO, label_done_tx_complete); // Still consuming same half of RXQ?
+  // Have changed which half we're consuming
+  rv_li(e, RV_T0, cfg->e_ring_size >> 4);
+  rv_sw(e, RV_T0, ETH_RXQ_BUF_SIZE_WORDS_OFFSET, RV_A6); // RXQ->ETH_RXQ_BUF_SIZE_WORDS = e_ring_size >> 4
+  rv_sh3add(e, RV_S3, RV_T0, RV_ZERO);
+  rv_and(e, RV_S3, RV_S3, RV_S5);       // e_ring_wrap_thr = e_ring_next_ptr & (e_ring_size >> 1)
+  rv_srli(e, RV_T0, RV_S3, e_ring_log2 - 3); // Move MSB of e_ring_mask to 4
+  rv_sw(e, RV_T0, ETH_RXQ_CTRL_OFFSET, RV_A6); // RXQ->ETH_RXQ_CTRL = e_ring_wrap_thr ? 4 : 0
+  rv_lw(e, RV_ZERO, ETH_RXQ_CTRL_OFFSET, RV_A6); // Ensure that the ETH_RXQ_CTRL store is sent out before the ETH_RXQ_PACKET_DROP_CNT load
+  rv_lw(e, RV_T0, ETH_RXQ_PACKET_DROP_CNT_OFFSET, RV_A6); // t0 = RXQ->ETH_RXQ_PACKET_DROP_CNT
+  rv_beq(e, RV_T0, drop_count_reg, label_done_tx_complete); // Still haven't dropped anything?
+  rv_j(e, label_err_overflow);
+
+  rv_label(e, label_disable_wrap_mode); // Preserves t1, t2, t3
+  // RXQ has wrapped, disable wrapping mode until we're ready for it to wrap again
+  rv_sw(e, RV_ZERO, ETH_RXQ_CTRL_OFFSET, RV_A6); // RXQ->ETH_RXQ_CTRL = 0 (i.e. raw RX mode, wrapping disabled)
+  rv_addi(e, RV_T0, RV_S6, -1);
+  rv_srli(e, RV_T0, RV_T0, 4);
+  rv_sw(e, RV_T0, ETH_RXQ_BUF_SIZE_WORDS_OFFSET, RV_A6); // RXQ->ETH_RXQ_BUF_SIZE_WORDS = (e_ring_tail_ptr - 1) >> 4
+  rv_lw(e, RV_ZERO, ETH_RXQ_BUF_SIZE_WORDS_OFFSET, RV_A6); // Ensure that the ETH_RXQ_BUF_SIZE_WORDS store is sent out before the ETH_RXQ_PACKET_DROP_CNT load
+  rv_lw(e, RV_T0, ETH_RXQ_PACKET_DROP_CNT_OFFSET, RV_A6); // t0 = RXQ->ETH_RXQ_PACKET_DROP_CNT
+  rv_mv(e, RV_S3, RV_ZERO);             // e_ring_wrap_thr = 0 (no longer checking for wrap)
+  rv_beq(e, RV_T0, drop_count_reg, label_done_disable_wrap_mode); // Still haven't dropped anything?
+
+  rv_label(e, label_err_overflow);
+  rv_li(e, RV_T0, 1);
+  rv_sw(e, RV_T0, 8, RV_A3);            // metadata_ptr->error = t0
+  rv_label(e, label_err_overflow_spin);
+  rv_lw(e, RV_T0, niu + NIU_MST_WRITE_REQS_OUTGOING_ID_OFFSET, RV_A7); // t0 = NIU->NIU_MST_WRITE_REQS_OUTGOING_ID(0)
+  rv_fence(e);
+  rv_bne(e, RV_T0, RV_ZERO, label_err_overflow_spin);
+  rv_sw(e, RV_A4, NOC_CMD_CTRL_OFFSET, RV_A7); // NIU2->NOC_CMD_CTRL = e_ring_mask (all we need is the low bit set)
+  rv_label(e, label_finished);
+  rv_j(e, label_finished);
+
+  rv_label(e, label_service_mailbox);
+  rv_sw(e, RV_T0, 4, RV_A3);            // metadata_ptr->mailbox_echo = t0
+  rv_sw(e, RV_ZERO, niu + ROUTER_CFG_2_OFFSET, RV_A7); // NIU->ROUTER_CFG_2 = 0 (clearing mailbox)
+  rv_label(e, label_service_mailbox_spin);
+  rv_lw(e, RV_T0, niu + NIU_MST_WRITE_REQS_OUTGOING_ID_OFFSET, RV_A7); // t0 = NIU->NIU_MST_WRITE_REQS_OUTGOING_ID(0)
+  rv_fence(e);
+  rv_bne(e, RV_T0, RV_ZERO, label_service_mailbox_spin);
+  rv_sw(e, RV_A4, NOC_CMD_CTRL_OFFSET, RV_A7); // NIU2->NOC_CMD_CTRL = e_ring_mask (all we need is the low bit set)
+  rv_lw(e, RV_ZERO, NOC_CMD_CTRL_OFFSET, RV_A7); // Ensure that the NOC_CMD_CTRL store is sent out before any future NIU_MST_WRITE_REQS_OUTGOING_ID load
+  rv_j(e, label_done_service_mailbox);
+
+  rv_finish(e);
+}
+
+// Frame batches:
+// Frames are handed out in batches of views pointing directly into the host receive ring.
+// As the ring wraps, a frame can straddle the end of the ring, in which case its view has
+// two parts.
+
+#define ETHDUMP_MAX_BATCH 64
+
+typedef struct ethdump_frame_t {
+  const uint8_t* data;      // Start of the frame (i.e. the destination MAC address).
+  uint32_t len;             // Number of bytes at data.
+  uint32_t wrap_len;        // Non-zero if the frame straddles the end of the ring, in which case
+  const uint8_t* wrap_data; // the frame continues for this many bytes at the start of the ring.
+} ethdump_frame_t;
+
+typedef struct ethdump_batch_t {
+  uint64_t timestamp_ns; // Host CLOCK_REALTIME at the time the batch was formed.
+  uint32_t start_ptr;    // Ring position of the first frame's metadata.
+  uint32_t end_ptr;      // Ring position just past the final frame.
+  uint32_t num_frames;
+  uint32_t sampled_out;  // Frames skipped by device-side sampling since the previous batch.
+  ethdump_frame_t frames[ETHDUMP_MAX_BATCH];
+} ethdump_batch_t;
+
+static uint32_t read_frame_length(const uint8_t* ring_contents, uint32_t ring_size, uint32_t read_ptr, uint32_t write_ptr) {
+  // Read the frame metadata.
+  uint32_t frame_info;
+  uint32_t read_ptr_masked = read_ptr & (ring_size - 1);
+  if (read_ptr_masked <= ring_size - sizeof(frame_info)) {
+    // Metadata does not straddle a ring wrap; this should compile to a simple unaligned load.
+    memcpy(&frame_info, ring_contents + read_ptr_masked, sizeof(frame_info));
+  } else {
+    // Metadata straddles a ring wrap; perform aligned loads from either end of the
+    // ring, and then shift bits around to get what we're after.
+    uint32_t end = *(volatile uint32_t*)(ring_contents + ring_size - sizeof(uint32_t));
+    uint32_t start = *(volatile uint32_t*)ring_contents;
+    uint32_t shift = (ring_size - read_ptr_masked) * __CHAR_BIT__;
+    end >>= (0u - shift) & 31;
+    start <<= shift;
+    frame_info = end + start;
+  }
+  frame_info = __builtin_bswap32(frame_info);
+  if ((frame_info & 0xe0880000) != 0u || (frame_info & 0xfffff) < 14u) {
+    FATAL("Ring is corrupt at read pointer 0x%x / write pointer 0x%x, as hardware metadata for a ring entry should never be 0x%08x", read_ptr, write_ptr, frame_info);
+  }
+  return frame_info & 0x3fff;
+}
+
+static void fill_batch(const pinned_host_buffer_t* h_ring, uint32_t read_ptr, uint32_t write_ptr, ethdump_batch_t* batch) {
+  // Populates everything other than batch->timestamp_ns and batch->sampled_out.
+  const uint8_t* ring_contents = (const uint8_t*)h_ring->host_ptr;
+  uint32_t ring_size = h_ring->size;
+  uint32_t n = 0;
+  batch->start_ptr = read_ptr;
+  while (n < ETHDUMP_MAX_BATCH && (write_ptr - read_ptr) >= sizeof(uint32_t)) { // 4 bytes is minimum we'll need to read a frame.
+    uint32_t frame_length = read_frame_length(ring_contents, ring_size, read_ptr, write_ptr);
+    if (write_ptr - read_ptr < sizeof(uint32_t) + frame_length) {
+      // Frame only partially present; don't read it yet.
+      break;
+    }
+    uint32_t read_ptr_masked = (read_ptr + sizeof(uint32_t)) & (ring_size - 1);
+    // Walking the ring is a chain of dependent loads, so prefetch well ahead of it. This may
+    // touch bytes not yet written by the device, which is harmless.
+    __builtin_prefetch(ring_contents + ((read_ptr + 2048) & (ring_size - 1)));
+    __builtin_prefetch(ring_contents + ((read_ptr + 2048 + 64) & (ring_size - 1)));
+    ethdump_frame_t* frame = batch->frames + n++;
+    frame->data = ring_contents + read_ptr_masked;
+    if (read_ptr_masked > ring_size - frame_length) {
+      frame->len = ring_size - read_ptr_masked;
+      frame->wrap_len = frame_length - frame->len;
+      frame->wrap_data = ring_contents;
+    } else {
+      frame->len = frame_length;
+      frame->wrap_len = 0;
+      frame->wrap_data = NULL;
+    }
+    read_ptr += sizeof(uint32_t) + frame_length;
+  }
+  batch->end_ptr = read_ptr;
+  batch->num_frames = n;
+}
+
+// Flow keys:
+// Frames are classified into flows using their L2/L3/L4 headers. Only the first
+// FLOW_HDR_BYTES of each frame are ever inspected.
+
+#define FLOW_HDR_BYTES 128
+
+typedef struct flow_key_t {
+  uint8_t addrs[2][16]; // Source then destination; IPv4 uses 4 bytes, IPv6 uses 16 bytes, non-IP frames use 6 byte MAC addresses.
+  uint16_t ports[2];    // Source then destination; zero for protocols without ports.
+  uint16_t ethertype;
+  uint16_t vlan;        // Outermost VLAN identifier, or zero if untagged.
+  uint8_t proto;        // IP protocol number, or zero for non-IP frames.
+  uint8_t addr_len;
+  uint8_t reserved[2];  // Always zero, so that keys can be hashed and compared as raw bytes.
+} flow_key_t;
+
+static uint16_t load_be16(const uint8_t* p) {
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint8_t parse_flow_key(const uint8_t* hdr, uint32_t len, flow_key_t* key) {
+  // hdr points at the (contiguous) first len bytes of an Ethernet frame, where len >= 14.
+  // Returns the TCP flags if the frame is a TCP segment, otherwise zero.
+  memset(key, 0, sizeof(*key));
+  uint32_t pos = 12;
+  uint16_t ethertype = load_be16(hdr + pos);
+  while ((ethertype == 0x8100 || ethertype == 0x88A8) && pos + 6 <= len) {
+    if (!key->vlan) key->vlan = load_be16(hdr + pos + 2) & 0xfff;
+    pos += 4;
+    ethertype = load_be16(hdr + pos);
+  }
+  pos += 2;
+  key->ethertype = ethertype;
+  uint32_t l4 = 0;
+  if (ethertype == 0x0800 && pos + 20 <= len) {
+    const uint8_t* ip = hdr + pos;
+    key->proto = ip[9];
+    key->addr_len = 4;
+    memcpy(key->addrs[0], ip + 12, 4);
+    memcpy(key->addrs[1], ip + 16, 4);
+    if ((load_be16(ip + 6) & 0x1fff) == 0) l4 = pos + (ip[0] & 0xf) * 4; // Only the first fragment carries ports.
+  } else if (ethertype == 0x86DD && pos + 40 <= len) {
+    const uint8_t* ip = hdr + pos;
+    key->proto = ip[6];
+    key->addr_len = 16;
+    memcpy(key->addrs[0], ip + 8, 16);
+    memcpy(key->addrs[1], ip + 24, 16);
+    l4 = pos + 40;
+  } else {
+    key->addr_len = 6;
+    memcpy(key->addrs[0], hdr + 6, 6);
+    memcpy(key->addrs[1], hdr, 6);
+    return 0;
+  }
+  if (l4 && l4 + 4 <= len && (key->proto == 6 || key->proto == 17 || key->proto == 132)) { // TCP, UDP, SCTP
+    key->ports[0] = load_be16(hdr + l4);
+    key->ports[1] = load_be16(hdr + l4 + 2);
+    if (key->proto == 6 && l4 + 14 <= len) return hdr[l4 + 13];
+  }
+  return 0;
+}
+
+static void flow_key_make_symmetric(flow_key_t* key) {
+  // Order the two endpoints, so that both directions of a conversation give the same key.
+  int c = memcmp(key->addrs[0], key->addrs[1], sizeof(key->addrs[0]));
+  if (c > 0 || (c == 0 && key->ports[0] > key->ports[1])) {
+    uint8_t addr[16];
+    memcpy(addr, key->addrs[0], sizeof(addr));
+    memcpy(key->addrs[0], key->addrs[1], sizeof(addr));
+    memcpy(key->addrs[1], addr, sizeof(addr));
+    uint16_t port = key->ports[0];
+    key->ports[0] = key->ports[1];
+    key->ports[1] = port;
+  }
+}
+
+static uint32_t flow_key_hash(const flow_key_t* key) {
+  uint32_t words[sizeof(flow_key_t) / sizeof(uint32_t)];
+  memcpy(words, key, sizeof(words));
+  uint64_t h = 0x9E3779B97F4A7C15ull;
+  for (unsigned i = 0; i < sizeof(words) / sizeof(*words); ++i) {
+    h = (h ^ words[i]) * 0xFF51AFD7ED558CCDull;
+    h ^= h >> 32;
+  }
+  return (uint32_t)h;
+}
+
+static const uint8_t* frame_headers(const ethdump_frame_t* frame, uint8_t* buf, uint32_t* len) {
+  // Returns a pointer to the first *len bytes of the frame, copying into buf if they straddle a ring wrap.
+  uint32_t frame_length = frame->len + frame->wrap_len;
+  uint32_t n = frame_length < FLOW_HDR_BYTES ? frame_length : FLOW_HDR_BYTES;
+  *len = n;
+  if (frame->len >= n) return frame->data;
+  memcpy(buf, frame->data, frame->len);
+  memcpy(buf + frame->len, frame->wrap_data, n - frame->len);
+  return buf;
+}
+
+// Sidecar capture index:
+// The pcap file is divided into blocks of approximately INDEX_BLOCK_BYTES. As each block
+// is completed, a record describing its file offsets, its time range, and the (symmetric)
+// hashes of the flows within it is appended to the index. When the capture finishes, a
+// directory of blocks and a per-flow posting list of block numbers are appended, followed
+// by a fixed-size trailer. If the trailer is missing (e.g. the capture was killed), the
+// block records alone are sufficient to answer queries, albeit less quickly.
+
+#define INDEX_MAGIC         0x58495454 // "TTIX"
+#define INDEX_BLOCK_MAGIC   0x4B4C4254 // "TBLK"
+#define INDEX_VERSION       1
+#define INDEX_BLOCK_BYTES   (1u << 20)
+#define INDEX_MAX_FLOWS_LOG2 15 // Blocks are ended early if they would contain more distinct flows than this.
+
+typedef struct index_file_hdr_t {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t block_bytes;
+  uint32_t sample_interval; // N if the device kept 1 in N frames (or flows), otherwise 0 (see num_sampled_out).
+} index_file_hdr_t;
+
+typedef struct index_block_rec_t {
+  uint32_t magic;
+  uint32_t num_flows; // In block records, followed by this many uint32_t flow hashes (sorted ascending).
+  uint32_t num_pkts;
+  uint32_t num_sampled_out; // Frames which the device skipped (due to sampling) amongst those in the block.
+  uint64_t start_offset; // pcap file offset of the first packet record in the block.
+  uint64_t end_offset;   // pcap file offset just past the last packet record in the block.
+  uint64_t first_ns;
+  uint64_t last_ns;
+} index_block_rec_t;
+
+typedef struct index_flow_ent_t {
+  uint32_t hash;
+  uint32_t postings_start; // Index into postings array; count is given by the next entry's postings_start.
+} index_flow_ent_t;
+
+typedef struct index_trailer_t {
+  uint64_t dir_offset;      // Array of num_blocks index_block_rec_t.
+  uint64_t flows_offset;    // Array of num_flows + 1 index_flow_ent_t, sorted by hash.
+  uint64_t postings_offset; // Array of num_postings uint32_t block numbers.
+  uint32_t num_blocks;
+  uint32_t num_flows;
+  uint32_t num_postings;
+  uint32_t magic;
+} index_trailer_t;
+
+typedef struct capture_index_t {
+  int fd;
+  uint64_t index_offset;
+  index_block_rec_t cur;        // Block currently being accumulated.
+  uint32_t flow_gen;            // Generation counter for flow_set, avoiding a clear per block.
+  uint32_t* flow_set;           // Open-addressing set of hashes in current block: [hash, gen] pairs.
+  uint32_t* block_flows;        // Distinct hashes in current block, in arrival order.
+  index_block_rec_t* blocks;    // All completed blocks.
+  uint32_t num_blocks;
+  uint32_t blocks_cap;
+  uint64_t* pairs;              // (hash << 32) + block number, for building posting lists.
+  size_t num_pairs;
+  size_t pairs_cap;
+} capture_index_t;
+
+static void index_write(capture_index_t* index, const void* data, size_t size) {
+  const char* src = (const char*)data;
+  while (size) {
+    ssize_t n = write(index->fd, src, size);
+    if (n > 0) {
+      src += n;
+      size -= n;
+      index->index_offset += n;
+    } else if (n == 0 || errno != EINTR) {
+      FATAL("Could not write to index file");
+    }
+  }
+}
+
+static void* grow_array(void* arr, size_t* cap, size_t needed, size_t elem_size) {
+  if (needed <= *cap) return arr;
+  size_t new_cap = *cap ? *cap * 2 : 1024;
+  while (new_cap < needed) new_cap *= 2;
+  arr = realloc(arr, new_cap * elem_size);
+  if (!arr) FATAL("Could not allocate %llu bytes", (long long unsigned)(new_cap * elem_size));
+  *cap = new_cap;
+  return arr;
+}
+
+static int cmp_u32(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+static int cmp_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static capture_index_t* index_open(const char* pcap_filename, uint32_t sample_interval) {
+  char* filename = malloc(strlen(pcap_filename) + 5);
+  if (!filename) FATAL("Could not allocate memory for index filename");
+  sprintf(filename, "%s.idx", pcap_filename);
+  int fd = open(filename, O_CLOEXEC | O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd < 0) FATAL("Could not open path '%s' for index writing", filename);
+  free(filename);
+  capture_index_t* index = calloc(1, sizeof(capture_index_t));
+  uint32_t set_size = 2u << INDEX_MAX_FLOWS_LOG2;
+  if (!index
+  ||  !(index->flow_set = calloc(set_size * 2, sizeof(uint32_t)))
+  ||  !(index->block_flows = malloc(sizeof(uint32_t) << INDEX_MAX_FLOWS_LOG2))) {
+    FATAL("Could not allocate memory for index");
+  }
+  index->fd = fd;
+  index_file_hdr_t hdr = {INDEX_MAGIC, INDEX_VERSION, INDEX_BLOCK_BYTES, sample_interval};
+  index_write(index, &hdr, sizeof(hdr));
+  index->flow_gen = 1;
+  return index;
+}
+
+static void index_end_block(capture_index_t* index, uint64_t end_offset) {
+  index_block_rec_t* cur = &index->cur;
+  if (cur->num_pkts == 0) return;
+  cur->magic = INDEX_BLOCK_MAGIC;
+  cur->end_offset = end_offset;
+  uint32_t num_flows = cur->num_flows;
+  qsort(index->block_flows, num_flows, sizeof(uint32_t), cmp_u32);
+  index_write(index, cur, sizeof(*cur));
+  index_write(index, index->block_flows, num_flows * sizeof(uint32_t));
+
+  size_t blocks_cap = index->blocks_cap;
+  index->blocks = grow_array(index->blocks, &blocks_cap, index->num_blocks + 1, sizeof(index_block_rec_t));
+  index->blocks_cap = (uint32_t)blocks_cap;
+  index->pairs = grow_array(index->pairs, &index->pairs_cap, index->num_pairs + num_flows, sizeof(uint64_t));
+  for (uint32_t i = 0; i < num_flows; ++i) {
+    index->pairs[index->num_pairs++] = ((uint64_t)index->block_flows[i] << 32) + index->num_blocks;
+  }
+  index->blocks[index->num_blocks] = *cur;
+  index->blocks[index->num_blocks++].magic = 0; // So that directory entries can't be mistaken for block records.
+  memset(cur, 0, sizeof(*cur));
+  if (++index->flow_gen == 0) {
+    memset(index->flow_set, 0, (4u << INDEX_MAX_FLOWS_LOG2) * sizeof(uint32_t));
+    index->flow_gen = 1;
+  }
+}
+
+static void index_add_packet(capture_index_t* index, uint64_t offset, uint32_t record_size, uint64_t ts_ns, uint32_t hash) {
+  index_block_rec_t* cur = &index->cur;
+  if (cur->num_pkts == 0) {
+    cur->start_offset = offset;
+    cur->first_ns = ts_ns;
+  }
+  cur->num_pkts += 1;
+  cur->last_ns = ts_ns;
+
+  // Insert hash into the set of flows for this block.
+  uint32_t mask = (2u << INDEX_MAX_FLOWS_LOG2) - 1;
+  uint32_t gen = index->flow_gen;
+  uint32_t* set = index->flow_set;
+  for (uint32_t i = hash;; ++i) {
+    uint32_t* slot = set + (i & mask) * 2;
+    if (slot[1] != gen) {
+      slot[0] = hash;
+      slot[1] = gen;
+      index->block_flows[cur->num_flows++] = hash;
+      break;
+    }
+    if (slot[0] == hash) break;
+  }
+
+  uint64_t end = offset + record_size;
+  if (end - cur->start_offset >= INDEX_BLOCK_BYTES || cur->num_flows == (1u << INDEX_MAX_FLOWS_LOG2)) {
+    index_end_block(index, end);
+  }
+}
+
+static void index_finish(capture_index_t* index, uint64_t end_offset) {
+  index_end_block(index, end_offset);
+
+  index_trailer_t trailer;
+  trailer.dir_offset = index->index_offset;
+  trailer.num_blocks = index->num_blocks;
+  index_write(index, index->blocks, index->num_blocks * sizeof(index_block_rec_t));
+
+  // Build posting lists from the (hash, block) pairs.
+  qsort(index->pairs, index->num_pairs, sizeof(uint64_t), cmp_u64);
+  size_t num_flows = 0;
+  for (size_t i = 0; i < index->num_pairs; ++i) {
+    if (i == 0 || (index->pairs[i] >> 32) != (index->pairs[i - 1] >> 32)) ++num_flows;
+  }
+  index_flow_ent_t* flows = malloc((num_flows + 1) * sizeof(index_flow_ent_t));
+  uint32_t* postings = malloc((index->num_pairs + 1) * sizeof(uint32_t));
+  if (!flows || !postings) FATAL("Could not allocate memory for index posting lists");
+  num_flows = 0;
+  for (size_t i = 0; i < index->num_pairs; ++i) {
+    uint32_t hash = (uint32_t)(index->pairs[i] >> 32);
+    if (i == 0 || hash != flows[num_flows - 1].hash) {
+      flows[num_flows].hash = hash;
+      flows[num_flows].postings_start = (uint32_t)i;
+      ++num_flows;
+    }
+    postings[i] = (uint32_t)index->pairs[i];
+  }
+  flows[num_flows].hash = UINT32_MAX;
+  flows[num_flows].postings_start = (uint32_t)index->num_pairs;
+  trailer.flows_offset = index->index_offset;
+  trailer.num_flows = (uint32_t)num_flows;
+  index_write(index, flows, (num_flows + 1) * sizeof(index_flow_ent_t));
+  trailer.postings_offset = index->index_offset;
+  trailer.num_postings = (uint32_t)index->num_pairs;
+  index_write(index, postings, index->num_pairs * sizeof(uint32_t));
+  trailer.magic = INDEX_MAGIC;
+  index_write(index, &trailer, sizeof(trailer));
+
+  free(flows);
+  free(postings);
+  free(index->pairs);
+  free(index->blocks);
+  free(index->block_flows);
+  free(index->flow_set);
+  close(index->fd);
+  free(index);
+}
+
+// Compressed output:
+// With --compress, the output stream is cut into fixed-size blocks, each of which is compressed
+// independently by a pool of worker threads and written out (in order) by a dedicated output
+// thread, so the thread draining the host ring only ever copies bytes into a free block. Each
+// block becomes one complete zstd or LZ4 frame, and after the final frame comes a seek table in
+// zstd's seekable format (a skippable frame listing the compressed and uncompressed size of every
+// frame), so the file can be decompressed by the standard zstd or lz4 tools (which skip the seek
+// table), and --query can decompress just the blocks it needs. The compression libraries are
+// loaded at runtime, so ethdump has no build-time dependency on them.
+
+#define COMPRESS_BLOCK_SIZE (1u << 20)
+#define COMPRESS_MAX_THREADS 64
+
+// Values for compress_config_t::algo:
+#define COMPRESS_NONE 0
+#define COMPRESS_ZSTD 1
+#define COMPRESS_LZ4  2
+
+// Values for compress_block_t::state:
+#define COMPRESS_BLOCK_FREE  0 // Available for filling.
+#define COMPRESS_BLOCK_READY 1 // Filled, waiting for a worker.
+#define COMPRESS_BLOCK_BUSY  2 // Being compressed.
+#define COMPRESS_BLOCK_DONE  3 // Compressed, waiting for the output thread.
+
+#define ZSTD_FRAME_MAGIC     0xFD2FB528u
+#define LZ4_FRAME_MAGIC      0x184D2204u
+#define SEEK_TABLE_SKIPPABLE_MAGIC 0x184D2A5Eu // Also in the range of skippable frames for LZ4.
+#define SEEK_TABLE_FOOTER_MAGIC    0x8F92EAB1u
+#define SEEK_TABLE_FOOTER_SIZE     9
+
+// Inlined copy of what we need from zstd.h and lz4frame.h:
+typedef struct {
+  int blockSizeID;         // LZ4F_max1MB = 6.
+  int blockMode;           // LZ4F_blockLinked = 0.
+  int contentChecksumFlag;
+  int frameType;
+  unsigned long long contentSize;
+  unsigned dictID;
+  int blockChecksumFlag;
+  int compressionLevel;
+  unsigned autoFlush;
+  unsigned favorDecSpeed;
+  unsigned reserved[3];
+} lz4f_preferences_t;
+#define LZ4F_VERSION 100
+
+typedef struct compress_lib_t {
+  void* handle;
+  size_t (*zstd_bound)(size_t);
+  void* (*zstd_create_cctx)(void);
+  size_t (*zstd_free_cctx)(void*);
+  size_t (*zstd_compress_cctx)(void*, void*, size_t, const void*, size_t, int);
+  size_t (*zstd_decompress)(void*, size_t, const void*, size_t);
+  unsigned (*zstd_is_error)(size_t);
+  size_t (*lz4f_bound)(size_t, const lz4f_preferences_t*);
+  size_t (*lz4f_compress)(void*, size_t, const void*, size_t, const lz4f_preferences_t*);
+  size_t (*lz4f_create_dctx)(void**, unsigned);
+  size_t (*lz4f_free_dctx)(void*);
+  size_t (*lz4f_decompress)(void*, void*, size_t*, const void*, size_t*, const void*);
+  unsigned (*lz4f_is_error)(size_t);
+} compress_lib_t;
+
+static void* compress_lib_sym(void* handle, const char* lib, const char* name) {
+  void* sym = dlsym(handle, name);
+  if (!sym) FATAL("%s does not provide %s; is it too old?", lib, name);
+  return sym;
+}
+
+static void compress_lib_load(compress_lib_t* lib, uint8_t algo) {
+  memset(lib, 0, sizeof(*lib));
+  const char* name = algo == COMPRESS_ZSTD ? "libzstd.so.1" : "liblz4.so.1";
+  lib->handle = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+  if (!lib->handle) FATAL("Could not load %s; is %s installed?", name, algo == COMPRESS_ZSTD ? "zstd" : "lz4");
+  if (algo == COMPRESS_ZSTD) {
+    *(void**)&lib->zstd_bound = compress_lib_sym(lib->handle, name, "ZSTD_compressBound");
+    *(void**)&lib->zstd_create_cctx = compress_lib_sym(lib->handle, name, "ZSTD_createCCtx");
+    *(void**)&lib->zstd_free_cctx = compress_lib_sym(lib->handle, name, "ZSTD_freeCCtx");
+    *(void**)&lib->zstd_compress_cctx = compress_lib_sym(lib->handle, name, "ZSTD_compressCCtx");
+    *(void**)&lib->zstd_decompress = compress_lib_sym(lib->handle, name, "ZSTD_decompress");
+    *(void**)&lib->zstd_is_error = compress_lib_sym(lib->handle, name, "ZSTD_isError");
+  } else {
+    *(void**)&lib->lz4f_bound = compress_lib_sym(lib->handle, name, "LZ4F_compressFrameBound");
+    *(void**)&lib->lz4f_compress = compress_lib_sym(lib->handle, name, "LZ4F_compressFrame");
+    *(void**)&lib->lz4f_create_dctx = compress_lib_sym(lib->handle, name, "LZ4F_createDecompressionContext");
+    *(void**)&lib->lz4f_free_dctx = compress_lib_sym(lib->handle, name, "LZ4F_freeDecompressionContext");
+    *(void**)&lib->lz4f_decompress = compress_lib_sym(lib->handle, name, "LZ4F_decompress");
+    *(void**)&lib->lz4f_is_error = compress_lib_sym(lib->handle, name, "LZ4F_isError");
+  }
+}
+
+static void lz4f_preferences_init(lz4f_preferences_t* prefs, int level, size_t content_size) {
+  memset(prefs, 0, sizeof(*prefs));
+  prefs->blockSizeID = 6;
+  prefs->contentSize = content_size;
+  prefs->compressionLevel = level;
+}
+
+typedef struct compress_config_t {
+  uint8_t algo;      // One of COMPRESS_*.
+  int level;         // As understood by the library; 0 means its default.
+  uint32_t threads;  // Number of worker threads.
+} compress_config_t;
+
+typedef struct compress_stats_t {
+  uint64_t blocks;
+  uint64_t bytes_in;        // Uncompressed bytes.
+  uint64_t bytes_out;       // Compressed bytes written (excluding the seek table).
+  uint64_t wall_ns;         // From starting the stream to finishing it.
+  uint64_t fill_stall_ns;   // Time the capture thread spent waiting for a free block.
+  uint64_t compress_busy_ns; // Summed over all workers.
+  uint64_t write_busy_ns;   // Time the output thread spent writing.
+} compress_stats_t;
+
+typedef struct compress_block_t {
+  uint8_t* in;
+  uint8_t* out;
+  uint32_t in_size;
+  uint32_t out_size;
+  uint32_t state; // One of COMPRESS_BLOCK_*.
+} compress_block_t;
+
+typedef struct compress_stream_t {
+  compress_config_t config;
+  compress_lib_t lib;
+  int fd;
+  uint32_t num_blocks;
+  size_t out_capacity;
+  compress_block_t* blocks;
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;  // Signalled when a block becomes READY, or when stopping.
+  pthread_cond_t done_cond;  // Signalled when a block becomes DONE, or when stopping.
+  pthread_cond_t free_cond;  // Signalled when a block becomes FREE.
+  uint64_t fill_seq;         // Block being filled by the capture thread (protected by lock once submitted).
+  uint64_t compress_seq;     // Next block for a worker to take.
+  uint64_t write_seq;        // Next block for the output thread to write.
+  bool stopping;
+  bool closed;               // Set by the output thread if the consumer went away.
+  uint32_t* seek_table;      // Compressed and uncompressed size of every block written.
+  size_t seek_table_cap;
+  uint64_t start_ns;
+  compress_stats_t stats;
+  pthread_t writer;
+  pthread_t workers[COMPRESS_MAX_THREADS];
+} compress_stream_t;
+
+static uint64_t compress_nanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t compress_block(const compress_lib_t* lib, const compress_config_t* config, void* cctx, compress_block_t* b, size_t out_capacity) {
+  size_t n;
+  if (config->algo == COMPRESS_ZSTD) {
+    n = lib->zstd_compress_cctx(cctx, b->out, out_capacity, b->in, b->in_size, config->level);
+    if (lib->zstd_is_error(n)) FATAL("zstd compression failed");
+  } else {
+    lz4f_preferences_t prefs;
+    lz4f_preferences_init(&prefs, config->level, b->in_size);
+    n = lib->lz4f_compress(b->out, out_capacity, b->in, b->in_size, &prefs);
+    if (lib->lz4f_is_error(n)) FATAL("LZ4 compression failed");
+  }
+  return n;
+}
+
+static void* compress_worker_main(void* arg) {
+  compress_stream_t* c = (compress_stream_t*)arg;
+  void* cctx = c->config.algo == COMPRESS_ZSTD ? c->lib.zstd_create_cctx() : NULL;
+  pthread_mutex_lock(&c->lock);
+  for (;;) {
+    compress_block_t* b = &c->blocks[c->compress_seq % c->num_blocks];
+    if (c->compress_seq == c->fill_seq || b->state != COMPRESS_BLOCK_READY) {
+      if (c->stopping && c->compress_seq == c->fill_seq) break;
+      pthread_cond_wait(&c->work_cond, &c->lock);
+      continue;
+    }
+    c->compress_seq += 1;
+    b->state = COMPRESS_BLOCK_BUSY;
+    pthread_mutex_unlock(&c->lock);
+    uint64_t t0 = compress_nanos();
+    size_t n = compress_block(&c->lib, &c->config, cctx, b, c->out_capacity);
+    uint64_t t1 = compress_nanos();
+    pthread_mutex_lock(&c->lock);
+    b->out_size = (uint32_t)n;
+    b->state = COMPRESS_BLOCK_DONE;
+    c->stats.compress_busy_ns += t1 - t0;
+    pthread_cond_signal(&c->done_cond);
+  }
+  pthread_mutex_unlock(&c->lock);
+  if (cctx) c->lib.zstd_free_cctx(cctx);
+  return NULL;
+}
+
+static bool compress_write_all(int fd, const uint8_t* data, size_t size) {
+  while (size) {
+    ssize_t n = write(fd, data, size);
+    if (n > 0) {
+      data += n;
+      size -= n;
+    } else if (n < 0 && errno == EPIPE) {
+      return false;
+    } else if (n == 0 || errno != EINTR) {
+      FATAL("Could not write to output file");
+    }
+  }
+  return true;
+}
+
+static void* compress_writer_main(void* arg) {
+  compress_stream_t* c = (compress_stream_t*)arg;
+  pthread_mutex_lock(&c->lock);
+  for (;;) {
+    compress_block_t* b = &c->blocks[c->write_seq % c->num_blocks];
+    if (c->write_seq == c->fill_seq || b->state != COMPRESS_BLOCK_DONE) {
+      if (c->stopping && c->write_seq == c->fill_seq) break;
+      pthread_cond_wait(&c->done_cond, &c->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&c->lock);
+    uint64_t t0 = compress_nanos();
+    bool ok = !c->closed && compress_write_all(c->fd, b->out, b->out_size);
+    uint64_t t1 = compress_nanos();
+    pthread_mutex_lock(&c->lock);
+    if (ok) {
+      c->seek_table = grow_array(c->seek_table, &c->seek_table_cap, (c->stats.blocks + 1) * 2, sizeof(uint32_t));
+      c->seek_table[c->stats.blocks * 2 + 0] = b->out_size;
+      c->seek_table[c->stats.blocks * 2 + 1] = b->in_size;
+      c->stats.blocks += 1;
+      c->stats.bytes_out += b->out_size;
+    } else {
+      __atomic_store_n(&c->closed, true, __ATOMIC_RELAXED);
+    }
+    c->stats.write_busy_ns += t1 - t0;
+    b->state = COMPRESS_BLOCK_FREE;
+    c->write_seq += 1;
+    pthread_cond_signal(&c->free_cond);
+  }
+  pthread_mutex_unlock(&c->lock);
+  return NULL;
+}
+
+static compress_stream_t* compress_stream_open(int fd, const compress_config_t* config) {
+  compress_stream_t* c = calloc(1, sizeof(compress_stream_t));
+  if (!c) FATAL("Could not allocate memory for compression");
+  c->config = *config;
+  if (c->config.threads == 0) c->config.threads = 1;
+  if (c->config.threads > COMPRESS_MAX_THREADS) c->config.threads = COMPRESS_MAX_THREADS;
+  compress_lib_load(&c->lib, config->algo);
+  c->fd = fd;
+  c->num_blocks = c->config.threads * 2 + 2;
+  if (config->algo == COMPRESS_ZSTD) {
+    c->out_capacity = c->lib.zstd_bound(COMPRESS_BLOCK_SIZE);
+  } else {
+    lz4f_preferences_t prefs;
+    lz4f_preferences_init(&prefs, config->level, COMPRESS_BLOCK_SIZE);
+    c->out_capacity = c->lib.lz4f_bound(COMPRESS_BLOCK_SIZE, &prefs);
+  }
+  c->blocks = calloc(c->num_blocks, sizeof(compress_block_t));
+  if (!c->blocks) FATAL("Could not allocate memory for compression");
+  for (uint32_t i = 0; i < c->num_blocks; ++i) {
+    c->blocks[i].in = malloc(COMPRESS_BLOCK_SIZE);
+    c->blocks[i].out = malloc(c->out_capacity);
+    if (!c->blocks[i].in || !c->blocks[i].out) FATAL("Could not allocate memory for compression");
+  }
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->work_cond, NULL);
+  pthread_cond_init(&c->done_cond, NULL);
+  pthread_cond_init(&c->free_cond, NULL);
+  signal(SIGPIPE, SIG_IGN); // Consumer going away is reported as EPIPE instead.
+  c->start_ns = compress_nanos();
+  int err = pthread_create(&c->writer, NULL, compress_writer_main, c);
+  for (uint32_t i = 0; i < c->config.threads && !err; ++i) err = pthread_create(&c->workers[i], NULL, compress_worker_main, c);
+  if (err) FATAL("Could not create compression thread (error %d)", err);
+  return c;
+}
+
+static void compress_stream_submit(compress_stream_t* c) {
+  // Hands the block being filled to the workers, then waits until the next block is free.
+  pthread_mutex_lock(&c->lock);
+  c->blocks[c->fill_seq % c->num_blocks].state = COMPRESS_BLOCK_READY;
+  c->fill_seq += 1;
+  pthread_cond_signal(&c->work_cond);
+  compress_block_t* next = &c->blocks[c->fill_seq % c->num_blocks];
+  if (next->state != COMPRESS_BLOCK_FREE) {
+    uint64_t t0 = compress_nanos();
+    while (next->state != COMPRESS_BLOCK_FREE) pthread_cond_wait(&c->free_cond, &c->lock);
+    c->stats.fill_stall_ns += compress_nanos() - t0;
+  }
+  next->in_size = 0;
+  pthread_mutex_unlock(&c->lock);
+}
+
+static bool compress_stream_write(compress_stream_t* c, const struct iovec* iovs, int iovcnt) {
+  // Returns false if the consumer has gone away. The block being filled (at fill_seq) is FREE, so
+  // nobody else looks at it.
+  for (int i = 0; i < iovcnt; ++i) {
+    const uint8_t* src = (const uint8_t*)iovs[i].iov_base;
+    size_t size = iovs[i].iov_len;
+    c->stats.bytes_in += size;
+    while (size) {
+      compress_block_t* b = &c->blocks[c->fill_seq % c->num_blocks];
+      size_t n = COMPRESS_BLOCK_SIZE - b->in_size;
+      if (n > size) n = size;
+      memcpy(b->in + b->in_size, src, n);
+      b->in_size += (uint32_t)n;
+      src += n;
+      size -= n;
+      if (b->in_size == COMPRESS_BLOCK_SIZE) compress_stream_submit(c);
+    }
+  }
+  return !__atomic_load_n(&c->closed, __ATOMIC_RELAXED);
+}
+
+static void compress_stream_close(compress_stream_t* c, compress_stats_t* stats) {
+  // Compresses and writes whatever remains, then appends the seek table.
+  if (c->blocks[c->fill_seq % c->num_blocks].in_size) compress_stream_submit(c);
+  pthread_mutex_lock(&c->lock);
+  c->stopping = true;
+  pthread_cond_broadcast(&c->work_cond);
+  pthread_cond_broadcast(&c->done_cond);
+  pthread_mutex_unlock(&c->lock);
+  for (uint32_t i = 0; i < c->config.threads; ++i) pthread_join(c->workers[i], NULL);
+  pthread_join(c->writer, NULL);
+  if (!c->closed) {
+    uint32_t num_frames = (uint32_t)c->stats.blocks;
+    size_t table_size = 8 + num_frames * 8 + SEEK_TABLE_FOOTER_SIZE;
+    uint8_t* table = malloc(table_size);
+    if (!table) FATAL("Could not allocate memory for seek table");
+    uint32_t words[2] = {SEEK_TABLE_SKIPPABLE_MAGIC, (uint32_t)(table_size - 8)};
+    memcpy(table, words, 8);
+    if (num_frames) memcpy(table + 8, c->seek_table, num_frames * 8);
+    uint8_t* footer = table + 8 + num_frames * 8;
+    memcpy(footer, &num_frames, 4);
+    footer[4] = 0; // Seek_Table_Descriptor: no checksums.
+    uint32_t magic = SEEK_TABLE_FOOTER_MAGIC;
+    memcpy(footer + 5, &magic, 4);
+    compress_write_all(c->fd, table, table_size);
+    free(table);
+  }
+  c->stats.wall_ns = compress_nanos() - c->start_ns;
+  *stats = c->stats;
+  for (uint32_t i = 0; i < c->num_blocks; ++i) {
+    free(c->blocks[i].in);
+    free(c->blocks[i].out);
+  }
+  free(c->blocks);
+  free(c->seek_table);
+  pthread_mutex_destroy(&c->lock);
+  pthread_cond_destroy(&c->work_cond);
+  pthread_cond_destroy(&c->done_cond);
+  pthread_cond_destroy(&c->free_cond);
+  dlclose(c->lib.handle);
+  free(c);
+}
+
+static void print_compress_stats(FILE* f, const compress_config_t* config, const compress_stats_t* stats) {
+  if (!stats->bytes_in) return;
+  double mb = 1e-6;
+  double wall_s = stats->wall_ns * 1e-9;
+  fprintf(f, "Compressed %.1f MB to %.1f MB (%.2fx) with %s in %llu blocks of %u KiB\n",
+    stats->bytes_in * mb, stats->bytes_out * mb, stats->bytes_out ? (double)stats->bytes_in / stats->bytes_out : 0.0,
+    config->algo == COMPRESS_ZSTD ? "zstd" : "LZ4", (long long unsigned)stats->blocks, COMPRESS_BLOCK_SIZE >> 10);
+  fprintf(f, "  Fill: %.1f MB/s average, stalled for %.1f ms waiting for a free block\n",
+    wall_s > 0 ? stats->bytes_in * mb / wall_s : 0.0, stats->fill_stall_ns * 1e-6);
+  fprintf(f, "  Compress: %.1f MB/s per thread whilst busy, %u threads %.0f%% busy\n",
+    stats->compress_busy_ns ? stats->bytes_in * mb / (stats->compress_busy_ns * 1e-9) : 0.0, (unsigned)config->threads,
+    stats->wall_ns ? 100.0 * stats->compress_busy_ns / ((double)stats->wall_ns * config->threads) : 0.0);
+  fprintf(f, "  Write: %.1f MB/s whilst busy, %.0f%% busy\n",
+    stats->write_busy_ns ? stats->bytes_out * mb / (stats->write_busy_ns * 1e-9) : 0.0,
+    stats->wall_ns ? 100.0 * stats->write_busy_ns / (double)stats->wall_ns : 0.0);
+}
+
+// Minimal pcap file writer:
+// The output can be a regular file, or "-" for stdout, or "unix:/path" to connect to a
+// listening stream socket. With --splice, when the output is a pipe, frame payloads are
+// vmspliced straight from the host ring into the pipe, meaning that the pipe holds references
+// to the ring rather than copies of it. Ring space is then released once the consumer has read
+// it out of the pipe (see pcap_writer_reclaim), and the per-packet headers are kept in their
+// own ring so that they too remain stable until read. This is only safe if the consumer copies
+// what it reads (as read does): a consumer which splices or tees out of the pipe passes on
+// references to the ring pages, which can then outlive the ring space they refer to, and there
+// is no way to tell when it is done with them. Hence without --splice, pipes are written with
+// writev like files. When the output is a socket, sendmsg is used with the same iovecs as
+// writev, which copies once straight from the host ring.
+
+#define PCAP_WRITER_NUM_IOVS 20
+
+// Values for pcap_writer_t::mode:
+#define PCAP_OUT_WRITEV  0
+#define PCAP_OUT_SENDMSG 1
+#define PCAP_OUT_SPLICE  2
+
+typedef struct pcap_pending_t {
+  uint64_t out_end;  // Value of total_byte_count once the batch had been written.
+  uint32_t ring_end; // Ring position just past the batch.
+} pcap_pending_t;
+
+typedef struct pcap_writer_t {
+  int fd;
+  int iovcnt;
+  uint8_t mode;
+  bool closed; // Set if the consumer went away.
+  size_t total_pkt_count;
+  size_t total_byte_count;
+  uint64_t file_offset; // Offset of the next packet record, including any not yet flushed.
+  capture_index_t* index; // Optional.
+  compress_stream_t* compressor; // Set if compressing.
+  compress_config_t compress;
+  compress_stats_t compress_stats; // Valid after pcap_writer_finish.
+  uint32_t* hdr_ring;   // PCAP_OUT_SPLICE only: per-packet headers, 16 bytes each.
+  pcap_pending_t* pending; // PCAP_OUT_SPLICE only: batches written but perhaps not yet read.
+  uint32_t ring_mask;   // Mask for both of the above.
+  uint32_t hdr_next;
+  uint32_t pending_head;
+  uint32_t pending_tail;
+  struct iovec iovs[PCAP_WRITER_NUM_IOVS];
+  uint32_t pkt_hdrs[PCAP_WRITER_NUM_IOVS * 4];
+} pcap_writer_t;
+
+static void flush_packets(pcap_writer_t* writer) {
+  int fd = writer->fd;
+  struct iovec* iovs = writer->iovs;
+  int iovcnt = writer->iovcnt;
+  writer->iovcnt = 0;
+  if (writer->closed) return;
+  if (writer->compressor) {
+    for (int i = 0; i < iovcnt; ++i) writer->total_byte_count += iovs[i].iov_len;
+    if (!compress_stream_write(writer->compressor, iovs, iovcnt)) writer->closed = true;
+    return;
+  }
+  for (;;) {
+    ssize_t n;
+    if (writer->mode == PCAP_OUT_SPLICE) {
+      n = vmsplice(fd, iovs, iovcnt, SPLICE_F_NONBLOCK);
+    } else if (writer->mode == PCAP_OUT_SENDMSG) {
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iovs;
+      msg.msg_iovlen = iovcnt;
+      n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } else {
+      n = writev(fd, iovs, iovcnt);
+    }
+    if (n > 0) {
+      writer->total_byte_count += n;
+      while (iovs->iov_len <= (size_t)n) {
+        if (--iovcnt == 0) return;
+        n -= iovs->iov_len;
+        ++iovs;
+      }
+      iovs->iov_len -= n;
+      iovs->iov_base = (char*)iovs->iov_base + n;
+    } else if (n < 0 && errno == EAGAIN) {
+      // Pipe is full; wait for the consumer to read some of it. In the meantime, the device
+      // continues writing to the host ring until the host ring is full.
+      struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+      poll(&pfd, 1, -1);
+    } else if (n < 0 && errno == EPIPE) {
+      writer->closed = true;
+      return;
+    } else if (n < 0 && errno == EFAULT && writer->mode == PCAP_OUT_SPLICE) {
+      // Some host ring allocations (e.g. DMA buffers) cannot be spliced; fall back to copying.
+      writer->mode = PCAP_OUT_WRITEV;
+      int flags = fcntl(fd, F_GETFL);
+      if (flags >= 0) fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    } else if (n == 0 || errno != EINTR) {
+      FATAL("Could not write to output file");
+    }
+  }
+}
+
+static int open_pcap_output(const char* filename) {
+  if (!strcmp(filename, "-")) return STDOUT_FILENO;
+  if (!strncmp(filename, "unix:", 5)) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(filename + 5) >= sizeof(addr.sun_path)) FATAL("Socket path %s is too long", filename + 5);
+    strcpy(addr.sun_path, filename + 5);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) FATAL("Could not connect to '%s' for pcap writing", filename + 5);
+    return fd;
+  }
+  int fd = open(filename, O_CLOEXEC | O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd < 0) FATAL("Could not open path '%s' for pcap writing", filename);
+  return fd;
+}
+
+static void pcap_writer_init(pcap_writer_t* writer, const char* filename, uint32_t ring_size, const compress_config_t* compress) {
+  // If ring_size is non-zero, the caller promises to only write frames from a host ring of that
+  // size, and to use pcap_writer_reclaim to decide when to release them, which allows splicing
+  // (so it should only do so if the consumer is known to copy whatever it reads from a pipe).
+  // If compress is non-NULL (and not COMPRESS_NONE), the output is compressed, and never spliced.
+  memset(writer, 0, sizeof(*writer));
+  writer->fd = open_pcap_output(filename);
+  writer->file_offset = sizeof(uint32_t) * 6;
+  if (compress && compress->algo != COMPRESS_NONE) {
+    writer->compress = *compress;
+    writer->compressor = compress_stream_open(writer->fd, compress);
+  }
+
+  uint32_t* pcap_hdr = writer->pkt_hdrs;
+  pcap_hdr[0] = 0xA1B23C4D; // Magic number for pcap with timestamps in nanoseconds
+  pcap_hdr[1] = 2 + (2 << 16); // Version 2.2
+  pcap_hdr[2] = 0; // Timezone correction
+  pcap_hdr[3] = 0; // Timestamp accuracy
+  pcap_hdr[4] = (1 << 14) - 1; // Maximum capture length
+  pcap_hdr[5] = 1; // Ethernet
+  writer->iovs[0].iov_base = pcap_hdr;
+  writer->iovs[0].iov_len = sizeof(uint32_t) * 6;
+  writer->iovcnt = 1;
+  flush_packets(writer);
+
+  struct stat st;
+  if (writer->compressor) return; // Compressed blocks are written by the compressor's output thread.
+  if (fstat(writer->fd, &st) != 0) FATAL("Could not stat output");
+  if (S_ISSOCK(st.st_mode)) {
+    writer->mode = PCAP_OUT_SENDMSG;
+  } else if (S_ISFIFO(st.st_mode)) {
+    signal(SIGPIPE, SIG_IGN); // Consumer going away is reported as EPIPE instead.
+    if (ring_size) {
+      // Every frame occupies at least 68 bytes of ring, so this many slots suffices.
+      uint32_t num_slots = ring_size / 64;
+      writer->hdr_ring = malloc(num_slots * sizeof(uint32_t) * 4);
+      writer->pending = malloc(num_slots * sizeof(pcap_pending_t));
+      if (!writer->hdr_ring || !writer->pending) FATAL("Could not allocate memory for pcap writer");
+      writer->ring_mask = num_slots - 1;
+      writer->mode = PCAP_OUT_SPLICE;
+      // Limit the pipe to half the ring, so that the device can always make progress whilst
+      // the pipe is full. Failure to resize is fine; the default is smaller.
+      fcntl(writer->fd, F_SETPIPE_SZ, (int)(ring_size / 2));
+      int flags = fcntl(writer->fd, F_GETFL);
+      if (flags >= 0) fcntl(writer->fd, F_SETFL, flags | O_NONBLOCK);
+    }
+  }
+}
+
+static void pcap_writer_finish(pcap_writer_t* writer) {
+  if (writer->compressor) {
+    compress_stream_close(writer->compressor, &writer->compress_stats);
+    writer->compressor = NULL;
+  }
+  close(writer->fd);
+}
+
+static bool pcap_writer_reclaim(pcap_writer_t* writer, uint32_t* ring_ptr) {
+  // For PCAP_OUT_SPLICE, determines how much of the host ring the consumer has read from the
+  // pipe. Returns true (and sets *ring_ptr) if that includes any previously written batches.
+  int unread = 0;
+  if (!writer->closed && ioctl(writer->fd, FIONREAD, &unread) != 0) unread = 0;
+  uint64_t consumed = writer->total_byte_count - (uint64_t)unread;
+  bool any = false;
+  while (writer->pending_head != writer->pending_tail) {
+    pcap_pending_t* p = writer->pending + (writer->pending_head & writer->ring_mask);
+    if (p->out_end > consumed) break;
+    *ring_ptr = p->ring_end;
+    writer->pending_head += 1;
+    any = true;
+  }
+  return any;
+}
+
+static void write_packets(pcap_writer_t* writer, const ethdump_batch_t* batch) {
+  // Writes out (and flushes) every frame in the batch, after which the batch can be released.
+  uint32_t ts_sec = (uint32_t)(batch->timestamp_ns / 1000000000u);
+  uint32_t ts_nsec = (uint32_t)(batch->timestamp_ns % 1000000000u);
+  if (writer->index) writer->index->cur.num_sampled_out += batch->sampled_out;
+  const ethdump_frame_t* frame = batch->frames;
+  for (uint32_t i = 0; i < batch->num_frames; ++i, ++frame) {
+    if (writer->iovcnt > (PCAP_WRITER_NUM_IOVS-3)) flush_packets(writer); // 3 IOVs is the maximum we'll need to write a frame.
+    uint32_t frame_length = frame->len + frame->wrap_len;
+
+    // Form the pcap per-packet header.
+    int iovcnt = writer->iovcnt;
+    uint32_t* pkt_hdr = writer->hdr_ring ? writer->hdr_ring + (writer->hdr_next++ & writer->ring_mask) * 4 : writer->pkt_hdrs + iovcnt * 4;
+    pkt_hdr[0] = ts_sec;
+    pkt_hdr[1] = ts_nsec;
+    pkt_hdr[2] = frame_length;
+    pkt_hdr[3] = frame_length;
+
+    // Usually require just one IOV for the header and one for the contents...
+    struct iovec* iov = writer->iovs + iovcnt;
+    iov[0].iov_base = pkt_hdr;
+    iov[0].iov_len = sizeof(uint32_t) * 4;
+    iov[1].iov_base = (void*)frame->data;
+    iov[1].iov_len = frame->len;
+    iovcnt += 2;
+    if (frame->wrap_len) {
+      // ... but if it straddles a ring wrap, need one more.
+      iov[2].iov_base = (void*)frame->wrap_data;
+      iov[2].iov_len = frame->wrap_len;
+      ++iovcnt;
+    }
+    writer->iovcnt = iovcnt;
+    writer->total_pkt_count += 1;
+    if (writer->index) {
+      uint8_t hdr_buf[FLOW_HDR_BYTES];
+      uint32_t hdr_len;
+      const uint8_t* hdr = frame_headers(frame, hdr_buf, &hdr_len);
+      flow_key_t key;
+      parse_flow_key(hdr, hdr_len, &key);
+      flow_key_make_symmetric(&key);
+      key.vlan = 0; // Index on addresses, ports, and protocol only.
+      index_add_packet(writer->index, writer->file_offset, sizeof(uint32_t) * 4 + frame_length,
+        batch->timestamp_ns, flow_key_hash(&key));
+    }
+    writer->file_offset += sizeof(uint32_t) * 4 + frame_length;
+  }
+  if (writer->iovcnt) flush_packets(writer);
+  if (writer->pending && batch->num_frames) {
+    pcap_pending_t* p = writer->pending + (writer->pending_tail++ & writer->ring_mask);
+    p->out_end = writer->total_byte_count;
+    p->ring_end = batch->end_ptr;
+  }
+}
+
+// Device configuration:
+
+#define MILLISECONDS(x) ((x) * 1000000ull)
+
+static uint64_t host_nanos64() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_REALTIME, &ts) != 0) {
+    FATAL("Could not query time using clock_gettime");
+  }
+  return ts.tv_sec * MILLISECONDS(1000u) + ts.tv_nsec;
+}
+
+static void configure_rx_for_training(bh_pcie_device_t* device) {
+  tlb_write_u32(device, RXCLASS_MAC_RX_ROUTING_ADDR, RXCLASS_MAC_RX_ROUTING_FROM_MAC);
+  tlb_write_u32(device, RXCLASS_NO_MATCH_ACTIONS_ADDR, 0);
+  tlb_write_u32(device, RXCLASS_USER_DEFINED_ETHERTYPE_ADDR(0), 0);
+  tlb_write_u32(device, RXCLASS_USER_DEFINED_ETHERTYPE_ADDR(1), 0);
+}
+
+static void wait_for_ethernet_training_complete(bh_pcie_device_t* device, const uint8_t* new_loopback_mode) {
+  volatile uint32_t* boot_results = (volatile uint32_t*)set_tlb_addr(device, ETH_BOOT_RESULTS_ADDR);
+  uint32_t port_status = boot_results[1];
+  if (port_status >= 3) {
+    FATAL("Selected Ethernet tile does not have an Ethernet port (status %u); try a different one", (unsigned)port_status);
+  }
+  if (new_loopback_mode) {
+    tlb_write_u32(device, SOFT_RESET_ADDR, SOFT_RESET_E0 | SOFT_RESET_E1); // Put both RISCVs into reset.
+    configure_rx_for_training(device);
+    tlb_write_u32(device, ETH_BOOT_PARAMS_ADDR + 8, *new_loopback_mode); // Set new loopback mode.
+    tlb_write_u32(device, ETH_BOOT_RESULTS_ADDR + 4, (port_status = 0)); // Set port status to unknown.
+    tlb_write_u32(device, SOFT_RESET_ADDR, SOFT_RESET_E1); // Take E0 out of reset, leave E1 in reset. Firmware on E0 should now start training.
+    boot_results = (volatile uint32_t*)set_tlb_addr(device, ETH_BOOT_RESULTS_ADDR); // Need to reconfigure the TLB to point it back to this.
+  }
+  if (port_status == 0) {
+    uint64_t start = host_nanos64();
+    for (;;) {
+      port_status = boot_results[1];
+      if (port_status != 0) {
+        break;
+      } else if (host_nanos64() - start > MILLISECONDS(1000u)) {
+        FATAL("Timed out waiting for Ethernet port training");
+      }
+    }
+    if (port_status >= 3) {
+      FATAL("Selected Ethernet tile has unknown port status %u after conclusion of training", (unsigned)port_status);
+    }
+  }
+  if (port_status != 1) {
+    FATAL("Selected Ethernet tile\'s port is down; try a different one");
+  }
+}
+
+static bool ethernet_training_complete(bh_pcie_device_t* device, uint64_t started_at) {
+  // As the wait in wait_for_ethernet_training_complete (without changing loopback mode), but
+  // returns false rather than waiting if the port is still training, for callers that have other
+  // things to be getting on with.
+  volatile uint32_t* boot_results = (volatile uint32_t*)set_tlb_addr(device, ETH_BOOT_RESULTS_ADDR);
+  uint32_t port_status = boot_results[1];
+  if (port_status == 0) {
+    if (host_nanos64() - started_at > MILLISECONDS(1000u)) FATAL("Timed out waiting for Ethernet port training");
+    return false;
+  }
+  if (port_status >= 3) {
+    FATAL("Selected Ethernet tile does not have an Ethernet port (status %u); try a different one", (unsigned)port_status);
+  }
+  if (port_status != 1) {
+    FATAL("Selected Ethernet tile\'s port is down; try a different one");
+  }
+  return true;
+}
+
+typedef struct h_ring_metadata_t {
+  uint32_t write_ptr;
+  uint32_t mailbox_echo;
+  uint32_t error;
+  uint32_t transfer_count; // Number of NoC transfers made to the host ring.
+  uint32_t deadline_count; // How many of those were smaller than coalesce_bytes, as coalesce_cycles had passed.
+  uint32_t sampled_out_count; // Number of frames skipped due to device-side sampling.
+  uint32_t padding[10]; // To make the whole thing 64 bytes.
+} h_ring_metadata_t;
+
+typedef struct ethdump_context_t {
+  pinned_host_buffer_t h_ring;
+  pinned_host_buffer_t h_meta;
+  uint32_t tx_ascii_counter_addr;
+  uint32_t tx_doorbell;
+  uint32_t e_ring_size;
+  uint32_t coalesce_bytes;
+  uint32_t coalesce_cycles;
+  uint32_t sample_mode;
+  uint32_t sample_interval;
+  uint32_t sample_cycles;
+  bool keep_tx_queues;
+} ethdump_context_t;
+
+#define INITIAL_ECHO 1 // Must be odd, but otherwise arbitrary.
+
+static void metadata_init(h_ring_metadata_t* meta) {
+  meta->write_ptr = 0;
+  meta->mailbox_echo = INITIAL_ECHO;
+  meta->error = 0;
+  meta->transfer_count = 0;
+  meta->deadline_count = 0;
+  meta->sampled_out_count = 0;
+}
+
+static void configure_ethernet(bh_pcie_device_t* device, ethdump_context_t* ctx) {
+  // Take E0 out of reset, put E1 into reset.
+  tlb_write_u32(device, SOFT_RESET_ADDR, SOFT_RESET_E1);
+
+  // Choose device-side addresses.
+  uint32_t meta_addr = ctx->e_ring_size;
+  uint32_t code_addr = meta_addr + sizeof(h_ring_metadata_t);
+  uint32_t tx_buf_addr = code_addr + RV_MAX_CODE_WORDS * sizeof(uint32_t);
+
+  // Send initial metadata to the device.
+  metadata_init((h_ring_metadata_t*)ctx->h_meta.host_ptr);
+  memcpy(set_tlb_addr(device, meta_addr), ctx->h_meta.host_ptr, sizeof(h_ring_metadata_t));
+
+  // Prepare a TX queue for traffic generation.
+  {
+    static const char pkt_contents[] = "Hello World 0000 from the " __FILE__ " dummy traffic generator, compiled at " __DATE__ " " __TIME__;
+    memcpy(set_tlb_addr(device, tx_buf_addr), pkt_contents, sizeof(pkt_contents));
+    ctx->tx_ascii_counter_addr = tx_buf_addr + 12;
+
+    uint32_t txhdr_id = 9;
+    uint32_t txhdr_addr = TXPKT_CFG_ADDR(txhdr_id);
+    tlb_write_u32(device, txhdr_addr + TXPKT_CFG_INSERT_CTL_OFFSET, TXPKT_CFG_INSERT_CTL_L3_HEADER + TXPKT_CFG_INSERT_CTL_L4_HEADER + TXPKT_CFG_INSERT_CTL_L4_CHECKSUM);
+    for (uint32_t i = TXPKT_CFG_MAC_SA_OFFSET; i < TXPKT_CFG_MAC_SA_OFFSET + 0x10; i += 4) {
+      // Copy MAC addresses from header entry #0.
+      tlb_write_u32(device, txhdr_addr + i, tlb_read_u32(device, TXPKT_CFG_ADDR(0) + i));
+    }
+    tlb_write_u32(device, txhdr_addr + TXPKT_CFG_USE_ETHERTYPE_OFFSET, 0x08000001); // Ethertype = 0x0800 (IPv4)
+    tlb_write_u32(device, txhdr_addr + TXPKT_CFG_L3_HEADER_OFFSET +  0, 0x45000000); // IPv4 version, IHL, DSCP, ECN (also length, but this'll be overwritten)
+    tlb_write_u32(device, txhdr_addr + TXPKT_CFG_L3_HEADER_OFFSET +  4, 0);          // IPv4 identification, flags, fragment offset
+    tlb_write_u32(device, txhdr_addr + TXPKT_CFG_L3_HEADER_OFFSET +  8, 0x0A110000); // IPv4 TTL, protocol (also header checksum, but this'll be overwritten)
+    tlb_write_u32(device, txhdr_addr + TXPKT_CFG_L3_HEADER_OFFSET + 12, 0x7F000001); // IPv4 source address
+    tlb_write_u32(device, txhdr_addr + TXPKT_CFG_L3_HEADER_OFFSET + 16, 0x7F000002); // IPv4 destination address
+    tlb_write_u32(device, txhdr_addr + TXPKT_CFG_L4_HEADER_OFFSET +  0, 0);          // UDP source port, destination port
+
+    uint32_t txq_idx = 2;
+    uint32_t txq_addr = TXQ_ADDR(txq_idx);
+    tlb_write_u32(device, txq_addr + ETH_TXQ_TRANSFER_START_ADDR_OFFSET, tx_buf_addr);
+    tlb_write_u32(device, txq_addr + ETH_TXQ_TRANSFER_SIZE_BYTES_OFFSET, sizeof(pkt_contents));
+    tlb_write_u32(device, txq_addr + ETH_TXQ_TXPKT_CFG_SEL_SW_OFFSET, txhdr_id);
+    ctx->tx_doorbell = txq_addr + ETH_TXQ_CMD_OFFSET;
+  }
+
+  // Configure NIU.
+  uint32_t niu_addr = NIU_ADDR(1);
+  tlb_write_u32(device, niu_addr + NOC_TARG_ADDR_MID_OFFSET, 0);
+  tlb_write_u32(device, niu_addr + NOC_TARG_ADDR_HI_OFFSET, 0);
+  tlb_write_u32(device, niu_addr + NOC_RET_ADDR_HI_OFFSET, BH_PCIE_XY);
+  tlb_write_u32(device, niu_addr + NOC_PACKET_TAG_OFFSET, 0);
+  tlb_write_u32(device, niu_addr + NOC_CTRL_OFFSET, NOC_CMD_WR | NOC_CMD_VC_STATIC);
+  tlb_write_u32(device, niu_addr + NOC_AT_LEN_BE_1_OFFSET, 0);
+  tlb_write_u32(device, niu_addr + NOC_BRCST_EXCLUDE_OFFSET, 0);
+  tlb_write_u32(device, niu_addr + NOC_L1_ACC_AT_INSTRN_OFFSET, 0);
+  tlb_write_u32(device, niu_addr + ROUTER_CFG_2_OFFSET, 0);
+  tlb_write_u32(device, niu_addr + ROUTER_CFG_4_OFFSET, 0);
+  niu_addr += 0x800;
+  tlb_write_u32(device, niu_addr + NOC_TARG_ADDR_LO_OFFSET, meta_addr);
+  tlb_write_u32(device, niu_addr + NOC_TARG_ADDR_MID_OFFSET, 0);
+  tlb_write_u32(device, niu_addr + NOC_TARG_ADDR_HI_OFFSET, 0);
+  tlb_write_u32(device, niu_addr + NOC_RET_ADDR_LO_OFFSET, (uint32_t)ctx->h_meta.noc_addr);
+  tlb_write_u32(device, niu_addr + NOC_RET_ADDR_MID_OFFSET, (uint32_t)(ctx->h_meta.noc_addr >> 32));
+  tlb_write_u32(device, niu_addr + NOC_RET_ADDR_HI_OFFSET, BH_PCIE_XY);
+  tlb_write_u32(device, niu_addr + NOC_PACKET_TAG_OFFSET, 0);
+  tlb_write_u32(device, niu_addr + NOC_CTRL_OFFSET, NOC_CMD_WR | NOC_CMD_VC_STATIC);
+  tlb_write_u32(device, niu_addr + NOC_AT_LEN_BE_OFFSET, sizeof(h_ring_metadata_t));
+  tlb_write_u32(device, niu_addr + NOC_AT_LEN_BE_1_OFFSET, 0);
+  tlb_write_u32(device, niu_addr + NOC_BRCST_EXCLUDE_OFFSET, 0);
+  tlb_write_u32(device, niu_addr + NOC_L1_ACC_AT_INSTRN_OFFSET, 0);
+
+  // Stop TX queues from sending regular TT-link packets, unless we're observing TT-link itself.
+  for (uint32_t q = 0; q < 3 && !ctx->keep_tx_queues; ++q) {
+    uint32_t txq_addr = TXQ_ADDR(q);
+    tlb_write_u32(device, txq_addr + ETH_TXQ_CTRL_OFFSET, 8u); // No regular heartbeats, ignore any received drop notifications.
+    tlb_write_u32(device, txq_addr + ETH_TXQ_REMOTE_SEQ_TIMEOUT_OFFSET, ~0u); // Maximum resend timeout.
+  }
+
+  // Drop all incoming frames while we reconfigure things.
+  tlb_write_u32(device, RXCLASS_OVERRIDE_DECISION_ADDR, RXCLASS_OVERRIDE_DECISION_DROP);
+
+  // Configure RX queue.
+  uint32_t rxq_idx = 2;
+  uint32_t rxq_addr = RXQ_ADDR(rxq_idx);
+  
+  tlb_write_u32(device, rxq_addr + ETH_RXQ_CTRL_OFFSET, 0); // Raw RX mode, buffer not wrapping
+  tlb_write_u32(device, rxq_addr + ETH_RXQ_BUF_START_WORD_ADDR_OFFSET, 0);
+  tlb_write_u32(device, rxq_addr + ETH_RXQ_BUF_SIZE_WORDS_OFFSET, ctx->e_ring_size >> 4);
+  tlb_write_u32(device, rxq_addr + ETH_RXQ_HDR_CTRL_OFFSET, 0); // Keep all headers
+  tlb_write_u32(device, rxq_addr + ETH_RXQ_BUF_PTR_OFFSET, 0);
+
+  // Configure RX classification engine.
+  tlb_write_u32(device, RXCLASS_TCAM_FLUSH, 1); // Flush the TCAM, so that we don't need to care about header extraction nor most of the flow table.
+  tlb_write_u32(device, RXCLASS_USER_DEFINED_ETHERTYPE_ADDR(0), 0xFFFF0800); // Rewrite IPv4 ethertype to something else, so that unsupported IPv4 headers aren't dropped.
+  tlb_write_u32(device, RXCLASS_USER_DEFINED_ETHERTYPE_ADDR(1), 0xFFFF86DD); // Rewrite IPv6 ethertype to something else, so that unsupported IPv6 headers aren't dropped.
+  tlb_write_u32(device, RXCLASS_MAC_RX_ROUTING_ADDR, RXCLASS_MAC_RX_ROUTING_FROM_ACTIONS);
+  tlb_write_u32(device, RXCLASS_NO_MATCH_ACTIONS_ADDR, RXCLASS_NO_MATCH_ACTIONS_PREPEND_HW_METADATA + RXCLASS_NO_MATCH_ACTIONS_TO_RXQ(rxq_idx));
+
+  // Generate RV32 code for this configuration, and deploy it to the device.
+  rv_shuttle_config_t rv_cfg;
+  rv_cfg.h_ring_noc_addr = ctx->h_ring.noc_addr;
+  rv_cfg.h_ring_size = ctx->h_ring.size;
+  rv_cfg.h_meta_addr = meta_addr;
+  rv_cfg.e_ring_size = ctx->e_ring_size;
+  rv_cfg.initial_drop_count = tlb_read_u32(device, rxq_addr + ETH_RXQ_PACKET_DROP_CNT_OFFSET);
+  rv_cfg.rxq_addr = rxq_addr;
+  rv_cfg.niu_addr = NIU_ADDR(1);
+  rv_cfg.coalesce_bytes = ctx->coalesce_bytes;
+  rv_cfg.coalesce_cycles = ctx->coalesce_cycles;
+  rv_cfg.sample_mode = ctx->sample_mode;
+  rv_cfg.sample_interval = ctx->sample_interval;
+  rv_cfg.sample_cycles = ctx->sample_cycles;
+  rv_cfg.sample_burst_cycles = ctx->sample_cycles > RV_CYCLES_PER_SECOND / 100 ? ctx->sample_cycles : RV_CYCLES_PER_SECOND / 100; // 10ms worth of frames
+  rv_emitter_t rv;
+  rv_gen_shuttle(&rv, &rv_cfg);
+  uint32_t code_size = rv.num_words * sizeof(uint32_t);
+  memcpy(set_tlb_addr(device, code_addr), rv.code, code_size);
+
+  // Point E1 at the code we just deployed.
+  tlb_write_u32(device, E1_RESET_PC_ADDR, code_addr);
+  tlb_write_u32(device, E1_END_PC_ADDR, code_addr + code_size);
+
+  {
+    // Have tt-kmd put E1 back into reset if we abort. This requires a fairly
+    // recent tt-kmd; older versions of tt-kmd will fail this with EINVAL.
+    struct tenstorrent_set_noc_cleanup req;
+    memset(&req, 0, sizeof(req));
+    req.argsz = sizeof(req);
+    req.enabled = true;
+    req.x = (device->tlb_cfg[1] >> 11) & 0x3f;
+    req.y = (device->tlb_cfg[1] >> 17) & 0x3f;
+    req.addr = SOFT_RESET_ADDR;
+    req.data = SOFT_RESET_E1;
+    (void)ioctl(device->fd, TENSTORRENT_IOCTL_SET_NOC_CLEANUP, &req);
+  }
+  // Take E1 out of reset.
+  tlb_write_u32(device, SOFT_RESET_ADDR, 0);
+
+  // Start accepting incoming frames again.
+  tlb_write_u32(device, RXCLASS_OVERRIDE_DECISION_ADDR, RXCLASS_OVERRIDE_DECISION_ACCEPT);
+}
+
+// Flow statistics:
+// With --flows, frames are aggregated into per-flow counters rather than being written out
+// individually. The flow table is split into shards by flow hash, each of which uses open
+// addressing with linear probing over a dense array of 32-bit tags, so a lookup typically
+// touches one cache line of tags plus the entry itself, and slots for a whole group of frames
+// are prefetched before any of them are updated. With --flow-threads=N (N > 1), each shard is
+// updated by its own thread: the thread consuming batches parses every frame, and passes the
+// parsed key to the owning shard through a single-producer single-consumer queue, so the batch
+// can be released straight away. With one shard, the consuming thread updates it directly.
+// Flows are exported as IPFIX (RFC 7011) data records when they have been idle for the idle
+// timeout, when they have been active for the active timeout, when their shard is getting too
+// full, or when the capture ends. A full shard is relieved by a CLOCK hand, which sweeps on
+// from wherever it last stopped, evicting entries not updated since it last passed them. The
+// output file is a sequence of IPFIX messages, as per RFC 5655.
+
+#define FLOW_BATCH 16
+#define FLOW_SWEEP_INTERVAL MILLISECONDS(1000u)
+#define FLOW_TEMPLATE_INTERVAL MILLISECONDS(10000u) // How often templates are re-sent, for collectors reading the output as it is written.
+#define FLOW_MAX_THREADS 16
+#define FLOW_QUEUE_DEPTH 4096 // Records per shard queue. Must be a power of two.
+#define IPFIX_TEMPLATE_ID 256
+#define IPFIX_SAMPLING_TEMPLATE_ID 257
+#define IPFIX_RECORD_BYTES 88
+#define IPFIX_MAX_MESSAGE_BYTES (16 + 4 + 744 * IPFIX_RECORD_BYTES)
+
+// Values for IPFIX flowEndReason:
+#define FLOW_END_IDLE_TIMEOUT      1
+#define FLOW_END_ACTIVE_TIMEOUT    2
+#define FLOW_END_FORCED            4
+#define FLOW_END_LACK_OF_RESOURCES 5
+
+typedef struct flow_entry_t {
+  flow_key_t key;
+  uint8_t tcp_flags;
+  uint8_t referenced; // Set whenever the entry is updated, and cleared as the CLOCK hand passes it.
+  uint8_t padding[2];
+  uint64_t last_ns;
+  uint64_t pkts; // Since last export; an entry with zero pkts is retained only until it becomes idle.
+  uint64_t bytes;
+  uint64_t first_ns;
+} __attribute__((aligned(128))) flow_entry_t;
+
+typedef struct flow_record_t {
+  // A parsed frame, on its way to the shard which owns its flow.
+  flow_key_t key;
+  uint32_t hash;
+  uint32_t frame_length;
+  uint64_t timestamp_ns;
+  uint8_t tcp_flags;
+} __attribute__((aligned(64))) flow_record_t;
+
+typedef struct flow_shard_t {
+  uint32_t* tags; // Zero for an empty slot, otherwise the (non-zero) hash of the entry's key.
+  flow_entry_t* entries;
+  uint32_t mask;
+  uint32_t count;
+  uint32_t hand; // Next slot for the CLOCK hand to visit.
+  uint64_t next_sweep_ns;
+  struct flow_table_t* table;
+  uint32_t msg_len;
+  uint8_t msg[IPFIX_MAX_MESSAGE_BYTES];
+  // Only used with more than one shard:
+  pthread_t thread;
+  flow_record_t* queue; // FLOW_QUEUE_DEPTH entries.
+  uint32_t tail __attribute__((aligned(64))); // Written by the consuming thread: records before this are ready.
+  uint32_t head __attribute__((aligned(64))); // Written by the shard's thread: records before this are done.
+} flow_shard_t;
+
+typedef struct flow_table_t {
+  flow_shard_t* shards;
+  uint32_t num_shards;
+  bool threads_running;
+  bool stop; // Set to stop the shard threads once their queues are empty.
+  bool sampled;
+  uint32_t sample_interval; // N if the device is keeping 1 in N frames (or flows), otherwise 0.
+  uint64_t idle_ns;
+  uint64_t active_ns;
+  uint64_t now_ns; // Timestamp of the latest batch, which shard threads time their sweeps by.
+  uint64_t next_sweep_ns;
+  uint64_t next_template_ns;
+  uint64_t total_pkt_count;
+  uint64_t total_record_count; // Only written with output_lock held.
+  uint64_t total_byte_count;   // Only written with output_lock held.
+  uint64_t sampled_out_count;  // Frames skipped by device-side sampling.
+  int fd;
+  pthread_mutex_t output_lock;
+  uint8_t msg[128]; // For template and options records, which are written by the consuming thread.
+} flow_table_t;
+
+static void put_be16(uint8_t* p, uint16_t v) {
+  p[0] = (uint8_t)(v >> 8);
+  p[1] = (uint8_t)v;
+}
+
+static void put_be32(uint8_t* p, uint32_t v) {
+  put_be16(p, (uint16_t)(v >> 16));
+  put_be16(p + 2, (uint16_t)v);
+}
+
+static void put_be64(uint8_t* p, uint64_t v) {
+  put_be32(p, (uint32_t)(v >> 32));
+  put_be32(p + 4, (uint32_t)v);
+}
+
+static uint64_t ns_to_ntp64(uint64_t ns) {
+  uint64_t secs = ns / 1000000000u + 2208988800u; // NTP epoch is 1900.
+  uint64_t frac = ((ns % 1000000000u) << 32) / 1000000000u;
+  return (secs << 32) + frac;
+}
+
+static void write_full(int fd, const void* data, size_t size, const char* what) {
+  const char* src = (const char*)data;
+  while (size) {
+    ssize_t n = write(fd, src, size);
+    if (n > 0) {
+      src += n;
+      size -= n;
+    } else if (n == 0 || errno != EINTR) {
+      FATAL("Could not write to %s", what);
+    }
+  }
+}
+
+static void ipfix_write(flow_table_t* t, uint8_t* msg, uint32_t len, uint16_t set_id, uint32_t num_records) {
+  // Fills in the message and set headers of a message containing a single set, then writes it out.
+  // Messages from different shards are written whole, one at a time.
+  pthread_mutex_lock(&t->output_lock);
+  put_be16(msg + 0, 10); // IPFIX version
+  put_be16(msg + 2, (uint16_t)len);
+  put_be32(msg + 4, (uint32_t)(host_nanos64() / 1000000000u)); // Export time
+  put_be32(msg + 8, (uint32_t)t->total_record_count); // Sequence number (of first data record in this message)
+  put_be32(msg + 12, 0); // Observation domain
+  put_be16(msg + 16, set_id);
+  put_be16(msg + 18, (uint16_t)(len - 16));
+  write_full(t->fd, msg, len, "flow output file");
+  t->total_byte_count += len;
+  t->total_record_count += num_records;
+  pthread_mutex_unlock(&t->output_lock);
+}
+
+static void flow_shard_flush(flow_shard_t* s) {
+  uint32_t len = s->msg_len;
+  if (len > 20) ipfix_write(s->table, s->msg, len, IPFIX_TEMPLATE_ID, (len - 20) / IPFIX_RECORD_BYTES);
+  s->msg_len = 0;
+}
+
+static void flow_export(flow_shard_t* s, const flow_entry_t* e, uint8_t reason) {
+  if (s->msg_len == 0) s->msg_len = 20; // Space for message header and set header.
+  uint8_t* r = s->msg + s->msg_len;
+  memset(r, 0, IPFIX_RECORD_BYTES);
+  put_be64(r +  0, ns_to_ntp64(e->first_ns)); // flowStartNanoseconds
+  put_be64(r +  8, ns_to_ntp64(e->last_ns));  // flowEndNanoseconds
+  put_be64(r + 16, e->pkts);                  // packetDeltaCount
+  put_be64(r + 24, e->bytes);                 // octetDeltaCount
+  if (e->key.addr_len == 16) {
+    memcpy(r + 32, e->key.addrs[0], 16);      // sourceIPv6Address
+    memcpy(r + 48, e->key.addrs[1], 16);      // destinationIPv6Address
+  } else if (e->key.addr_len == 4) {
+    r[42] = r[43] = r[58] = r[59] = 0xff;     // IPv4-mapped IPv6 addresses
+    memcpy(r + 44, e->key.addrs[0], 4);
+    memcpy(r + 60, e->key.addrs[1], 4);
+  } else {
+    memcpy(r + 64, e->key.addrs[0], 6);       // sourceMacAddress
+    memcpy(r + 70, e->key.addrs[1], 6);       // destinationMacAddress
+  }
+  put_be16(r + 76, e->key.ports[0]);          // sourceTransportPort
+  put_be16(r + 78, e->key.ports[1]);          // destinationTransportPort
+  put_be16(r + 80, e->key.ethertype);         // ethernetType
+  put_be16(r + 82, e->key.vlan);              // vlanId
+  r[84] = e->key.proto;                       // protocolIdentifier
+  put_be16(r + 85, e->tcp_flags);             // tcpControlBits
+  r[87] = reason;                             // flowEndReason
+  s->msg_len += IPFIX_RECORD_BYTES;
+  if (s->msg_len + IPFIX_RECORD_BYTES > IPFIX_MAX_MESSAGE_BYTES) flow_shard_flush(s);
+}
+
+static void ipfix_export_sampling(flow_table_t* t) {
+  // Exports an options data record with the number of frames observed and selected so far, from
+  // which collectors can scale packet and byte counts back up.
+  uint8_t* r = t->msg + 20;
+  put_be32(r +  0, 0);                                         // observationDomainId
+  put_be32(r +  4, t->sample_interval);                        // samplingPacketInterval
+  put_be64(r +  8, t->total_pkt_count + t->sampled_out_count); // selectorIdTotalPktsObserved
+  put_be64(r + 16, t->total_pkt_count);                        // selectorIdTotalPktsSelected
+  ipfix_write(t, t->msg, 44, IPFIX_SAMPLING_TEMPLATE_ID, 0);
+}
+
+static void ipfix_export_templates(flow_table_t* t) {
+  // Writes a template set describing the layout of data records...
+  static const uint16_t template_fields[][2] = {
+    {156, 8}, {157, 8}, {2, 8}, {1, 8}, {27, 16}, {28, 16}, {56, 6}, {80, 6},
+    {7, 2}, {11, 2}, {256, 2}, {58, 2}, {4, 1}, {6, 2}, {136, 1}
+  };
+  uint32_t num_fields = sizeof(template_fields) / sizeof(*template_fields);
+  uint8_t* p = t->msg + 20;
+  put_be16(p, IPFIX_TEMPLATE_ID);
+  put_be16(p + 2, (uint16_t)num_fields);
+  p += 4;
+  for (uint32_t i = 0; i < num_fields; ++i, p += 4) {
+    put_be16(p, template_fields[i][0]);
+    put_be16(p + 2, template_fields[i][1]);
+  }
+  ipfix_write(t, t->msg, (uint32_t)(p - t->msg), 2, 0); // Set ID 2 is a template set.
+  if (t->sampled) {
+    // ... followed by an options template set describing sampling records (RFC 7011 section 3.4.2.2).
+    p = t->msg + 20;
+    put_be16(p +  0, IPFIX_SAMPLING_TEMPLATE_ID);
+    put_be16(p +  2, 4); // Field count
+    put_be16(p +  4, 1); // Scope field count
+    put_be16(p +  6, 149); put_be16(p +  8, 4); // observationDomainId
+    put_be16(p + 10, 305); put_be16(p + 12, 4); // samplingPacketInterval
+    put_be16(p + 14, 318); put_be16(p + 16, 8); // selectorIdTotalPktsObserved
+    put_be16(p + 18, 319); put_be16(p + 20, 8); // selectorIdTotalPktsSelected
+    ipfix_write(t, t->msg, 20 + 22, 3, 0); // Set ID 3 is an options template set.
+  }
+}
+
+static void flow_shard_delete(flow_shard_t* s, uint32_t i) {
+  // Backward-shift deletion: pull subsequent entries of the probe sequence into the hole,
+  // so that no tombstones are required. Entries only ever move backwards, to slots from i
+  // onwards, so a hand sweeping forwards through the shard doesn't miss any.
+  uint32_t mask = s->mask;
+  for (uint32_t j = (i + 1) & mask; s->tags[j]; j = (j + 1) & mask) {
+    uint32_t home = s->tags[j] & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      s->tags[i] = s->tags[j];
+      s->entries[i] = s->entries[j];
+      i = j;
+    }
+  }
+  s->tags[i] = 0;
+  s->count -= 1;
+}
+
+static void flow_shard_sweep(flow_shard_t* s, uint64_t now, uint64_t idle_ns, uint8_t idle_reason) {
+  // Start at an empty slot, as then backward-shift deletion never moves an entry to before
+  // the sweep position.
+  uint32_t size = s->mask + 1;
+  uint32_t start = 0;
+  while (s->tags[start]) ++start;
+  for (uint32_t n = 0; n < size;) {
+    uint32_t i = (start + n) & s->mask;
+    flow_entry_t* e = s->entries + i;
+    if (!s->tags[i]) {
+      ++n;
+    } else if ((int64_t)(now - e->last_ns) >= (int64_t)idle_ns) {
+      if (e->pkts) flow_export(s, e, idle_reason);
+      flow_shard_delete(s, i); // Moves a different entry into slot i, so don't advance n.
+    } else {
+      if (e->pkts && (int64_t)(now - e->first_ns) >= (int64_t)s->table->active_ns) {
+        flow_export(s, e, FLOW_END_ACTIVE_TIMEOUT);
+        e->pkts = 0;
+        e->bytes = 0;
+        e->tcp_flags = 0;
+      }
+      ++n;
+    }
+  }
+  flow_shard_flush(s);
+}
+
+static void flow_shard_make_room(flow_shard_t* s, uint64_t now) {
+  // Advance the CLOCK hand until the shard is at most 5/8 full, evicting entries which are idle
+  // or which haven't been updated since the hand last passed them, and clearing the referenced
+  // bit of the rest. The hand carries on from where it stopped last time, so no slot is visited
+  // more than twice per eviction of an eighth of the shard.
+  uint32_t mask = s->mask;
+  uint32_t low_water = (mask >> 1) + (mask >> 3);
+  uint32_t i = s->hand;
+  while (s->count > low_water) {
+    flow_entry_t* e = s->entries + i;
+    if (!s->tags[i]) {
+      i = (i + 1) & mask;
+      continue;
+    }
+    bool idle = (int64_t)(now - e->last_ns) >= (int64_t)s->table->idle_ns;
+    if (e->referenced && !idle) {
+      e->referenced = 0;
+      i = (i + 1) & mask;
+    } else {
+      if (e->pkts) flow_export(s, e, idle ? FLOW_END_IDLE_TIMEOUT : FLOW_END_LACK_OF_RESOURCES);
+      flow_shard_delete(s, i); // Moves a different entry into slot i, so don't advance i.
+    }
+  }
+  s->hand = i;
+  flow_shard_flush(s);
+}
+
+static void flow_shard_update(flow_shard_t* s, const flow_key_t* key, uint32_t hash, uint8_t tcp_flags, uint32_t frame_length, uint64_t now) {
+  uint32_t mask = s->mask;
+  uint32_t i = hash & mask;
+  for (;;) {
+    uint32_t tag = s->tags[i];
+    if (tag == hash && !memcmp(&s->entries[i].key, key, sizeof(*key))) break;
+    if (tag == 0) {
+      if (s->count >= mask - (mask >> 2)) {
+        flow_shard_make_room(s, now);
+        i = hash & mask;
+        continue;
+      }
+      s->tags[i] = hash;
+      s->count += 1;
+      flow_entry_t* e = s->entries + i;
+      e->key = *key;
+      e->tcp_flags = 0;
+      e->pkts = 0;
+      e->bytes = 0;
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+  flow_entry_t* e = s->entries + i;
+  if (e->pkts == 0) e->first_ns = now;
+  e->pkts += 1;
+  e->bytes += frame_length;
+  e->last_ns = now;
+  e->tcp_flags |= tcp_flags;
+  e->referenced = 1;
+}
+
+static void flow_shard_prefetch(const flow_shard_t* s, uint32_t hash) {
+  const flow_entry_t* e = s->entries + (hash & s->mask);
+  __builtin_prefetch(s->tags + (hash & s->mask));
+  __builtin_prefetch(e, 1);
+  __builtin_prefetch((const uint8_t*)e + 64, 1);
+}
+
+static void* flow_shard_main(void* arg) {
+  flow_shard_t* s = (flow_shard_t*)arg;
+  flow_table_t* t = s->table;
+  for (;;) {
+    // Load stop before tail: stop is stored after the final tail, so if the queue looks empty
+    // here then nothing more will be queued.
+    bool stop = __atomic_load_n(&t->stop, __ATOMIC_ACQUIRE);
+    uint32_t tail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+    uint32_t head = s->head;
+    if (head == tail) {
+      if (stop) break;
+      struct timespec ts = {0, 10000};
+      nanosleep(&ts, NULL);
+    } else {
+      if (tail - head > FLOW_QUEUE_DEPTH / 4) tail = head + FLOW_QUEUE_DEPTH / 4;
+      for (; head != tail; ++head) {
+        if (tail - head > FLOW_BATCH) flow_shard_prefetch(s, s->queue[(head + FLOW_BATCH) & (FLOW_QUEUE_DEPTH - 1)].hash);
+        const flow_record_t* r = &s->queue[head & (FLOW_QUEUE_DEPTH - 1)];
+        flow_shard_update(s, &r->key, r->hash, r->tcp_flags, r->frame_length, r->timestamp_ns);
+      }
+      __atomic_store_n(&s->head, head, __ATOMIC_RELEASE);
+    }
+    uint64_t now = __atomic_load_n(&t->now_ns, __ATOMIC_RELAXED);
+    if ((int64_t)(now - s->next_sweep_ns) >= 0) {
+      flow_shard_sweep(s, now, t->idle_ns, FLOW_END_IDLE_TIMEOUT);
+      s->next_sweep_ns = now + FLOW_SWEEP_INTERVAL;
+    }
+  }
+  return NULL;
+}
+
+static flow_table_t* flow_table_open(const char* filename, uint32_t table_size, uint32_t num_threads, uint64_t idle_ns, uint64_t active_ns, bool sampled, uint32_t sample_interval) {
+  // table_size is split evenly between num_threads shards (rounding down to powers of two). If the
+  // device is sampling, sample_interval is N if it keeps 1 in N frames (or flows), otherwise 0.
+  int fd = open(filename, O_CLOEXEC | O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd < 0) FATAL("Could not open path '%s' for flow record writing", filename);
+  flow_table_t* t = calloc(1, sizeof(flow_table_t));
+  if (!t || !(t->shards = aligned_alloc(64, num_threads * sizeof(flow_shard_t)))) FATAL("Could not allocate a flow table");
+  memset(t->shards, 0, num_threads * sizeof(flow_shard_t));
+  uint32_t shard_size = table_size;
+  while (shard_size > 1024 && shard_size > table_size / num_threads) shard_size >>= 1;
+  t->num_shards = num_threads;
+  t->idle_ns = idle_ns;
+  t->active_ns = active_ns;
+  t->now_ns = host_nanos64();
+  t->next_sweep_ns = t->now_ns + FLOW_SWEEP_INTERVAL;
+  t->next_template_ns = t->now_ns + FLOW_TEMPLATE_INTERVAL;
+  t->sampled = sampled;
+  t->sample_interval = sample_interval;
+  t->fd = fd;
+  pthread_mutex_init(&t->output_lock, NULL);
+  for (uint32_t i = 0; i < num_threads; ++i) {
+    flow_shard_t* s = &t->shards[i];
+    if (!(s->tags = calloc(shard_size, sizeof(uint32_t)))
+    ||  !(s->entries = aligned_alloc(sizeof(flow_entry_t), (size_t)shard_size * sizeof(flow_entry_t)))
+    ||  (num_threads > 1 && !(s->queue = aligned_alloc(sizeof(flow_record_t), FLOW_QUEUE_DEPTH * sizeof(flow_record_t))))) {
+      FATAL("Could not allocate a flow table shard with %u entries", (unsigned)shard_size);
+    }
+    s->mask = shard_size - 1;
+    s->next_sweep_ns = t->next_sweep_ns;
+    s->table = t;
+  }
+
+  ipfix_export_templates(t);
+
+  if (num_threads > 1) {
+    for (uint32_t i = 0; i < num_threads; ++i) {
+      int err = pthread_create(&t->shards[i].thread, NULL, flow_shard_main, &t->shards[i]);
+      if (err) FATAL("Could not create flow table thread (error %d)", err);
+    }
+    t->threads_running = true;
+  }
+  return t;
+}
+
+static void flow_table_stop_threads(flow_table_t* t) {
+  // Waits for the shard threads to drain their queues, then stops them.
+  if (!t->threads_running) return;
+  __atomic_store_n(&t->stop, true, __ATOMIC_RELEASE);
+  for (uint32_t i = 0; i < t->num_shards; ++i) pthread_join(t->shards[i].thread, NULL);
+  t->threads_running = false;
+}
+
+static uint32_t flow_table_count(const flow_table_t* t) {
+  // Only valid once the shard threads have been stopped.
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < t->num_shards; ++i) count += t->shards[i].count;
+  return count;
+}
+
+static void flow_table_finish(flow_table_t* t) {
+  flow_table_stop_threads(t);
+  uint64_t now = host_nanos64();
+  for (uint32_t i = 0; i < t->num_shards; ++i) flow_shard_sweep(&t->shards[i], now, 0, FLOW_END_FORCED);
+  if (t->sampled) ipfix_export_sampling(t);
+  close(t->fd);
+}
+
+static void flow_table_consume(flow_table_t* t, const ethdump_batch_t* batch) {
+  // Uses the batch timestamp for every frame in the batch, rather than one timestamp per frame.
+  uint64_t now = batch->timestamp_ns;
+  uint32_t num_shards = t->num_shards;
+  for (uint32_t base = 0; base < batch->num_frames; base += FLOW_BATCH) {
+    // Parse a group of frames and prefetch their table slots (or queue slots)...
+    flow_record_t group[FLOW_BATCH];
+    uint32_t n = batch->num_frames - base;
+    if (n > FLOW_BATCH) n = FLOW_BATCH;
+    for (uint32_t i = 0; i < n; ++i) {
+      const ethdump_frame_t* frame = batch->frames + base + i;
+      uint8_t hdr_buf[FLOW_HDR_BYTES];
+      uint32_t hdr_len;
+      const uint8_t* hdr = frame_headers(frame, hdr_buf, &hdr_len);
+      group[i].tcp_flags = parse_flow_key(hdr, hdr_len, &group[i].key);
+      uint32_t hash = flow_key_hash(&group[i].key);
+      hash += (hash == 0); // Zero tags denote empty slots.
+      group[i].hash = hash;
+      group[i].frame_length = frame->len + frame->wrap_len;
+      group[i].timestamp_ns = now;
+      if (num_shards == 1) flow_shard_prefetch(&t->shards[0], hash);
+    }
+    // ... then update the table, or hand the frames to the threads which will.
+    for (uint32_t i = 0; i < n; ++i) {
+      if (num_shards == 1) {
+        flow_shard_update(&t->shards[0], &group[i].key, group[i].hash, group[i].tcp_flags, group[i].frame_length, now);
+        continue;
+      }
+      // Shards are chosen by the top bits of the hash, as the bottom bits choose the slot.
+      flow_shard_t* s = &t->shards[((uint64_t)group[i].hash * num_shards) >> 32];
+      while (s->tail - __atomic_load_n(&s->head, __ATOMIC_ACQUIRE) >= FLOW_QUEUE_DEPTH) {
+        __atomic_store_n(&s->tail, s->tail, __ATOMIC_RELEASE);
+        struct timespec ts = {0, 10000};
+        nanosleep(&ts, NULL);
+      }
+      s->queue[s->tail & (FLOW_QUEUE_DEPTH - 1)] = group[i];
+      s->tail += 1; // Published once the whole batch is queued.
+    }
+  }
+  for (uint32_t i = 0; i < num_shards && num_shards > 1; ++i) __atomic_store_n(&t->shards[i].tail, t->shards[i].tail, __ATOMIC_RELEASE);
+  t->total_pkt_count += batch->num_frames;
+  t->sampled_out_count += batch->sampled_out;
+  __atomic_store_n(&t->now_ns, now, __ATOMIC_RELAXED);
+  if ((int64_t)(now - t->next_sweep_ns) >= 0) {
+    if (num_shards == 1) flow_shard_sweep(&t->shards[0], now, t->idle_ns, FLOW_END_IDLE_TIMEOUT);
+    if ((int64_t)(now - t->next_template_ns) >= 0) {
+      ipfix_export_templates(t);
+      t->next_template_ns = now + FLOW_TEMPLATE_INTERVAL;
+    }
+    if (t->sampled) ipfix_export_sampling(t);
+    t->next_sweep_ns = now + FLOW_SWEEP_INTERVAL;
+  }
+}
+
+#define LINK_RATE_GBPS 400 // Each Blackhole Ethernet tile has one 400 GbE link.
+
+static uint64_t process_cpu_nanos64() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) {
+    FATAL("Could not query CPU time using clock_gettime");
+  }
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool run_flows_benchmark(flow_table_t* t, uint32_t ring_size) {
+  // Fill a ring with synthetic frames (IMIX-like sizes, 100000 flows), arranged so that the
+  // contents repeat seamlessly as the ring wraps, then feed it through the flow table in 64 KiB
+  // increments (as the device would) for a couple of seconds. The ring is made at least 64 MiB,
+  // so that it contains enough frames to touch every flow. Returns whether aggregation kept up
+  // with a fully loaded link carrying the same mix of frame sizes.
+  if (ring_size < (64u << 20)) ring_size = 64u << 20;
+  pinned_host_buffer_t h_ring;
+  h_ring.size = ring_size;
+  h_ring.host_ptr = aligned_alloc(4096, ring_size);
+  h_ring.noc_addr = 0;
+  if (!h_ring.host_ptr) FATAL("Could not allocate %u bytes for synthetic ring", (unsigned)ring_size);
+  uint8_t* ring = (uint8_t*)h_ring.host_ptr;
+  uint32_t rng = 12345;
+  for (uint32_t wp = 0; wp < ring_size;) {
+    rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+    uint32_t len = (rng % 12) < 7 ? 64 : (rng % 12) < 11 ? 576 : 1514;
+    if (ring_size - wp < 2 * 1518) len = ring_size - wp - sizeof(uint32_t); // Filler frame.
+    uint32_t flow = (rng >> 8) % 100000;
+    uint8_t frame[1 << 14];
+    memset(frame, 0, len);
+    memcpy(frame, "\x02\x00\x00\x00\x00\x01\x02\x00\x00\x00\x00\x02\x08\x00", 14);
+    uint8_t* ip = frame + 14;
+    ip[0] = 0x45;
+    ip[9] = (flow & 1) ? 17 : 6;
+    put_be32(ip + 12, 0x0A000000 + flow);
+    put_be32(ip + 16, 0xC0A80001);
+    put_be16(ip + 20, (uint16_t)(1024 + (flow >> 1)));
+    put_be16(ip + 22, 443);
+    ip[33] = 0x10; // TCP ACK
+    uint32_t info = __builtin_bswap32(len);
+    for (uint32_t i = 0; i < sizeof(info) + len; ++i) {
+      ring[(wp + i) & (ring_size - 1)] = i < sizeof(info) ? ((uint8_t*)&info)[i] : frame[(i - sizeof(info)) & (sizeof(frame) - 1)];
+    }
+    wp += sizeof(info) + len;
+  }
+
+  uint64_t total_bytes = 0;
+  uint32_t read_ptr = 0, write_ptr = 0;
+  uint64_t start = host_nanos64(), elapsed;
+  uint64_t cpu_start = process_cpu_nanos64();
+  ethdump_batch_t batch;
+  batch.sampled_out = 0;
+  do {
+    for (unsigned i = 0; i < 256; ++i) {
+      write_ptr += 1u << 16;
+      batch.timestamp_ns = host_nanos64();
+      for (;;) {
+        fill_batch(&h_ring, read_ptr, write_ptr, &batch);
+        if (!batch.num_frames) break;
+        flow_table_consume(t, &batch);
+        total_bytes += batch.end_ptr - read_ptr;
+        read_ptr = batch.end_ptr;
+      }
+    }
+    elapsed = host_nanos64() - start;
+  } while (elapsed < MILLISECONDS(2000u));
+  flow_table_stop_threads(t); // Includes the time taken to drain the shard queues.
+  elapsed = host_nanos64() - start;
+  double cpu_secs = (process_cpu_nanos64() - cpu_start) * 1e-9;
+  uint64_t frames = t->total_pkt_count;
+  double secs = elapsed * 1e-9;
+  printf("Aggregated %llu frames into %u flows in %.2f s: %.1f Mframes/s, %.1f Gbit/s of frames (%.1f Gbit/s on the wire)\n",
+    (long long unsigned)frames, (unsigned)flow_table_count(t), secs, frames / secs * 1e-6,
+    (total_bytes - frames * sizeof(uint32_t)) * 8 / secs * 1e-9,
+    (total_bytes + frames * 16) * 8 / secs * 1e-9); // -4 bytes of metadata, +20 bytes of preamble and inter-frame gap.
+  printf("Used %.2f CPU seconds across %u flow table shard(s) and the consuming thread: %.0f ns of CPU time per frame\n",
+    cpu_secs, (unsigned)t->num_shards, cpu_secs * 1e9 / frames);
+  double wire_bytes_per_frame = (double)(total_bytes + frames * 16) / frames;
+  double link_mframes = LINK_RATE_GBPS * 1e9 / 8 / wire_bytes_per_frame * 1e-6;
+  double fraction = frames / secs * 1e-6 / link_mframes;
+  printf("That is %.1f%% of %u GbE link rate, which for this mix of frame sizes is %.1f Mframes/s: %s\n",
+    fraction * 100, LINK_RATE_GBPS, link_mframes, fraction >= 1 ? "keeping up" : "NOT keeping up");
+  free(h_ring.host_ptr);
+  return fraction >= 1;
+}
+
+// Self test:
+// With --selftest, the code from rv_gen_shuttle is run on a small RV32 interpreter (RV32IM plus
+// the Zba and Zbb instructions) against models of the RX queue, the NIU, and the host, for a
+// range of ring sizes, host ring alignments, coalescing settings, and sampling modes. The models
+// check every load and store the code makes, including that NoC transfers never cross the end
+// of either ring and never overwrite data the host has yet to read, and that the device ring is
+// only read once the RX queue has written it. The host side then checks that exactly the frames
+// which should have been kept arrive in the host ring, in order and intact. The RX queue lands
+// its data lazily, so the code has to rely on ETH_RXQ_OUTSTANDING_WR_CNT, and the cycle counter
+// starts just shy of wrapping.
+
+#define SELFTEST_SCRATCH_ADDR 0xFFB01F00 // Start of the memory just below sp, which the code uses for spills.
+#define SELFTEST_BYTES_PER_CYCLE 37      // 400 Gbit/s at 1.35 GHz.
+#define SELFTEST_MAX_NOC 8               // Outstanding NoC transfers the NIU model can track.
+#define SELFTEST_RATE_CYCLES 500         // For ETHDUMP_SAMPLE_RATE: at most one frame per this many cycles...
+#define SELFTEST_RATE_BURST_CYCLES 2000  // ... with bursts of up to four.
+
+typedef struct selftest_config_t {
+  uint32_t e_ring_size;
+  uint32_t h_ring_size;
+  uint64_t h_ring_noc_addr;
+  uint32_t initial_drop_count;
+  bool coalesce;
+  uint32_t sample_mode;
+  bool overflow; // Have the host stall until the RX queue drops frames, and check that the device reports it.
+} selftest_config_t;
+
+typedef struct selftest_noc_t {
+  uint32_t buf;
+  uint32_t src;
+  uint32_t len;
+  uint64_t dst;
+  uint64_t done_at;
+  uint8_t data[NOC_TRANSACTION_SIZE_LIMIT]; // Read from L1 when the transfer is issued.
+} selftest_noc_t;
+
+typedef struct selftest_t {
+  rv_shuttle_config_t cfg;
+  rv_emitter_t rv;
+  uint32_t rng;
+  bool overflow;
+  uint64_t now;           // Cycles since the code started; the cycle CSR reads as the low 32 bits of this plus cycle_base.
+  uint32_t cycle_base;
+  // RISCV core:
+  uint32_t x[32];
+  uint32_t pc;            // Byte offset into rv.code.
+  uint8_t* l1;            // Device ring, followed by h_ring_metadata_t.
+  uint32_t scratch[64];   // Memory at SELFTEST_SCRATCH_ADDR.
+  // RX queue:
+  uint8_t* rx_shadow;     // What the RX queue has accepted, as it'll appear in L1 once written.
+  uint64_t rx_written;    // Bytes accepted by the RX queue.
+  uint64_t rx_landed;     // Bytes actually written to L1, which can lag rx_written.
+  uint32_t rxq_ctrl;
+  uint32_t rxq_buf_ptr;
+  uint32_t rxq_buf_size_words;
+  uint32_t rxq_drop_cnt;
+  // NIU:
+  uint32_t niu_regs[2][NOC_CMD_CTRL_OFFSET / 4]; // For each command buffer, registers as last written.
+  uint32_t router_cfg_2;
+  uint32_t router_cfg_4;
+  uint32_t noc_pending[2]; // Outstanding transfers from each command buffer.
+  uint32_t noc_head;
+  uint32_t noc_count;
+  selftest_noc_t noc_queue[SELFTEST_MAX_NOC];
+  uint64_t h_written;     // Bytes sent to the host ring.
+  uint32_t transfer_count;
+  uint32_t short_transfer_count; // Transfers smaller than coalesce_bytes.
+  // Host:
+  uint8_t* h_ring;
+  h_ring_metadata_t h_meta;
+  uint32_t read_ptr;
+  uint64_t next_poll_at;
+  uint32_t polls_until_mailbox;
+  uint32_t mailbox_sent;
+  uint32_t mailbox_echoes;
+  // Traffic:
+  uint8_t* frame_data;    // Every frame sent, back to back.
+  uint32_t* frame_offset; // Indexed by serial number (which is also in the last 4 bytes of each frame).
+  uint32_t num_frames;
+  uint32_t next_serial;   // Next frame to send.
+  uint64_t next_frame_at;
+  uint32_t burst_left;
+  uint32_t* expected;     // Serial numbers of the frames the host should receive, in order.
+  uint32_t expected_count;
+  uint32_t expected_head;
+  uint32_t accepted_count;
+  uint32_t received_count;
+} selftest_t;
+
+static uint32_t selftest_rand(selftest_t* st) {
+  uint32_t r = st->rng;
+  r ^= r << 13; r ^= r >> 17; r ^= r << 5;
+  return st->rng = r;
+}
+
+static uint32_t selftest_flow_sample_hash(const flow_key_t* key) {
+  // The hash which the ETHDUMP_SAMPLE_FLOW code in rv_gen_sample computes, in terms of the flow
+  // key which the host parses from the same frame. Test frames never use port zero, so zero
+  // ports mean that parse_flow_key didn't find any (and the device shouldn't have either).
+  uint32_t h = key->ethertype;
+  uint8_t pairs[2 + 16];
+  uint32_t n = 0;
+  if (key->addr_len != 6) {
+    h ^= key->proto;
+    if (key->ports[0] | key->ports[1]) {
+      pairs[n++] = (uint8_t)((key->ports[0] ^ key->ports[1]) >> 8);
+      pairs[n++] = (uint8_t)(key->ports[0] ^ key->ports[1]);
+    }
+  }
+  for (uint32_t i = 0; i < key->addr_len; ++i) pairs[n++] = key->addrs[0][i] ^ key->addrs[1][i];
+  for (uint32_t i = 0; i < n; ++i) h = ((h << 8) | (h >> 24)) ^ pairs[i];
+  h ^= h >> 16;
+  h += h << 3;
+  h ^= h >> 11;
+  h += h << 15;
+  return h;
+}
+
+static uint32_t selftest_make_frame(selftest_t* st, uint8_t* frame, uint32_t max_len, uint32_t serial) {
+  // Writes a random frame from one of a few hundred flows (in a random direction), and returns its length.
+  uint32_t r = selftest_rand(st);
+  uint32_t flow = r % 300;
+  uint32_t dir = (r >> 9) & 1;
+  uint32_t kind = flow % 14;
+  uint32_t len = 80 + selftest_rand(st) % (max_len - 80 + 1);
+  for (uint32_t i = 0; i < len; ++i) frame[i] = (uint8_t)selftest_rand(st);
+  uint8_t macs[2][6] = {{0x02, 0, 0, 0, (uint8_t)(flow >> 8), (uint8_t)flow}, {0x02, 0, 0, 1, (uint8_t)(flow >> 8), (uint8_t)flow}};
+  memcpy(frame, macs[dir], 6);
+  memcpy(frame + 6, macs[!dir], 6);
+  uint32_t pos = 12;
+  static const uint16_t tags[14][2] = {
+    {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0x8100}, {0x88A8}, {0x88A8, 0x8100}, {0x8100}, {0x8100, 0x8100}, {0x88A8},
+  };
+  for (uint32_t i = 0; i < 2 && tags[kind][i]; ++i) {
+    put_be16(frame + pos, tags[kind][i]);
+    put_be16(frame + pos + 2, (uint16_t)(flow + i));
+    pos += 4;
+  }
+  uint8_t* ip = frame + pos + 2;
+  uint8_t* l4 = NULL;
+  static const uint8_t protos[14] = {6, 17, 132, 17, 17, 1, 6, 17, 0, 0, 0, 6, 17, 132};
+  switch (kind) {
+  case 0: case 1: case 2: case 3: case 4: case 5: case 11: case 12: // IPv4
+    put_be16(frame + pos, 0x0800);
+    ip[0] = kind == 4 ? 0x46 : 0x45; // With 4 bytes of options for kind 4.
+    put_be16(ip + 6, kind == 3 ? 0x2000 + 1 + (flow & 0xff) : kind == 1 ? 0x2000 : 0); // Kind 3 is a non-first fragment.
+    ip[9] = protos[kind];
+    memcpy(ip + 12 + 4 * dir, "\x0a\x00", 2);
+    put_be16(ip + 14 + 4 * dir, (uint16_t)flow);
+    memcpy(ip + 16 - 4 * dir, "\xc0\xa8\x00\x01", 4);
+    l4 = kind == 3 ? NULL : ip + (ip[0] & 15) * 4;
+    break;
+  case 6: case 7: case 13: // IPv6
+    put_be16(frame + pos, 0x86DD);
+    ip[0] = 0x60;
+    ip[6] = protos[kind];
+    memset(ip + 8, 0, 32);
+    ip[8 + 16 * dir] = 0xfd;
+    put_be16(ip + 22 + 16 * dir, (uint16_t)flow);
+    ip[24 - 16 * dir] = 0xfd;
+    ip[39 - 16 * dir] = 1;
+    l4 = ip + 40;
+    break;
+  default: // Not IP
+    put_be16(frame + pos, kind == 8 ? 0x0806 : 0x88B5);
+    break;
+  }
+  if (l4) {
+    put_be16(l4 + 2 * dir, (uint16_t)(1024 + flow));
+    put_be16(l4 + 2 - 2 * dir, (uint16_t)(80 + kind));
+  }
+  put_be32(frame + len - 4, serial);
+  return len;
+}
+
+static uint32_t selftest_load(selftest_t* st, uint32_t addr, uint32_t funct3) {
+  const rv_shuttle_config_t* cfg = &st->cfg;
+  uint32_t e_ring_mask = cfg->e_ring_size - 1;
+  if (funct3 == 4) { // lbu
+    if (addr >= cfg->e_ring_size) FATAL("pc=0x%x: lbu from 0x%08x, which is outside the device ring", st->pc, addr);
+    if (((addr - st->rx_landed) & e_ring_mask) < st->rx_written - st->rx_landed) {
+      FATAL("pc=0x%x: lbu from 0x%08x, which the RX queue has yet to write", st->pc, addr);
+    }
+    return st->l1[addr];
+  }
+  if (funct3 != 2 || (addr & 3)) FATAL("pc=0x%x: Unsupported load (funct3 %u) from 0x%08x", st->pc, funct3, addr);
+  if (addr - cfg->h_meta_addr < sizeof(h_ring_metadata_t)) {
+    uint32_t value;
+    memcpy(&value, st->l1 + addr, sizeof(value));
+    return value;
+  }
+  if (addr - SELFTEST_SCRATCH_ADDR < sizeof(st->scratch)) return st->scratch[(addr - SELFTEST_SCRATCH_ADDR) / 4];
+  switch (addr - cfg->niu_addr) {
+  case ROUTER_CFG_2_OFFSET: return st->router_cfg_2;
+  case ROUTER_CFG_4_OFFSET: return st->router_cfg_4;
+  case NIU_MST_WRITE_REQS_OUTGOING_ID_OFFSET: return st->noc_count;
+  case 0x800 + NOC_CMD_CTRL_OFFSET: return 0;
+  }
+  switch (addr - cfg->rxq_addr) {
+  case ETH_RXQ_CTRL_OFFSET: return st->rxq_ctrl;
+  case ETH_RXQ_BUF_PTR_OFFSET: return st->rxq_buf_ptr;
+  case ETH_RXQ_BUF_SIZE_WORDS_OFFSET: return st->rxq_buf_size_words;
+  case ETH_RXQ_PACKET_DROP_CNT_OFFSET: return st->rxq_drop_cnt;
+  case ETH_RXQ_OUTSTANDING_WR_CNT_OFFSET: return (uint32_t)((st->rx_written - st->rx_landed + 95) / 96);
+  }
+  FATAL("pc=0x%x: Unexpected load from 0x%08x", st->pc, addr);
+}
+
+static void selftest_noc_issue(selftest_t* st, uint32_t buf) {
+  const rv_shuttle_config_t* cfg = &st->cfg;
+  if (st->noc_count == SELFTEST_MAX_NOC) FATAL("pc=0x%x: Too many outstanding NoC transfers", st->pc);
+  uint32_t* regs = st->niu_regs[buf];
+  uint32_t src = regs[NOC_TARG_ADDR_LO_OFFSET / 4];
+  uint32_t len = regs[NOC_AT_LEN_BE_OFFSET / 4];
+  uint64_t dst = (uint64_t)regs[NOC_RET_ADDR_MID_OFFSET / 4] << 32 | regs[NOC_RET_ADDR_LO_OFFSET / 4];
+  if (buf == 0) {
+    uint32_t h_ring_offset = (uint32_t)st->h_written & (cfg->h_ring_size - 1);
+    if (len == 0 || len > NOC_TRANSACTION_SIZE_LIMIT) FATAL("pc=0x%x: NoC transfer of %u bytes", st->pc, len);
+    if (src >= cfg->e_ring_size || len > cfg->e_ring_size - src) {
+      FATAL("pc=0x%x: NoC transfer of %u bytes from 0x%x runs off the end of the device ring", st->pc, len, src);
+    }
+    if (dst != cfg->h_ring_noc_addr + h_ring_offset) {
+      FATAL("pc=0x%x: NoC transfer to 0x%llx, rather than 0x%llx", st->pc, (long long unsigned)dst,
+        (long long unsigned)(cfg->h_ring_noc_addr + h_ring_offset));
+    }
+    for (uint32_t i = 0; i < len; ++i) {
+      if (((src + i - st->rx_landed) & (cfg->e_ring_size - 1)) < st->rx_written - st->rx_landed) {
+        FATAL("pc=0x%x: NoC transfer of %u bytes from 0x%x includes data the RX queue has yet to write", st->pc, len, src);
+      }
+    }
+    if (len > cfg->h_ring_size - h_ring_offset) FATAL("pc=0x%x: NoC transfer of %u bytes runs off the end of the host ring", st->pc, len);
+    if (st->h_written + len - st->read_ptr > cfg->h_ring_size) FATAL("pc=0x%x: NoC transfer overwrites data the host hasn't read", st->pc);
+    st->h_written += len;
+    st->transfer_count += 1;
+    st->short_transfer_count += len < cfg->coalesce_bytes;
+  }
+  uint32_t i = (st->noc_head + st->noc_count++) % SELFTEST_MAX_NOC;
+  st->noc_queue[i].buf = buf;
+  st->noc_queue[i].src = src;
+  st->noc_queue[i].len = len;
+  st->noc_queue[i].dst = dst;
+  st->noc_queue[i].done_at = st->now + 10 + selftest_rand(st) % 300;
+  if (buf == 0) {
+    memcpy(st->noc_queue[i].data, st->l1 + src, len);
+  } else {
+    memcpy(st->noc_queue[i].data, st->l1 + cfg->h_meta_addr, sizeof(h_ring_metadata_t));
+  }
+  st->noc_pending[buf] += 1;
+}
+
+static void selftest_store(selftest_t* st, uint32_t addr, uint32_t value) {
+  const rv_shuttle_config_t* cfg = &st->cfg;
+  if (addr & 3) FATAL("pc=0x%x: Misaligned store to 0x%08x", st->pc, addr);
+  if (addr - cfg->h_meta_addr < sizeof(h_ring_metadata_t)) {
+    memcpy(st->l1 + addr, &value, sizeof(value));
+    return;
+  }
+  if (addr - SELFTEST_SCRATCH_ADDR < sizeof(st->scratch)) {
+    st->scratch[(addr - SELFTEST_SCRATCH_ADDR) / 4] = value;
+    return;
+  }
+  switch (addr - cfg->niu_addr) {
+  case NOC_TARG_ADDR_LO_OFFSET:
+  case NOC_RET_ADDR_LO_OFFSET:
+  case NOC_RET_ADDR_MID_OFFSET:
+  case NOC_AT_LEN_BE_OFFSET:
+    if (st->noc_pending[0]) FATAL("pc=0x%x: Changed NIU command registers while a transfer using them was outstanding", st->pc);
+    st->niu_regs[0][(addr - cfg->niu_addr) / 4] = value;
+    return;
+  case NOC_CMD_CTRL_OFFSET:
+  case 0x800 + NOC_CMD_CTRL_OFFSET:
+    if (!(value & 1)) FATAL("pc=0x%x: NOC_CMD_CTRL written without the low bit set", st->pc);
+    selftest_noc_issue(st, addr - cfg->niu_addr >= 0x800);
+    return;
+  case ROUTER_CFG_2_OFFSET:
+    st->router_cfg_2 = value;
+    return;
+  }
+  switch (addr - cfg->rxq_addr) {
+  case ETH_RXQ_CTRL_OFFSET:
+    if (value != 0 && value != 4) FATAL("pc=0x%x: ETH_RXQ_CTRL set to 0x%x", st->pc, value);
+    st->rxq_ctrl = value;
+    return;
+  case ETH_RXQ_BUF_SIZE_WORDS_OFFSET:
+    st->rxq_buf_size_words = value;
+    return;
+  }
+  FATAL("pc=0x%x: Unexpected store to 0x%08x", st->pc, addr);
+}
+
+static void selftest_step(selftest_t* st) {
+  // Executes one instruction.
+  if (st->pc >= st->rv.num_words * 4) FATAL("pc=0x%x: Ran off the end of the code", st->pc);
+  uint32_t insn = st->rv.code[st->pc / 4];
+  uint32_t* x = st->x;
+  uint32_t rd = (insn >> 7) & 31, funct3 = (insn >> 12) & 7, funct7 = insn >> 25;
+  uint32_t a = x[(insn >> 15) & 31], b = x[(insn >> 20) & 31];
+  int32_t imm = (int32_t)insn >> 20;
+  uint32_t next_pc = st->pc + 4;
+  uint32_t result = 0;
+  switch (insn & 0x7f) {
+  case 0x37: // lui
+    result = insn & 0xfffff000u;
+    break;
+  case 0x13: // OP-IMM
+    switch (funct3) {
+    case 0: result = a + imm; break;
+    case 2: result = (int32_t)a < imm; break;
+    case 3: result = a < (uint32_t)imm; break;
+    case 4: result = a ^ imm; break;
+    case 6: result = a | imm; break;
+    case 7: result = a & imm; break;
+    case 1: if (funct7 != 0) goto unsupported; result = a << (imm & 31); break;
+    case 5:
+      if (funct7 == 0) result = a >> (imm & 31);
+      else if (funct7 == 0x20) result = (uint32_t)((int32_t)a >> (imm & 31));
+      else goto unsupported;
+      break;
+    }
+    break;
+  case 0x33: // OP
+    switch (funct7 << 3 | funct3) {
+    case 0x000: result = a + b; break;
+    case 0x100: result = a - b; break;
+    case 0x001: result = a << (b & 31); break;
+    case 0x002: result = (int32_t)a < (int32_t)b; break;
+    case 0x003: result = a < b; break;
+    case 0x004: result = a ^ b; break;
+    case 0x005: result = a >> (b & 31); break;
+    case 0x105: result = (uint32_t)((int32_t)a >> (b & 31)); break;
+    case 0x006: result = a | b; break;
+    case 0x007: result = a & b; break;
+    case 0x008: result = a * b; break; // M
+    case 0x009: result = (uint32_t)(((int64_t)(int32_t)a * (int32_t)b) >> 32); break;
+    case 0x00a: result = (uint32_t)(((int64_t)(int32_t)a * (uint64_t)b) >> 32); break;
+    case 0x00b: result = (uint32_t)(((uint64_t)a * b) >> 32); break;
+    case 0x00c: result = b == 0 ? UINT32_MAX : (a == 0x80000000u && b == UINT32_MAX) ? a : (uint32_t)((int32_t)a / (int32_t)b); break;
+    case 0x00d: result = b == 0 ? UINT32_MAX : a / b; break;
+    case 0x00e: result = b == 0 ? a : (a == 0x80000000u && b == UINT32_MAX) ? 0 : (uint32_t)((int32_t)a % (int32_t)b); break;
+    case 0x00f: result = b == 0 ? a : a % b; break;
+    case 0x082: result = (a << 1) + b; break; // Zba
+    case 0x084: result = (a << 2) + b; break;
+    case 0x086: result = (a << 3) + b; break;
+    case 0x02c: result = (int32_t)a < (int32_t)b ? a : b; break; // Zbb
+    case 0x02d: result = a < b ? a : b; break;
+    case 0x02e: result = (int32_t)a < (int32_t)b ? b : a; break;
+    case 0x02f: result = a < b ? b : a; break;
+    case 0x104: result = ~(a ^ b); break;
+    case 0x106: result = a | ~b; break;
+    case 0x107: result = a & ~b; break;
+    default: goto unsupported;
+    }
+    break;
+  case 0x03: // LOAD
+    result = selftest_load(st, a + imm, funct3);
+    break;
+  case 0x23: // STORE
+    if (funct3 != 2) goto unsupported;
+    selftest_store(st, a + (uint32_t)((int32_t)(insn & 0xfe000000) >> 20 | rd), b);
+    rd = 0;
+    break;
+  case 0x63: { // BRANCH
+    bool taken;
+    switch (funct3) {
+    case 0: taken = a == b; break;
+    case 1: taken = a != b; break;
+    case 4: taken = (int32_t)a < (int32_t)b; break;
+    case 5: taken = (int32_t)a >= (int32_t)b; break;
+    case 6: taken = a < b; break;
+    case 7: taken = a >= b; break;
+    default: goto unsupported;
+    }
+    if (taken) {
+      next_pc = st->pc + ((uint32_t)((int32_t)(insn & 0x80000000) >> 19) | (insn & 0x80) << 4 | (insn >> 20 & 0x7e0) | (insn >> 7 & 0x1e));
+    }
+    rd = 0;
+    break;
+  }
+  case 0x6f: // jal
+    result = next_pc;
+    next_pc = st->pc + ((uint32_t)((int32_t)(insn & 0x80000000) >> 11) | (insn & 0xff000) | (insn >> 9 & 0x800) | (insn >> 20 & 0x7fe));
+    break;
+  case 0x67: // jalr
+    result = next_pc;
+    next_pc = (a + imm) & ~1u;
+    break;
+  case 0x0f: // fence
+    break;
+  case 0x73: // csrrs rd, cycle, x0 (i.e. rdcycle)
+    if (funct3 != 2 || ((insn >> 15) & 31) != 0 || (insn >> 20) != 0xc00) goto unsupported;
+    result = (uint32_t)st->now + st->cycle_base;
+    break;
+  default:
+  unsupported:
+    FATAL("pc=0x%x: Unsupported instruction 0x%08x", st->pc, insn);
+  }
+  if (rd) x[rd] = result;
+  st->pc = next_pc;
+  st->now += 1;
+}
+
+static bool selftest_rxq_receive(selftest_t* st, const uint8_t* frame, uint32_t len) {
+  // The RX queue accepts a frame (prepending hardware metadata), or drops it if there's no room
+  // below ETH_RXQ_BUF_SIZE_WORDS and wrapping is disabled. The data then lands in L1 gradually.
+  uint32_t e_ring_mask = st->cfg.e_ring_size - 1;
+  uint32_t n = 4 + len;
+  uint64_t limit = (uint64_t)st->rxq_buf_size_words * 16;
+  if (!(st->rxq_ctrl & 4) && st->rxq_buf_ptr + n > limit) {
+    st->rxq_drop_cnt += 1;
+    return false;
+  }
+  uint8_t info[4] = {0, 0, (uint8_t)(len >> 8), (uint8_t)len};
+  for (uint32_t i = 0; i < n; ++i) {
+    uint32_t at = (uint32_t)(st->rx_written + i) & e_ring_mask;
+    st->rx_shadow[at] = i < 4 ? info[i] : frame[i - 4];
+    st->l1[at] = 0xEE; // Not there yet.
+  }
+  st->rx_written += n;
+  st->rxq_buf_ptr += n;
+  if ((st->rxq_ctrl & 4) && st->rxq_buf_ptr >= limit) st->rxq_buf_ptr -= (uint32_t)limit;
+  return true;
+}
+
+static bool selftest_rxq_has_room(selftest_t* st, uint32_t len, bool may_drop) {
+  // Whether the link can deliver a frame to the RX queue yet. The code relies on the RX queue
+  // never getting half a ring ahead of e_ring_front_ptr (to tell new data from old), nor wrapping
+  // onto data the code hasn't released before the code notices the wrap, so the link has to be
+  // slow relative to the device ring size. Test rings are small, so those are enforced here.
+  // Unless may_drop, frames are also held back rather than being dropped by the RX queue. How
+  // the RX queue behaves when a frame ends exactly at the end of the buffer with wrapping
+  // disabled isn't modelled, so such frames are held back too.
+  uint32_t e_ring_mask = st->cfg.e_ring_size - 1;
+  uint32_t n = 4 + len;
+  uint32_t write_ptr = (uint32_t)st->rx_written & e_ring_mask;
+  uint32_t ahead = st->rxq_buf_ptr == st->cfg.e_ring_size ? st->rxq_buf_ptr - st->x[RV_S4] : (write_ptr - st->x[RV_S4]) & e_ring_mask;
+  if (ahead + n >= st->cfg.e_ring_size / 2) return false;
+  if (st->rxq_ctrl & 4) return ((write_ptr - st->x[RV_S6]) & e_ring_mask) + n < st->cfg.e_ring_size;
+  if (st->rxq_buf_ptr + n == st->cfg.e_ring_size) return false;
+  return may_drop || st->rxq_buf_ptr + n <= (uint64_t)st->rxq_buf_size_words * 16;
+}
+
+static void selftest_send_traffic(selftest_t* st) {
+  // Bursts of frames at up to line rate (as far as the RX queue has room for them, unless testing
+  // overflow) separated by gaps, some of which exceed the coalescing deadline.
+  if (st->next_serial == st->num_frames || st->now < st->next_frame_at) return;
+  uint32_t serial = st->next_serial;
+  const uint8_t* frame = st->frame_data + st->frame_offset[serial];
+  uint32_t len = st->frame_offset[serial + 1] - st->frame_offset[serial];
+  if (!selftest_rxq_has_room(st, len, st->overflow)) return;
+  if (selftest_rxq_receive(st, frame, len)) {
+    bool keep = true;
+    if (st->cfg.sample_mode == ETHDUMP_SAMPLE_COUNT) {
+      keep = st->accepted_count % st->cfg.sample_interval == 0;
+    } else if (st->cfg.sample_mode == ETHDUMP_SAMPLE_FLOW) {
+      flow_key_t key;
+      parse_flow_key(frame, len < FLOW_HDR_BYTES ? len : FLOW_HDR_BYTES, &key);
+      keep = selftest_flow_sample_hash(&key) < (uint32_t)(0x100000000ull / st->cfg.sample_interval);
+    }
+    if (keep) st->expected[st->expected_count++] = serial;
+    st->accepted_count += 1;
+  }
+  st->next_serial += 1;
+  st->next_frame_at = st->now + (4 + len + 16 + SELFTEST_BYTES_PER_CYCLE - 1) / SELFTEST_BYTES_PER_CYCLE;
+  if (--st->burst_left == 0) {
+    st->burst_left = 1 + selftest_rand(st) % 40;
+    st->next_frame_at += selftest_rand(st) % 3000;
+  }
+}
+
+static void selftest_check_frame(selftest_t* st, const uint8_t* data, uint32_t len) {
+  if (len < 4) FATAL("Host received a %u byte frame", len);
+  uint32_t serial = (uint32_t)data[len - 4] << 24 | (uint32_t)data[len - 3] << 16 | load_be16(data + len - 2);
+  if (st->cfg.sample_mode == ETHDUMP_SAMPLE_RATE) {
+    // Any subset of the frames can be kept, so long as their order is preserved.
+    while (st->expected_head < st->expected_count && st->expected[st->expected_head] != serial) st->expected_head += 1;
+  }
+  if (st->expected_head == st->expected_count) FATAL("Host received frame %u, which should have been skipped", serial);
+  uint32_t want = st->expected[st->expected_head++];
+  uint32_t want_len = st->frame_offset[want + 1] - st->frame_offset[want];
+  if (want != serial || want_len != len || memcmp(data, st->frame_data + st->frame_offset[want], len)) {
+    FATAL("Host received frame %u (%u bytes) in place of frame %u (%u bytes), or the frame was corrupted", serial, len, want, want_len);
+  }
+  st->received_count += 1;
+}
+
+static void selftest_host_poll(selftest_t* st) {
+  // Consumes whatever the device has sent, and now and again checks that the mailbox works.
+  if (st->now < st->next_poll_at) return;
+  uint32_t r = selftest_rand(st);
+  st->next_poll_at = st->now + 100 + r % 1500;
+  if (r % 32 == 0) st->next_poll_at += 20000; // Occasionally fall behind, so that the host ring fills up.
+  if (st->overflow && st->rxq_drop_cnt == st->cfg.initial_drop_count) return; // Fall behind until frames get dropped.
+  pinned_host_buffer_t h_ring;
+  h_ring.size = st->cfg.h_ring_size;
+  h_ring.host_ptr = st->h_ring;
+  h_ring.noc_addr = st->cfg.h_ring_noc_addr;
+  ethdump_batch_t batch;
+  for (;;) {
+    fill_batch(&h_ring, st->read_ptr, st->h_meta.write_ptr, &batch);
+    if (!batch.num_frames) break;
+    for (uint32_t i = 0; i < batch.num_frames; ++i) {
+      const ethdump_frame_t* frame = batch.frames + i;
+      uint8_t buf[1 << 14];
+      memcpy(buf, frame->data, frame->len);
+      memcpy(buf + frame->len, frame->wrap_data, frame->wrap_len);
+      selftest_check_frame(st, buf, frame->len + frame->wrap_len);
+    }
+    st->read_ptr = batch.end_ptr;
+  }
+  st->router_cfg_4 = st->read_ptr;
+  uint32_t echo = st->h_meta.mailbox_echo;
+  if (echo != st->mailbox_sent && echo != st->mailbox_sent - 1) FATAL("Mailbox echo is %u, but %u was sent", echo, st->mailbox_sent);
+  if (--st->polls_until_mailbox == 0) {
+    st->polls_until_mailbox = 10;
+    if (echo == st->mailbox_sent && !st->router_cfg_2) {
+      st->mailbox_echoes += 1;
+      st->router_cfg_2 = ++st->mailbox_sent;
+    }
+  }
+}
+
+static void selftest_tick(selftest_t* st) {
+  // Advances the RX queue, NIU, host, and traffic models by one cycle.
+  if (st->rx_landed != st->rx_written && (selftest_rand(st) & 1) == 0) {
+    // Write up to 96 bytes of what the RX queue has accepted to L1.
+    uint32_t e_ring_mask = st->cfg.e_ring_size - 1;
+    uint64_t n = st->rx_written - st->rx_landed;
+    for (uint64_t i = 0; i < n && i < 96; ++i) {
+      uint32_t at = (uint32_t)st->rx_landed++ & e_ring_mask;
+      st->l1[at] = st->rx_shadow[at];
+    }
+  }
+  if (st->noc_count && st->now >= st->noc_queue[st->noc_head].done_at) {
+    // The data is read from L1 as the transfer is issued, but only reaches the host later. The
+    // code shouldn't let the RX queue reuse the device ring in the meantime.
+    selftest_noc_t* t = st->noc_queue + st->noc_head;
+    if (t->buf == 0) {
+      if (memcmp(t->data, st->l1 + t->src, t->len)) FATAL("RX queue overwrote data in the device ring before the NoC transfer of it finished");
+      memcpy(st->h_ring + (t->dst - st->cfg.h_ring_noc_addr), t->data, t->len);
+    } else {
+      memcpy(&st->h_meta, t->data, sizeof(st->h_meta));
+    }
+    st->noc_pending[t->buf] -= 1;
+    st->noc_head = (st->noc_head + 1) % SELFTEST_MAX_NOC;
+    st->noc_count -= 1;
+  }
+  selftest_send_traffic(st);
+  selftest_host_poll(st);
+}
+
+static void selftest_run(const selftest_config_t* tc, uint32_t seed) {
+  selftest_t* st = calloc(1, sizeof(selftest_t));
+  if (!st) FATAL("Could not allocate memory for self test");
+  rv_shuttle_config_t* cfg = &st->cfg;
+  cfg->h_ring_noc_addr = tc->h_ring_noc_addr;
+  cfg->h_ring_size = tc->h_ring_size;
+  cfg->h_meta_addr = tc->e_ring_size;
+  cfg->e_ring_size = tc->e_ring_size;
+  cfg->initial_drop_count = tc->initial_drop_count;
+  cfg->rxq_addr = RXQ_ADDR(2);
+  cfg->niu_addr = NIU_ADDR(1);
+  cfg->coalesce_bytes = tc->coalesce ? (tc->e_ring_size / 4 < 4096 ? tc->e_ring_size / 4 : 4096) : 0;
+  cfg->coalesce_cycles = 500;
+  cfg->sample_mode = tc->sample_mode;
+  cfg->sample_interval = 3;
+  cfg->sample_cycles = SELFTEST_RATE_CYCLES;
+  cfg->sample_burst_cycles = SELFTEST_RATE_BURST_CYCLES;
+  rv_gen_shuttle(&st->rv, cfg);
+  st->rng = seed;
+  st->overflow = tc->overflow;
+  st->cycle_base = 0u - 20000; // So that the cycle counter wraps early on.
+  for (uint32_t i = 1; i < 32; ++i) st->x[i] = 0xBAADF00D; // Registers start out as junk.
+  for (uint32_t i = 0; i < 64; ++i) st->scratch[i] = 0xBAADF00D;
+
+  // As per configure_ethernet.
+  st->l1 = malloc(tc->e_ring_size + sizeof(h_ring_metadata_t));
+  st->rx_shadow = malloc(tc->e_ring_size);
+  st->h_ring = malloc(tc->h_ring_size);
+  if (!st->l1 || !st->rx_shadow || !st->h_ring) FATAL("Could not allocate memory for self test");
+  memset(st->l1, 0xEE, tc->e_ring_size);
+  memset(st->h_ring, 0xEE, tc->h_ring_size);
+  metadata_init(&st->h_meta);
+  memcpy(st->l1 + cfg->h_meta_addr, &st->h_meta, sizeof(st->h_meta));
+  st->rxq_buf_size_words = tc->e_ring_size >> 4;
+  st->rxq_drop_cnt = tc->initial_drop_count;
+  st->mailbox_sent = st->h_meta.mailbox_echo;
+  st->polls_until_mailbox = 10;
+  st->burst_left = 1;
+  st->next_frame_at = 1000; // Give the code time to initialise itself.
+
+  // Enough traffic to go around the host ring several times, even if only a third of it is kept.
+  uint32_t max_len = tc->e_ring_size / 4 - 4 < 1514 ? tc->e_ring_size / 4 - 4 : 1514;
+  st->num_frames = (uint32_t)(12ull * tc->h_ring_size / ((80 + max_len) / 2));
+  if (st->num_frames < 1000) st->num_frames = 1000;
+  st->frame_offset = malloc((st->num_frames + 1) * sizeof(uint32_t));
+  st->frame_data = malloc((size_t)st->num_frames * max_len);
+  st->expected = malloc(st->num_frames * sizeof(uint32_t));
+  if (!st->frame_offset || !st->frame_data || !st->expected) FATAL("Could not allocate memory for self test");
+  st->frame_offset[0] = 0;
+  for (uint32_t i = 0; i < st->num_frames; ++i) {
+    st->frame_offset[i + 1] = st->frame_offset[i] + selftest_make_frame(st, st->frame_data + st->frame_offset[i], max_len, i);
+  }
+
+  for (;;) {
+    selftest_step(st);
+    selftest_tick(st);
+    if (st->overflow) {
+      if (st->h_meta.error) break;
+    } else if (st->next_serial == st->num_frames && st->received_count + st->h_meta.sampled_out_count == st->accepted_count
+        && (cfg->sample_mode == ETHDUMP_SAMPLE_RATE || st->expected_head == st->expected_count)) {
+      break;
+    }
+    if (st->now > 1000u * st->num_frames + 1000000u) {
+      FATAL("Stalled after %llu cycles: sent %u of %u frames, host received %u, device skipped %u, pc=0x%x",
+        (long long unsigned)st->now, st->next_serial, st->num_frames, st->received_count, st->h_meta.sampled_out_count, st->pc);
+    }
+  }
+
+  // Check the device's metadata against what was observed.
+  const h_ring_metadata_t* meta = &st->h_meta;
+  if (st->overflow) {
+    if (meta->error != 1) FATAL("Device reported error %u", meta->error);
+  } else {
+    if (meta->error) FATAL("Device reported error %u", meta->error);
+    if (st->rxq_drop_cnt != tc->initial_drop_count) FATAL("RX queue dropped %u frames", st->rxq_drop_cnt - tc->initial_drop_count);
+    if (meta->transfer_count != st->transfer_count) FATAL("Device counted %u transfers, but made %u", meta->transfer_count, st->transfer_count);
+    if (cfg->coalesce_bytes ? meta->deadline_count == 0 || meta->deadline_count > st->short_transfer_count : meta->deadline_count != 0) {
+      FATAL("Device counted %u transfers sent early to meet the deadline, with %u transfers of less than %u bytes",
+        meta->deadline_count, st->short_transfer_count, cfg->coalesce_bytes);
+    }
+    if (st->rx_written < 2ull * tc->e_ring_size || st->h_written < 2ull * tc->h_ring_size) FATAL("Rings did not wrap");
+    if (!st->mailbox_echoes) FATAL("Mailbox never echoed");
+    if (cfg->sample_mode == ETHDUMP_SAMPLE_RATE) {
+      uint64_t limit = (st->now + SELFTEST_RATE_BURST_CYCLES) / SELFTEST_RATE_CYCLES;
+      if (st->received_count > limit || st->received_count == 0 || st->received_count == st->accepted_count) {
+        FATAL("Kept %u of %u frames over %llu cycles, with a limit of %llu", st->received_count, st->accepted_count,
+          (long long unsigned)st->now, (long long unsigned)limit);
+      }
+    } else if (cfg->sample_mode != ETHDUMP_SAMPLE_NONE && (st->received_count == 0 || st->received_count == st->accepted_count)) {
+      FATAL("Kept %u of %u frames", st->received_count, st->accepted_count);
+    }
+  }
+  static const char* sample_names[] = {"no sampling", "sampling 1 in 3", "sampling 1 in 3 flows", "sampling by rate"};
+  printf("  %3u KiB device ring, %4u KiB host ring at 0x%llx, coalescing %s, %s%s: %u frames, %u kept, %u NoC transfers",
+    tc->e_ring_size >> 10, tc->h_ring_size >> 10, (long long unsigned)tc->h_ring_noc_addr, tc->coalesce ? "on " : "off",
+    sample_names[tc->sample_mode], tc->overflow ? ", overflowing" : "", st->accepted_count, st->received_count, st->transfer_count);
+  printf(tc->overflow ? ", overflow reported\n" : ", %u deadlines\n", meta->deadline_count);
+  free(st->expected);
+  free(st->frame_data);
+  free(st->frame_offset);
+  free(st->h_ring);
+  free(st->rx_shadow);
+  free(st->l1);
+  free(st);
+}
+
+static void run_selftest(void) {
+  static const struct {
+    uint32_t e_ring_size;
+    uint32_t h_ring_size;
+    uint64_t h_ring_noc_addr;
+    uint32_t initial_drop_count;
+  } rings[] = {
+    {4u << 10, 4u << 10, 0x123456000ull, 0},    // Aligned, as small as possible.
+    {4u << 10, 16u << 10, 0x1FFFFE100ull, 0},   // Unaligned, and crossing a 4 GiB boundary.
+    {16u << 10, 64u << 10, 0x300000040ull, 3},  // Unaligned, needing the NoC transfer size limit.
+    {64u << 10, 256u << 10, 0x200000000ull, 0}, // Aligned, with the low 32 bits of the address all zero.
+  };
+  printf("Running ethdump's device code against models of the hardware:\n");
+  uint32_t n = 0;
+  for (uint32_t r = 0; r < sizeof(rings) / sizeof(*rings); ++r) {
+    for (uint32_t coalesce = 0; coalesce < 2; ++coalesce) {
+      for (uint32_t sample_mode = ETHDUMP_SAMPLE_NONE; sample_mode <= ETHDUMP_SAMPLE_RATE; ++sample_mode) {
+        selftest_config_t tc;
+        tc.e_ring_size = rings[r].e_ring_size;
+        tc.h_ring_size = rings[r].h_ring_size;
+        tc.h_ring_noc_addr = rings[r].h_ring_noc_addr;
+        tc.initial_drop_count = rings[r].initial_drop_count;
+        tc.coalesce = coalesce;
+        tc.sample_mode = sample_mode;
+        tc.overflow = false;
+        selftest_run(&tc, 12345 + n++);
+        if (sample_mode == ETHDUMP_SAMPLE_NONE || sample_mode == ETHDUMP_SAMPLE_FLOW) {
+          tc.overflow = true;
+          selftest_run(&tc, 12345 + n++);
+        }
+      }
+    }
+  }
+  printf("All %u configurations passed\n", n);
+}
+
+// TT-link decoding:
+// With --ttlink, frames are decoded as TT-link packets (see EthernetTxRx.md) rather than written
+// out, and per-queue statistics are printed periodically. A TT-link packet is an Ethernet header
+// (plus any VLAN tags, and IP/UDP headers if the sender's TX header table inserts them), then an
+// 18 byte TT-link header, then a payload which is a multiple of 16 bytes. Queues are told apart in
+// the same way as the receiving RX classifier routes them: by MAC addresses, and by bit #216 of
+// the frame (bit 0 of byte 13 of the TT-link header), which is set for MMIO write packets. Packets
+// without a payload are sequence number updates, which are counted as acknowledgements if their
+// acknowledgement number moved on, and as heartbeats otherwise. Every other packet consumes a
+// sequence number, so a sequence number at or behind the highest seen so far is a resend, and one
+// more than a step ahead means packets went missing before reaching us. EthernetTxRx.md doesn't
+// say where in the header the pair of sequence numbers lives, so the user has to supply it with
+// --ttlink-seq-offset (the sending sequence number is at that byte, and the acknowledgement number
+// in the byte after it). Every count which depends on it is labelled as unverified in the reports.
+
+#define TTLINK_HDR_BYTES 18
+#define TTLINK_MMIO_BYTE 13 // Frame bit #216 is bit 0 of this header byte.
+#define TTLINK_MAX_QUEUES 64
+#define TTLINK_FCS_BYTES 4
+
+// Values for indexing ttlink_counts_t::pkts:
+#define TTLINK_DATA      0 // L1 write or NoC Overlay packet.
+#define TTLINK_MMIO      1 // MMIO write packet.
+#define TTLINK_ACK       2 // Sequence number update which acknowledged something new.
+#define TTLINK_HEARTBEAT 3 // Sequence number update which didn't.
+#define TTLINK_NUM_KINDS 4
+
+typedef struct ttlink_counts_t {
+  uint64_t pkts[TTLINK_NUM_KINDS];
+  uint64_t payload_bytes; // TT-link payload bytes of DATA and MMIO packets, excluding resends.
+  uint64_t wire_bytes;    // Including preamble and inter-frame gap.
+  uint64_t resends;       // DATA or MMIO packets with a sequence number which had already been seen.
+  uint64_t missing;       // Sequence numbers skipped over.
+} ttlink_counts_t;
+
+typedef struct ttlink_queue_t {
+  uint8_t macs[12];      // Destination then source.
+  bool mmio;
+  bool have_seq;
+  bool have_ack;
+  uint8_t seq;           // Highest sequence number seen on a DATA or MMIO packet.
+  uint8_t ack;           // Most recent acknowledgement number.
+  ttlink_counts_t cur;   // Since the last report.
+  ttlink_counts_t total;
+} ttlink_queue_t;
+
+typedef struct ttlink_decoder_t {
+  FILE* out;
+  uint64_t interval_ns;
+  uint64_t first_ns;     // Timestamp of the first batch, or 0 before then.
+  uint64_t report_ns;    // Timestamp of the previous report (or the first batch).
+  uint32_t seq_offset;
+  uint32_t num_queues;
+  uint32_t last_queue;   // Consecutive frames usually belong to the same queue, so try this one first.
+  uint64_t other_cur;    // Frames which weren't TT-link packets (or didn't fit in the queue table).
+  uint64_t other_total;
+  ttlink_queue_t queues[TTLINK_MAX_QUEUES];
+} ttlink_decoder_t;
+
+static void ttlink_decoder_init(ttlink_decoder_t* d, FILE* out, uint32_t interval_secs, uint32_t seq_offset) {
+  memset(d, 0, sizeof(*d));
+  d->out = out;
+  d->interval_ns = interval_secs * MILLISECONDS(1000u);
+  d->seq_offset = seq_offset;
+}
+
+static uint32_t ttlink_locate(const uint8_t* hdr, uint32_t len, uint32_t frame_length, uint32_t* payload_len) {
+  // Returns the offset of the TT-link header within the frame (and sets *payload_len), or 0 if
+  // the frame cannot be a TT-link packet.
+  uint32_t pos = 12;
+  uint16_t ethertype = load_be16(hdr + pos);
+  while ((ethertype == 0x8100 || ethertype == 0x88A8) && pos + 6 <= len) {
+    pos += 4;
+    ethertype = load_be16(hdr + pos);
+  }
+  pos += 2;
+  uint32_t end = frame_length - TTLINK_FCS_BYTES; // Anything beyond this within a minimum size frame is padding.
+  if (ethertype < 0x600) {
+    end = pos + ethertype; // Length rather than ethertype; this also excludes any padding.
+  } else if (ethertype == 0x0800) {
+    if (pos + 20 > len || hdr[pos + 9] != 17) return 0; // IP, but not UDP.
+    end = pos + load_be16(hdr + pos + 2);
+    pos += (hdr[pos] & 0xf) * 4 + 8;
+  } else if (ethertype == 0x86DD) {
+    if (pos + 40 > len || hdr[pos + 6] != 17) return 0;
+    end = pos + 40 + load_be16(hdr + pos + 4);
+    pos += 48;
+  }
+  if (pos + TTLINK_HDR_BYTES > len || pos + TTLINK_HDR_BYTES > end || end > frame_length) return 0;
+  uint32_t n = end - pos - TTLINK_HDR_BYTES;
+  if (frame_length <= 64 && ethertype >= 0x600) n = 0; // Can't tell a short payload from padding.
+  *payload_len = n & ~15u;
+  return pos;
+}
+
+static ttlink_queue_t* ttlink_find_queue(ttlink_decoder_t* d, const uint8_t* macs, bool mmio) {
+  ttlink_queue_t* q = d->queues + d->last_queue;
+  if (d->num_queues && q->mmio == mmio && !memcmp(q->macs, macs, sizeof(q->macs))) return q;
+  for (uint32_t i = 0; i < d->num_queues; ++i) {
+    q = d->queues + i;
+    if (q->mmio == mmio && !memcmp(q->macs, macs, sizeof(q->macs))) {
+      d->last_queue = i;
+      return q;
+    }
+  }
+  if (d->num_queues == TTLINK_MAX_QUEUES) return NULL;
+  d->last_queue = d->num_queues++;
+  q = d->queues + d->last_queue;
+  memcpy(q->macs, macs, sizeof(q->macs));
+  q->mmio = mmio;
+  return q;
+}
+
+static void ttlink_decode_frame(ttlink_decoder_t* d, const ethdump_frame_t* frame) {
+  uint8_t hdr_buf[FLOW_HDR_BYTES];
+  uint32_t hdr_len, payload_len;
+  uint32_t frame_length = frame->len + frame->wrap_len;
+  const uint8_t* hdr = frame_headers(frame, hdr_buf, &hdr_len);
+  uint32_t pos = hdr_len >= 14 ? ttlink_locate(hdr, hdr_len, frame_length, &payload_len) : 0;
+  ttlink_queue_t* q = pos ? ttlink_find_queue(d, hdr, hdr[pos + TTLINK_MMIO_BYTE] & 1) : NULL;
+  if (!q) {
+    d->other_cur += 1;
+    return;
+  }
+  ttlink_counts_t* c = &q->cur;
+  c->wire_bytes += frame_length + 20;
+  uint8_t seq = hdr[pos + d->seq_offset];
+  uint8_t ack = hdr[pos + d->seq_offset + 1];
+  bool new_ack = !q->have_ack || ack != q->ack;
+  q->ack = ack;
+  q->have_ack = true;
+  if (!payload_len && !q->mmio) {
+    c->pkts[new_ack ? TTLINK_ACK : TTLINK_HEARTBEAT] += 1;
+    return;
+  }
+  c->pkts[q->mmio ? TTLINK_MMIO : TTLINK_DATA] += 1;
+  int8_t ahead = (int8_t)(uint8_t)(seq - q->seq);
+  if (q->have_seq && ahead <= 0) {
+    c->resends += 1;
+    return;
+  }
+  if (q->have_seq) c->missing += (uint64_t)(ahead - 1);
+  q->seq = seq;
+  q->have_seq = true;
+  c->payload_bytes += payload_len;
+}
+
+static void ttlink_print_counts(FILE* f, const ttlink_queue_t* q, const ttlink_counts_t* c, double secs) {
+  const uint8_t* m = q->macs;
+  uint64_t sent = c->pkts[TTLINK_DATA] + c->pkts[TTLINK_MMIO];
+  fprintf(f, "  %02x:%02x:%02x:%02x:%02x:%02x > %02x:%02x:%02x:%02x:%02x:%02x %s: %.3f Gbit/s of payload (%.3f Gbit/s on the wire), "
+    "%llu %s, %llu resent (%.3f%%), %llu missing, %llu acks, %llu heartbeats\n",
+    m[6], m[7], m[8], m[9], m[10], m[11], m[0], m[1], m[2], m[3], m[4], m[5], q->mmio ? "mmio" : "data",
+    secs > 0 ? c->payload_bytes * 8 / secs * 1e-9 : 0.0, secs > 0 ? c->wire_bytes * 8 / secs * 1e-9 : 0.0,
+    (long long unsigned)sent, q->mmio ? "writes" : "packets",
+    (long long unsigned)c->resends, sent ? 100.0 * c->resends / sent : 0.0,
+    (long long unsigned)c->missing, (long long unsigned)c->pkts[TTLINK_ACK], (long long unsigned)c->pkts[TTLINK_HEARTBEAT]);
+}
+
+static void ttlink_report(ttlink_decoder_t* d, uint64_t now_ns, bool final) {
+  // Prints the counts since the previous report (skipping idle queues), or the totals if final.
+  FILE* f = d->out;
+  double secs = (now_ns - (final ? d->first_ns : d->report_ns)) * 1e-9;
+  time_t t = (time_t)(now_ns / 1000000000u);
+  struct tm tm;
+  char when[16];
+  strftime(when, sizeof(when), "%H:%M:%S", localtime_r(&t, &tm));
+  d->other_total += d->other_cur;
+  fprintf(f, "%s TT-link %s %.2f s: %u queues, %llu other frames (resent, missing, ack, and heartbeat counts are unverified, "
+    "as they assume sequence numbers at TT-link header byte %u)\n", when, final ? "totals over" : "in the last",
+    secs, (unsigned)d->num_queues, (long long unsigned)(final ? d->other_total : d->other_cur), (unsigned)d->seq_offset);
+  d->other_cur = 0;
+  for (uint32_t i = 0; i < d->num_queues; ++i) {
+    ttlink_queue_t* q = d->queues + i;
+    if (!final && q->cur.wire_bytes) ttlink_print_counts(f, q, &q->cur, secs);
+    uint64_t* total = (uint64_t*)&q->total;
+    const uint64_t* cur = (const uint64_t*)&q->cur;
+    for (uint32_t j = 0; j < sizeof(ttlink_counts_t) / sizeof(uint64_t); ++j) total[j] += cur[j];
+    memset(&q->cur, 0, sizeof(q->cur));
+    if (final) ttlink_print_counts(f, q, &q->total, secs);
+  }
+  d->report_ns = now_ns;
+  fflush(f);
+}
+
+static void ttlink_consume(ttlink_decoder_t* d, const ethdump_batch_t* batch) {
+  if (!d->first_ns) d->first_ns = d->report_ns = batch->timestamp_ns;
+  for (uint32_t i = 0; i < batch->num_frames; ++i) ttlink_decode_frame(d, batch->frames + i);
+  if (batch->timestamp_ns - d->report_ns >= d->interval_ns) ttlink_report(d, batch->timestamp_ns, false);
+}
+
+static void ttlink_finish(ttlink_decoder_t* d) {
+  if (d->first_ns) ttlink_report(d, host_nanos64(), true);
+}
+
+// Capture API:
+// The ethdump_capture_* functions own the device side of a capture along with the host
+// receive ring, and hand out batches of frames which point directly into the host ring (no
+// copies are made). A batch remains valid until it is passed to ethdump_capture_release, and
+// the device will not overwrite any part of the host ring until the batch covering it has
+// been released. Batches must be released in the order they were obtained. Errors are fatal,
+// as they are everywhere else in this file. To use this API from another program, define
+// ETHDUMP_NO_MAIN and then #include this file. The expected sequence is open_bh_pcie_device,
+// set_ethernet_x, wait_for_ethernet_training_complete, ethdump_capture_start, then either
+// ethdump_capture_run or a loop of ethdump_capture_poll and ethdump_capture_release, and
+// finally ethdump_capture_stop followed by close_bh_pcie_device.
+// Alternatively, ethdump_capture_attach obtains batches from a capture being shared by
+// another process (see ethdump_capture_share), in which case no device is involved.
+
+// A shared capture consists of the host receive ring (mapped read-only by readers) and a
+// control region (mapped read-write by everyone). The owner publishes the device's write
+// pointer in the control region, each reader publishes its read pointer in its own slot of
+// the control region, and the owner gives the device credit up to the minimum read pointer.
+// Both pointers are tagged with a generation number, which the owner increments every time
+// it resets the queues (which causes the ring pointers to restart from zero).
+
+#define SHARE_MAGIC 0x52485354 // "TSHR"
+#define SHARE_MAX_READERS 63
+
+// Values for share_slot_t::state:
+#define SHARE_SLOT_FREE    0
+#define SHARE_SLOT_ACTIVE  1
+#define SHARE_SLOT_EVICTED 2
+
+typedef struct share_slot_t {
+  uint64_t position;   // Written by the reader: (generation << 32) | read pointer.
+  uint32_t state;      // Written by the owner: one of SHARE_SLOT_*.
+  uint32_t pid;        // Written by the owner.
+  uint8_t padding[48]; // To give each slot its own cache line.
+} share_slot_t;
+
+typedef struct share_ctrl_t {
+  uint32_t magic;
+  uint32_t ring_size;
+  uint64_t published;  // Written by the owner: (generation << 32) | device write pointer.
+  uint64_t sampled_out; // Written by the owner: total frames skipped by device-side sampling.
+  uint32_t sample_mode; // One of ETHDUMP_SAMPLE_*.
+  uint32_t sample_interval;
+  uint8_t padding[32]; // To make the header 64 bytes.
+  share_slot_t slots[SHARE_MAX_READERS];
+} share_ctrl_t;
+
+typedef struct share_hello_t {
+  // Sent by the owner to a newly connected reader, along with the ring and control memfds.
+  uint32_t magic;
+  uint32_t slot;
+  uint32_t ring_size;
+  uint32_t reserved;
+} share_hello_t;
+
+typedef struct ethdump_capture_config_t {
+  uint32_t device_ring_size;   // As per --device-ring-size.
+  uint32_t host_ring_size;     // As per --host-ring-size.
+  bool generate_traffic;       // As per --generate-traffic.
+  uint32_t coalesce_bytes;     // As per --coalesce-bytes, or 0 to start every NoC transfer as soon as possible.
+  uint32_t coalesce_usecs;     // As per --coalesce-usecs.
+  uint32_t sample_mode;        // One of ETHDUMP_SAMPLE_*, as per --sample, --sample-flows, or --sample-rate.
+  uint32_t sample_interval;    // For ETHDUMP_SAMPLE_COUNT and ETHDUMP_SAMPLE_FLOW: N, to keep 1 in N frames (or flows).
+  uint32_t sample_rate;        // For ETHDUMP_SAMPLE_RATE: maximum frames per second.
+  bool shareable;              // Back the host ring with a memfd, as required by ethdump_capture_share.
+  bool numa_aware;             // Pin the calling thread and allocate the host ring near the device.
+  int poller_cpu;              // As per --cpu, or -1 to choose automatically. Only used if numa_aware.
+  pinned_arena_t* arena;       // Where to allocate the host ring and metadata from, or NULL for a private arena.
+  bool keep_tx_queues;         // Leave TX queues sending TT-link heartbeats and resends, as per --ttlink.
+} ethdump_capture_config_t;
+
+typedef struct ethdump_capture_t {
+  bh_pcie_device_t* device; // NULL for an attached capture.
+  bool generate_traffic;
+  bool finished;      // Set to stop ethdump_capture_run (e.g. an attached capture's owner has gone away).
+  ethdump_context_t ctx;
+  uint32_t read_ptr;  // Everything before this has been released.
+  uint32_t next_ptr;  // Everything before this has been handed out in a batch.
+  uint32_t write_ptr; // Everything before this has been written by the device.
+  uint32_t last_echo;
+  uint32_t tx_gen_ctr;
+  uint32_t generation; // Incremented every time the queues are reset.
+  uint64_t last_activity_at;
+  uint64_t transfer_bytes; // Totals of what the device has written to the host ring, across resets.
+  uint64_t transfer_count;
+  uint64_t deadline_count;
+  uint32_t last_transfer_count;
+  uint32_t last_deadline_count;
+  uint64_t sampled_out_count; // Total frames skipped by device-side sampling, across resets.
+  uint64_t sampled_out_batched; // How many of those have been reported via ethdump_batch_t::sampled_out.
+  uint32_t last_sampled_out_count;
+  int ring_memfd;      // Backing for ctx.h_ring if config->shareable, otherwise -1.
+  pinned_arena_t* arena; // Backing for ctx.h_meta, and ctx.h_ring if not config->shareable.
+  bool owns_arena;
+  int share_fd;        // Socket connected to the owner, for an attached capture.
+  share_ctrl_t* share; // Control region, for an attached capture.
+  share_slot_t* share_slot;
+} ethdump_capture_t;
+
+typedef void (*ethdump_batch_fn_t)(void* user, ethdump_capture_t* cap, const ethdump_batch_t* batch);
+
+static uint32_t fmt_ascii_u4(uint32_t u) {
+  char buf[4];
+  buf[3] = '0' + (u % 10); u /= 10;
+  buf[2] = '0' + (u % 10); u /= 10;
+  buf[1] = '0' + (u % 10); u /= 10;
+  buf[0] = '0' + u;
+  memcpy(&u, buf, sizeof(buf));
+  return u;
+}
+
+static void capture_reset_pointers(ethdump_capture_t* cap) {
+  cap->last_activity_at = host_nanos64();
+  cap->write_ptr = 0;
+  cap->last_transfer_count = 0;
+  cap->last_deadline_count = 0;
+  cap->last_sampled_out_count = 0;
+  cap->last_echo = INITIAL_ECHO;
+  cap->read_ptr = 0;
+  cap->next_ptr = 0;
+  cap->tx_gen_ctr = 0;
+}
+
+static ethdump_capture_t* ethdump_capture_start(bh_pcie_device_t* device, const ethdump_capture_config_t* config) {
+  ethdump_capture_t* cap = calloc(1, sizeof(ethdump_capture_t));
+  if (!cap) FATAL("Could not allocate memory for capture");
+  cap->device = device;
+  cap->generate_traffic = config->generate_traffic;
+  cap->ctx.e_ring_size = config->device_ring_size;
+  cap->ctx.coalesce_bytes = config->coalesce_bytes;
+  cap->ctx.coalesce_cycles = config->coalesce_usecs * (RV_CYCLES_PER_SECOND / 1000000u);
+  cap->ctx.sample_mode = config->sample_mode;
+  cap->ctx.sample_interval = config->sample_interval;
+  cap->ctx.sample_cycles = config->sample_mode == ETHDUMP_SAMPLE_RATE ? RV_CYCLES_PER_SECOND / config->sample_rate : 0;
+  cap->ctx.keep_tx_queues = config->keep_tx_queues;
+  cap->ctx.h_ring.size = config->host_ring_size;
+  cap->ctx.h_meta.size = sizeof(h_ring_metadata_t);
+  if (config->numa_aware) {
+    pin_thread_near_device(device, config->poller_cpu);
+    bind_memory_to_node(device->numa_node);
+  }
+  cap->arena = config->arena;
+  if (!cap->arena) {
+    cap->arena = pinned_arena_create(device);
+    cap->owns_arena = true;
+    pinned_arena_reserve(cap->arena, config->shareable ? cap->ctx.h_meta.size : cap->ctx.h_ring.size + cap->ctx.h_meta.size);
+  }
+  if (config->shareable) {
+    cap->ring_memfd = allocate_shared_host_buffer(device, &cap->ctx.h_ring);
+  } else {
+    cap->ring_memfd = -1;
+    pinned_arena_alloc(cap->arena, &cap->ctx.h_ring);
+  }
+  pinned_arena_alloc(cap->arena, &cap->ctx.h_meta);
+  if (config->numa_aware) {
+    unbind_memory();
+    warn_if_not_on_node(&cap->ctx.h_ring, device->numa_node, "Host ring");
+  }
+  cap->share_fd = -1;
+  configure_ethernet(device, &cap->ctx);
+  capture_reset_pointers(cap);
+  return cap;
+}
+
+static void capture_check_device(ethdump_capture_t* cap) {
+  // Called when the device has not written anything new to the host ring.
+  volatile h_ring_metadata_t* meta = (volatile h_ring_metadata_t*)cap->ctx.h_meta.host_ptr;
+  uint32_t new_echo = meta->mailbox_echo;
+  if ((cap->last_echo - new_echo) & 0x80000000) {
+    // Device advanced the mailbox_echo value; this is a clear
+    // indication that the device is alive and ticking.
+    cap->last_echo = new_echo;
+    cap->last_activity_at = host_nanos64();
+    return;
+  }
+  uint64_t new_time = host_nanos64();
+  if ((new_time - cap->last_activity_at) >= MILLISECONDS(10u)) {
+    // Haven't seen any activity from the device in a while; this could be
+    // because there is no traffic, or it could be because of a problem.
+    bh_pcie_device_t* device = cap->device;
+    if (meta->error != 0) {
+      if (cap->next_ptr != cap->read_ptr) return; // Can't reset until everything has been released.
+      fprintf(stderr, "WARNING: Dropped packets; resetting queues and starting again...\n");
+      configure_ethernet(device, &cap->ctx);
+      capture_reset_pointers(cap);
+      cap->generation += 1;
+      return;
+    }
+    if (cap->generate_traffic) {
+      // If we're willing to generate traffic, transmit one packet now.
+      cap->tx_gen_ctr = (cap->tx_gen_ctr == 9999) ? 0 : cap->tx_gen_ctr + 1;
+      tlb_write_u32(device, cap->ctx.tx_ascii_counter_addr, fmt_ascii_u4(cap->tx_gen_ctr));
+      tlb_write_u32(device, cap->ctx.tx_doorbell, 1);
+    }
+    if (cap->last_echo & 1) {
+      // Request that the device write to mailbox_echo, to prove liveness.
+      ++cap->last_echo; // Is now even, so we won't take this branch again.
+      cap->last_activity_at = new_time; // Bump this to give the device time to respond.
+      tlb_write_u32(device, NIU_ADDR(1) + ROUTER_CFG_2_OFFSET, cap->last_echo + 1);
+    } else {
+      FATAL("Timed out waiting for echo from device");
+    }
+  }
+}
+
+static void capture_accumulate_counters(ethdump_capture_t* cap) {
+  // The device's counters restart from zero whenever the queues are reset.
+  volatile h_ring_metadata_t* meta = (volatile h_ring_metadata_t*)cap->ctx.h_meta.host_ptr;
+  uint32_t transfer_count = meta->transfer_count;
+  uint32_t deadline_count = meta->deadline_count;
+  uint32_t sampled_out_count = meta->sampled_out_count;
+  cap->transfer_count += transfer_count - cap->last_transfer_count;
+  cap->deadline_count += deadline_count - cap->last_deadline_count;
+  cap->sampled_out_count += sampled_out_count - cap->last_sampled_out_count;
+  cap->last_transfer_count = transfer_count;
+  cap->last_deadline_count = deadline_count;
+  cap->last_sampled_out_count = sampled_out_count;
+}
+
+static uint32_t capture_take_sampled_out(ethdump_capture_t* cap) {
+  uint32_t n = (uint32_t)(cap->sampled_out_count - cap->sampled_out_batched);
+  cap->sampled_out_batched = cap->sampled_out_count;
+  return n;
+}
+
+static uint32_t attached_capture_poll(ethdump_capture_t* cap, ethdump_batch_t* batch) {
+  if (__atomic_load_n(&cap->share_slot->state, __ATOMIC_RELAXED) != SHARE_SLOT_ACTIVE) {
+    FATAL("Evicted by the sharing process (session stopped, or fell too far behind)");
+  }
+  uint64_t published = __atomic_load_n(&cap->share->published, __ATOMIC_ACQUIRE);
+  uint32_t generation = (uint32_t)(published >> 32);
+  if (generation != cap->generation) {
+    // The owner reset the queues, which it only does once every reader has released everything.
+    cap->generation = generation;
+    cap->read_ptr = cap->next_ptr = 0;
+    __atomic_store_n(&cap->share_slot->position, (uint64_t)generation << 32, __ATOMIC_RELEASE);
+  }
+  cap->write_ptr = (uint32_t)published;
+  cap->sampled_out_count = __atomic_load_n(&cap->share->sampled_out, __ATOMIC_RELAXED);
+  fill_batch(&cap->ctx.h_ring, cap->next_ptr, cap->write_ptr, batch);
+  uint64_t now = host_nanos64();
+  if (batch->num_frames) {
+    batch->timestamp_ns = now;
+    batch->sampled_out = capture_take_sampled_out(cap);
+    cap->next_ptr = batch->end_ptr;
+    return batch->num_frames;
+  }
+  if ((now - cap->last_activity_at) >= MILLISECONDS(100u)) {
+    // Check whether the owner has gone away (it never sends anything after the hello).
+    struct pollfd pfd = {.fd = cap->share_fd, .events = POLLIN};
+    if (poll(&pfd, 1, 0) != 0) cap->finished = true;
+    cap->last_activity_at = now;
+  }
+  return 0;
+}
+
+static uint32_t ethdump_capture_poll(ethdump_capture_t* cap, ethdump_batch_t* batch) {
+  // Never blocks. Returns the number of frames placed into batch, which can be zero.
+  if (cap->share) return attached_capture_poll(cap, batch);
+  volatile h_ring_metadata_t* meta = (volatile h_ring_metadata_t*)cap->ctx.h_meta.host_ptr;
+  uint64_t now = 0;
+  uint32_t new_write_ptr = meta->write_ptr;
+  if (new_write_ptr != cap->write_ptr) {
+    // Device changed the ring write pointer; this is a clear
+    // indication that the device is alive and ticking.
+    cap->transfer_bytes += new_write_ptr - cap->write_ptr;
+    cap->write_ptr = new_write_ptr;
+    cap->last_activity_at = now = host_nanos64();
+  }
+  capture_accumulate_counters(cap);
+  fill_batch(&cap->ctx.h_ring, cap->next_ptr, cap->write_ptr, batch);
+  if (batch->num_frames) {
+    batch->timestamp_ns = now ? now : host_nanos64();
+    batch->sampled_out = capture_take_sampled_out(cap);
+    cap->next_ptr = batch->end_ptr;
+    return batch->num_frames;
+  }
+  capture_check_device(cap);
+  return 0;
+}
+
+static void ethdump_capture_release_to(ethdump_capture_t* cap, uint32_t end_ptr) {
+  // Releases every batch up to and including the one ending at end_ptr.
+  if (end_ptr - cap->read_ptr > cap->next_ptr - cap->read_ptr) FATAL("Cannot release frames which have not been handed out");
+  cap->read_ptr = end_ptr;
+  if (cap->share) {
+    // Inform the owner of our progress.
+    __atomic_store_n(&cap->share_slot->position, ((uint64_t)cap->generation << 32) | cap->read_ptr, __ATOMIC_RELEASE);
+  } else {
+    tlb_write_u32(cap->device, NIU_ADDR(1) + ROUTER_CFG_4_OFFSET, cap->read_ptr); // Inform the device of our progress.
+  }
+}
+
+static void ethdump_capture_release(ethdump_capture_t* cap, const ethdump_batch_t* batch) {
+  if (!batch->num_frames) return;
+  if (batch->start_ptr != cap->read_ptr) FATAL("Batches must be released in the order they were obtained");
+  ethdump_capture_release_to(cap, batch->end_ptr);
+}
+
+static void ethdump_capture_stop(ethdump_capture_t* cap) {
+  if (cap->share) {
+    munmap(cap->ctx.h_ring.host_ptr, cap->ctx.h_ring.size);
+    munmap(cap->share, sizeof(share_ctrl_t));
+    close(cap->share_fd); // The owner will notice this and free our slot.
+  } else {
+    tlb_write_u32(cap->device, SOFT_RESET_ADDR, SOFT_RESET_E1); // Put E1 back into reset.
+    if (cap->ring_memfd >= 0) {
+      close(cap->ring_memfd);
+    } else {
+      pinned_arena_free(cap->arena, &cap->ctx.h_ring);
+    }
+    pinned_arena_free(cap->arena, &cap->ctx.h_meta);
+    if (cap->owns_arena) pinned_arena_destroy(cap->arena);
+  }
+  free(cap);
+}
+
+static volatile sig_atomic_t g_caught_sigint;
+static void catch_sigint(int sig) {
+  (void)sig;
+  g_caught_sigint = 1;
+}
+
+static void install_sigint_handler(void) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = catch_sigint;
+  sa.sa_flags = SA_RESETHAND | SA_RESTART;
+  g_caught_sigint = 0;
+  sigaction(SIGINT, &sa, NULL);
+}
+
+static void ethdump_capture_run(ethdump_capture_t* cap, ethdump_batch_fn_t fn, void* user) {
+  // Calls fn for every batch of frames (fn is responsible for releasing them), and also calls
+  // fn with an empty batch every 100 milliseconds whilst idle, so that fn can perform periodic work.
+  // This function will happily run forever, so wire up a SIGINT handler to allow it to be stopped.
+  // For an attached capture, it also returns if the owner goes away.
+  install_sigint_handler();
+
+  ethdump_batch_t batch;
+  uint64_t last_call_at = host_nanos64();
+  while (!g_caught_sigint && !cap->finished) {
+    if (ethdump_capture_poll(cap, &batch)) {
+      fn(user, cap, &batch);
+      last_call_at = batch.timestamp_ns;
+      continue;
+    }
+    uint64_t now = host_nanos64();
+    if (now - last_call_at >= MILLISECONDS(100u)) {
+      batch.timestamp_ns = now;
+      batch.start_ptr = batch.end_ptr = cap->next_ptr;
+      batch.num_frames = 0;
+      batch.sampled_out = capture_take_sampled_out(cap); // In case everything is being skipped.
+      fn(user, cap, &batch);
+      last_call_at = now;
+    }
+  }
+}
+
+// Sharing a capture between processes:
+// The sharing process acts as a long-lived capture daemon: it keeps the host ring pinned and the
+// device code running, and clients connect to its socket to attach readers or to control it. Each
+// connection starts with a share_request_t. Readers can be anonymous, or can name a session, in
+// which case the session (and its read pointer) persists when the reader disconnects, so that a
+// restarted reader resumes where it left off without losing frames (for as long as the host ring
+// and device ring can buffer them).
+
+// Values for share_request_t::op:
+#define SHARE_OP_ATTACH   1 // Attach a reader, optionally to a named session.
+#define SHARE_OP_START    2 // Create a named session, without attaching a reader to it yet.
+#define SHARE_OP_STOP     3 // Destroy a named session, evicting its reader if attached.
+#define SHARE_OP_RETARGET 4 // Switch the capture to the Ethernet tile at X = arg.
+#define SHARE_OP_STATUS   5 // Describe the capture and its sessions.
+
+#define SHARE_NAME_LEN 32
+#define SHARE_MAX_PENDING 16 // Connections which have not yet sent their request.
+
+typedef struct share_request_t {
+  uint32_t magic;
+  uint32_t op;   // One of SHARE_OP_*.
+  uint32_t arg;
+  uint32_t reserved;
+  char name[SHARE_NAME_LEN]; // Session name; empty for an anonymous reader.
+} share_request_t;
+
+typedef struct ethdump_share_stats_t {
+  uint64_t total_byte_count;   // Bytes written to the host ring by the device.
+  uint32_t total_reader_count; // Readers which attached at some point.
+  uint32_t evicted_reader_count;
+} ethdump_share_stats_t;
+
+typedef struct share_server_t {
+  ethdump_capture_t* cap;
+  share_ctrl_t* ctrl;
+  int ctrl_fd;
+  int listen_fd;
+  uint64_t evict_ns;
+  unsigned ethernet_x;
+  unsigned retarget_x;     // Non-zero if a retarget is waiting for readers to drain the ring, or for the new tile's port.
+  uint64_t retarget_started_at; // Non-zero once the new tile has been selected and its port is being waited for.
+  uint32_t num_slots_used; // Slots at or beyond this index are free.
+  int client_fds[SHARE_MAX_READERS];
+  bool persistent[SHARE_MAX_READERS]; // Slot belongs to a named session.
+  char names[SHARE_MAX_READERS][SHARE_NAME_LEN];
+  uint64_t lagging_since[SHARE_MAX_READERS];
+  int pending_fds[SHARE_MAX_PENDING];
+  uint64_t pending_since[SHARE_MAX_PENDING];
+  ethdump_share_stats_t* stats;
+} share_server_t;
+
+static void share_publish(share_server_t* srv) {
+  __atomic_store_n(&srv->ctrl->sampled_out, srv->cap->sampled_out_count, __ATOMIC_RELAXED);
+  __atomic_store_n(&srv->ctrl->published, ((uint64_t)srv->cap->generation << 32) | srv->cap->write_ptr, __ATOMIC_RELEASE);
+}
+
+static void share_free_slot(share_server_t* srv, uint32_t slot) {
+  if (srv->client_fds[slot] >= 0) close(srv->client_fds[slot]);
+  srv->client_fds[slot] = -1;
+  srv->persistent[slot] = false;
+  srv->names[slot][0] = '\0';
+  __atomic_store_n(&srv->ctrl->slots[slot].state, SHARE_SLOT_FREE, __ATOMIC_RELEASE);
+  while (srv->num_slots_used && srv->ctrl->slots[srv->num_slots_used - 1].state == SHARE_SLOT_FREE) --srv->num_slots_used;
+}
+
+static int share_find_session(share_server_t* srv, const char* name) {
+  for (uint32_t i = 0; i < srv->num_slots_used; ++i) {
+    if (srv->persistent[i] && !strcmp(srv->names[i], name)) return (int)i;
+  }
+  return -1;
+}
+
+static int share_new_slot(share_server_t* srv, const char* name) {
+  // Returns -1 if all slots are in use. New slots start from the current write pointer.
+  uint32_t slot = 0;
+  while (slot < SHARE_MAX_READERS && srv->ctrl->slots[slot].state != SHARE_SLOT_FREE) ++slot;
+  if (slot == SHARE_MAX_READERS) return -1;
+  share_slot_t* s = srv->ctrl->slots + slot;
+  s->pid = 0;
+  __atomic_store_n(&s->position, __atomic_load_n(&srv->ctrl->published, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+  __atomic_store_n(&s->state, SHARE_SLOT_ACTIVE, __ATOMIC_RELEASE);
+  srv->persistent[slot] = name[0] != '\0';
+  strcpy(srv->names[slot], name);
+  srv->lagging_since[slot] = 0;
+  if (slot >= srv->num_slots_used) srv->num_slots_used = slot + 1;
+  return (int)slot;
+}
+
+static void share_reply(int fd, const char* fmt, ...) {
+  char buf[4096];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (n < 0) return;
+  if (n >= (int)sizeof(buf)) n = sizeof(buf) - 1;
+  send(fd, buf, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static bool share_send_hello(share_server_t* srv, int fd, uint32_t slot) {
+  share_hello_t hello;
+  memset(&hello, 0, sizeof(hello));
+  hello.magic = SHARE_MAGIC;
+  hello.slot = slot;
+  hello.ring_size = (uint32_t)srv->cap->ctx.h_ring.size;
+  struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * 2)];
+  } cmsg;
+  memset(&cmsg, 0, sizeof(cmsg));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg.buf;
+  msg.msg_controllen = sizeof(cmsg.buf);
+  struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+  int fds[2] = {srv->cap->ring_memfd, srv->ctrl_fd};
+  memcpy(CMSG_DATA(c), fds, sizeof(fds));
+  return sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)sizeof(hello);
+}
+
+static uint32_t share_slot_lag(share_server_t* srv, uint32_t slot) {
+  ethdump_capture_t* cap = srv->cap;
+  uint64_t position = __atomic_load_n(&srv->ctrl->slots[slot].position, __ATOMIC_ACQUIRE);
+  uint32_t cursor = (uint32_t)(position >> 32) == cap->generation ? (uint32_t)position : 0;
+  return cap->write_ptr - cursor;
+}
+
+static void share_status(share_server_t* srv, int fd) {
+  char buf[4096];
+  size_t len = 0;
+  ethdump_capture_t* cap = srv->cap;
+  len += snprintf(buf + len, sizeof(buf) - len, "Capturing from X=%u (generation %u, %llu bytes so far, %u byte host ring)%s\n",
+    srv->ethernet_x, (unsigned)cap->generation, (long long unsigned)srv->stats->total_byte_count,
+    (unsigned)cap->ctx.h_ring.size, srv->retarget_x ? ", retarget pending" : "");
+  for (uint32_t i = 0; i < srv->num_slots_used && len < sizeof(buf); ++i) {
+    share_slot_t* s = srv->ctrl->slots + i;
+    if (s->state == SHARE_SLOT_FREE) continue;
+    len += snprintf(buf + len, sizeof(buf) - len, "Slot %u: %s%s, %s, %u bytes behind\n", (unsigned)i,
+      srv->persistent[i] ? "session " : "anonymous", srv->names[i],
+      s->state == SHARE_SLOT_EVICTED ? "evicted" : srv->client_fds[i] >= 0 ? "attached" : "detached",
+      (unsigned)share_slot_lag(srv, i));
+  }
+  share_reply(fd, "%s", buf);
+}
+
+static bool share_handle_request(share_server_t* srv, int fd, const share_request_t* req) {
+  // Returns true if fd has been taken over as a reader's connection.
+  char name[SHARE_NAME_LEN];
+  memcpy(name, req->name, sizeof(name));
+  name[SHARE_NAME_LEN - 1] = '\0';
+  int slot = name[0] ? share_find_session(srv, name) : -1;
+  switch (req->op) {
+  case SHARE_OP_ATTACH:
+    if (slot >= 0 && srv->client_fds[slot] >= 0) {
+      share_reply(fd, "ERROR: Session %s already has a reader attached", name);
+      return false;
+    }
+    if (slot < 0 && (slot = share_new_slot(srv, name)) < 0) {
+      share_reply(fd, "ERROR: All %u reader slots are in use", (unsigned)SHARE_MAX_READERS);
+      return false;
+    }
+    if (!share_send_hello(srv, fd, slot)) {
+      if (!srv->persistent[slot]) share_free_slot(srv, slot);
+      return false;
+    }
+    {
+      struct ucred cred;
+      socklen_t cred_len = sizeof(cred);
+      srv->ctrl->slots[slot].pid = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0 ? (uint32_t)cred.pid : 0;
+    }
+    srv->client_fds[slot] = fd;
+    srv->stats->total_reader_count += 1;
+    return true;
+  case SHARE_OP_START:
+    if (!name[0]) {
+      share_reply(fd, "ERROR: A session name is required");
+    } else if (slot >= 0) {
+      share_reply(fd, "Session %s already exists", name);
+    } else if (share_new_slot(srv, name) < 0) {
+      share_reply(fd, "ERROR: All %u reader slots are in use", (unsigned)SHARE_MAX_READERS);
+    } else {
+      share_reply(fd, "Started session %s", name);
+    }
+    return false;
+  case SHARE_OP_STOP:
+    if (slot < 0) {
+      share_reply(fd, "ERROR: No session named %s", name);
+    } else if (srv->client_fds[slot] >= 0) {
+      // The slot is freed once the reader notices and disconnects.
+      srv->persistent[slot] = false;
+      __atomic_store_n(&srv->ctrl->slots[slot].state, SHARE_SLOT_EVICTED, __ATOMIC_RELEASE);
+      share_reply(fd, "Stopped session %s", name);
+    } else {
+      share_free_slot(srv, slot);
+      share_reply(fd, "Stopped session %s", name);
+    }
+    return false;
+  case SHARE_OP_RETARGET:
+    if (srv->retarget_started_at) {
+      share_reply(fd, "ERROR: Already switching to X=%u", (unsigned)srv->retarget_x);
+      return false;
+    }
+    if (!ethernet_x_is_usable(srv->cap->device, req->arg)) {
+      share_reply(fd, "ERROR: X=%u is not a usable Ethernet tile", (unsigned)req->arg);
+      return false;
+    }
+    // Stop the device now, then switch once every reader has drained the host ring.
+    tlb_write_u32(srv->cap->device, SOFT_RESET_ADDR, SOFT_RESET_E1);
+    srv->retarget_x = req->arg;
+    share_reply(fd, "Retargeting to X=%u once readers have caught up", (unsigned)req->arg);
+    return false;
+  case SHARE_OP_STATUS:
+    share_status(srv, fd);
+    return false;
+  default:
+    share_reply(fd, "ERROR: Unknown request");
+    return false;
+  }
+}
+
+static void share_retarget(share_server_t* srv, uint64_t now) {
+  // Called repeatedly from the main loop once the ring has drained. Rather than waiting for the new
+  // tile's port here, returns straight away whilst it is still training, so that requests (and
+  // departing readers) keep being serviced in the meantime.
+  ethdump_capture_t* cap = srv->cap;
+  if (!srv->retarget_started_at) {
+    set_ethernet_x(cap->device, srv->retarget_x);
+    srv->retarget_started_at = now;
+  }
+  if (!ethernet_training_complete(cap->device, srv->retarget_started_at)) return;
+  srv->retarget_started_at = 0;
+  configure_ethernet(cap->device, &cap->ctx);
+  capture_reset_pointers(cap);
+  cap->generation += 1;
+  share_publish(srv);
+  srv->ethernet_x = srv->retarget_x;
+  srv->retarget_x = 0;
+}
+
+static void share_service(share_server_t* srv, uint64_t now) {
+  // Called every millisecond or so to handle new connections, notice departed readers, and evict slow readers.
+  for (;;) {
+    int fd = accept4(srv->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) fprintf(stderr, "WARNING: accept failed (errno %d)\n", errno);
+      break;
+    }
+    // The socket grants control of the capture (and sight of every frame), so only accept
+    // connections from processes running as the same user as this one.
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 || cred.uid != geteuid()) {
+      share_reply(fd, "ERROR: Only uid %u can use this capture", (unsigned)geteuid());
+      close(fd);
+      continue;
+    }
+    uint32_t i = 0;
+    while (i < SHARE_MAX_PENDING && srv->pending_fds[i] >= 0) ++i;
+    if (i == SHARE_MAX_PENDING) {
+      close(fd);
+      continue;
+    }
+    srv->pending_fds[i] = fd;
+    srv->pending_since[i] = now;
+  }
+  for (uint32_t i = 0; i < SHARE_MAX_PENDING; ++i) {
+    int fd = srv->pending_fds[i];
+    if (fd < 0) continue;
+    share_request_t req;
+    ssize_t n = recv(fd, &req, sizeof(req), MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) && now - srv->pending_since[i] < MILLISECONDS(1000u)) continue;
+    srv->pending_fds[i] = -1;
+    if (n != (ssize_t)sizeof(req) || req.magic != SHARE_MAGIC || !share_handle_request(srv, fd, &req)) close(fd);
+  }
+
+  struct pollfd pfds[SHARE_MAX_READERS];
+  uint32_t n = srv->num_slots_used;
+  for (uint32_t i = 0; i < n; ++i) {
+    pfds[i].fd = srv->client_fds[i]; // Negative fds are ignored by poll.
+    pfds[i].events = POLLIN;
+    pfds[i].revents = 0;
   }
-  if (new_loopback_mode) {
-    tlb_write_u32(device, SOFT_RESET_ADDR, SOFT_RESET_E0 | SOFT_RESET_E1); // Put both RISCVs into reset.
-    configure_rx_for_training(device);
-    tlb_write_u32(device, ETH_BOOT_PARAMS_ADDR + 8, *new_loopback_mode); // Set new loopback mode.
-    tlb_write_u32(device, ETH_BOOT_RESULTS_ADDR + 4, (port_status = 0)); // Set port status to unknown.
-    tlb_write_u32(device, SOFT_RESET_ADDR, SOFT_RESET_E1); // Take E0 out of reset, leave E1 in reset. Firmware on E0 should now start training.
-    boot_results = (volatile uint32_t*)set_tlb_addr(device, ETH_BOOT_RESULTS_ADDR); // Need to reconfigure the TLB to point it back to this.
+  if (n && poll(pfds, n, 0) > 0) {
+    for (uint32_t i = 0; i < n; ++i) {
+      if (pfds[i].revents) {
+        // Readers never send anything after their request, so this is EOF (or an error); either way,
+        // the reader is gone. Named sessions keep their slot (and hence their place in the ring).
+        close(srv->client_fds[i]);
+        srv->client_fds[i] = -1;
+        if (!srv->persistent[i]) share_free_slot(srv, i);
+      }
+    }
   }
-  if (port_status == 0) {
-    uint64_t start = host_nanos64();
-    for (;;) {
-      port_status = boot_results[1];
-      if (port_status != 0) {
-        break;
-      } else if (host_nanos64() - start > MILLISECONDS(1000u)) {
-        FATAL("Timed out waiting for Ethernet port training");
+  if (!srv->evict_ns) return;
+  ethdump_capture_t* cap = srv->cap;
+  uint32_t lag_limit = (uint32_t)(cap->ctx.h_ring.size / 4 * 3);
+  for (uint32_t i = 0; i < srv->num_slots_used; ++i) {
+    share_slot_t* s = srv->ctrl->slots + i;
+    if (s->state != SHARE_SLOT_ACTIVE) continue;
+    if (share_slot_lag(srv, i) <= lag_limit) {
+      srv->lagging_since[i] = 0;
+    } else if (!srv->lagging_since[i]) {
+      srv->lagging_since[i] = now;
+    } else if (now - srv->lagging_since[i] >= srv->evict_ns) {
+      srv->stats->evicted_reader_count += 1;
+      if (srv->client_fds[i] >= 0) {
+        // The slot stays allocated until the reader notices and disconnects.
+        fprintf(stderr, "WARNING: Evicting reader (pid %u) for falling too far behind\n", (unsigned)s->pid);
+        srv->persistent[i] = false;
+        __atomic_store_n(&s->state, SHARE_SLOT_EVICTED, __ATOMIC_RELEASE);
+      } else {
+        fprintf(stderr, "WARNING: Stopping detached session %s for falling too far behind\n", srv->names[i]);
+        share_free_slot(srv, i);
       }
     }
-    if (port_status >= 3) {
-      FATAL("Selected Ethernet tile has unknown port status %u after conclusion of training", (unsigned)port_status);
+  }
+}
+
+static void ethdump_capture_share(ethdump_capture_t* cap, const char* socket_path, unsigned ethernet_x, uint32_t evict_ms, ethdump_share_stats_t* stats) {
+  // Rather than handing out batches itself, distributes the host ring to any number of other processes
+  // which connect to socket_path (see ethdump_capture_attach), and accepts control requests on the same
+  // socket (see ethdump_share_request). The device is given credit up to the slowest reader's read
+  // pointer, including detached named sessions (or everything, if there are no readers). If evict_ms is
+  // non-zero, readers which fall more than 3/4 of the ring behind for that long are evicted.
+  // Runs until SIGINT.
+  if (cap->ring_memfd < 0) FATAL("Capture must be started with config->shareable set in order to be shared");
+  memset(stats, 0, sizeof(*stats));
+  share_server_t* srv = calloc(1, sizeof(share_server_t));
+  if (!srv) FATAL("Could not allocate memory for sharing");
+  srv->cap = cap;
+  srv->evict_ns = (uint64_t)evict_ms * 1000000;
+  srv->ethernet_x = ethernet_x;
+  srv->stats = stats;
+  for (uint32_t i = 0; i < SHARE_MAX_READERS; ++i) srv->client_fds[i] = -1;
+  for (uint32_t i = 0; i < SHARE_MAX_PENDING; ++i) srv->pending_fds[i] = -1;
+
+  srv->ctrl_fd = memfd_create("ethdump_share_ctrl", MFD_CLOEXEC);
+  if (srv->ctrl_fd < 0 || ftruncate(srv->ctrl_fd, sizeof(share_ctrl_t)) != 0) FATAL("Could not create shared control region");
+  srv->ctrl = mmap(NULL, sizeof(share_ctrl_t), PROT_READ | PROT_WRITE, MAP_SHARED, srv->ctrl_fd, 0);
+  if (srv->ctrl == MAP_FAILED) FATAL("Could not map shared control region");
+  srv->ctrl->magic = SHARE_MAGIC;
+  srv->ctrl->ring_size = (uint32_t)cap->ctx.h_ring.size;
+  srv->ctrl->sample_mode = cap->ctx.sample_mode;
+  srv->ctrl->sample_interval = cap->ctx.sample_interval;
+  share_publish(srv);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) FATAL("Socket path %s is too long", socket_path);
+  strcpy(addr.sun_path, socket_path);
+  srv->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (srv->listen_fd < 0) FATAL("Could not create socket");
+  unlink(socket_path); // Remove any stale socket from a previous run.
+  mode_t old_umask = umask(0177); // Create the socket with mode 0600.
+  int bind_err = bind(srv->listen_fd, (struct sockaddr*)&addr, sizeof(addr));
+  umask(old_umask);
+  if (bind_err != 0) FATAL("Could not bind to %s", socket_path);
+  if (listen(srv->listen_fd, 16) != 0) FATAL("Could not listen on %s", socket_path);
+
+  install_sigint_handler();
+  volatile h_ring_metadata_t* meta = (volatile h_ring_metadata_t*)cap->ctx.h_meta.host_ptr;
+  uint64_t next_service_at = 0;
+  while (!g_caught_sigint) {
+    bool progress = false;
+    capture_accumulate_counters(cap);
+    if (cap->sampled_out_count != srv->ctrl->sampled_out) share_publish(srv);
+    uint32_t new_write_ptr = meta->write_ptr;
+    if (new_write_ptr != cap->write_ptr) {
+      // Device changed the ring write pointer; this is a clear
+      // indication that the device is alive and ticking.
+      stats->total_byte_count += new_write_ptr - cap->write_ptr;
+      cap->transfer_bytes += new_write_ptr - cap->write_ptr;
+      cap->write_ptr = cap->next_ptr = new_write_ptr;
+      cap->last_activity_at = host_nanos64();
+      share_publish(srv);
+      progress = true;
+    }
+    // Credit the device with the minimum read pointer over all readers. An evicted reader may still
+    // be working through a batch it obtained before noticing its eviction, so its last position
+    // keeps being honoured until its connection closes (which it does once it notices).
+    uint32_t max_lag = 0;
+    for (uint32_t i = 0; i < srv->num_slots_used; ++i) {
+      uint32_t state = __atomic_load_n(&srv->ctrl->slots[i].state, __ATOMIC_RELAXED);
+      if (state != SHARE_SLOT_ACTIVE && !(state == SHARE_SLOT_EVICTED && srv->client_fds[i] >= 0)) continue;
+      uint32_t lag = share_slot_lag(srv, i);
+      if (lag > max_lag) max_lag = lag;
+    }
+    uint32_t new_read_ptr = cap->write_ptr - max_lag;
+    if (new_read_ptr != cap->read_ptr) {
+      cap->read_ptr = new_read_ptr;
+      tlb_write_u32(cap->device, NIU_ADDR(1) + ROUTER_CFG_4_OFFSET, new_read_ptr); // Inform the device of our progress.
+      progress = true;
+    }
+    uint64_t now = host_nanos64();
+    if (!progress) {
+      if (srv->retarget_x) {
+        // The device has been stopped; switch once the final frames have been consumed.
+        if (srv->retarget_started_at || (cap->read_ptr == cap->write_ptr && now - cap->last_activity_at >= MILLISECONDS(10u))) share_retarget(srv, now);
+      } else {
+        uint32_t generation = cap->generation;
+        capture_check_device(cap);
+        if (cap->generation != generation) share_publish(srv);
+      }
+    }
+    if (now >= next_service_at) {
+      share_service(srv, now);
+      next_service_at = now + MILLISECONDS(1u);
     }
   }
-  if (port_status != 1) {
-    FATAL("Selected Ethernet tile\'s port is down; try a different one");
+
+  // Readers will notice their connection being closed, and finish up.
+  for (uint32_t i = 0; i < SHARE_MAX_READERS; ++i) {
+    if (srv->client_fds[i] >= 0) close(srv->client_fds[i]);
+  }
+  for (uint32_t i = 0; i < SHARE_MAX_PENDING; ++i) {
+    if (srv->pending_fds[i] >= 0) close(srv->pending_fds[i]);
   }
+  close(srv->listen_fd);
+  unlink(socket_path);
+  munmap(srv->ctrl, sizeof(share_ctrl_t));
+  close(srv->ctrl_fd);
+  free(srv);
 }
 
-typedef struct h_ring_metadata_t {
-  uint32_t write_ptr;
-  uint32_t mailbox_echo;
-  uint32_t error;
-  uint32_t padding[13]; // To make the whole thing 64 bytes.
-} h_ring_metadata_t;
+static int share_connect(const char* socket_path, uint32_t op, uint32_t arg, const char* name) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) FATAL("Socket path %s is too long", socket_path);
+  strcpy(addr.sun_path, socket_path);
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) FATAL("Could not create socket");
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) FATAL("Could not connect to %s", socket_path);
+  share_request_t req;
+  memset(&req, 0, sizeof(req));
+  req.magic = SHARE_MAGIC;
+  req.op = op;
+  req.arg = arg;
+  if (name) {
+    if (strlen(name) >= SHARE_NAME_LEN) FATAL("Session name %s is too long (limit is %u characters)", name, (unsigned)SHARE_NAME_LEN - 1);
+    strcpy(req.name, name);
+  }
+  if (send(fd, &req, sizeof(req), MSG_NOSIGNAL) != (ssize_t)sizeof(req)) FATAL("Could not send request to %s", socket_path);
+  return fd;
+}
 
-typedef struct ethdump_context_t {
-  pinned_host_buffer_t h_ring;
-  pinned_host_buffer_t h_meta;
-  uint32_t tx_ascii_counter_addr;
-  uint32_t tx_doorbell;
-  uint32_t e_ring_size;
-} ethdump_context_t;
+static void ethdump_share_request(const char* socket_path, uint32_t op, uint32_t arg, const char* name) {
+  // Sends a control request (anything other than SHARE_OP_ATTACH) to a sharing process, and prints the reply.
+  int fd = share_connect(socket_path, op, arg, name);
+  char buf[4097];
+  ssize_t n;
+  do {
+    n = recv(fd, buf, sizeof(buf) - 1, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) FATAL("No reply from %s", socket_path);
+  buf[n] = '\0';
+  if (!strncmp(buf, "ERROR: ", 7)) FATAL("%s", buf + 7);
+  printf("%s%s", buf, buf[n - 1] == '\n' ? "" : "\n");
+  close(fd);
+}
 
-#define INITIAL_ECHO 1 // Must be odd, but otherwise arbitrary.
+static ethdump_capture_t* ethdump_capture_attach(const char* socket_path, const char* session) {
+  // If session is non-NULL, attaches to (or creates) that named session, resuming from wherever
+  // the previous reader of that session got to.
+  int fd = share_connect(socket_path, SHARE_OP_ATTACH, 0, session);
+  share_hello_t hello;
+  char err[4097];
+  struct iovec iov[2] = {{.iov_base = &hello, .iov_len = sizeof(hello)}, {.iov_base = err, .iov_len = sizeof(err) - sizeof(hello) - 1}};
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * 2)];
+  } cmsg;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  msg.msg_control = cmsg.buf;
+  msg.msg_controllen = sizeof(cmsg.buf);
+  ssize_t n;
+  do {
+    n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+  if (n != (ssize_t)sizeof(hello) || hello.magic != SHARE_MAGIC || !c || c->cmsg_type != SCM_RIGHTS || c->cmsg_len != CMSG_LEN(sizeof(int) * 2)) {
+    if (n > 7) {
+      // Error replies are plain text, which ended up split across hello and err.
+      char text[4097];
+      memcpy(text, &hello, n < (ssize_t)sizeof(hello) ? (size_t)n : sizeof(hello));
+      if (n > (ssize_t)sizeof(hello)) memcpy(text + sizeof(hello), err, n - sizeof(hello));
+      text[n] = '\0';
+      if (!strncmp(text, "ERROR: ", 7)) FATAL("Could not attach to %s: %s", socket_path, text + 7);
+    }
+    FATAL("Could not attach to %s", socket_path);
+  }
+  int fds[2];
+  memcpy(fds, CMSG_DATA(c), sizeof(fds));
 
-static void metadata_init(h_ring_metadata_t* meta) {
-  meta->write_ptr = 0;
-  meta->mailbox_echo = INITIAL_ECHO;
-  meta->error = 0;
+  ethdump_capture_t* cap = calloc(1, sizeof(ethdump_capture_t));
+  if (!cap) FATAL("Could not allocate memory for capture");
+  cap->ring_memfd = -1;
+  cap->share_fd = fd;
+  cap->ctx.h_ring.size = hello.ring_size;
+  cap->ctx.h_ring.host_ptr = mmap(NULL, hello.ring_size, PROT_READ, MAP_SHARED, fds[0], 0);
+  cap->share = mmap(NULL, sizeof(share_ctrl_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[1], 0);
+  if (cap->ctx.h_ring.host_ptr == MAP_FAILED || cap->share == MAP_FAILED) FATAL("Could not map shared capture from %s", socket_path);
+  close(fds[0]);
+  close(fds[1]);
+  cap->share_slot = cap->share->slots + hello.slot;
+  cap->ctx.sample_mode = cap->share->sample_mode;
+  cap->ctx.sample_interval = cap->share->sample_interval;
+  cap->sampled_out_count = cap->sampled_out_batched = __atomic_load_n(&cap->share->sampled_out, __ATOMIC_RELAXED);
+  uint64_t position = __atomic_load_n(&cap->share_slot->position, __ATOMIC_ACQUIRE);
+  cap->generation = (uint32_t)(position >> 32);
+  cap->read_ptr = cap->next_ptr = cap->write_ptr = (uint32_t)position;
+  cap->last_activity_at = host_nanos64();
+  return cap;
 }
 
-static void configure_ethernet(bh_pcie_device_t* device, ethdump_context_t* ctx) {
-  // Take E0 out of reset, put E1 into reset.
-  tlb_write_u32(device, SOFT_RESET_ADDR, SOFT_RESET_E1);
+// Capturing from several devices at once:
+// A single process can capture from several devices, merging all of their frames into one
+// time-ordered stream of batches. Each device gets its own capture (and hence its own pinned host
+// ring near that device), and is polled by exactly one poller thread; a poller can look after
+// several devices, but a device is never touched by more than one thread, as its TLB window is
+// not thread safe. Pollers hand batches to a single consumer (the thread calling
+// multi_capture_run) via a single-producer single-consumer queue per device. The consumer always
+// takes whichever queued batch has the earliest timestamp, but only once every other device has
+// either queued a later batch or published a watermark promising that it won't queue an earlier
+// one. Once the consumer is done with a batch it advances the queue's head, and the poller then
+// releases the batch back to its device.
 
-  // Choose device-side addresses.
-  uint32_t meta_addr = ctx->e_ring_size;
-  uint32_t code_addr = meta_addr + sizeof(h_ring_metadata_t);
-  uint32_t tx_buf_addr = code_addr + sizeof(rv_code) + sizeof(rv_code_arguments_t);
+#define MULTI_MAX_DEVICES 32
+#define MULTI_QUEUE_DEPTH 64 // Must be a power of two.
 
-  // Send initial metadata to the device.
-  metadata_init((h_ring_metadata_t*)ctx->h_meta.host_ptr);
-  memcpy(set_tlb_addr(device, meta_addr), ctx->h_meta.host_ptr, sizeof(h_ring_metadata_t));
+typedef struct multi_source_t {
+  // Set up before the pollers start:
+  char name[32];
+  bh_pcie_device_t* device;
+  uint8_t ethernet_x;
+  unsigned poller;
+  ethdump_batch_t* queue; // MULTI_QUEUE_DEPTH entries.
+  // Written by the poller:
+  ethdump_capture_t* cap;
+  uint32_t tail;          // Batches before this are ready to be consumed.
+  uint32_t released;      // Batches before this have been released (only used by the poller).
+  uint64_t last_push_at;  // Only used by the poller.
+  uint64_t watermark;     // No batch will be queued in future with a timestamp before this.
+  bool done;              // No more batches will be queued.
+  // Written by the consumer:
+  uint32_t head __attribute__((aligned(64))); // Batches before this have been consumed.
+} multi_source_t;
 
-  // Prepare a TX queue for traffic generation.
-  {
-    static const char pkt_contents[] = "Hello World 0000 from the " __FILE__ " dummy traffic generator, compiled at " __DATE__ " " __TIME__;
-    memcpy(set_tlb_addr(device, tx_buf_addr), pkt_contents, sizeof(pkt_contents));
-    ctx->tx_ascii_counter_addr = tx_buf_addr + 12;
+typedef struct multi_poller_t {
+  pthread_t thread;
+  int cpu; // Or -1 to leave the thread unpinned.
+  unsigned num_sources;
+  struct multi_capture_t* mc;
+} multi_poller_t;
 
-    uint32_t txhdr_id = 9;
-    uint32_t txhdr_addr = TXPKT_CFG_ADDR(txhdr_id);
-    tlb_write_u32(device, txhdr_addr + TXPKT_CFG_INSERT_CTL_OFFSET, TXPKT_CFG_INSERT_CTL_L3_HEADER + TXPKT_CFG_INSERT_CTL_L4_HEADER + TXPKT_CFG_INSERT_CTL_L4_CHECKSUM);
-    for (uint32_t i = TXPKT_CFG_MAC_SA_OFFSET; i < TXPKT_CFG_MAC_SA_OFFSET + 0x10; i += 4) {
-      // Copy MAC addresses from header entry #0.
-      tlb_write_u32(device, txhdr_addr + i, tlb_read_u32(device, TXPKT_CFG_ADDR(0) + i));
+typedef struct multi_capture_t {
+  ethdump_capture_config_t config; // Shared by every device; poller_cpu is overridden per poller.
+  const uint8_t* loopback_mode;    // As per wait_for_ethernet_training_complete.
+  unsigned num_sources;
+  unsigned num_pollers;
+  bool stop; // Set by the consumer to stop the pollers.
+  multi_source_t sources[MULTI_MAX_DEVICES];
+  multi_poller_t pollers[MULTI_MAX_DEVICES];
+} multi_capture_t;
+
+static multi_capture_t* multi_capture_create(const ethdump_capture_config_t* config, const uint8_t* loopback_mode) {
+  multi_capture_t* mc = calloc(1, sizeof(multi_capture_t));
+  if (!mc) FATAL("Could not allocate memory for multi-device capture");
+  mc->config = *config;
+  mc->config.numa_aware = true;
+  mc->config.shareable = false;
+  mc->config.arena = NULL; // Pinned memory is per device, so each capture needs its own arena.
+  mc->loopback_mode = loopback_mode;
+  return mc;
+}
+
+static void multi_capture_add(multi_capture_t* mc, const char* name, bh_pcie_device_t* device, uint8_t ethernet_x) {
+  if (mc->num_sources >= MULTI_MAX_DEVICES) FATAL("Cannot capture from more than %u devices at once", (unsigned)MULTI_MAX_DEVICES);
+  multi_source_t* s = &mc->sources[mc->num_sources++];
+  snprintf(s->name, sizeof(s->name), "%s", name);
+  s->device = device;
+  s->ethernet_x = ethernet_x;
+  s->queue = calloc(MULTI_QUEUE_DEPTH, sizeof(ethdump_batch_t));
+  if (!s->queue) FATAL("Could not allocate memory for multi-device capture");
+}
+
+static void multi_capture_plan(multi_capture_t* mc, const cpu_set_t* cpus) {
+  // Assigns devices to pollers, and pollers to CPUs. Without a CPU budget, every device gets its
+  // own poller on a distinct CPU near that device. With a budget, there is one poller per CPU in
+  // the budget (or per device, if fewer), and devices share pollers, preferring pollers on their
+  // own NUMA node.
+  cpu_set_t used;
+  CPU_ZERO(&used);
+  unsigned max_pollers = cpus && (unsigned)CPU_COUNT(cpus) < mc->num_sources ? (unsigned)CPU_COUNT(cpus) : mc->num_sources;
+  for (unsigned i = 0; i < mc->num_sources; ++i) {
+    multi_source_t* s = &mc->sources[i];
+    cpu_set_t node_cpus;
+    bool have_node_cpus = read_node_cpulist(s->device->numa_node, &node_cpus);
+    if (mc->num_pollers < max_pollers) {
+      int cpu = -1;
+      if (!cpus) {
+        cpu = choose_cpu_near_device(s->device, &used);
+        if (cpu < 0 && have_node_cpus) {
+          fprintf(stderr, "WARNING: No unused CPU near %s; its poller will not be pinned\n", s->name);
+        }
+      } else {
+        // Highest-numbered unused CPU in the budget, preferably on the device's node.
+        for (int pass = have_node_cpus ? 0 : 1; pass < 2 && cpu < 0; ++pass) {
+          for (int c = CPU_SETSIZE - 1; c >= 0; --c) {
+            if (CPU_ISSET(c, cpus) && !CPU_ISSET(c, &used) && (pass || CPU_ISSET(c, &node_cpus))) {
+              cpu = c;
+              break;
+            }
+          }
+        }
+      }
+      if (cpu >= 0) CPU_SET(cpu, &used);
+      multi_poller_t* p = &mc->pollers[mc->num_pollers];
+      p->cpu = cpu;
+      p->mc = mc;
+      s->poller = mc->num_pollers++;
+    } else {
+      // Least-loaded poller, preferably on the device's node.
+      unsigned best = 0;
+      for (unsigned j = 1; j < mc->num_pollers; ++j) {
+        multi_poller_t* p = &mc->pollers[j];
+        multi_poller_t* b = &mc->pollers[best];
+        bool p_near = have_node_cpus && p->cpu >= 0 && CPU_ISSET(p->cpu, &node_cpus);
+        bool b_near = have_node_cpus && b->cpu >= 0 && CPU_ISSET(b->cpu, &node_cpus);
+        if (p->num_sources < b->num_sources || (p->num_sources == b->num_sources && p_near && !b_near)) best = j;
+      }
+      s->poller = best;
     }
-    tlb_write_u32(device, txhdr_addr + TXPKT_CFG_USE_ETHERTYPE_OFFSET, 0x08000001); // Ethertype = 0x0800 (IPv4)
-    tlb_write_u32(device, txhdr_addr + TXPKT_CFG_L3_HEADER_OFFSET +  0, 0x45000000); // IPv4 version, IHL, DSCP, ECN (also length, but this'll be overwritten)
-    tlb_write_u32(device, txhdr_addr + TXPKT_CFG_L3_HEADER_OFFSET +  4, 0);          // IPv4 identification, flags, fragment offset
-    tlb_write_u32(device, txhdr_addr + TXPKT_CFG_L3_HEADER_OFFSET +  8, 0x0A110000); // IPv4 TTL, protocol (also header checksum, but this'll be overwritten)
-    tlb_write_u32(device, txhdr_addr + TXPKT_CFG_L3_HEADER_OFFSET + 12, 0x7F000001); // IPv4 source address
-    tlb_write_u32(device, txhdr_addr + TXPKT_CFG_L3_HEADER_OFFSET + 16, 0x7F000002); // IPv4 destination address
-    tlb_write_u32(device, txhdr_addr + TXPKT_CFG_L4_HEADER_OFFSET +  0, 0);          // UDP source port, destination port
+    mc->pollers[s->poller].num_sources += 1;
+  }
+}
 
-    uint32_t txq_idx = 2;
-    uint32_t txq_addr = TXQ_ADDR(txq_idx);
-    tlb_write_u32(device, txq_addr + ETH_TXQ_TRANSFER_START_ADDR_OFFSET, tx_buf_addr);
-    tlb_write_u32(device, txq_addr + ETH_TXQ_TRANSFER_SIZE_BYTES_OFFSET, sizeof(pkt_contents));
-    tlb_write_u32(device, txq_addr + ETH_TXQ_TXPKT_CFG_SEL_SW_OFFSET, txhdr_id);
-    ctx->tx_doorbell = txq_addr + ETH_TXQ_CMD_OFFSET;
+static void multi_poll_source(multi_source_t* s) {
+  // Releases whatever the consumer has finished with, then queues the next batch (if there's room).
+  uint32_t head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+  while (s->released != head) {
+    ethdump_capture_release(s->cap, &s->queue[s->released++ & (MULTI_QUEUE_DEPTH - 1)]);
+  }
+  if (s->tail - head == MULTI_QUEUE_DEPTH) return;
+  uint64_t now = host_nanos64();
+  ethdump_batch_t* batch = &s->queue[s->tail & (MULTI_QUEUE_DEPTH - 1)];
+  if (!ethdump_capture_poll(s->cap, batch)) {
+    if (now - s->last_push_at < MILLISECONDS(100u)) {
+      __atomic_store_n(&s->watermark, now, __ATOMIC_RELEASE);
+      return;
+    }
+    // Queue an empty batch every 100 milliseconds whilst idle, as ethdump_capture_run would.
+    batch->timestamp_ns = now;
+    batch->start_ptr = batch->end_ptr = s->cap->next_ptr;
+    batch->num_frames = 0;
+    batch->sampled_out = capture_take_sampled_out(s->cap);
   }
+  s->last_push_at = now;
+  __atomic_store_n(&s->tail, s->tail + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&s->watermark, now, __ATOMIC_RELEASE);
+}
 
-  // Configure NIU.
-  uint32_t niu_addr = NIU_ADDR(1);
-  tlb_write_u32(device, niu_addr + NOC_TARG_ADDR_MID_OFFSET, 0);
-  tlb_write_u32(device, niu_addr + NOC_TARG_ADDR_HI_OFFSET, 0);
-  tlb_write_u32(device, niu_addr + NOC_RET_ADDR_HI_OFFSET, BH_PCIE_XY);
-  tlb_write_u32(device, niu_addr + NOC_PACKET_TAG_OFFSET, 0);
-  tlb_write_u32(device, niu_addr + NOC_CTRL_OFFSET, NOC_CMD_WR | NOC_CMD_VC_STATIC);
-  tlb_write_u32(device, niu_addr + NOC_AT_LEN_BE_1_OFFSET, 0);
-  tlb_write_u32(device, niu_addr + NOC_BRCST_EXCLUDE_OFFSET, 0);
-  tlb_write_u32(device, niu_addr + NOC_L1_ACC_AT_INSTRN_OFFSET, 0);
-  tlb_write_u32(device, niu_addr + ROUTER_CFG_2_OFFSET, 0);
-  tlb_write_u32(device, niu_addr + ROUTER_CFG_4_OFFSET, 0);
-  niu_addr += 0x800;
-  tlb_write_u32(device, niu_addr + NOC_TARG_ADDR_LO_OFFSET, meta_addr);
-  tlb_write_u32(device, niu_addr + NOC_TARG_ADDR_MID_OFFSET, 0);
-  tlb_write_u32(device, niu_addr + NOC_TARG_ADDR_HI_OFFSET, 0);
-  tlb_write_u32(device, niu_addr + NOC_RET_ADDR_LO_OFFSET, (uint32_t)ctx->h_meta.noc_addr);
-  tlb_write_u32(device, niu_addr + NOC_RET_ADDR_MID_OFFSET, (uint32_t)(ctx->h_meta.noc_addr >> 32));
-  tlb_write_u32(device, niu_addr + NOC_RET_ADDR_HI_OFFSET, BH_PCIE_XY);
-  tlb_write_u32(device, niu_addr + NOC_PACKET_TAG_OFFSET, 0);
-  tlb_write_u32(device, niu_addr + NOC_CTRL_OFFSET, NOC_CMD_WR | NOC_CMD_VC_STATIC);
-  tlb_write_u32(device, niu_addr + NOC_AT_LEN_BE_OFFSET, sizeof(h_ring_metadata_t));
-  tlb_write_u32(device, niu_addr + NOC_AT_LEN_BE_1_OFFSET, 0);
-  tlb_write_u32(device, niu_addr + NOC_BRCST_EXCLUDE_OFFSET, 0);
-  tlb_write_u32(device, niu_addr + NOC_L1_ACC_AT_INSTRN_OFFSET, 0);
+static void* multi_poller_main(void* arg) {
+  multi_poller_t* p = (multi_poller_t*)arg;
+  multi_capture_t* mc = p->mc;
+  unsigned poller = (unsigned)(p - mc->pollers);
+  for (unsigned i = 0; i < mc->num_sources; ++i) {
+    multi_source_t* s = &mc->sources[i];
+    if (s->poller != poller) continue;
+    ethdump_capture_config_t config = mc->config;
+    config.poller_cpu = p->cpu;
+    set_ethernet_x(s->device, s->ethernet_x);
+    wait_for_ethernet_training_complete(s->device, mc->loopback_mode);
+    s->cap = ethdump_capture_start(s->device, &config);
+    s->last_push_at = host_nanos64();
+  }
+  while (!__atomic_load_n(&mc->stop, __ATOMIC_ACQUIRE)) {
+    for (unsigned i = 0; i < mc->num_sources; ++i) {
+      if (mc->sources[i].poller == poller) multi_poll_source(&mc->sources[i]);
+    }
+  }
+  for (unsigned i = 0; i < mc->num_sources; ++i) {
+    if (mc->sources[i].poller == poller) __atomic_store_n(&mc->sources[i].done, true, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
 
-  // Stop TX queues from sending regular TT-link packets.
-  for (uint32_t q = 0; q < 3; ++q) {
-    uint32_t txq_addr = TXQ_ADDR(q);
-    tlb_write_u32(device, txq_addr + ETH_TXQ_CTRL_OFFSET, 8u); // No regular heartbeats, ignore any received drop notifications.
-    tlb_write_u32(device, txq_addr + ETH_TXQ_REMOTE_SEQ_TIMEOUT_OFFSET, ~0u); // Maximum resend timeout.
+static void multi_capture_start(multi_capture_t* mc) {
+  for (unsigned i = 0; i < mc->num_pollers; ++i) {
+    int err = pthread_create(&mc->pollers[i].thread, NULL, multi_poller_main, &mc->pollers[i]);
+    if (err) FATAL("Could not create poller thread (error %d)", err);
   }
+}
 
-  // Drop all incoming frames while we reconfigure things.
-  tlb_write_u32(device, RXCLASS_OVERRIDE_DECISION_ADDR, RXCLASS_OVERRIDE_DECISION_DROP);
+static multi_source_t* multi_capture_next(multi_capture_t* mc) {
+  // Returns the source whose queued batch should be consumed next, or NULL if that isn't yet known.
+  multi_source_t* best = NULL;
+  uint64_t best_ts = 0;
+  uint64_t bound = UINT64_MAX;
+  for (unsigned i = 0; i < mc->num_sources; ++i) {
+    multi_source_t* s = &mc->sources[i];
+    // Load done and watermark before tail: they are stored after tail, so if the queue looks
+    // empty then anything queued since has a timestamp no earlier than the watermark seen here.
+    bool done = __atomic_load_n(&s->done, __ATOMIC_ACQUIRE);
+    uint64_t watermark = __atomic_load_n(&s->watermark, __ATOMIC_ACQUIRE);
+    if (s->head != __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE)) {
+      uint64_t ts = s->queue[s->head & (MULTI_QUEUE_DEPTH - 1)].timestamp_ns;
+      if (!best || ts < best_ts) {
+        best = s;
+        best_ts = ts;
+      }
+    } else if (!done && watermark < bound) {
+      bound = watermark;
+    }
+  }
+  return best && best_ts <= bound ? best : NULL;
+}
 
-  // Configure RX queue.
-  uint32_t rxq_idx = 2;
-  uint32_t rxq_addr = RXQ_ADDR(rxq_idx);
-  
-  tlb_write_u32(device, rxq_addr + ETH_RXQ_CTRL_OFFSET, 0); // Raw RX mode, buffer not wrapping
-  tlb_write_u32(device, rxq_addr + ETH_RXQ_BUF_START_WORD_ADDR_OFFSET, 0);
-  tlb_write_u32(device, rxq_addr + ETH_RXQ_BUF_SIZE_WORDS_OFFSET, ctx->e_ring_size >> 4);
-  tlb_write_u32(device, rxq_addr + ETH_RXQ_HDR_CTRL_OFFSET, 0); // Keep all headers
-  tlb_write_u32(device, rxq_addr + ETH_RXQ_BUF_PTR_OFFSET, 0);
+static void multi_capture_consume(multi_source_t* s, ethdump_batch_fn_t fn, void* user) {
+  fn(user, s->cap, &s->queue[s->head & (MULTI_QUEUE_DEPTH - 1)]);
+  __atomic_store_n(&s->head, s->head + 1, __ATOMIC_RELEASE);
+}
 
-  // Configure RX classification engine.
-  tlb_write_u32(device, RXCLASS_TCAM_FLUSH, 1); // Flush the TCAM, so that we don't need to care about header extraction nor most of the flow table.
-  tlb_write_u32(device, RXCLASS_USER_DEFINED_ETHERTYPE_ADDR(0), 0xFFFF0800); // Rewrite IPv4 ethertype to something else, so that unsupported IPv4 headers aren't dropped.
-  tlb_write_u32(device, RXCLASS_USER_DEFINED_ETHERTYPE_ADDR(1), 0xFFFF86DD); // Rewrite IPv6 ethertype to something else, so that unsupported IPv6 headers aren't dropped.
-  tlb_write_u32(device, RXCLASS_MAC_RX_ROUTING_ADDR, RXCLASS_MAC_RX_ROUTING_FROM_ACTIONS);
-  tlb_write_u32(device, RXCLASS_NO_MATCH_ACTIONS_ADDR, RXCLASS_NO_MATCH_ACTIONS_PREPEND_HW_METADATA + RXCLASS_NO_MATCH_ACTIONS_TO_RXQ(rxq_idx));
+static void multi_capture_run(multi_capture_t* mc, ethdump_batch_fn_t fn, void* user) {
+  // Calls fn for every batch of frames from every device, in timestamp order, until SIGINT (or
+  // until fn sets finished on the capture it was given). Unlike ethdump_capture_run, fn must not
+  // release the batch, as that happens on the poller thread. Returns with the pollers stopped and
+  // everything they had queued consumed.
+  install_sigint_handler();
+  bool finished = false;
+  while (!g_caught_sigint && !finished) {
+    multi_source_t* s = multi_capture_next(mc);
+    if (s) {
+      multi_capture_consume(s, fn, user);
+      finished = s->cap->finished;
+    } else {
+      struct timespec ts = {0, 10000};
+      nanosleep(&ts, NULL);
+    }
+  }
+  __atomic_store_n(&mc->stop, true, __ATOMIC_RELEASE);
+  for (unsigned i = 0; i < mc->num_pollers; ++i) pthread_join(mc->pollers[i].thread, NULL);
+  if (!finished) {
+    for (multi_source_t* s; (s = multi_capture_next(mc)) != NULL;) multi_capture_consume(s, fn, user);
+  }
+}
+
+static void multi_capture_stop(multi_capture_t* mc) {
+  // Only valid once multi_capture_run has returned. Also closes the devices.
+  for (unsigned i = 0; i < mc->num_sources; ++i) {
+    multi_source_t* s = &mc->sources[i];
+    ethdump_capture_stop(s->cap);
+    close_bh_pcie_device(s->device);
+    free(s->queue);
+  }
+  free(mc);
+}
+
+// Consumers of frame batches:
+
+static void write_packets_fn(void* user, ethdump_capture_t* cap, const ethdump_batch_t* batch) {
+  pcap_writer_t* writer = (pcap_writer_t*)user;
+  write_packets(writer, batch);
+  if (writer->pending) {
+    // Spliced frames can only be released once the consumer has read them.
+    uint32_t ring_ptr;
+    if (pcap_writer_reclaim(writer, &ring_ptr)) ethdump_capture_release_to(cap, ring_ptr);
+  } else {
+    ethdump_capture_release(cap, batch);
+  }
+  if (writer->closed) cap->finished = true;
+}
+
+static void aggregate_flows_fn(void* user, ethdump_capture_t* cap, const ethdump_batch_t* batch) {
+  flow_table_consume((flow_table_t*)user, batch);
+  ethdump_capture_release(cap, batch);
+}
+
+static void decode_ttlink_fn(void* user, ethdump_capture_t* cap, const ethdump_batch_t* batch) {
+  ttlink_consume((ttlink_decoder_t*)user, batch);
+  ethdump_capture_release(cap, batch);
+}
+
+static void write_merged_packets_fn(void* user, ethdump_capture_t* cap, const ethdump_batch_t* batch) {
+  // As write_packets_fn, but for multi_capture_run, which takes care of releasing.
+  pcap_writer_t* writer = (pcap_writer_t*)user;
+  write_packets(writer, batch);
+  if (writer->closed) cap->finished = true;
+}
+
+static void aggregate_merged_flows_fn(void* user, ethdump_capture_t* cap, const ethdump_batch_t* batch) {
+  (void)cap;
+  flow_table_consume((flow_table_t*)user, batch);
+}
+
+static void decode_merged_ttlink_fn(void* user, ethdump_capture_t* cap, const ethdump_batch_t* batch) {
+  (void)cap;
+  ttlink_consume((ttlink_decoder_t*)user, batch);
+}
+
+// Querying an indexed capture:
+
+typedef struct query_filter_t {
+  uint64_t start_ns;
+  uint64_t end_ns;
+  bool have_flow;
+  uint32_t flow_hash;
+  flow_key_t flow;
+} query_filter_t;
+
+static void pread_full(int fd, void* buf, size_t size, uint64_t offset, const char* what) {
+  char* dst = (char*)buf;
+  while (size) {
+    ssize_t n = pread(fd, dst, size, (off_t)offset);
+    if (n > 0) {
+      dst += n;
+      size -= n;
+      offset += n;
+    } else if (n == 0 || errno != EINTR) {
+      FATAL("Could not read from %s", what);
+    }
+  }
+}
+
+// Captures written with --compress are read a block at a time, using the seek table to find the
+// block containing any given offset into the uncompressed stream.
+
+typedef struct capture_file_t {
+  int fd;
+  uint8_t algo;          // One of COMPRESS_*.
+  compress_lib_t lib;
+  void* dctx;            // For COMPRESS_LZ4.
+  uint32_t num_frames;
+  uint64_t* comp_offsets;   // num_frames + 1 entries.
+  uint64_t* decomp_offsets; // num_frames + 1 entries.
+  uint8_t* comp_buf;
+  uint8_t* frame_buf;
+  uint32_t cached_frame;    // Frame currently in frame_buf, or UINT32_MAX.
+} capture_file_t;
+
+static capture_file_t* capture_file_open(const char* filename) {
+  capture_file_t* cf = calloc(1, sizeof(capture_file_t));
+  if (!cf) FATAL("Could not allocate memory for reading '%s'", filename);
+  cf->fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (cf->fd < 0) FATAL("Could not open path '%s' for pcap reading", filename);
+  uint32_t magic;
+  pread_full(cf->fd, &magic, sizeof(magic), 0, "capture file");
+  if (magic == ZSTD_FRAME_MAGIC) {
+    cf->algo = COMPRESS_ZSTD;
+  } else if (magic == LZ4_FRAME_MAGIC) {
+    cf->algo = COMPRESS_LZ4;
+  } else {
+    return cf;
+  }
+  compress_lib_load(&cf->lib, cf->algo);
+  if (cf->algo == COMPRESS_LZ4 && cf->lib.lz4f_is_error(cf->lib.lz4f_create_dctx(&cf->dctx, LZ4F_VERSION))) {
+    FATAL("Could not create LZ4 decompression context");
+  }
+
+  // Find the seek table via its footer at the very end of the file.
+  struct stat st;
+  if (fstat(cf->fd, &st) != 0) FATAL("Could not stat '%s'", filename);
+  uint64_t file_size = (uint64_t)st.st_size;
+  uint8_t footer[SEEK_TABLE_FOOTER_SIZE];
+  uint32_t footer_magic = 0;
+  if (file_size >= 8 + SEEK_TABLE_FOOTER_SIZE) {
+    pread_full(cf->fd, footer, sizeof(footer), file_size - sizeof(footer), "capture file");
+    memcpy(&footer_magic, footer + 5, 4);
+  }
+  if (footer_magic != SEEK_TABLE_FOOTER_MAGIC) {
+    FATAL("'%s' is compressed but has no seek table (was the capture interrupted?); decompress it with %s first",
+      filename, cf->algo == COMPRESS_ZSTD ? "zstd -d" : "lz4 -d");
+  }
+  memcpy(&cf->num_frames, footer, 4);
+  uint32_t entry_size = (footer[4] & 0x80) ? 12 : 8;
+  uint64_t table_size = 8 + (uint64_t)cf->num_frames * entry_size + SEEK_TABLE_FOOTER_SIZE;
+  if (table_size > file_size) FATAL("Seek table of '%s' is corrupt", filename);
+  uint8_t* table = malloc(table_size);
+  cf->comp_offsets = malloc((cf->num_frames + 1) * sizeof(uint64_t));
+  cf->decomp_offsets = malloc((cf->num_frames + 1) * sizeof(uint64_t));
+  if (!table || !cf->comp_offsets || !cf->decomp_offsets) FATAL("Could not allocate memory for seek table of '%s'", filename);
+  pread_full(cf->fd, table, table_size, file_size - table_size, "capture file");
+  uint32_t hdr[2];
+  memcpy(hdr, table, sizeof(hdr));
+  if (hdr[0] != SEEK_TABLE_SKIPPABLE_MAGIC || hdr[1] != table_size - 8) FATAL("Seek table of '%s' is corrupt", filename);
+  uint32_t max_comp = 0, max_decomp = 0;
+  cf->comp_offsets[0] = cf->decomp_offsets[0] = 0;
+  for (uint32_t i = 0; i < cf->num_frames; ++i) {
+    uint32_t sizes[2];
+    memcpy(sizes, table + 8 + i * entry_size, sizeof(sizes));
+    cf->comp_offsets[i + 1] = cf->comp_offsets[i] + sizes[0];
+    cf->decomp_offsets[i + 1] = cf->decomp_offsets[i] + sizes[1];
+    if (sizes[0] > max_comp) max_comp = sizes[0];
+    if (sizes[1] > max_decomp) max_decomp = sizes[1];
+  }
+  free(table);
+  if (cf->comp_offsets[cf->num_frames] > file_size - table_size) FATAL("Seek table of '%s' is corrupt", filename);
+  cf->comp_buf = malloc(max_comp ? max_comp : 1);
+  cf->frame_buf = malloc(max_decomp ? max_decomp : 1);
+  if (!cf->comp_buf || !cf->frame_buf) FATAL("Could not allocate memory for reading '%s'", filename);
+  cf->cached_frame = UINT32_MAX;
+  return cf;
+}
+
+static void capture_file_load_frame(capture_file_t* cf, uint32_t frame) {
+  size_t comp_size = (size_t)(cf->comp_offsets[frame + 1] - cf->comp_offsets[frame]);
+  size_t decomp_size = (size_t)(cf->decomp_offsets[frame + 1] - cf->decomp_offsets[frame]);
+  pread_full(cf->fd, cf->comp_buf, comp_size, cf->comp_offsets[frame], "capture file");
+  size_t got = 0;
+  if (cf->algo == COMPRESS_ZSTD) {
+    got = cf->lib.zstd_decompress(cf->frame_buf, decomp_size, cf->comp_buf, comp_size);
+    if (cf->lib.zstd_is_error(got)) got = SIZE_MAX;
+  } else {
+    size_t consumed = 0;
+    for (;;) {
+      size_t dst_size = decomp_size - got;
+      size_t src_size = comp_size - consumed;
+      size_t hint = cf->lib.lz4f_decompress(cf->dctx, cf->frame_buf + got, &dst_size, cf->comp_buf + consumed, &src_size, NULL);
+      if (cf->lib.lz4f_is_error(hint)) {
+        got = SIZE_MAX;
+        break;
+      }
+      got += dst_size;
+      consumed += src_size;
+      if (hint == 0 || (dst_size == 0 && src_size == 0)) break;
+    }
+  }
+  if (got != decomp_size) FATAL("Could not decompress block %u of capture file", (unsigned)frame);
+  cf->cached_frame = frame;
+}
+
+static void capture_file_read(capture_file_t* cf, void* buf, size_t size, uint64_t offset) {
+  // Reads from the uncompressed stream, whether or not the file is compressed.
+  if (cf->algo == COMPRESS_NONE) {
+    pread_full(cf->fd, buf, size, offset, "capture file");
+    return;
+  }
+  uint8_t* dst = (uint8_t*)buf;
+  while (size) {
+    if (offset >= cf->decomp_offsets[cf->num_frames]) FATAL("Could not read from capture file");
+    uint32_t frame = cf->cached_frame;
+    if (frame == UINT32_MAX || offset < cf->decomp_offsets[frame] || offset >= cf->decomp_offsets[frame + 1]) {
+      uint32_t lo = 0, hi = cf->num_frames - 1;
+      while (lo < hi) {
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+        if (cf->decomp_offsets[mid] <= offset) lo = mid; else hi = mid - 1;
+      }
+      capture_file_load_frame(cf, (frame = lo));
+    }
+    size_t within = (size_t)(offset - cf->decomp_offsets[frame]);
+    size_t n = (size_t)(cf->decomp_offsets[frame + 1] - offset);
+    if (n > size) n = size;
+    memcpy(dst, cf->frame_buf + within, n);
+    dst += n;
+    size -= n;
+    offset += n;
+  }
+}
+
+static void capture_file_close(capture_file_t* cf) {
+  close(cf->fd);
+  if (cf->dctx) cf->lib.lz4f_free_dctx(cf->dctx);
+  if (cf->lib.handle) dlclose(cf->lib.handle);
+  free(cf->comp_offsets);
+  free(cf->decomp_offsets);
+  free(cf->comp_buf);
+  free(cf->frame_buf);
+  free(cf);
+}
+
+static bool parse_flow_endpoint(const char* str, size_t len, flow_key_t* key, unsigned which) {
+  char buf[64];
+  const char* port = NULL;
+  if (len >= sizeof(buf)) return false;
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+  char* addr = buf;
+  if (*addr == '[') {
+    char* close_bracket = strchr(addr, ']');
+    if (!close_bracket || close_bracket[1] != ':') return false;
+    *close_bracket = '\0';
+    port = close_bracket + 2;
+    ++addr;
+  } else {
+    char* colon = strrchr(addr, ':');
+    if (!colon) return false;
+    *colon = '\0';
+    port = colon + 1;
+  }
+  uintptr_t port_num = parse_small_int(port);
+  if (port_num > 0xffff) return false;
+  key->ports[which] = (uint16_t)port_num;
+  if (inet_pton(AF_INET, addr, key->addrs[which]) == 1) {
+    key->addr_len = 4;
+    key->ethertype = 0x0800;
+  } else if (inet_pton(AF_INET6, addr, key->addrs[which]) == 1) {
+    key->addr_len = 16;
+    key->ethertype = 0x86DD;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void parse_flow_spec(const char* spec, flow_key_t* key) {
+  // Syntax is PROTO,SRC:PORT,DST:PORT where PROTO is tcp or udp or sctp or a protocol number,
+  // and IPv6 addresses are written in brackets.
+  memset(key, 0, sizeof(*key));
+  const char* c1 = strchr(spec, ',');
+  const char* c2 = c1 ? strchr(c1 + 1, ',') : NULL;
+  if (!c2) goto bad_spec;
+  size_t proto_len = c1 - spec;
+  if (proto_len == 3 && !memcmp(spec, "tcp", 3)) key->proto = 6;
+  else if (proto_len == 3 && !memcmp(spec, "udp", 3)) key->proto = 17;
+  else if (proto_len == 4 && !memcmp(spec, "sctp", 4)) key->proto = 132;
+  else {
+    char proto_buf[4];
+    if (proto_len >= sizeof(proto_buf)) goto bad_spec;
+    memcpy(proto_buf, spec, proto_len);
+    proto_buf[proto_len] = '\0';
+    uintptr_t proto = parse_small_int(proto_buf);
+    if (proto > 255) goto bad_spec;
+    key->proto = (uint8_t)proto;
+  }
+  uint8_t addr_len;
+  if (!parse_flow_endpoint(c1 + 1, c2 - (c1 + 1), key, 0)) goto bad_spec;
+  addr_len = key->addr_len;
+  if (!parse_flow_endpoint(c2 + 1, strlen(c2 + 1), key, 1) || key->addr_len != addr_len) goto bad_spec;
+  return;
+bad_spec:
+  FATAL("Could not parse flow '%s'; expected something like tcp,10.0.0.1:1234,10.0.0.2:80", spec);
+}
+
+static void query_block(pcap_writer_t* writer, capture_file_t* capture, const index_block_rec_t* blk, uint8_t* buf, const query_filter_t* filter) {
+  if (blk->last_ns < filter->start_ns || blk->first_ns > filter->end_ns) return;
+  size_t size = blk->end_offset - blk->start_offset;
+  capture_file_read(capture, buf, size, blk->start_offset);
+  for (size_t pos = 0; pos + sizeof(uint32_t) * 4 <= size;) {
+    uint32_t rec_hdr[4];
+    memcpy(rec_hdr, buf + pos, sizeof(rec_hdr));
+    uint8_t* rec = buf + pos;
+    size_t rec_size = sizeof(rec_hdr) + rec_hdr[2];
+    pos += rec_size;
+    if (pos > size) FATAL("Capture file does not match its index");
+    uint64_t ts_ns = rec_hdr[0] * 1000000000ull + rec_hdr[1];
+    if (ts_ns < filter->start_ns || ts_ns > filter->end_ns) continue;
+    if (filter->have_flow) {
+      if (rec_hdr[2] < 14) continue;
+      flow_key_t key;
+      parse_flow_key(rec + sizeof(rec_hdr), rec_hdr[2] < FLOW_HDR_BYTES ? rec_hdr[2] : FLOW_HDR_BYTES, &key);
+      flow_key_make_symmetric(&key);
+      key.vlan = 0;
+      if (memcmp(&key, &filter->flow, sizeof(key))) continue;
+    }
+    struct iovec* iov = writer->iovs + writer->iovcnt++;
+    iov->iov_base = rec;
+    iov->iov_len = rec_size;
+    writer->total_pkt_count += 1;
+    if (writer->iovcnt == PCAP_WRITER_NUM_IOVS) flush_packets(writer);
+  }
+  if (writer->iovcnt) flush_packets(writer);
+}
+
+static void run_query(const char* capture_filename, const char* output_filename, const query_filter_t* filter, const compress_config_t* compress) {
+  capture_file_t* capture = capture_file_open(capture_filename);
+  uint32_t pcap_hdr[6];
+  capture_file_read(capture, pcap_hdr, sizeof(pcap_hdr), 0);
+  if (pcap_hdr[0] != 0xA1B23C4D) FATAL("'%s' is not a pcap file written by ethdump", capture_filename);
+
+  char* index_filename = malloc(strlen(capture_filename) + 5);
+  if (!index_filename) FATAL("Could not allocate memory for index filename");
+  sprintf(index_filename, "%s.idx", capture_filename);
+  int index_fd = open(index_filename, O_RDONLY | O_CLOEXEC);
+  if (index_fd < 0) FATAL("Could not open index '%s'; was the capture made with --index?", index_filename);
+  free(index_filename);
+  index_file_hdr_t index_hdr;
+  pread_full(index_fd, &index_hdr, sizeof(index_hdr), 0, "index file");
+  if (index_hdr.magic != INDEX_MAGIC || index_hdr.version != INDEX_VERSION) FATAL("Index for '%s' is not in a supported format", capture_filename);
+  struct stat st;
+  if (fstat(index_fd, &st) != 0) FATAL("Could not stat index for '%s'", capture_filename);
+  uint64_t index_size = (uint64_t)st.st_size;
+  index_trailer_t trailer;
+  memset(&trailer, 0, sizeof(trailer));
+  if (index_size >= sizeof(index_hdr) + sizeof(trailer)) {
+    pread_full(index_fd, &trailer, sizeof(trailer), index_size - sizeof(trailer), "index file");
+  }
+
+  pcap_writer_t writer;
+  pcap_writer_init(&writer, output_filename, 0, compress);
+  uint8_t* buf = malloc(INDEX_BLOCK_BYTES + (1u << 16));
+  if (!buf) FATAL("Could not allocate memory for query buffer");
+  index_block_rec_t blk;
+  if (trailer.magic == INDEX_MAGIC && filter->have_flow) {
+    // Posting list lookup: binary search for the flow, then visit just the blocks containing it.
+    uint32_t lo = 0, hi = trailer.num_flows;
+    index_flow_ent_t ent[2];
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      pread_full(index_fd, ent, sizeof(ent[0]), trailer.flows_offset + mid * sizeof(ent[0]), "index file");
+      if (ent[0].hash < filter->flow_hash) lo = mid + 1; else hi = mid;
+    }
+    if (lo < trailer.num_flows) {
+      pread_full(index_fd, ent, sizeof(ent), trailer.flows_offset + lo * sizeof(ent[0]), "index file");
+      if (ent[0].hash == filter->flow_hash) {
+        for (uint32_t i = ent[0].postings_start; i < ent[1].postings_start; ++i) {
+          uint32_t block_num;
+          pread_full(index_fd, &block_num, sizeof(block_num), trailer.postings_offset + i * sizeof(uint32_t), "index file");
+          pread_full(index_fd, &blk, sizeof(blk), trailer.dir_offset + block_num * sizeof(blk), "index file");
+          query_block(&writer, capture, &blk, buf, filter);
+        }
+      }
+    }
+  } else if (trailer.magic == INDEX_MAGIC) {
+    // Time window lookup: binary search for the first block which might overlap, then scan forwards.
+    uint32_t lo = 0, hi = trailer.num_blocks;
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      pread_full(index_fd, &blk, sizeof(blk), trailer.dir_offset + mid * sizeof(blk), "index file");
+      if (blk.last_ns < filter->start_ns) lo = mid + 1; else hi = mid;
+    }
+    for (uint32_t i = lo; i < trailer.num_blocks; ++i) {
+      pread_full(index_fd, &blk, sizeof(blk), trailer.dir_offset + i * sizeof(blk), "index file");
+      if (blk.first_ns > filter->end_ns) break;
+      query_block(&writer, capture, &blk, buf, filter);
+    }
+  } else {
+    // No trailer, so the capture did not finish cleanly; walk the block records instead.
+    fprintf(stderr, "WARNING: Index for '%s' is incomplete; falling back to scanning block records\n", capture_filename);
+    uint32_t* hashes = NULL;
+    size_t hashes_cap = 0;
+    for (uint64_t pos = sizeof(index_hdr); pos + sizeof(blk) <= index_size;) {
+      pread_full(index_fd, &blk, sizeof(blk), pos, "index file");
+      if (blk.magic != INDEX_BLOCK_MAGIC) break;
+      pos += sizeof(blk) + blk.num_flows * sizeof(uint32_t);
+      if (pos > index_size) break;
+      if (filter->have_flow) {
+        hashes = grow_array(hashes, &hashes_cap, blk.num_flows, sizeof(uint32_t));
+        pread_full(index_fd, hashes, blk.num_flows * sizeof(uint32_t), pos - blk.num_flows * sizeof(uint32_t), "index file");
+        if (!bsearch(&filter->flow_hash, hashes, blk.num_flows, sizeof(uint32_t), cmp_u32)) continue;
+      }
+      query_block(&writer, capture, &blk, buf, filter);
+    }
+    free(hashes);
+  }
+  free(buf);
+  close(index_fd);
+  capture_file_close(capture);
+  pcap_writer_finish(&writer);
+  FILE* summary = writer.fd == STDOUT_FILENO ? stderr : stdout;
+  fprintf(summary, "Extracted %llu packets, wrote %llu bytes to %s\n",
+    (long long unsigned)writer.total_pkt_count,
+    (long long unsigned)writer.total_byte_count, output_filename);
+  if (writer.compress.algo != COMPRESS_NONE) print_compress_stats(summary, &writer.compress, &writer.compress_stats);
+}
 
-  // Deploy RV32 code to the device.
-  uint32_t rv_payload[(sizeof(rv_code) + sizeof(rv_code_arguments_t))/sizeof(uint32_t)];
-  memcpy((char*)rv_payload, rv_code, sizeof(rv_code));
-#define fixup_shift(lbl, val) rv_payload[lbl/sizeof(uint32_t)] = rv_code[lbl/sizeof(uint32_t)] | ((val) << 20)
-  fixup_shift(label_shift_fixup_0, 32 - __builtin_ctzl(ctx->e_ring_size));
-  fixup_shift(label_shift_fixup_1, 32 - __builtin_ctzl(ctx->e_ring_size));
-  fixup_shift(label_shift_fixup_2, __builtin_ctzl(ctx->e_ring_size) - 3);
-#undef fixup_shift
-  rv_code_arguments_t* rv_args = (rv_code_arguments_t*)((char*)rv_payload + sizeof(rv_code));
-  rv_args->h_ring_noc_addr = ctx->h_ring.noc_addr;
-  rv_args->h_ring_size = ctx->h_ring.size;
-  rv_args->h_meta_addr = meta_addr;
-  rv_args->e_ring_mask = ctx->e_ring_size - 1;
-  rv_args->initial_drop_count = tlb_read_u32(device, rxq_addr + ETH_RXQ_PACKET_DROP_CNT_OFFSET);
-  rv_args->rxq_addr = rxq_addr;
-  rv_args->niu_addr = niu_addr;
-  memcpy(set_tlb_addr(device, code_addr), rv_payload, sizeof(rv_payload));
+// Scanning every device:
+// --scan reads the Ethernet tile information of every device in /dev/tenstorrent and prints it
+// as JSON. Each device is scanned by its own child process, so that all devices are scanned
+// concurrently, and so that a device which can't be opened (or isn't a Blackhole) becomes an
+// "error" entry rather than ending the scan. The output is cached, tagged with the identity of
+// the device nodes (which are recreated when the driver is reloaded or a device is reset), and
+// a repeated scan within --scan-max-age seconds is answered from the cache without touching
+// any device.
 
-  // Point E1 at the code we just deployed.
-  tlb_write_u32(device, E1_RESET_PC_ADDR, code_addr);
-  tlb_write_u32(device, E1_END_PC_ADDR, code_addr + sizeof(rv_code));
+#define SCAN_MAX_DEVICES 64
+#define SCAN_CACHE_MAGIC "ethdump-scan-v1"
 
-  {
-    // Have tt-kmd put E1 back into reset if we abort. This requires a fairly
-    // recent tt-kmd; older versions of tt-kmd will fail this with EINVAL.
-    struct tenstorrent_set_noc_cleanup req;
-    memset(&req, 0, sizeof(req));
-    req.argsz = sizeof(req);
-    req.enabled = true;
-    req.x = (device->tlb_cfg[1] >> 11) & 0x3f;
-    req.y = (device->tlb_cfg[1] >> 17) & 0x3f;
-    req.addr = SOFT_RESET_ADDR;
-    req.data = SOFT_RESET_E1;
-    (void)ioctl(device->fd, TENSTORRENT_IOCTL_SET_NOC_CLEANUP, &req);
-  }
-  // Take E1 out of reset.
-  tlb_write_u32(device, SOFT_RESET_ADDR, 0);
+typedef struct scan_child_t {
+  char path[32];
+  pid_t pid;
+  int fd;
+  char* out;
+  size_t out_size;
+  size_t out_cap;
+} scan_child_t;
 
-  // Start accepting incoming frames again.
-  tlb_write_u32(device, RXCLASS_OVERRIDE_DECISION_ADDR, RXCLASS_OVERRIDE_DECISION_ACCEPT);
+static unsigned list_tenstorrent_devices(uint32_t nums[SCAN_MAX_DEVICES]) {
+  unsigned n = 0;
+  DIR* dir = opendir("/dev/tenstorrent");
+  if (!dir) return 0;
+  struct dirent* ent;
+  while ((ent = readdir(dir)) != NULL && n < SCAN_MAX_DEVICES) {
+    uintptr_t num = parse_small_int(ent->d_name);
+    if (num != INVALID_PARSE && ent->d_name[0] != ' ' && ent->d_name[0] != '+') nums[n++] = (uint32_t)num;
+  }
+  closedir(dir);
+  qsort(nums, n, sizeof(*nums), cmp_u32);
+  return n;
 }
 
-// Main host-side spin loop:
+static void scan_fingerprint(const uint32_t* nums, unsigned n, char* buf, size_t size) {
+  size_t used = 0;
+  buf[0] = '\0';
+  for (unsigned i = 0; i < n && used < size; ++i) {
+    char path[32];
+    struct stat st;
+    sprintf(path, "/dev/tenstorrent/%u", (unsigned)nums[i]);
+    if (stat(path, &st) != 0) memset(&st, 0, sizeof(st));
+    used += snprintf(buf + used, size - used, "%u:%llx:%lld.%09ld;", (unsigned)nums[i], (long long unsigned)st.st_rdev,
+      (long long)st.st_ctim.tv_sec, (long)st.st_ctim.tv_nsec);
+  }
+}
 
-static uint32_t fmt_ascii_u4(uint32_t u) {
-  char buf[4];
-  buf[3] = '0' + (u % 10); u /= 10;
-  buf[2] = '0' + (u % 10); u /= 10;
-  buf[1] = '0' + (u % 10); u /= 10;
-  buf[0] = '0' + u;
-  memcpy(&u, buf, sizeof(buf));
-  return u;
+static void write_json_string(FILE* f, const char* str, size_t len) {
+  fputc('"', f);
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char c = (unsigned char)str[i];
+    if (c == '"' || c == '\\') {
+      fprintf(f, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(f, "\\u%04x", c);
+    } else {
+      fputc(c, f);
+    }
+  }
+  fputc('"', f);
 }
 
-static volatile sig_atomic_t g_caught_sigint;
-static void catch_sigint(int sig) {
-  (void)sig;
-  g_caught_sigint = 1;
+static void scan_device_child(const char* path) {
+  // Runs in a child process, with stdout and stderr both going to the parent. Errors are
+  // FATAL as usual, and the parent reports whatever was printed.
+  bh_pcie_device_t* device = open_bh_pcie_device(path);
+  hwinfo_t info;
+  read_hwinfo(device, &info);
+  printf("{\"device\": \"%s\", \"pci_address\": \"%s\", \"numa_node\": %d, \"tiles\": ", path, device->pci_address, device->numa_node);
+  print_hwinfo_json(stdout, &info);
+  printf("}");
+  close_bh_pcie_device(device);
+  exit(0);
 }
 
-static void host_spin(bh_pcie_device_t* device, pcap_writer_t* writer, ethdump_context_t* ctx, bool generate_traffic) {
-  // This function will happily run forever, so wire up a SIGINT handler to allow it to be stopped.
-  {
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = catch_sigint;
-    sa.sa_flags = SA_RESETHAND | SA_RESTART;
-    g_caught_sigint = 0;
-    sigaction(SIGINT, &sa, NULL);
-  }
-
-  volatile h_ring_metadata_t* meta = (volatile h_ring_metadata_t*)ctx->h_meta.host_ptr;
-reentry:;
-  uint64_t last_activity_at = host_nanos64();
-  uint32_t write_ptr = 0;
-  uint32_t last_echo = INITIAL_ECHO;
-  uint32_t read_ptr = 0;
-  uint32_t tx_gen_ctr = 0;
-  while (!g_caught_sigint) {
-    uint32_t new_write_ptr = meta->write_ptr;
-    if (new_write_ptr != write_ptr) {
-      // Device changed the ring write pointer; this is a clear
-      // indication that the device is alive and ticking.
-      write_ptr = new_write_ptr;
-      last_activity_at = host_nanos64();
+static void scan_all_devices(FILE* f) {
+  uint32_t nums[SCAN_MAX_DEVICES];
+  unsigned n = list_tenstorrent_devices(nums);
+  scan_child_t* children = calloc(n ? n : 1, sizeof(scan_child_t));
+  struct pollfd* pfds = calloc(n ? n : 1, sizeof(struct pollfd));
+  if (!children || !pfds) FATAL("Could not allocate memory for scanning %u devices", n);
+  fflush(stdout);
+  fflush(stderr);
+  for (unsigned i = 0; i < n; ++i) {
+    scan_child_t* c = &children[i];
+    int fds[2];
+    sprintf(c->path, "/dev/tenstorrent/%u", (unsigned)nums[i]);
+    if (pipe2(fds, O_CLOEXEC) != 0) FATAL("Could not create pipe (errno %d)", errno);
+    c->pid = fork();
+    if (c->pid < 0) FATAL("Could not fork to scan %s (errno %d)", c->path, errno);
+    if (c->pid == 0) {
+      dup2(fds[1], STDOUT_FILENO);
+      dup2(fds[1], STDERR_FILENO);
+      scan_device_child(c->path);
     }
-    read_ptr = append_packets(writer, &ctx->h_ring, read_ptr, write_ptr);
-    if (writer->iovcnt) {
-      flush_packets(writer);
-      tlb_write_u32(device, NIU_ADDR(1) + ROUTER_CFG_4_OFFSET, read_ptr); // Inform the device of our progress.
-      continue;
+    close(fds[1]);
+    c->fd = fds[0];
+  }
+
+  // Collect everything each child prints, until they've all closed their end of the pipe.
+  for (unsigned remaining = n; remaining;) {
+    unsigned num_pfds = 0;
+    for (unsigned i = 0; i < n; ++i) {
+      if (children[i].fd < 0) continue;
+      pfds[num_pfds].fd = children[i].fd;
+      pfds[num_pfds].events = POLLIN;
+      pfds[num_pfds].revents = 0;
+      ++num_pfds;
     }
-    uint32_t new_echo = meta->mailbox_echo;
-    if ((last_echo - new_echo) & 0x80000000) {
-      // Device advanced the mailbox_echo value; this is a clear
-      // indication that the device is alive and ticking.
-      last_echo = new_echo;
-      last_activity_at = host_nanos64();
-      continue;
+    if (poll(pfds, num_pfds, -1) < 0) {
+      if (errno == EINTR) continue;
+      FATAL("poll failed (errno %d)", errno);
     }
-    uint64_t new_time = host_nanos64();
-    if ((new_time - last_activity_at) >= MILLISECONDS(10u)) {
-      // Haven't seen any activity from the device in a while; this could be
-      // because there is no traffic, or it could be because of a problem.
-      if (meta->error != 0) {
-        fprintf(stderr, "WARNING: Dropped packets; resetting queues and starting again...\n");
-        configure_ethernet(device, ctx);
-        goto reentry;
+    for (unsigned i = 0, j = 0; i < n; ++i) {
+      scan_child_t* c = &children[i];
+      if (c->fd < 0) continue;
+      if (pfds[j++].revents == 0) continue;
+      c->out = grow_array(c->out, &c->out_cap, c->out_size + 4096, 1);
+      ssize_t got = read(c->fd, c->out + c->out_size, c->out_cap - c->out_size);
+      if (got > 0) {
+        c->out_size += (size_t)got;
+      } else if (got == 0 || (errno != EINTR && errno != EAGAIN)) {
+        close(c->fd);
+        c->fd = -1;
+        --remaining;
       }
-      if (generate_traffic) {
-        // If we're willing to generate traffic, transmit one packet now.
-        tx_gen_ctr = (tx_gen_ctr == 9999) ? 0 : tx_gen_ctr + 1;
-        tlb_write_u32(device, ctx->tx_ascii_counter_addr, fmt_ascii_u4(tx_gen_ctr));
-        tlb_write_u32(device, ctx->tx_doorbell, 1);
-      }
-      if (last_echo & 1) {
-        // Request that the device write to mailbox_echo, to prove liveness.
-        ++last_echo; // Is now even, so we won't take this branch again.
-        last_activity_at = new_time; // Bump this to give the device time to respond.
-        tlb_write_u32(device, NIU_ADDR(1) + ROUTER_CFG_2_OFFSET, last_echo + 1);
+    }
+  }
+
+  fprintf(f, "{\"scanned_at\": %lld, \"devices\": [", (long long)time(NULL));
+  for (unsigned i = 0; i < n; ++i) {
+    scan_child_t* c = &children[i];
+    int status = 0;
+    while (waitpid(c->pid, &status, 0) < 0 && errno == EINTR) {}
+    fprintf(f, "%s\n  ", i ? "," : "");
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+      fwrite(c->out, 1, c->out_size, f);
+    } else {
+      size_t len = c->out_size;
+      while (len && (c->out[len - 1] == '\n' || c->out[len - 1] == '\r')) --len;
+      fprintf(f, "{\"device\": \"%s\", \"error\": ", c->path);
+      if (len) {
+        write_json_string(f, c->out, len);
       } else {
-        FATAL("Timed out waiting for echo from device");
+        fprintf(f, "\"Scan exited with status 0x%x\"", (unsigned)status);
       }
+      fprintf(f, "}");
+    }
+    free(c->out);
+  }
+  fprintf(f, "%s]}\n", n ? "\n" : "");
+  free(pfds);
+  free(children);
+}
+
+static bool print_cached_scan(const char* cache_path, const char* fingerprint, uint32_t max_age) {
+  int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  struct stat st;
+  time_t now = time(NULL);
+  bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == getuid()
+    && st.st_mtime <= now && now - st.st_mtime < (time_t)max_age;
+  char* contents = NULL;
+  size_t size = ok ? (size_t)st.st_size : 0;
+  if (ok && (contents = malloc(size + 1)) != NULL) {
+    ok = read(fd, contents, size) == (ssize_t)size;
+  } else {
+    ok = false;
+  }
+  close(fd);
+  if (ok) {
+    contents[size] = '\0';
+    char* json = strchr(contents, '\n');
+    size_t magic_len = strlen(SCAN_CACHE_MAGIC);
+    ok = json && !strncmp(contents, SCAN_CACHE_MAGIC, magic_len) && contents[magic_len] == ' '
+      && (size_t)(json - (contents + magic_len + 1)) == strlen(fingerprint)
+      && !memcmp(contents + magic_len + 1, fingerprint, strlen(fingerprint));
+    if (ok) fwrite(json + 1, 1, size - (size_t)(json + 1 - contents), stdout);
+  }
+  free(contents);
+  return ok;
+}
+
+static void write_scan_cache(const char* cache_path, const char* fingerprint, const char* json, size_t json_size) {
+  // Written to a temporary file and then renamed into place, so concurrent scans never see half a cache.
+  size_t path_len = strlen(cache_path);
+  char* tmp_path = malloc(path_len + 8);
+  if (!tmp_path) return;
+  memcpy(tmp_path, cache_path, path_len);
+  memcpy(tmp_path + path_len, ".XXXXXX", 8);
+  int fd = mkstemp(tmp_path);
+  if (fd >= 0) {
+    FILE* f = fdopen(fd, "w");
+    bool ok = f != NULL;
+    if (ok) {
+      fprintf(f, SCAN_CACHE_MAGIC " %s\n", fingerprint);
+      fwrite(json, 1, json_size, f);
+      ok = fclose(f) == 0;
+    } else {
+      close(fd);
+    }
+    if (ok && rename(tmp_path, cache_path) == 0) {
+      free(tmp_path);
+      return;
+    }
+    unlink(tmp_path);
+  }
+  fprintf(stderr, "WARNING: Could not write scan cache '%s' (errno %d)\n", cache_path, errno);
+  free(tmp_path);
+}
+
+static void run_scan(const char* cache_path, uint32_t max_age) {
+  char default_cache_path[256];
+  if (!cache_path) {
+    const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir && *runtime_dir && strlen(runtime_dir) < sizeof(default_cache_path) - 24) {
+      sprintf(default_cache_path, "%s/ethdump-scan.json", runtime_dir);
+    } else {
+      sprintf(default_cache_path, "/tmp/ethdump-scan-%u.json", (unsigned)getuid());
     }
+    cache_path = default_cache_path;
   }
+  uint32_t nums[SCAN_MAX_DEVICES];
+  char fingerprint[SCAN_MAX_DEVICES * 64];
+  scan_fingerprint(nums, list_tenstorrent_devices(nums), fingerprint, sizeof(fingerprint));
+  if (max_age && print_cached_scan(cache_path, fingerprint, max_age)) return;
+
+  char* json = NULL;
+  size_t json_size = 0;
+  FILE* f = open_memstream(&json, &json_size);
+  if (!f) FATAL("Could not allocate memory for scan output");
+  scan_all_devices(f);
+  fclose(f);
+  fwrite(json, 1, json_size, stdout);
+  fflush(stdout);
+  write_scan_cache(cache_path, fingerprint, json, json_size);
+  free(json);
 }
 
 // Command line parsing:
@@ -1171,6 +6141,40 @@ typedef struct ethdump_args_t {
   bool apply_loopback_mode;
   uint8_t to_print;
   bool generate_traffic;
+  bool write_index;
+  bool splice;
+  const char* query;
+  const char* flow;
+  uint64_t start_ns;
+  uint64_t end_ns;
+  const char* flows;
+  uint32_t flow_table_size;
+  uint32_t flow_threads;
+  uint32_t flow_idle_timeout;
+  uint32_t flow_active_timeout;
+  bool benchmark_flows;
+  bool selftest;
+  const char* share;
+  const char* attach;
+  uint32_t evict_slow_readers;
+  const char* session;
+  uint32_t share_op;
+  uint32_t share_arg;
+  int cpu;
+  uint32_t coalesce_bytes;
+  uint32_t coalesce_usecs;
+  uint32_t sample_count;
+  uint32_t sample_flows;
+  uint32_t sample_rate;
+  const char* cpus;
+  uint32_t memory_budget;
+  compress_config_t compress;
+  bool scan;
+  const char* scan_cache;
+  uint32_t scan_max_age;
+  uint32_t ttlink_interval;
+  uint32_t ttlink_seq_offset;
+  bool have_ttlink_seq_offset;
 } ethdump_args_t;
 
 typedef struct cmdline_def_t {
@@ -1214,6 +6218,24 @@ static uintptr_t parse_byte_size(const char* str) {
   }
 }
 
+static uintptr_t parse_timestamp(const char* str) {
+  // Seconds since the epoch, with an optional fractional part.
+  uint64_t secs = 0, nanos = 0;
+  unsigned num_digits = 0;
+  for (; '0' <= *str && *str <= '9'; ++str) {
+    secs = secs * 10 + (*str - '0');
+    if (++num_digits > 12) return INVALID_PARSE;
+  }
+  if (*str == '.') {
+    uint64_t scale = 100000000;
+    for (++str; '0' <= *str && *str <= '9'; ++str, scale /= 10) {
+      nanos += (*str - '0') * scale;
+    }
+  }
+  if (*str != '\0' || !num_digits) return INVALID_PARSE;
+  return (uintptr_t)(secs * 1000000000ull + nanos);
+}
+
 static uintptr_t action_set_device_ring_size(ethdump_args_t* args, uintptr_t parsed) {
   if (parsed >= 4096 && parsed <= (256 * 1024) && !(parsed & (parsed - 1))) {
     args->device_ring_size = (uint32_t)parsed;
@@ -1271,6 +6293,237 @@ static uintptr_t action_set_loopback_mode(ethdump_args_t* args, uintptr_t x) {
   }
 }
 
+static uintptr_t action_write_index(ethdump_args_t* args, uintptr_t parsed) {
+  args->write_index = true;
+  return parsed;
+}
+
+static uintptr_t action_splice(ethdump_args_t* args, uintptr_t parsed) {
+  args->splice = true;
+  return parsed;
+}
+
+static uintptr_t action_set_query_path(ethdump_args_t* args, uintptr_t parsed) {
+  args->query = (const char*)parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_flow(ethdump_args_t* args, uintptr_t parsed) {
+  args->flow = (const char*)parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_start_time(ethdump_args_t* args, uintptr_t parsed) {
+  args->start_ns = parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_end_time(ethdump_args_t* args, uintptr_t parsed) {
+  args->end_ns = parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_flows_path(ethdump_args_t* args, uintptr_t parsed) {
+  args->flows = (const char*)parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_flow_table_size(ethdump_args_t* args, uintptr_t parsed) {
+  if (parsed >= 1024 && parsed <= (1u << 26) && !(parsed & (parsed - 1))) {
+    args->flow_table_size = (uint32_t)parsed;
+    return parsed;
+  } else {
+    return INVALID_PARSE;
+  }
+}
+
+static uintptr_t action_set_flow_threads(ethdump_args_t* args, uintptr_t parsed) {
+  if (parsed < 1 || parsed > FLOW_MAX_THREADS) return INVALID_PARSE;
+  args->flow_threads = (uint32_t)parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_flow_idle_timeout(ethdump_args_t* args, uintptr_t parsed) {
+  args->flow_idle_timeout = (uint32_t)parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_flow_active_timeout(ethdump_args_t* args, uintptr_t parsed) {
+  args->flow_active_timeout = (uint32_t)parsed;
+  return parsed;
+}
+
+static uintptr_t action_benchmark_flows(ethdump_args_t* args, uintptr_t parsed) {
+  args->benchmark_flows = true;
+  return parsed;
+}
+
+static uintptr_t action_selftest(ethdump_args_t* args, uintptr_t parsed) {
+  args->selftest = true;
+  return parsed;
+}
+
+static uintptr_t action_set_share_path(ethdump_args_t* args, uintptr_t parsed) {
+  args->share = (const char*)parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_attach_path(ethdump_args_t* args, uintptr_t parsed) {
+  args->attach = (const char*)parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_evict_slow_readers(ethdump_args_t* args, uintptr_t parsed) {
+  args->evict_slow_readers = (uint32_t)parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_coalesce_bytes(ethdump_args_t* args, uintptr_t parsed) {
+  if (parsed <= 8192) {
+    args->coalesce_bytes = (uint32_t)parsed;
+    return parsed;
+  } else {
+    return INVALID_PARSE;
+  }
+}
+
+static uintptr_t action_set_coalesce_usecs(ethdump_args_t* args, uintptr_t parsed) {
+  if (parsed <= 1000000) {
+    args->coalesce_usecs = (uint32_t)parsed;
+    return parsed;
+  } else {
+    return INVALID_PARSE;
+  }
+}
+
+static uintptr_t action_set_sample_count(ethdump_args_t* args, uintptr_t parsed) {
+  if (parsed >= 1) {
+    args->sample_count = (uint32_t)parsed;
+    return parsed;
+  } else {
+    return INVALID_PARSE;
+  }
+}
+
+static uintptr_t action_set_sample_flows(ethdump_args_t* args, uintptr_t parsed) {
+  if (parsed >= 1) {
+    args->sample_flows = (uint32_t)parsed;
+    return parsed;
+  } else {
+    return INVALID_PARSE;
+  }
+}
+
+static uintptr_t action_set_sample_rate(ethdump_args_t* args, uintptr_t parsed) {
+  if (parsed >= 1) {
+    args->sample_rate = (uint32_t)parsed;
+    return parsed;
+  } else {
+    return INVALID_PARSE;
+  }
+}
+
+static uintptr_t action_scan(ethdump_args_t* args, uintptr_t parsed) {
+  args->scan = true;
+  return parsed;
+}
+
+static uintptr_t action_set_scan_cache(ethdump_args_t* args, uintptr_t parsed) {
+  args->scan_cache = (const char*)parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_scan_max_age(ethdump_args_t* args, uintptr_t parsed) {
+  args->scan_max_age = (uint32_t)parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_ttlink_interval(ethdump_args_t* args, uintptr_t parsed) {
+  if (parsed < 1 || parsed > 3600) return INVALID_PARSE;
+  args->ttlink_interval = (uint32_t)parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_ttlink_seq_offset(ethdump_args_t* args, uintptr_t parsed) {
+  if (parsed > TTLINK_HDR_BYTES - 2) return INVALID_PARSE;
+  args->ttlink_seq_offset = (uint32_t)parsed;
+  args->have_ttlink_seq_offset = true;
+  return parsed;
+}
+
+static uintptr_t action_set_compress(ethdump_args_t* args, uintptr_t parsed) {
+  // Accepts "zstd" or "lz4", optionally followed by ":LEVEL".
+  const char* str = (const char*)parsed;
+  const char* colon = strchr(str, ':');
+  size_t len = colon ? (size_t)(colon - str) : strlen(str);
+  int max_level;
+  if (len == 4 && !memcmp(str, "zstd", 4)) {
+    args->compress.algo = COMPRESS_ZSTD;
+    max_level = 22;
+  } else if (len == 3 && !memcmp(str, "lz4", 3)) {
+    args->compress.algo = COMPRESS_LZ4;
+    max_level = 12;
+  } else {
+    return INVALID_PARSE;
+  }
+  args->compress.level = 0;
+  if (colon) {
+    uintptr_t level = parse_small_int(colon + 1);
+    if (level == INVALID_PARSE || level > (uintptr_t)max_level) return INVALID_PARSE;
+    args->compress.level = (int)level;
+  }
+  return parsed;
+}
+
+static uintptr_t action_set_compress_threads(ethdump_args_t* args, uintptr_t parsed) {
+  if (parsed < 1 || parsed > COMPRESS_MAX_THREADS) return INVALID_PARSE;
+  args->compress.threads = (uint32_t)parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_cpu(ethdump_args_t* args, uintptr_t parsed) {
+  args->cpu = (int)parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_cpus(ethdump_args_t* args, uintptr_t parsed) {
+  args->cpus = (const char*)parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_memory_budget(ethdump_args_t* args, uintptr_t parsed) {
+  args->memory_budget = (uint32_t)parsed;
+  return parsed;
+}
+
+static uintptr_t action_set_session(ethdump_args_t* args, uintptr_t parsed) {
+  args->session = (const char*)parsed;
+  return parsed;
+}
+
+static uintptr_t action_start_session(ethdump_args_t* args, uintptr_t parsed) {
+  args->session = (const char*)parsed;
+  args->share_op = SHARE_OP_START;
+  return parsed;
+}
+
+static uintptr_t action_stop_session(ethdump_args_t* args, uintptr_t parsed) {
+  args->session = (const char*)parsed;
+  args->share_op = SHARE_OP_STOP;
+  return parsed;
+}
+
+static uintptr_t action_retarget(ethdump_args_t* args, uintptr_t x) {
+  args->share_op = SHARE_OP_RETARGET;
+  args->share_arg = (uint32_t)x;
+  return x;
+}
+
+static uintptr_t action_share_status(ethdump_args_t* args, uintptr_t parsed) {
+  args->share_op = SHARE_OP_STATUS;
+  return parsed;
+}
+
 static uintptr_t action_set_output_path(ethdump_args_t* args, uintptr_t parsed) {
   args->output = (const char*)parsed;
   return parsed;
@@ -1281,17 +6534,53 @@ static int cmdline_def_cmp(const void* key, const void* def) {
 }
 
 static const cmdline_def_t g_cmdline_actions[] = {
+  {"--attach",           action_set_attach_path,      parse_str},
+  {"--benchmark-flows",  action_benchmark_flows,      NULL},
+  {"--coalesce-bytes",   action_set_coalesce_bytes,   parse_byte_size},
+  {"--coalesce-usecs",   action_set_coalesce_usecs,   parse_small_int},
+  {"--compress",         action_set_compress,         parse_str},
+  {"--compress-threads", action_set_compress_threads, parse_small_int},
+  {"--cpu",              action_set_cpu,              parse_small_int},
+  {"--cpus",             action_set_cpus,             parse_str},
   {"--device",           action_set_device_path,      parse_str},
   {"--device-ring-size", action_set_device_ring_size, parse_byte_size},
+  {"--end-time",         action_set_end_time,         parse_timestamp},
   {"--eth-x",            action_set_ethernet_x,       parse_small_int},
   {"--ethernet-x",       action_set_ethernet_x,       parse_small_int},
+  {"--evict-slow-readers", action_set_evict_slow_readers, parse_small_int},
+  {"--flow",             action_set_flow,             parse_str},
+  {"--flow-active-timeout", action_set_flow_active_timeout, parse_small_int},
+  {"--flow-idle-timeout", action_set_flow_idle_timeout, parse_small_int},
+  {"--flow-table-size",  action_set_flow_table_size,  parse_byte_size},
+  {"--flow-threads",     action_set_flow_threads,     parse_small_int},
+  {"--flows",            action_set_flows_path,       parse_str},
   {"--generate-traffic", action_generate_traffic,     NULL},
   {"--host-ring-size",   action_set_host_ring_size,   parse_byte_size},
   {"--hwinfo",           action_print_hwinfo,         NULL},
+  {"--index",            action_write_index,          NULL},
   {"--loopback",         action_set_loopback_mode,    parse_small_int},
   {"--loopback-mode",    action_set_loopback_mode,    parse_small_int},
+  {"--memory-budget",    action_set_memory_budget,    parse_byte_size},
   {"--out",              action_set_output_path,      parse_str},
   {"--output",           action_set_output_path,      parse_str},
+  {"--query",            action_set_query_path,       parse_str},
+  {"--retarget",         action_retarget,             parse_small_int},
+  {"--sample",           action_set_sample_count,     parse_small_int},
+  {"--sample-flows",     action_set_sample_flows,     parse_small_int},
+  {"--sample-rate",      action_set_sample_rate,      parse_small_int},
+  {"--scan",             action_scan,                 NULL},
+  {"--scan-cache",       action_set_scan_cache,       parse_str},
+  {"--scan-max-age",     action_set_scan_max_age,     parse_small_int},
+  {"--selftest",         action_selftest,             NULL},
+  {"--session",          action_set_session,          parse_str},
+  {"--share",            action_set_share_path,       parse_str},
+  {"--splice",           action_splice,               NULL},
+  {"--start-session",    action_start_session,        parse_str},
+  {"--start-time",       action_set_start_time,       parse_timestamp},
+  {"--status",           action_share_status,         NULL},
+  {"--stop-session",     action_stop_session,         parse_str},
+  {"--ttlink",           action_set_ttlink_interval,  parse_small_int},
+  {"--ttlink-seq-offset", action_set_ttlink_seq_offset, parse_small_int},
   {"--txheaders",        action_print_txheaders,      NULL},
 };
 
@@ -1337,6 +6626,23 @@ static void parse_args(ethdump_args_t* args, int argc, const char** argv) {
       FATAL("Invalid value '%s' provided for %s", arg, arg_buf);
     }
   }
+  if (args->coalesce_bytes > args->device_ring_size / 4) {
+    FATAL("--coalesce-bytes (%u bytes) cannot be more than a quarter of the device ring size (%u bytes)",
+      (unsigned)args->coalesce_bytes, (unsigned)args->device_ring_size);
+  }
+  if ((args->sample_count != 0) + (args->sample_flows != 0) + (args->sample_rate != 0) > 1) {
+    FATAL("Only one of --sample, --sample-flows, and --sample-rate can be used at once");
+  }
+  if (args->ttlink_interval) {
+    if (args->output || args->flows) FATAL("--ttlink prints statistics instead of writing frames, so cannot be combined with --out or --flows");
+    if (args->generate_traffic) FATAL("--ttlink leaves the TX queues to TT-link, so cannot be combined with --generate-traffic");
+    if (args->sample_count || args->sample_flows || args->sample_rate) FATAL("--ttlink needs to see every frame to track sequence numbers, so cannot be combined with sampling");
+    if (!args->have_ttlink_seq_offset) {
+      FATAL("--ttlink requires --ttlink-seq-offset, as the position of the sequence numbers within the TT-link header isn't documented");
+    }
+  } else if (args->have_ttlink_seq_offset) {
+    FATAL("--ttlink-seq-offset only makes sense with --ttlink");
+  }
   if (args->host_ring_size < args->device_ring_size) {
     FATAL("Host ring size (%u bytes) cannot be smaller than device ring size (%u bytes)",
       (unsigned)args->host_ring_size, (unsigned)args->device_ring_size);
@@ -1345,14 +6651,240 @@ static void parse_args(ethdump_args_t* args, int argc, const char** argv) {
 
 // Entry point:
 
+#ifndef ETHDUMP_NO_MAIN
+static void print_transfer_stats(FILE* f, const char* prefix, const ethdump_capture_t* cap) {
+  if (cap->ctx.sample_mode != ETHDUMP_SAMPLE_NONE) {
+    fprintf(f, "%sDevice-side sampling skipped %llu frames\n", prefix, (long long unsigned)cap->sampled_out_count);
+  }
+  if (!cap->transfer_count) return;
+  fprintf(f, "%sDevice made %llu NoC transfers to the host (average %llu bytes; %llu sent early to meet the latency deadline)\n",
+    prefix, (long long unsigned)cap->transfer_count, (long long unsigned)(cap->transfer_bytes / cap->transfer_count),
+    (long long unsigned)cap->deadline_count);
+}
+
+static uint32_t sample_interval_of(uint32_t sample_mode, uint32_t sample_interval) {
+  // For recording in output metadata: N if the device is keeping 1 in N frames (or flows), otherwise 0.
+  return sample_mode == ETHDUMP_SAMPLE_COUNT || sample_mode == ETHDUMP_SAMPLE_FLOW ? sample_interval : 0;
+}
+
+static void capture_config_from_args(const ethdump_args_t* args, ethdump_capture_config_t* config) {
+  memset(config, 0, sizeof(*config));
+  config->device_ring_size = args->device_ring_size;
+  config->host_ring_size = args->host_ring_size;
+  config->generate_traffic = args->generate_traffic;
+  config->coalesce_bytes = args->coalesce_bytes;
+  config->coalesce_usecs = args->coalesce_usecs;
+  config->keep_tx_queues = args->ttlink_interval != 0;
+  if (args->sample_count > 1) {
+    config->sample_mode = ETHDUMP_SAMPLE_COUNT;
+    config->sample_interval = args->sample_count;
+  } else if (args->sample_flows > 1) {
+    config->sample_mode = ETHDUMP_SAMPLE_FLOW;
+    config->sample_interval = args->sample_flows;
+  } else if (args->sample_rate) {
+    config->sample_mode = ETHDUMP_SAMPLE_RATE;
+    config->sample_rate = args->sample_rate;
+  }
+}
+
+static void run_consumer(ethdump_capture_t* cap, const ethdump_args_t* args) {
+  // Writes frames from cap to either a flow record file or a pcap file (or decodes them as
+  // TT-link), then stops cap.
+  if (args->ttlink_interval) {
+    ttlink_decoder_t* d = malloc(sizeof(ttlink_decoder_t));
+    if (!d) FATAL("Could not allocate memory for TT-link decoder");
+    ttlink_decoder_init(d, stdout, args->ttlink_interval, args->ttlink_seq_offset);
+    ethdump_capture_run(cap, decode_ttlink_fn, d);
+    ttlink_finish(d);
+    free(d);
+    print_transfer_stats(stdout, "", cap);
+    ethdump_capture_stop(cap);
+  } else if (args->flows) {
+    flow_table_t* flows = flow_table_open(args->flows, args->flow_table_size, args->flow_threads,
+      args->flow_idle_timeout * MILLISECONDS(1000u), args->flow_active_timeout * MILLISECONDS(1000u),
+      cap->ctx.sample_mode != ETHDUMP_SAMPLE_NONE, sample_interval_of(cap->ctx.sample_mode, cap->ctx.sample_interval));
+    ethdump_capture_run(cap, aggregate_flows_fn, flows);
+    flow_table_finish(flows);
+    printf("Aggregated %llu packets into %llu flow records, wrote %llu bytes to %s\n",
+      (long long unsigned)flows->total_pkt_count,
+      (long long unsigned)flows->total_record_count,
+      (long long unsigned)flows->total_byte_count, args->flows);
+    print_transfer_stats(stdout, "", cap);
+    ethdump_capture_stop(cap);
+  } else {
+    pcap_writer_t writer;
+    pcap_writer_init(&writer, args->output, args->splice ? (uint32_t)cap->ctx.h_ring.size : 0, &args->compress);
+    if (args->write_index) writer.index = index_open(args->output, sample_interval_of(cap->ctx.sample_mode, cap->ctx.sample_interval));
+    ethdump_capture_run(cap, write_packets_fn, &writer);
+    if (writer.index) index_finish(writer.index, writer.file_offset);
+    pcap_writer_finish(&writer);
+    // Keep stdout clean if the pcap itself is going there.
+    FILE* summary = writer.fd == STDOUT_FILENO ? stderr : stdout;
+    fprintf(summary, "Captured %llu packets, wrote %llu bytes to %s\n",
+      (long long unsigned)writer.total_pkt_count,
+      (long long unsigned)writer.total_byte_count, args->output);
+    if (writer.compress.algo != COMPRESS_NONE) print_compress_stats(summary, &writer.compress, &writer.compress_stats);
+    print_transfer_stats(summary, "", cap);
+    ethdump_capture_stop(cap);
+  }
+}
+
+static void run_multi_device(const ethdump_args_t* args) {
+  // Captures from every device in the comma-separated args->device (each optionally followed by
+  // ":X" to override args->ethernet_x), merging everything into one output.
+  if (args->share) FATAL("--share only supports a single device");
+  if (args->to_print) FATAL("--hwinfo and --txheaders only support a single device; use --scan to see every device");
+  if (args->cpu >= 0) FATAL("--cpu only supports a single device; use --cpus to give the CPUs for pollers to use");
+  ethdump_capture_config_t config;
+  capture_config_from_args(args, &config);
+  multi_capture_t* mc = multi_capture_create(&config, args->apply_loopback_mode ? &args->loopback_mode : NULL);
+  char* list = strdup(args->device);
+  if (!list) FATAL("Could not allocate memory for device list");
+  char* save = NULL;
+  for (char* name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+    uint8_t ethernet_x = args->ethernet_x;
+    char* colon = strchr(name, ':');
+    if (colon) {
+      uintptr_t x = parse_small_int(colon + 1);
+      if (x == INVALID_PARSE || x != (uint8_t)x) FATAL("Invalid Ethernet X coordinate in device '%s'", name);
+      ethernet_x = (uint8_t)x;
+      *colon = '\0';
+    }
+    multi_capture_add(mc, name, open_bh_pcie_device(name), ethernet_x);
+  }
+  free(list);
+
+  // Shrink the host rings if need be to fit within the memory budget.
+  uint32_t n = mc->num_sources;
+  if (args->memory_budget) {
+    while (mc->config.host_ring_size > args->device_ring_size && (uint64_t)mc->config.host_ring_size * n > args->memory_budget) {
+      mc->config.host_ring_size >>= 1;
+    }
+    if ((uint64_t)mc->config.host_ring_size * n > args->memory_budget) {
+      FATAL("--memory-budget (%u bytes) is too small for %u host rings of at least --device-ring-size (%u bytes) each",
+        (unsigned)args->memory_budget, (unsigned)n, (unsigned)args->device_ring_size);
+    }
+  }
+  if (args->cpus) {
+    cpu_set_t cpus;
+    parse_cpulist(args->cpus, &cpus);
+    if (CPU_COUNT(&cpus) == 0) FATAL("Invalid value '%s' provided for --cpus", args->cpus);
+    multi_capture_plan(mc, &cpus);
+  } else {
+    multi_capture_plan(mc, NULL);
+  }
+  multi_capture_start(mc);
+
+  FILE* summary = stdout;
+  if (args->ttlink_interval) {
+    ttlink_decoder_t* d = malloc(sizeof(ttlink_decoder_t));
+    if (!d) FATAL("Could not allocate memory for TT-link decoder");
+    ttlink_decoder_init(d, stdout, args->ttlink_interval, args->ttlink_seq_offset);
+    multi_capture_run(mc, decode_merged_ttlink_fn, d);
+    ttlink_finish(d);
+    free(d);
+  } else if (args->flows) {
+    flow_table_t* flows = flow_table_open(args->flows, args->flow_table_size, args->flow_threads,
+      args->flow_idle_timeout * MILLISECONDS(1000u), args->flow_active_timeout * MILLISECONDS(1000u),
+      config.sample_mode != ETHDUMP_SAMPLE_NONE, sample_interval_of(config.sample_mode, config.sample_interval));
+    multi_capture_run(mc, aggregate_merged_flows_fn, flows);
+    flow_table_finish(flows);
+    printf("Aggregated %llu packets from %u devices into %llu flow records, wrote %llu bytes to %s\n",
+      (long long unsigned)flows->total_pkt_count, (unsigned)n,
+      (long long unsigned)flows->total_record_count,
+      (long long unsigned)flows->total_byte_count, args->flows);
+  } else {
+    const char* output = args->output ? args->output : "tt_merged.pcap";
+    pcap_writer_t writer;
+    pcap_writer_init(&writer, output, 0, &args->compress); // Frames come from several rings, so don't splice.
+    if (args->write_index) writer.index = index_open(output, sample_interval_of(config.sample_mode, config.sample_interval));
+    multi_capture_run(mc, write_merged_packets_fn, &writer);
+    if (writer.index) index_finish(writer.index, writer.file_offset);
+    pcap_writer_finish(&writer);
+    if (writer.fd == STDOUT_FILENO) summary = stderr;
+    fprintf(summary, "Captured %llu packets from %u devices, wrote %llu bytes to %s\n",
+      (long long unsigned)writer.total_pkt_count, (unsigned)n,
+      (long long unsigned)writer.total_byte_count, output);
+    if (writer.compress.algo != COMPRESS_NONE) print_compress_stats(summary, &writer.compress, &writer.compress_stats);
+  }
+  for (unsigned i = 0; i < n; ++i) {
+    char prefix[40];
+    snprintf(prefix, sizeof(prefix), "%s: ", mc->sources[i].name);
+    print_transfer_stats(summary, prefix, mc->sources[i].cap);
+  }
+  multi_capture_stop(mc);
+}
+
 int main(int argc, const char** argv) {
   ethdump_args_t args;
   memset(&args, 0, sizeof(args));
   args.ethernet_x = 25;
   args.device_ring_size = 256 << 10;
   args.host_ring_size = 2 << 20; 
+  args.end_ns = UINT64_MAX;
+  args.flow_table_size = 1u << 18;
+  args.flow_threads = 1;
+  args.flow_idle_timeout = 15;
+  args.flow_active_timeout = 60;
+  args.cpu = -1;
+  args.coalesce_bytes = 4096;
+  args.coalesce_usecs = 10;
+  args.scan_max_age = 60;
+  args.compress.threads = 2;
   parse_args(&args, argc, argv);
-  bool capturing_traffic = !args.to_print || args.output || args.generate_traffic;
+  if (args.scan) {
+    run_scan(args.scan_cache, args.scan_max_age);
+    return 0;
+  }
+  if (args.selftest) {
+    run_selftest();
+    return 0;
+  }
+  if (args.benchmark_flows) {
+    flow_table_t* flows = flow_table_open(args.flows ? args.flows : "/dev/null", args.flow_table_size, args.flow_threads,
+      args.flow_idle_timeout * MILLISECONDS(1000u), args.flow_active_timeout * MILLISECONDS(1000u), false, 0);
+    bool keeps_up = run_flows_benchmark(flows, args.host_ring_size);
+    flow_table_finish(flows);
+    return keeps_up ? 0 : 1;
+  }
+  if (args.query) {
+    if (!args.output) FATAL("--query requires --out to specify where to write the extracted packets");
+    query_filter_t filter;
+    memset(&filter, 0, sizeof(filter));
+    filter.start_ns = args.start_ns;
+    filter.end_ns = args.end_ns;
+    if (args.flow) {
+      parse_flow_spec(args.flow, &filter.flow);
+      flow_key_make_symmetric(&filter.flow);
+      filter.flow_hash = flow_key_hash(&filter.flow);
+      filter.have_flow = true;
+    }
+    run_query(args.query, args.output, &filter, &args.compress);
+    return 0;
+  }
+  if (args.write_index && args.output && (!strcmp(args.output, "-") || !strncmp(args.output, "unix:", 5))) {
+    FATAL("--index requires --out to be a regular file");
+  }
+  if (args.share_op && !args.attach) {
+    FATAL("--start-session, --stop-session, --retarget, and --status require --attach to specify the sharing process");
+  }
+  if (args.attach) {
+    if (args.share_op) {
+      ethdump_share_request(args.attach, args.share_op, args.share_arg, args.session);
+      return 0;
+    }
+    if (!args.output && !args.flows && !args.ttlink_interval) FATAL("--attach requires --out, --flows, or --ttlink to specify what to do with frames");
+    run_consumer(ethdump_capture_attach(args.attach, args.session), &args);
+    return 0;
+  }
+  if (args.share && (args.output || args.flows || args.ttlink_interval)) {
+    FATAL("--share cannot be combined with --out, --flows, or --ttlink; use a separate ethdump --attach instead");
+  }
+  if (args.device && strchr(args.device, ',')) {
+    run_multi_device(&args);
+    return 0;
+  }
+  bool capturing_traffic = !args.to_print || args.output || args.generate_traffic || args.flows || args.share || args.ttlink_interval;
 
   bh_pcie_device_t* device = open_bh_pcie_device(args.device);
   if (args.to_print & PRINT_HW_INFO) {
@@ -1368,26 +6900,29 @@ int main(int argc, const char** argv) {
   }
   if (capturing_traffic) {
     char output_filename_buf[12];
-    if (!args.output) {
+    if (!args.output && !args.flows && !args.share && !args.ttlink_interval) {
       sprintf(output_filename_buf, "tt_%u.pcap", (unsigned)args.ethernet_x);
       args.output = output_filename_buf;
     }
-    ethdump_context_t ctx;
-    ctx.e_ring_size = args.device_ring_size;
-    ctx.h_ring.size = args.host_ring_size;
-    ctx.h_meta.size = device->host_page_size;
-    allocate_host_buffer(device, &ctx.h_ring);
-    allocate_host_buffer(device, &ctx.h_meta);
-    pcap_writer_t writer;
-    pcap_writer_init(&writer, args.output);
-    configure_ethernet(device, &ctx);
-    host_spin(device, &writer, &ctx, args.generate_traffic);
-    tlb_write_u32(device, SOFT_RESET_ADDR, SOFT_RESET_E1);
-    close(writer.fd);
-    printf("Captured %llu packets, wrote %llu bytes to %s\n",
-      (long long unsigned)writer.total_pkt_count,
-      (long long unsigned)writer.total_byte_count, args.output);
+    ethdump_capture_config_t config;
+    capture_config_from_args(&args, &config);
+    config.shareable = args.share != NULL;
+    config.numa_aware = true;
+    config.poller_cpu = args.cpu;
+    ethdump_capture_t* cap = ethdump_capture_start(device, &config);
+    if (args.share) {
+      ethdump_share_stats_t stats;
+      ethdump_capture_share(cap, args.share, args.ethernet_x, args.evict_slow_readers, &stats);
+      printf("Shared %llu bytes with %u readers (%u evicted) via %s\n",
+        (long long unsigned)stats.total_byte_count, (unsigned)stats.total_reader_count,
+        (unsigned)stats.evicted_reader_count, args.share);
+      print_transfer_stats(stdout, "", cap);
+      ethdump_capture_stop(cap);
+    } else {
+      run_consumer(cap, &args);
+    }
   }
   close_bh_pcie_device(device);
   return 0;
 }
+#endif
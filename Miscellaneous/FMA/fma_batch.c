@@ -0,0 +1,468 @@
+/*
+ * SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Array versions of the three models in fma.c, computing out[i] = x[i] * y[i] + z[i] for every i,
+ * with results bit-identical to calling the scalar model once per element. Each model is
+ * re-expressed without branches: every lane computes every path, and the result is then chosen
+ * by masks in the reverse order of the scalar model's early returns. If every lane of a vector
+ * takes one of the early returns for NaN / Inf inputs or for x * y being zero (which includes
+ * every flushed denormal in the Blackhole and Wormhole models), the rest is skipped, so that the
+ * vector models don't lose out to the scalar ones on inputs where those return early. The vector models are
+ * written once using GCC vector extensions, and this file includes itself to compile them at the
+ * native vector width of AVX-512 and of AVX2. The best variant which the CPU supports is chosen
+ * at runtime; without either (or on anything other than x86), the batch functions just call the
+ * scalar models.
+ */
+
+#ifndef FMA_BATCH_SUFFIX
+#include <stddef.h>
+#include <string.h>
+#include "fma.c"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define FMA_CAT_(a, b) a##b
+#define FMA_CAT(a, b) FMA_CAT_(a, b)
+
+// The helpers are macros, and the vector models take and return pointers, as otherwise GCC warns
+// that the calling convention for wide vectors differs between targets (even when inlined).
+// All 64-bit lanes hold values below 2^63, so comparisons can be signed (AVX2 has no unsigned ones).
+#define fma_sel(mask, a, b) (((a) & (fma_vu)(mask)) | ((b) & ~(fma_vu)(mask))) // mask ? a : b
+#define fma_seli(mask, a, b) (((a) & (fma_vi)(mask)) | ((b) & ~(fma_vi)(mask)))
+
+// floor(log2(v)) for 0 < v < 2^52; garbage for v == 0
+#define fma_ilog2(v) ((fma_vi)((fma_vu)((fma_vd)((v) | 0x4330000000000000ull) - 0x1p52) >> 52) - 1023)
+
+// Shift amounts must be in [0, 63]
+#define fma_clamp_shift(s) ({ \
+    fma_vi s_ = (s); \
+    s_ = fma_seli(s_ < 0, (fma_vi){0}, s_); \
+    fma_seli(s_ > 63, (fma_vi){0} + 63, s_); \
+  })
+
+// As per sticky_shift in fma_model_ieee, for 64-bit v and amount >= 0
+#define fma_sticky_shift(v, amount) ({ \
+    fma_vu v_ = (v); \
+    fma_vi a_ = (amount); \
+    fma_vi s_ = fma_clamp_shift(a_); \
+    fma_vu r_ = v_ >> (fma_vu)s_; \
+    r_ |= (fma_vu)((r_ << (fma_vu)s_) != v_) & 1; \
+    fma_sel(a_ >= 64, (fma_vu)(v_ != 0) & 1, r_); \
+  })
+
+// As per semi_sticky_shift, for v < 2^32 and amount >= 0
+#define fma_semi_sticky_shift(v, amount) ({ \
+    fma_vu v_ = (v); \
+    fma_vi a_ = (amount); \
+    fma_vi s_ = fma_clamp_shift(a_); \
+    fma_vu r_ = v_ >> (fma_vu)s_; \
+    r_ |= (fma_vu)((r_ << (fma_vu)s_) != v_) & (fma_vu)(r_ != 0) & 1; \
+    fma_sel(a_ >= 64, (fma_vu){0}, r_); \
+  })
+
+// a * b for a, b < 2^32, which is a single instruction per vector
+#define fma_mul24(a, b) (((a) & 0xffffffffu) * ((b) & 0xffffffffu))
+
+typedef void (*fma_batch_fn)(const uint32_t* x, const uint32_t* y, const uint32_t* z, uint32_t* out, size_t n);
+
+// The vector variants use x86 target attributes; elsewhere only the generic variant exists.
+#if defined(__x86_64__) || defined(__i386__)
+#define FMA_BATCH_X86 1
+#else
+#define FMA_BATCH_X86 0
+#endif
+
+#if FMA_BATCH_X86
+#define FMA_BATCH_SUFFIX avx512
+#define FMA_BATCH_TARGET "avx512f,avx512dq"
+#define FMA_LANES 8
+#include __FILE__
+#undef FMA_LANES
+#undef FMA_BATCH_TARGET
+#undef FMA_BATCH_SUFFIX
+
+#define FMA_BATCH_SUFFIX avx2
+#define FMA_BATCH_TARGET "avx2"
+#define FMA_LANES 4
+#include __FILE__
+#undef FMA_LANES
+#undef FMA_BATCH_TARGET
+#undef FMA_BATCH_SUFFIX
+#endif
+
+#define FMA_BATCH_GENERIC(model) \
+  static void model##_batch_generic(const uint32_t* x, const uint32_t* y, const uint32_t* z, uint32_t* out, size_t n) { \
+    for (size_t i = 0; i < n; ++i) out[i] = model(x[i], y[i], z[i]); \
+  }
+FMA_BATCH_GENERIC(fma_model_ieee)
+FMA_BATCH_GENERIC(fma_model_bh)
+FMA_BATCH_GENERIC(fma_model_wh)
+#undef FMA_BATCH_GENERIC
+
+// Values for fma_batch_isa:
+#define FMA_ISA_GENERIC 0
+#define FMA_ISA_AVX2    1
+#define FMA_ISA_AVX512  2
+
+static int fma_batch_isa(void) { // The best variant which this CPU supports
+#if FMA_BATCH_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) return FMA_ISA_AVX512;
+  if (__builtin_cpu_supports("avx2")) return FMA_ISA_AVX2;
+#endif
+  return FMA_ISA_GENERIC;
+}
+
+#if FMA_BATCH_X86
+#define FMA_BATCH_SELECT(model, isa) \
+  (isa == FMA_ISA_AVX512 ? model##_batch_avx512 : isa == FMA_ISA_AVX2 ? model##_batch_avx2 : model##_batch_generic)
+#else
+#define FMA_BATCH_SELECT(model, isa) ((void)(isa), model##_batch_generic)
+#endif
+
+#define FMA_BATCH_DISPATCH(model) \
+  fma_batch_fn model##_batch_variant(int isa) { \
+    return FMA_BATCH_SELECT(model, isa); \
+  } \
+  void model##_batch(const uint32_t* x, const uint32_t* y, const uint32_t* z, uint32_t* out, size_t n) { \
+    static fma_batch_fn fn; \
+    fma_batch_fn f = __atomic_load_n(&fn, __ATOMIC_RELAXED); \
+    if (!f) __atomic_store_n(&fn, (f = model##_batch_variant(fma_batch_isa())), __ATOMIC_RELAXED); \
+    f(x, y, z, out, n); \
+  }
+
+FMA_BATCH_DISPATCH(fma_model_ieee)
+FMA_BATCH_DISPATCH(fma_model_bh)
+FMA_BATCH_DISPATCH(fma_model_wh)
+#undef FMA_BATCH_DISPATCH
+#undef FMA_BATCH_SELECT
+
+#else // Included from above, with FMA_BATCH_SUFFIX, FMA_BATCH_TARGET, and FMA_LANES defined.
+
+#define fma_vu FMA_CAT(fma_vu_, FMA_BATCH_SUFFIX)
+#define fma_vi FMA_CAT(fma_vi_, FMA_BATCH_SUFFIX)
+#define fma_vd FMA_CAT(fma_vd_, FMA_BATCH_SUFFIX)
+#define fma_vu32 FMA_CAT(fma_vu32_, FMA_BATCH_SUFFIX)
+#define fma_vec_ieee FMA_CAT(fma_vec_ieee_, FMA_BATCH_SUFFIX)
+#define fma_vec_bh FMA_CAT(fma_vec_bh_, FMA_BATCH_SUFFIX)
+#define fma_vec_wh FMA_CAT(fma_vec_wh_, FMA_BATCH_SUFFIX)
+#define FMA_INLINE static inline __attribute__((always_inline, target(FMA_BATCH_TARGET)))
+
+typedef uint64_t fma_vu __attribute__((vector_size(FMA_LANES * 8)));
+typedef int64_t fma_vi __attribute__((vector_size(FMA_LANES * 8)));
+typedef double fma_vd __attribute__((vector_size(FMA_LANES * 8)));
+typedef uint32_t fma_vu32 __attribute__((vector_size(FMA_LANES * 4)));
+
+// Whether every lane of a comparison result is true
+#if FMA_LANES == 4
+#define fma_all(mask) (_mm256_movemask_pd((__m256d)(mask)) == 0xf)
+#else
+#define fma_all(mask) (_mm512_movepi64_mask((__m512i)(mask)) == 0xff)
+#endif
+
+FMA_INLINE void fma_vec_ieee(fma_vu* rp, const fma_vu* xp, const fma_vu* yp, const fma_vu* zp) {
+  fma_vu x = *xp, y = *yp, z = *zp;
+
+  // Unpack inputs
+#define fp32_unpack(var) \
+    fma_vi var##_e = (fma_vi)((var >> 23) & 255); \
+    fma_vu var##_m = (var & 0x7fffff) ^ 0x800000; \
+    { \
+      fma_vi is_denorm = var##_e == 0; \
+      fma_vu dm = var & 0x7fffff; \
+      fma_vi l = fma_ilog2(dm | 1); \
+      var##_m = fma_sel(is_denorm, dm << (fma_vu)(23 - l), var##_m); \
+      var##_e = fma_seli(is_denorm, l - 22, var##_e); \
+    }
+  fp32_unpack(x)
+  fp32_unpack(y)
+  fp32_unpack(z)
+  fma_vu z_sign = z & 0x80000000;
+#undef fp32_unpack
+
+  // p = x * y
+  fma_vu p_sign = (x ^ y) & 0x80000000;
+  fma_vu p_m = fma_mul24(x_m, y_m);
+  fma_vi p_e = x_e + y_e - 23 - 127;
+
+  // Add three extra bits of precision (aka. G, R, S bits)
+  p_m <<= 3, z_m <<= 3;
+
+  // Handle NaN or Inf input
+  fma_vi x_inf = x_e == 255, y_inf = y_e == 255, z_inf = z_e == 255;
+  fma_vi nonfinite = x_inf | y_inf | z_inf;
+  fma_vi nan = (x_inf & ((fma_vi)(x_m != 0x800000) | (fma_vi)(y_m == 0)))
+             | (y_inf & ((fma_vi)(y_m != 0x800000) | (fma_vi)(x_m == 0)))
+             | (z_inf & (fma_vi)(z_m != 0x4000000))
+             | (z_inf & (x_inf | y_inf) & (fma_vi)(z_sign != p_sign));
+  fma_vu special = fma_sel(nan, (fma_vu){0} + 0x7fc00000, fma_sel(z_inf, z, p_sign | 0x7f800000));
+
+  // Realign z_m to match p_m (adding 23 bits)
+  z_m <<= 23;
+  z_e -= 23;
+
+  // Shortcut if p == 0
+  fma_vi p_zero = p_m == 0;
+  fma_vu p_zero_result = fma_sel(z_m != 0, z, z_sign & p_sign);
+  if (fma_all(nonfinite | p_zero)) {
+    *rp = fma_sel(nonfinite, special, p_zero_result);
+    return;
+  }
+
+  // r = z + p
+  fma_vi r_e = fma_seli(p_e > z_e, p_e, z_e);
+  p_m = fma_sticky_shift(p_m, r_e - p_e); // Discard low bits from p_m
+  z_m = fma_sticky_shift(z_m, r_e - z_e); // Discard low bits from z_m
+  fma_vu r_sign = fma_sel((fma_vi)p_m >= (fma_vi)z_m, p_sign, z_sign);
+  fma_vi signs_differ = z_sign != p_sign;
+  z_m = fma_sel(z_sign != r_sign, ~z_m, z_m);
+  p_m = fma_sel(p_sign != r_sign, ~p_m, p_m);
+  fma_vu r_m = z_m + p_m + ((fma_vu)signs_differ & 1);
+
+  // Shortcut if r == 0
+  fma_vi r_zero = r_m == 0;
+
+  // Normalise 64-bit result to 37 zero bits, 1 one bit, 26 fractional bits
+  fma_vi n = fma_ilog2(r_m) - 26;
+  r_e += n;
+  fma_vi r_inf = r_e >= 255;
+  fma_vi r_denorm = r_e <= 0;
+  n = fma_seli(r_denorm, n + 1 - r_e, n);
+  r_e = fma_seli(r_denorm, (fma_vi){0}, r_e);
+  r_m = fma_sel(n <= 0, r_m << (fma_vu)fma_clamp_shift(-n), fma_sticky_shift(r_m, n));
+
+  // Start reassembling result
+  fma_vu r = ((fma_vu)r_e << 23) | ((r_m >> 3) & 0x7fffff);
+
+  // Round to nearest even
+  r += (fma_vu)(((r_m & 7) + (r & 1)) > 4) & 1;
+  r |= r_sign;
+
+  // Apply the early returns, last first
+  r = fma_sel(r_inf, r_sign | 0x7f800000, r);
+  r = fma_sel(r_zero, z_sign & p_sign, r);
+  r = fma_sel(p_zero, p_zero_result, r);
+  *rp = fma_sel(nonfinite, special, r);
+}
+
+FMA_INLINE void fma_vec_bh(fma_vu* rp, const fma_vu* xp, const fma_vu* yp, const fma_vu* zp) {
+  fma_vu x = *xp, y = *yp, z = *zp;
+
+  // Unpack inputs
+#define fp32_unpack_no_denorms(var) \
+    fma_vi var##_e = (fma_vi)((var >> 23) & 255); \
+    fma_vu var##_m = fma_sel(var##_e == 0, (fma_vu){0}, (var & 0x7fffff) ^ 0x800000);
+  fp32_unpack_no_denorms(x)
+  fp32_unpack_no_denorms(y)
+  fp32_unpack_no_denorms(z)
+  fma_vu z_sign = z & 0x80000000;
+#undef fp32_unpack_no_denorms
+
+  // p = x * y
+  fma_vu p_sign = (x ^ y) & 0x80000000;
+  fma_vu p_m = fma_mul24(x_m, y_m);
+  fma_vi p_e = x_e + y_e - 23 - 127;
+
+  // Add three extra bits of precision (aka. G, R, S bits)
+  p_m <<= 3, z_m <<= 3;
+
+  // Realign p_m to match z_m (removing 23 bits)
+  p_m = (p_m >> 23) | ((fma_vu)((p_m & 0x7fffff) != 0) & 1);
+  p_e += 23;
+
+  // Handle NaN or Inf input or (x * y) Inf
+  fma_vi x_inf = x_e == 255, y_inf = y_e == 255, z_inf = z_e == 255;
+  fma_vi nonfinite = x_inf | y_inf | (p_e >= 255) | z_inf;
+  fma_vi nan = (x_inf & ((fma_vi)(x_m != 0x800000) | (fma_vi)(y_m == 0)))
+             | (y_inf & ((fma_vi)(y_m != 0x800000) | (fma_vi)(x_m == 0)))
+             | (z_inf & (fma_vi)(z_m != 0x4000000))
+             | (z_inf & (x_inf | y_inf) & (fma_vi)(z_sign != p_sign));
+  fma_vu special = fma_sel(nan, (fma_vu){0} + 0x7fc00000, fma_sel(z_inf, z, p_sign | 0x7f800000));
+
+  // Shortcut if p == 0, or if the multiply on its own would underflow
+  fma_vi p_zero = (p_m == 0) | (p_e < 0);
+  fma_vu p_zero_result = fma_sel(z_m != 0, z, z_sign & p_sign);
+  if (fma_all(nonfinite | p_zero)) {
+    *rp = fma_sel(nonfinite, special, p_zero_result);
+    return;
+  }
+
+  // r = z + p
+  fma_vi r_e = fma_seli(p_e > z_e, p_e, z_e);
+  p_m = fma_semi_sticky_shift(p_m, r_e - p_e); // Discard low bits from p_m
+  z_m = fma_semi_sticky_shift(z_m, r_e - z_e); // Discard low bits from z_m
+  fma_vu r_sign = fma_sel((fma_vi)p_m >= (fma_vi)z_m, p_sign, z_sign);
+  fma_vi signs_differ = z_sign != p_sign;
+  z_m = fma_sel(z_sign != r_sign, ~z_m, z_m);
+  p_m = fma_sel(p_sign != r_sign, ~p_m, p_m);
+  fma_vu r_m = (z_m + p_m + ((fma_vu)signs_differ & 1)) & 0xffffffff;
+
+  // Shortcut if r == 0
+  fma_vi r_zero = r_m == 0;
+
+  // Normalise 32-bit result to 5 zero bits, 1 one bit, 26 fractional bits
+  fma_vi n = fma_ilog2(r_m) - 26;
+  r_e += n;
+  fma_vi r_inf = r_e >= 255;
+  fma_vi r_denorm = r_e <= 0;
+  n = fma_seli(r_denorm, n + 1, n);
+  r_e = fma_seli(r_denorm, (fma_vi){0}, r_e);
+  fma_vu r_m_right = (r_m >> (fma_vu)fma_clamp_shift(n)) | ((fma_vu)((r_m & (fma_vu)(n | 1)) != 0) & 1);
+  r_m = fma_sel(n <= 0, (r_m << (fma_vu)fma_clamp_shift(-n)) & 0xffffffff, r_m_right);
+
+  // Start reassembling result
+  fma_vu r = ((fma_vu)r_e << 23) + ((r_m >> 3) & 0x7fffff);
+
+  // Round to nearest even
+  r += (fma_vu)(((r_m & 7) + (r & 1)) > 4) & 1;
+
+  // Flush denormals (after rounding, preserving sign)
+  r = fma_sel((r >> 23) == 0, (fma_vu){0}, r);
+  r |= r_sign;
+
+  // Apply the early returns, last first
+  r = fma_sel(r_inf, r_sign | 0x7f800000, r);
+  r = fma_sel(r_zero, z_sign & p_sign, r);
+  r = fma_sel(p_zero, p_zero_result, r);
+  *rp = fma_sel(nonfinite, special, r);
+}
+
+FMA_INLINE void fma_vec_wh(fma_vu* rp, const fma_vu* xp, const fma_vu* yp, const fma_vu* zp) {
+  fma_vu x = *xp, y = *yp, z = *zp;
+
+  // Unpack inputs
+#define fp32_unpack_no_denorms(var) \
+    fma_vi var##_e = (fma_vi)((var >> 23) & 255); \
+    fma_vu var##_m = fma_sel(var##_e == 0, (fma_vu){0}, (var & 0x7fffff) ^ 0x800000);
+  fp32_unpack_no_denorms(x)
+  fp32_unpack_no_denorms(y)
+  fp32_unpack_no_denorms(z)
+  fma_vu z_sign = z & 0x80000000;
+#undef fp32_unpack_no_denorms
+
+  // p = x * y
+  fma_vu p_sign = (x ^ y) & 0x80000000;
+  fma_vu p_m = fma_mul24(x_m, y_m);
+  fma_vi p_e = x_e + y_e - 23 - 127;
+
+  // Add three extra bits of precision (aka. G, R, S bits)
+  p_m <<= 3, z_m <<= 3;
+
+  // Realign p_m to match z_m (removing 23 bits)
+  p_m = (p_m >> 23) | ((fma_vu)((p_m & 0x7fffff) != 0) & 1);
+  p_e += 23;
+
+  // Handle NaN or Inf input or (x * y) Inf
+  // Lanes which get a nan_result carry on, as some mantissa bits can subsequently leak in
+  fma_vi x_inf = x_e == 255, y_inf = y_e == 255, z_inf = z_e == 255, p_inf = p_e >= 255;
+  fma_vi nonfinite = x_inf | y_inf | p_inf | z_inf;
+  fma_vi nan_from_p = (x_inf & ((fma_vi)(x_m != 0x800000) | (fma_vi)(y_m == 0)))
+                    | (y_inf & ((fma_vi)(y_m != 0x800000) | (fma_vi)(x_m == 0)))
+                    | (z_inf & (fma_vi)(z_m == 0x4000000) & (x_inf | y_inf | p_inf) & (fma_vi)(z_sign != p_sign));
+  fma_vi nan_from_z = ~nan_from_p & z_inf & (fma_vi)(z_m != 0x4000000);
+  fma_vu nan_result = fma_sel(nonfinite & nan_from_p, p_sign | 0x7f800001, fma_sel(nonfinite & nan_from_z, z_sign | 0x7f800001, (fma_vu){0}));
+  fma_vi has_nan = nan_result != 0;
+  fma_vi special = nonfinite & ~has_nan;
+  fma_vu special_result = fma_sel(z_inf, z, p_sign | 0x7f800000);
+  p_e = fma_seli(has_nan & (p_e > 255), (fma_vi){0} + 255, p_e);
+
+  // Shortcut if p == 0, or if the multiply on its own would underflow
+  fma_vi p_zero = (p_m == 0) | (p_e < 0);
+  fma_vu p_zero_result = fma_sel(z_m != 0, z, (fma_vu){0});
+  p_m = fma_sel(p_zero & has_nan, (fma_vu){0}, p_m);
+  p_e = fma_seli(p_zero & has_nan, (fma_vi){0}, p_e);
+  p_zero &= ~has_nan;
+  if (fma_all(special | p_zero)) {
+    *rp = fma_sel(special, special_result, p_zero_result);
+    return;
+  }
+
+  // r = z + p
+  fma_vi r_e = fma_seli(p_e > z_e, p_e, z_e);
+  p_m = fma_semi_sticky_shift(p_m, r_e - p_e); // Discard low bits from p_m
+  z_m = fma_semi_sticky_shift(z_m, r_e - z_e); // Discard low bits from z_m
+  fma_vu r_sign = fma_sel((fma_vi)p_m >= (fma_vi)z_m, p_sign, z_sign);
+  fma_vi signs_differ = z_sign != p_sign;
+  z_m = fma_sel(z_sign != r_sign, ~z_m, z_m);
+  p_m = fma_sel(p_sign != r_sign, ~p_m, p_m);
+  fma_vu r_m = (z_m + p_m + ((fma_vu)signs_differ & 1)) & 0xffffffff;
+
+  // Shortcut if r == 0
+  fma_vi r_zero = r_m == 0;
+
+  // Normalise 32-bit result to 5 zero bits, 1 one bit, 26 fractional bits
+  fma_vi n = fma_ilog2(r_m) - 26;
+  r_e += n;
+  fma_vi r_inf = r_e >= 255;
+  fma_vi r_denorm = r_e < 0; // Flush blatant denormals (before rounding, discarding sign)
+  fma_vu r_m_right = (r_m >> (fma_vu)fma_clamp_shift(n)) | (r_m & 1);
+  r_m = fma_sel(n <= 0, (r_m << (fma_vu)fma_clamp_shift(-n)) & 0xffffffff, r_m_right);
+
+  // Start reassembling result
+  fma_vu r = (((fma_vu)r_e << 23) + ((r_m >> 3) & 0x7fffff)) & 0xffffffff;
+
+  // Round to nearest even
+  r += (fma_vu)(((r_m & 7) + (r & 1)) > 4) & 1;
+
+  // Flush denormals (after rounding, discarding sign)
+  fma_vi r_flush = ((r & 0xffffffff) >> 23) == 0;
+  r = (fma_sel(has_nan, nan_result, r_sign) | r) & 0xffffffff;
+
+  // Apply the early returns, last first
+  r = fma_sel(r_flush | r_denorm | r_zero, nan_result, r);
+  r = fma_sel(r_inf & ~r_zero, fma_sel(has_nan, nan_result, r_sign | 0x7f800000), r);
+  r = fma_sel(p_zero, p_zero_result, r);
+  *rp = fma_sel(special, special_result, r);
+}
+
+// Each batch function processes FMA_LANES elements at a time. The final partial vector is padded
+// with zeros, and only its valid lanes are stored.
+#define FMA_BATCH_VARIANT(model, vec_fn) \
+  __attribute__((target(FMA_BATCH_TARGET))) \
+  static void FMA_CAT(model##_batch_, FMA_BATCH_SUFFIX)(const uint32_t* x, const uint32_t* y, const uint32_t* z, uint32_t* out, size_t n) { \
+    fma_vu32 vx, vy, vz, r; \
+    fma_vu wx, wy, wz, wr; \
+    size_t i = 0; \
+    for (; i + FMA_LANES <= n; i += FMA_LANES) { \
+      memcpy(&vx, x + i, sizeof(vx)); \
+      memcpy(&vy, y + i, sizeof(vy)); \
+      memcpy(&vz, z + i, sizeof(vz)); \
+      wx = __builtin_convertvector(vx, fma_vu); \
+      wy = __builtin_convertvector(vy, fma_vu); \
+      wz = __builtin_convertvector(vz, fma_vu); \
+      vec_fn(&wr, &wx, &wy, &wz); \
+      r = __builtin_convertvector(wr, fma_vu32); \
+      memcpy(out + i, &r, sizeof(r)); \
+    } \
+    if (i < n) { \
+      size_t bytes = (n - i) * sizeof(uint32_t); \
+      vx = vy = vz = (fma_vu32){0}; \
+      memcpy(&vx, x + i, bytes); \
+      memcpy(&vy, y + i, bytes); \
+      memcpy(&vz, z + i, bytes); \
+      wx = __builtin_convertvector(vx, fma_vu); \
+      wy = __builtin_convertvector(vy, fma_vu); \
+      wz = __builtin_convertvector(vz, fma_vu); \
+      vec_fn(&wr, &wx, &wy, &wz); \
+      r = __builtin_convertvector(wr, fma_vu32); \
+      memcpy(out + i, &r, bytes); \
+    } \
+  }
+FMA_BATCH_VARIANT(fma_model_ieee, fma_vec_ieee)
+FMA_BATCH_VARIANT(fma_model_bh, fma_vec_bh)
+FMA_BATCH_VARIANT(fma_model_wh, fma_vec_wh)
+#undef FMA_BATCH_VARIANT
+
+#undef fma_all
+#undef FMA_INLINE
+#undef fma_vec_wh
+#undef fma_vec_bh
+#undef fma_vec_ieee
+#undef fma_vu32
+#undef fma_vd
+#undef fma_vi
+#undef fma_vu
+#endif
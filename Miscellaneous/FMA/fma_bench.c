@@ -0,0 +1,359 @@
+/*
+ * SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Microbenchmark of the three models in fma.c, and of their batch versions in fma_batch.c, per
+ * class of input. Build with:
+ *   gcc -O2 fma_bench.c -o fma_bench
+ * Then run as:
+ *   ./fma_bench [-n INPUTS] [-r REPS] [-s SEED] [-c] [-b BASELINE.csv] [-x PERCENT]
+ *
+ * Each class of input is aimed at one path through the models: the main path, the normalisation
+ * of denormal inputs (which fma_model_bh and fma_model_wh instead flush), the NaN / Inf early exits,
+ * the p_m == 0 shortcut, and massive cancellation (a long normalisation shift of the result). Two
+ * further classes contain the same mixture of all of those, once grouped by class (so branches are
+ * predictable) and once shuffled (so they are not); the difference between the two is the cost of
+ * branch mispredictions.
+ *
+ * Latency is measured by making x of each call depend on the result of the previous call (via an
+ * AND with a zero which the compiler cannot see, then an XOR, so it includes those two operations).
+ * Throughput is measured with independent calls. The batch versions only have throughput.
+ *
+ * With -c, results are printed as CSV, which can be saved and then passed back with -b to compare
+ * against; the exit status is then 1 if anything got more than -x percent (default 10) slower.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fma_batch.c"
+
+// Section: Input generation
+
+// Values for fma_bench_class_t:
+#define CLASS_NORMAL       0 // Normal inputs, with x * y and z of similar magnitude
+#define CLASS_DENORMAL     1 // x and z denormal, y large
+#define CLASS_NAN_INF      2 // One of x, y, z is NaN or Inf
+#define CLASS_ZERO         3 // x or y is zero, so p_m == 0
+#define CLASS_CANCEL       4 // z within a few ulp of -(x * y)
+#define NUM_PURE_CLASSES   5
+#define CLASS_MIX_SORTED   5 // Equal parts of each of the above, grouped by class
+#define CLASS_MIX_SHUFFLED 6 // The same inputs as CLASS_MIX_SORTED, in random order
+#define NUM_CLASSES        7
+
+static const char* const g_class_names[NUM_CLASSES] = {
+  "normal", "denormal", "nan-inf", "zero", "cancel", "mix-sorted", "mix-shuffled"
+};
+
+typedef struct fma_bench_rng_t {
+  uint64_t state;
+} fma_bench_rng_t;
+
+static uint64_t rng_next(fma_bench_rng_t* r) { // splitmix64
+  uint64_t z = (r->state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static int32_t rng_range(fma_bench_rng_t* r, int32_t lo, int32_t hi) { // Uniform in [lo, hi]
+  return lo + (int32_t)(rng_next(r) % (uint64_t)(hi - lo + 1));
+}
+
+static uint32_t fp32_make(uint32_t sign, int32_t e, uint32_t mantissa) { // e is unbiased
+  return (sign & 0x80000000) | ((uint32_t)(e + 127) << 23) | (mantissa & 0x7fffff);
+}
+
+static uint32_t fp32_bits(float f) {
+  uint32_t u;
+  memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
+static float fp32_float(uint32_t u) {
+  float f;
+  memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+static void gen_input(int cls, fma_bench_rng_t* r, uint32_t* x, uint32_t* y, uint32_t* z) {
+  uint64_t bits = rng_next(r);
+  int32_t ex = rng_range(r, -20, 20), ey = rng_range(r, -20, 20);
+  *x = fp32_make(bits >> 32, ex, bits);
+  *y = fp32_make(bits >> 1, ey, bits >> 23);
+  *z = fp32_make(bits << 31, ex + ey + rng_range(r, -8, 8), rng_next(r));
+  switch (cls) {
+  case CLASS_DENORMAL:
+    *x = (*x & 0x80000000) | ((((uint32_t)bits & 0x7fffff) | 1) >> ((bits >> 40) & 15));
+    *y = fp32_make(*y, rng_range(r, 40, 100), *y);
+    *z = (*z & 0x80000000) | ((uint32_t)rng_next(r) & 0x7fffff);
+    break;
+  case CLASS_NAN_INF: {
+    uint32_t special = 0x7f800000 | (((bits >> 40) & 1) ? (uint32_t)rng_next(r) & 0x7fffff : 0);
+    switch ((bits >> 41) % 3) {
+    case 0: *x = (*x & 0x80000000) | special; break;
+    case 1: *y = (*y & 0x80000000) | special; break;
+    default: *z = (*z & 0x80000000) | special; break;
+    }
+    break; }
+  case CLASS_ZERO:
+    if ((bits >> 40) & 1) *x &= 0x80000000; else *y &= 0x80000000;
+    break;
+  case CLASS_CANCEL: {
+    double p = (double)fp32_float(*x) * (double)fp32_float(*y); // Exact
+    *z = fp32_bits((float)-p) + (uint32_t)rng_range(r, -4, 4); // Within a few ulp of -(x * y)
+    break; }
+  }
+}
+
+typedef struct fma_bench_inputs_t {
+  uint32_t* x;
+  uint32_t* y;
+  uint32_t* z;
+} fma_bench_inputs_t;
+
+static void gen_inputs(int cls, size_t n, uint64_t seed, fma_bench_inputs_t* in) {
+  fma_bench_rng_t rng = {seed ^ (0x9e3779b97f4a7c15ull * (cls + 1))};
+  if (cls < NUM_PURE_CLASSES) {
+    for (size_t i = 0; i < n; ++i) gen_input(cls, &rng, &in->x[i], &in->y[i], &in->z[i]);
+    return;
+  }
+  for (size_t i = 0; i < n; ++i) { // Grouped into NUM_PURE_CLASSES runs
+    gen_input((int)(i * NUM_PURE_CLASSES / n), &rng, &in->x[i], &in->y[i], &in->z[i]);
+  }
+  if (cls == CLASS_MIX_SHUFFLED) { // Fisher-Yates shuffle
+    for (size_t i = n - 1; i > 0; --i) {
+      size_t j = rng_next(&rng) % (i + 1);
+      uint32_t t;
+      t = in->x[i]; in->x[i] = in->x[j]; in->x[j] = t;
+      t = in->y[i]; in->y[i] = in->y[j]; in->y[j] = t;
+      t = in->z[i]; in->z[i] = in->z[j]; in->z[j] = t;
+    }
+  }
+}
+
+// Section: Timing
+
+// Values for fma_bench_impl_t:
+#define IMPL_SCALAR        0 // The scalar model, inlined into the benchmark loop
+#define IMPL_BATCH_GENERIC 1 // model##_batch_variant(FMA_ISA_GENERIC)
+#define IMPL_BATCH_AVX2    2 // model##_batch_variant(FMA_ISA_AVX2)
+#define IMPL_BATCH_AVX512  3 // model##_batch_variant(FMA_ISA_AVX512)
+#define NUM_IMPLS          4
+
+static const char* const g_impl_names[NUM_IMPLS] = {
+  "scalar", "batch-generic", "batch-avx2", "batch-avx512"
+};
+
+#define NUM_MODELS 3
+
+static const char* const g_model_names[NUM_MODELS] = {
+  "ieee", "bh", "wh"
+};
+
+static volatile uint32_t g_zero = 0;
+static volatile uint32_t g_sink;
+
+static double now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+#define FMA_BENCH_SCALAR(model) \
+  static uint32_t model##_latency(const fma_bench_inputs_t* in, uint32_t* out, size_t n) { \
+    (void)out; \
+    uint32_t zero = g_zero, r = 0; \
+    for (size_t i = 0; i < n; ++i) r = model(in->x[i] ^ (r & zero), in->y[i], in->z[i]); \
+    return r; \
+  } \
+  static uint32_t model##_throughput(const fma_bench_inputs_t* in, uint32_t* out, size_t n) { \
+    for (size_t i = 0; i < n; ++i) out[i] = model(in->x[i], in->y[i], in->z[i]); \
+    return out[n - 1]; \
+  }
+FMA_BENCH_SCALAR(fma_model_ieee)
+FMA_BENCH_SCALAR(fma_model_bh)
+FMA_BENCH_SCALAR(fma_model_wh)
+#undef FMA_BENCH_SCALAR
+
+typedef uint32_t (*fma_bench_scalar_fn)(const fma_bench_inputs_t* in, uint32_t* out, size_t n);
+
+static const fma_bench_scalar_fn g_scalar_fns[NUM_MODELS][2] = { // [model][latency, throughput]
+  {fma_model_ieee_latency, fma_model_ieee_throughput},
+  {fma_model_bh_latency, fma_model_bh_throughput},
+  {fma_model_wh_latency, fma_model_wh_throughput},
+};
+
+static fma_batch_fn batch_fn(int model, int impl) {
+  int isa = impl == IMPL_BATCH_AVX512 ? FMA_ISA_AVX512 : impl == IMPL_BATCH_AVX2 ? FMA_ISA_AVX2 : FMA_ISA_GENERIC;
+  switch (model) {
+  case 0: return fma_model_ieee_batch_variant(isa);
+  case 1: return fma_model_bh_batch_variant(isa);
+  default: return fma_model_wh_batch_variant(isa);
+  }
+}
+
+static int cmp_double(const void* a, const void* b) {
+  double l = *(const double*)a, r = *(const double*)b;
+  return (l > r) - (l < r);
+}
+
+typedef struct fma_bench_result_t {
+  double ns_min;    // Nanoseconds per element, fastest repetition
+  double ns_median; // Nanoseconds per element, median repetition
+} fma_bench_result_t;
+
+static fma_bench_result_t measure(int model, int impl, int latency, const fma_bench_inputs_t* in, uint32_t* out, size_t n, int reps) {
+  double* times = malloc(sizeof(double) * reps);
+  fma_batch_fn batch = impl == IMPL_SCALAR ? NULL : batch_fn(model, impl);
+  fma_bench_scalar_fn scalar = g_scalar_fns[model][!latency];
+  for (int rep = -1; rep < reps; ++rep) { // Repetition -1 is a warm-up
+    double t0 = now_ns();
+    if (batch) {
+      batch(in->x, in->y, in->z, out, n);
+      g_sink = out[n - 1];
+    } else {
+      g_sink = scalar(in, out, n);
+    }
+    double t1 = now_ns();
+    if (rep >= 0) times[rep] = (t1 - t0) / n;
+  }
+  qsort(times, reps, sizeof(double), cmp_double);
+  fma_bench_result_t result = {times[0], times[reps / 2]};
+  free(times);
+  return result;
+}
+
+// Section: Baseline comparison
+
+typedef struct fma_bench_baseline_t {
+  char key[96]; // "model,impl,mode,class"
+  double ns_min;
+} fma_bench_baseline_t;
+
+static fma_bench_baseline_t* g_baseline;
+static size_t g_baseline_count;
+
+static int load_baseline(const char* path) {
+  FILE* f = fopen(path, "r");
+  if (!f) return 0;
+  char line[512];
+  size_t cap = 0;
+  while (fgets(line, sizeof(line), f)) {
+    char model[16], impl[16], mode[16], cls[16];
+    double ns_min;
+    if (sscanf(line, "%15[^,],%15[^,],%15[^,],%15[^,],%*[^,],%*[^,],%lf", model, impl, mode, cls, &ns_min) != 5) {
+      continue; // Header or malformed
+    }
+    if (g_baseline_count == cap) {
+      cap = cap ? cap * 2 : 64;
+      g_baseline = realloc(g_baseline, sizeof(*g_baseline) * cap);
+    }
+    fma_bench_baseline_t* b = &g_baseline[g_baseline_count++];
+    snprintf(b->key, sizeof(b->key), "%s,%s,%s,%s", model, impl, mode, cls);
+    b->ns_min = ns_min;
+  }
+  fclose(f);
+  return 1;
+}
+
+static double baseline_ns(const char* key) { // NAN if not in the baseline
+  for (size_t i = 0; i < g_baseline_count; ++i) {
+    if (!strcmp(g_baseline[i].key, key)) return g_baseline[i].ns_min;
+  }
+  return NAN;
+}
+
+// Section: Main
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "Usage: %s [-n INPUTS] [-r REPS] [-s SEED] [-c] [-b BASELINE.csv] [-x PERCENT]\n", argv0);
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  long n = 65536;
+  long reps = 11;
+  uint64_t seed = 1;
+  int csv = 0;
+  const char* baseline_path = NULL;
+  double tolerance = 10;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:s:cb:x:h")) != -1) {
+    char* end;
+    errno = 0;
+    switch (opt) {
+    case 'n': n = strtol(optarg, &end, 0); if (*end || n < NUM_PURE_CLASSES || n > (1l << 28)) usage(argv[0]); break;
+    case 'r': reps = strtol(optarg, &end, 0); if (*end || reps < 1 || reps > 10000) usage(argv[0]); break;
+    case 's': seed = strtoull(optarg, &end, 0); if (*end || errno) usage(argv[0]); break;
+    case 'c': csv = 1; break;
+    case 'b': baseline_path = optarg; break;
+    case 'x': tolerance = strtod(optarg, &end); if (*end || !(tolerance >= 0)) usage(argv[0]); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc) usage(argv[0]);
+  if (baseline_path && !load_baseline(baseline_path)) {
+    fprintf(stderr, "Cannot read %s: %s\n", baseline_path, strerror(errno));
+    return 2;
+  }
+
+  fma_bench_inputs_t in;
+  in.x = malloc(sizeof(uint32_t) * n);
+  in.y = malloc(sizeof(uint32_t) * n);
+  in.z = malloc(sizeof(uint32_t) * n);
+  uint32_t* out = malloc(sizeof(uint32_t) * n);
+  if (!in.x || !in.y || !in.z || !out) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  int isa = fma_batch_isa();
+  int num_impls = IMPL_BATCH_GENERIC + 1 + isa; // The batch variants which this CPU supports
+
+  if (csv) {
+    printf("model,impl,mode,class,inputs,reps,ns_min,ns_median%s\n", baseline_path ? ",baseline_ns_min,ratio" : "");
+  } else {
+    printf("%ld inputs per class, best and median of %ld repetitions, in nanoseconds per element\n", n, reps);
+    printf("%-5s %-14s %-10s %-13s %9s %9s %10s%s\n", "model", "impl", "mode", "class", "ns_min", "ns_median", "M/s",
+      baseline_path ? "    vs base" : "");
+  }
+  int regressions = 0;
+  for (int cls = 0; cls < NUM_CLASSES; ++cls) {
+    gen_inputs(cls, n, seed, &in);
+    for (int model = 0; model < NUM_MODELS; ++model) {
+      for (int impl = 0; impl < num_impls; ++impl) {
+        for (int latency = impl == IMPL_SCALAR; latency >= 0; --latency) {
+          const char* mode = latency ? "latency" : "throughput";
+          fma_bench_result_t res = measure(model, impl, latency, &in, out, n, reps);
+          char key[96];
+          snprintf(key, sizeof(key), "%s,%s,%s,%s", g_model_names[model], g_impl_names[impl], mode, g_class_names[cls]);
+          double base = baseline_path ? baseline_ns(key) : NAN;
+          double ratio = res.ns_min / base;
+          int regressed = ratio > 1 + tolerance / 100;
+          regressions += regressed;
+          if (csv) {
+            printf("%s,%ld,%ld,%.4f,%.4f", key, n, reps, res.ns_min, res.ns_median);
+            if (baseline_path) printf(",%.4f,%.3f", base, ratio);
+            printf("\n");
+          } else {
+            printf("%-5s %-14s %-10s %-13s %9.3f %9.3f %10.1f", g_model_names[model], g_impl_names[impl], mode,
+              g_class_names[cls], res.ns_min, res.ns_median, 1e3 / res.ns_min);
+            if (baseline_path && isnan(base)) printf("          -");
+            else if (baseline_path) printf("  %8.3fx%s", ratio, regressed ? " *" : "");
+            printf("\n");
+          }
+          fflush(stdout);
+        }
+      }
+    }
+  }
+  if (baseline_path && !csv) {
+    printf("%d results more than %g%% slower than the baseline (* marks them)\n", regressions, tolerance);
+  }
+  return regressions != 0;
+}
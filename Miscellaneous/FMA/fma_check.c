@@ -0,0 +1,469 @@
+/*
+ * SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Differential test of fma_model_ieee against the host's fmaf, with branch coverage of all three
+ * models in fma.c. Build with:
+ *   gcc -O2 -pthread fma_check.c -o fma_check -lm
+ * Then run as:
+ *   ./fma_check [-t THREADS] [-n MILLIONS] [-s SEED]
+ *
+ * Exhaustive testing is out of the question (2^96 inputs), so instead the input space is sampled
+ * from several classes, each aimed at a different part of the models: uniformly random bits,
+ * every combination of interesting special values, specific exponent differences between x * y
+ * and z, near-total cancellation, results and inputs around the denormal boundary, and results
+ * which are exactly (or almost exactly) half way between two representable values.
+ *
+ * Work is split into units of FMA_CHECK_UNIT inputs. Each thread starts with an equal contiguous
+ * range of units and takes from the bottom of it; a thread whose range is empty steals the top half
+ * of another thread's remaining range.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Section: Branch coverage
+
+// Every `if` in fma.c is redirected through fma_check_cover, which counts how often its
+// condition was true and how often false. Each `if` gets a unique site number from __COUNTER__.
+#define FMA_CHECK_MAX_SITES 128
+
+typedef struct fma_check_site_t {
+  const char* func;
+  const char* file;
+  int line;
+} fma_check_site_t;
+
+static fma_check_site_t g_sites[FMA_CHECK_MAX_SITES];
+static _Thread_local uint64_t t_cover[FMA_CHECK_MAX_SITES][2];
+
+static inline int fma_check_cover(int site, const char* func, const char* file, int line, int cond) {
+  if (!t_cover[site][0] && !t_cover[site][1]) { // First visit by this thread
+    g_sites[site].func = func;
+    g_sites[site].file = file;
+    g_sites[site].line = line;
+  }
+  t_cover[site][cond != 0] += 1;
+  return cond;
+}
+
+enum { FMA_CHECK_SITE_BASE = __COUNTER__ + 1 };
+#define if(cond) if (fma_check_cover(__COUNTER__ - FMA_CHECK_SITE_BASE, __func__, __FILE__, __LINE__, !!(cond)))
+#include "fma.c"
+#undef if
+enum { FMA_CHECK_NUM_SITES = __COUNTER__ - FMA_CHECK_SITE_BASE };
+_Static_assert(FMA_CHECK_NUM_SITES <= FMA_CHECK_MAX_SITES, "Increase FMA_CHECK_MAX_SITES");
+
+// Section: Input generation
+
+#define FMA_CHECK_UNIT 65536 // Inputs per unit of work
+
+// Values for fma_check_class_t:
+#define CLASS_RANDOM       0 // Uniformly random bits
+#define CLASS_SPECIAL      1 // Special values (all combinations, then mixed with random values)
+#define CLASS_EXP_DIFF     2 // Specific differences between the exponents of x * y and of z
+#define CLASS_CANCEL       3 // z close to -(x * y)
+#define CLASS_DENORMAL     4 // Inputs or results around the denormal boundary
+#define CLASS_TIE          5 // x * y + z exactly or almost exactly half way between two values
+#define NUM_CLASSES        6
+
+static const char* const g_class_names[NUM_CLASSES] = {
+  "random", "special", "exp-diff", "cancel", "denormal", "tie"
+};
+
+static const uint32_t g_specials[] = {
+  0x00000000, // +0
+  0x00000001, // Smallest denormal
+  0x00000002,
+  0x003fffff,
+  0x00400000,
+  0x007fffff, // Largest denormal
+  0x00800000, // Smallest normal
+  0x00800001,
+  0x00ffffff,
+  0x01000000,
+  0x0c800000, // 2^-102
+  0x1f800000, // 2^-64
+  0x33800000, // 2^-24
+  0x34000000, // 2^-23
+  0x3f000000, // 0.5
+  0x3f7fffff, // Largest value below 1
+  0x3f800000, // 1
+  0x3f800001, // Smallest value above 1
+  0x3fc00000, // 1.5
+  0x40000000, // 2
+  0x4b000000, // 2^23
+  0x4b800000, // 2^24
+  0x5f800000, // 2^64
+  0x7e800000, // 2^126
+  0x7f000000, // 2^127
+  0x7f7fffff, // Largest finite
+  0x7f800000, // Inf
+  0x7f800001, // Signalling NaN
+  0x7fbfffff, // Signalling NaN
+  0x7fc00000, // Quiet NaN
+  0x7fffffff, // Quiet NaN
+};
+#define NUM_SPECIALS (sizeof(g_specials) / sizeof(g_specials[0]))
+#define NUM_SPECIAL_COMBOS (NUM_SPECIALS * 2 * NUM_SPECIALS * 2 * NUM_SPECIALS * 2)
+
+typedef struct fma_check_rng_t {
+  uint64_t state;
+} fma_check_rng_t;
+
+static uint64_t rng_next(fma_check_rng_t* r) { // splitmix64
+  uint64_t z = (r->state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static int32_t rng_range(fma_check_rng_t* r, int32_t lo, int32_t hi) { // Uniform in [lo, hi]
+  return lo + (int32_t)(rng_next(r) % (uint64_t)(hi - lo + 1));
+}
+
+static uint32_t fp32_make(uint32_t sign, int32_t e, uint32_t mantissa) { // e is unbiased
+  return (sign & 0x80000000) | ((uint32_t)(e + 127) << 23) | (mantissa & 0x7fffff);
+}
+
+static uint32_t fp32_bits(float f) {
+  uint32_t u;
+  memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
+static float fp32_float(uint32_t u) {
+  float f;
+  memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+static void gen_exp_diff(fma_check_rng_t* r, int32_t d, uint32_t* x, uint32_t* y, uint32_t* z) {
+  uint64_t bits = rng_next(r);
+  int32_t ex, ey, ez;
+  do {
+    ex = rng_range(r, -60, 60);
+    ey = rng_range(r, -60, 60);
+    ez = ex + ey - d;
+  } while (ez < -126 || ez > 127);
+  *x = fp32_make(bits >> 32, ex, bits);
+  *y = fp32_make(bits >> 1, ey, bits >> 23);
+  *z = fp32_make(bits << 31, ez, rng_next(r));
+}
+
+static void gen_cancel(fma_check_rng_t* r, uint32_t* x, uint32_t* y, uint32_t* z) {
+  uint64_t bits = rng_next(r);
+  *x = fp32_make(bits >> 32, rng_range(r, -40, 40), bits);
+  *y = fp32_make(bits >> 1, rng_range(r, -40, 40), bits >> 23);
+  double p = (double)fp32_float(*x) * (double)fp32_float(*y); // Exact
+  *z = fp32_bits((float)-p) + (uint32_t)rng_range(r, -4, 4); // Within a few ulp of -(x * y)
+}
+
+static void gen_denormal(fma_check_rng_t* r, uint32_t* x, uint32_t* y, uint32_t* z) {
+  uint64_t bits = rng_next(r);
+  switch (bits & 3) {
+  case 0: // Product and z both near the smallest normal
+    *x = fp32_make(bits >> 32, rng_range(r, -90, -36), bits);
+    *y = fp32_make(bits >> 1, rng_range(r, -155, -120) - (int32_t)(((*x >> 23) & 255) - 127), bits >> 23);
+    *z = fp32_make(bits << 31, rng_range(r, -126, -120), rng_next(r));
+    break;
+  case 1: // Product near the smallest normal, z denormal or zero
+    *x = fp32_make(bits >> 32, rng_range(r, -90, -36), bits);
+    *y = fp32_make(bits >> 1, rng_range(r, -152, -122) - (int32_t)(((*x >> 23) & 255) - 127), bits >> 23);
+    *z = ((uint32_t)(bits << 31)) | (rng_next(r) & ((bits & 4) ? 0x7fffff : 0xff));
+    break;
+  case 2: // Denormal times large
+    *x = ((uint32_t)(bits >> 32) & 0x80000000) | (((uint32_t)(bits >> 32) & 0x7fffff) >> ((bits >> 8) & 15));
+    *y = fp32_make(bits >> 1, rng_range(r, 0, 127), bits >> 23);
+    *z = fp32_make(bits << 31, rng_range(r, -126, 10), rng_next(r));
+    break;
+  default: // Denormal plus denormal
+    *x = ((uint32_t)(bits >> 32) & 0x807fffff);
+    *y = fp32_make(bits >> 1, rng_range(r, -3, 3), bits >> 23);
+    *z = ((uint32_t)(bits << 31)) | (rng_next(r) & 0x7fffff);
+    break;
+  }
+}
+
+static void gen_tie(fma_check_rng_t* r, uint32_t* x, uint32_t* y, uint32_t* z) {
+  // Mantissas of x and y have at most 12 significant bits, so x * y is exact in 24 bits, and
+  // then its least significant bit is placed at (or near) half an ulp of z.
+  uint64_t bits = rng_next(r);
+  uint32_t mx = (uint32_t)(bits & 0x7ff000), my = (uint32_t)((bits >> 12) & 0x7ff000);
+  int32_t ex = rng_range(r, -30, 30), ey = rng_range(r, -30, 30);
+  uint32_t xs = fp32_make(bits >> 32, ex, mx), ys = fp32_make(bits >> 33, ey, my);
+  int32_t p_lsb = (ex - 23 + __builtin_ctz(mx | 0x800000)) + (ey - 23 + __builtin_ctz(my | 0x800000));
+  int32_t ez = p_lsb + 24 + rng_range(r, -2, 2); // Aiming for half an ulp of z, i.e. 2^(ez - 24), to be 2^p_lsb
+  if (ez < -126) ez = -126;
+  if (ez > 127) ez = 127;
+  *x = xs;
+  *y = ys;
+  *z = fp32_make(bits >> 34, ez, rng_next(r));
+}
+
+static void gen_input(int cls, uint64_t sub, uint32_t i, fma_check_rng_t* r, uint32_t* x, uint32_t* y, uint32_t* z) {
+  switch (cls) {
+  case CLASS_SPECIAL: {
+    uint64_t k = sub * FMA_CHECK_UNIT + i;
+    if (k < NUM_SPECIAL_COMBOS) { // Every combination of specials and signs
+      *x = g_specials[k % NUM_SPECIALS] | (uint32_t)(k / NUM_SPECIALS % 2) << 31; k /= NUM_SPECIALS * 2;
+      *y = g_specials[k % NUM_SPECIALS] | (uint32_t)(k / NUM_SPECIALS % 2) << 31; k /= NUM_SPECIALS * 2;
+      *z = g_specials[k % NUM_SPECIALS] | (uint32_t)(k / NUM_SPECIALS % 2) << 31;
+    } else { // Each of x, y, z is special with probability 1/2
+      uint64_t bits = rng_next(r);
+      *x = (bits & 1) ? g_specials[(bits >> 8) % NUM_SPECIALS] ^ (uint32_t)(bits & 2) << 30 : (uint32_t)(bits >> 32);
+      bits = rng_next(r);
+      *y = (bits & 1) ? g_specials[(bits >> 8) % NUM_SPECIALS] ^ (uint32_t)(bits & 2) << 30 : (uint32_t)(bits >> 32);
+      bits = rng_next(r);
+      *z = (bits & 1) ? g_specials[(bits >> 8) % NUM_SPECIALS] ^ (uint32_t)(bits & 2) << 30 : (uint32_t)(bits >> 32);
+    }
+    break; }
+  case CLASS_EXP_DIFF: gen_exp_diff(r, (int32_t)(sub % 161) - 80, x, y, z); break;
+  case CLASS_CANCEL: gen_cancel(r, x, y, z); break;
+  case CLASS_DENORMAL: gen_denormal(r, x, y, z); break;
+  case CLASS_TIE: gen_tie(r, x, y, z); break;
+  default: {
+    uint64_t bits = rng_next(r);
+    *x = (uint32_t)bits;
+    *y = (uint32_t)(bits >> 32);
+    *z = (uint32_t)rng_next(r);
+    break; }
+  }
+}
+
+// Section: Work distribution
+
+typedef struct fma_check_queue_t {
+  _Atomic uint64_t range; // (hi << 32) | lo, meaning units [lo, hi) remain
+  char pad[56];
+} fma_check_queue_t;
+
+typedef struct fma_check_thread_t {
+  pthread_t thread;
+  unsigned index;
+  uint64_t tested[NUM_CLASSES];
+  uint64_t mismatches[NUM_CLASSES];
+  uint64_t cover[FMA_CHECK_MAX_SITES][2];
+} fma_check_thread_t;
+
+static fma_check_queue_t* g_queues;
+static fma_check_thread_t* g_threads;
+static unsigned g_num_threads;
+static uint64_t g_seed;
+static pthread_mutex_t g_print_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t g_printed_mismatches;
+
+static int queue_take(fma_check_queue_t* q, uint32_t* unit) { // Owner takes from the bottom
+  uint64_t r = atomic_load_explicit(&q->range, memory_order_relaxed);
+  for (;;) {
+    uint32_t lo = (uint32_t)r, hi = (uint32_t)(r >> 32);
+    if (lo >= hi) return 0;
+    if (atomic_compare_exchange_weak(&q->range, &r, ((uint64_t)hi << 32) | (lo + 1))) {
+      *unit = lo;
+      return 1;
+    }
+  }
+}
+
+static int queue_steal(fma_check_queue_t* victim, fma_check_queue_t* self) { // Thief takes the top half
+  uint64_t r = atomic_load_explicit(&victim->range, memory_order_relaxed);
+  for (;;) {
+    uint32_t lo = (uint32_t)r, hi = (uint32_t)(r >> 32);
+    if (lo >= hi) return 0;
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (atomic_compare_exchange_weak(&victim->range, &r, ((uint64_t)mid << 32) | lo)) {
+      // Our own range is empty, so no other thread will modify it until after this store.
+      atomic_store(&self->range, ((uint64_t)hi << 32) | mid);
+      return 1;
+    }
+  }
+}
+
+// Section: Checking
+
+static int fp32_is_nan(uint32_t u) {
+  return (u & 0x7fffffff) > 0x7f800000;
+}
+
+static void check_unit(fma_check_thread_t* t, uint32_t unit) {
+  int cls = unit % NUM_CLASSES;
+  uint64_t sub = unit / NUM_CLASSES;
+  fma_check_rng_t rng = {g_seed ^ (0x9e3779b97f4a7c15ull * (unit + 1))};
+  uint64_t mismatches = 0;
+  for (uint32_t i = 0; i < FMA_CHECK_UNIT; ++i) {
+    uint32_t x, y, z;
+    gen_input(cls, sub, i, &rng, &x, &y, &z);
+    uint32_t expected = fp32_bits(fmaf(fp32_float(x), fp32_float(y), fp32_float(z)));
+    uint32_t actual = fma_model_ieee(x, y, z);
+    (void)fma_model_bh(x, y, z);
+    (void)fma_model_wh(x, y, z);
+    if (actual != expected && !(fp32_is_nan(actual) && fp32_is_nan(expected))) {
+      mismatches += 1;
+      pthread_mutex_lock(&g_print_lock);
+      if (g_printed_mismatches++ < 20) {
+        printf("MISMATCH (%s): fma(0x%08x, 0x%08x, 0x%08x): model 0x%08x, host 0x%08x\n",
+          g_class_names[cls], x, y, z, actual, expected);
+      }
+      pthread_mutex_unlock(&g_print_lock);
+    }
+  }
+  t->tested[cls] += FMA_CHECK_UNIT;
+  t->mismatches[cls] += mismatches;
+}
+
+static void* check_thread_main(void* arg) {
+  fma_check_thread_t* t = (fma_check_thread_t*)arg;
+  fma_check_queue_t* self = &g_queues[t->index];
+  for (;;) {
+    uint32_t unit;
+    if (queue_take(self, &unit)) {
+      check_unit(t, unit);
+      continue;
+    }
+    int stole = 0;
+    for (unsigned k = 1; k < g_num_threads && !stole; ++k) {
+      stole = queue_steal(&g_queues[(t->index + k) % g_num_threads], self);
+    }
+    if (!stole) break;
+  }
+  memcpy(t->cover, t_cover, sizeof(t->cover));
+  return NULL;
+}
+
+// Section: Reporting
+
+static void print_source_line(const char* file, int line) {
+  FILE* f = file ? fopen(file, "r") : NULL;
+  if (!f) {
+    printf("\n");
+    return;
+  }
+  char buf[512];
+  for (int i = 1; fgets(buf, sizeof(buf), f); ++i) {
+    if (i == line) {
+      char* s = buf;
+      while (*s == ' ') ++s;
+      size_t n = strlen(s);
+      while (n && (s[n-1] == '\n' || s[n-1] == '\r')) s[--n] = '\0';
+      if (n > 72) strcpy(s + 69, "...");
+      printf("  %s\n", s);
+      fclose(f);
+      return;
+    }
+  }
+  printf("\n");
+  fclose(f);
+}
+
+static void report_coverage(void) {
+  uint64_t cover[FMA_CHECK_MAX_SITES][2] = {{0}};
+  for (unsigned i = 0; i < g_num_threads; ++i) {
+    for (int s = 0; s < FMA_CHECK_NUM_SITES; ++s) {
+      cover[s][0] += g_threads[i].cover[s][0];
+      cover[s][1] += g_threads[i].cover[s][1];
+    }
+  }
+  printf("\nBranch coverage (each `if` in fma.c; a site inside a macro is reported at the macro's use):\n");
+  printf("%-16s %5s %14s %14s\n", "function", "line", "true", "false");
+  int full = 0;
+  const char* func = NULL;
+  for (int s = 0; s < FMA_CHECK_NUM_SITES; ++s) {
+    const fma_check_site_t* site = &g_sites[s];
+    if (site->func) func = site->func;
+    full += cover[s][0] && cover[s][1];
+    const char* flag = (cover[s][0] && cover[s][1]) ? "" : " *";
+    if (site->func) {
+      printf("%-16s %5d %14llu %14llu%s", site->func, site->line,
+        (unsigned long long)cover[s][1], (unsigned long long)cover[s][0], flag);
+      print_source_line(site->file, site->line);
+    } else {
+      printf("%-16s %5s %14s %14s *  (site %d never evaluated)\n", func ? func : "?", "?", "0", "0", s);
+    }
+  }
+  printf("%d of %d branch sites seen both true and false (* marks the rest)\n", full, FMA_CHECK_NUM_SITES);
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "Usage: %s [-t THREADS] [-n MILLIONS] [-s SEED]\n", argv0);
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  double millions = 100;
+  g_seed = (uint64_t)time(NULL);
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:s:h")) != -1) {
+    char* end;
+    errno = 0;
+    switch (opt) {
+    case 't': threads = strtol(optarg, &end, 0); if (*end || threads < 1 || threads > 1024) usage(argv[0]); break;
+    case 'n': millions = strtod(optarg, &end); if (*end || !(millions > 0)) usage(argv[0]); break;
+    case 's': g_seed = strtoull(optarg, &end, 0); if (*end || errno) usage(argv[0]); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc) usage(argv[0]);
+  if (threads < 1) threads = 1;
+
+  double units_d = millions * 1e6 / FMA_CHECK_UNIT;
+  if (units_d > 4e9) units_d = 4e9;
+  uint32_t units = (uint32_t)units_d;
+  if (units < NUM_CLASSES) units = NUM_CLASSES;
+  g_num_threads = (unsigned)threads;
+  g_queues = aligned_alloc(64, sizeof(*g_queues) * g_num_threads);
+  g_threads = calloc(g_num_threads, sizeof(*g_threads));
+  if (!g_queues || !g_threads) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  for (unsigned i = 0; i < g_num_threads; ++i) {
+    uint64_t lo = (uint64_t)units * i / g_num_threads, hi = (uint64_t)units * (i + 1) / g_num_threads;
+    atomic_init(&g_queues[i].range, (hi << 32) | lo);
+  }
+  printf("Checking %llu inputs on %u threads (seed %llu)\n",
+    (unsigned long long)units * FMA_CHECK_UNIT, g_num_threads, (unsigned long long)g_seed);
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (unsigned i = 0; i < g_num_threads; ++i) {
+    g_threads[i].index = i;
+    int err = pthread_create(&g_threads[i].thread, NULL, check_thread_main, &g_threads[i]);
+    if (err) {
+      fprintf(stderr, "pthread_create failed: %s\n", strerror(err));
+      return 1;
+    }
+  }
+  for (unsigned i = 0; i < g_num_threads; ++i) {
+    pthread_join(g_threads[i].thread, NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+
+  uint64_t total_tested = 0, total_mismatches = 0;
+  printf("\n%-10s %14s %12s\n", "class", "inputs", "mismatches");
+  for (int c = 0; c < NUM_CLASSES; ++c) {
+    uint64_t tested = 0, mismatches = 0;
+    for (unsigned i = 0; i < g_num_threads; ++i) {
+      tested += g_threads[i].tested[c];
+      mismatches += g_threads[i].mismatches[c];
+    }
+    printf("%-10s %14llu %12llu\n", g_class_names[c], (unsigned long long)tested, (unsigned long long)mismatches);
+    total_tested += tested;
+    total_mismatches += mismatches;
+  }
+  printf("%-10s %14llu %12llu\n", "total", (unsigned long long)total_tested, (unsigned long long)total_mismatches);
+  printf("%.2f seconds, %.1f million inputs per second\n", secs, total_tested / secs * 1e-6);
+
+  report_coverage();
+  return total_mismatches != 0;
+}
@@ -0,0 +1,446 @@
+/*
+ * SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Measures how often, and why, the three models in fma.c give different results. Build with:
+ *   gcc -O2 -pthread fma_diverge.c -o fma_diverge
+ * Then run as either of:
+ *   ./fma_diverge [-t THREADS] [-o PREFIX] [-n MILLIONS] [-s SEED] [-g bits|narrow] [-e RANGE]
+ *   ./fma_diverge [-t THREADS] [-o PREFIX] X.bin Y.bin Z.bin
+ * The first form generates inputs: uniformly random bits, or (the default) values whose exponents
+ * are within RANGE (default 16) of 1.0, which is closer to typical tensor contents. The second form
+ * reads x, y, and z from three files of raw FP32 values (in host byte order) of equal size, for
+ * example tensors dumped from a model.
+ *
+ * Each triple is passed through all three models (via the batch versions in fma_batch.c), and two
+ * pairs of results are compared, in the same way as the README describes the differences:
+ * fma_model_bh against fma_model_ieee, and fma_model_wh against fma_model_bh. Every difference is
+ * attributed to one cause, and its distance in ulp is counted in a histogram. The causes of
+ * bh / ieee differences are decided from the inputs, in order of precedence: a denormal input, the
+ * product on its own overflowing, the product on its own underflowing, a denormal result, and
+ * otherwise the realignment of the product to the addend. The causes of wh / bh differences are
+ * decided from the two results: both NaN, Inf versus NaN, zeros of different sign, only the wh
+ * result flushed to zero, and otherwise (both finite and non-zero) the sticky bit bug.
+ *
+ * Triples are also counted in a 32x32 grid of (exponent of x * y, exponent of z), which is printed
+ * as a heatmap of how often each pair of models differs. With -o, the full histograms and heatmaps
+ * per cause are also written to PREFIX_hist.csv and PREFIX_heatmap.csv.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "fma_batch.c"
+
+#define FMA_DIVERGE_UNIT 16384 // Triples per unit of work
+
+// Section: Classification
+
+// Values for pair:
+#define PAIR_BH_IEEE 0
+#define PAIR_WH_BH   1
+#define NUM_PAIRS    2
+
+#define NUM_CAUSES 6
+
+static const char* const g_pair_names[NUM_PAIRS] = {"bh vs ieee", "wh vs bh"};
+static const char* const g_pair_ids[NUM_PAIRS] = {"bh-ieee", "wh-bh"};
+
+// Causes for PAIR_BH_IEEE:
+#define CAUSE_DENORMAL_INPUT    0 // A denormal input (which bh flushes)
+#define CAUSE_PRODUCT_OVERFLOW  1 // x * y on its own overflows
+#define CAUSE_PRODUCT_UNDERFLOW 2 // x * y on its own underflows
+#define CAUSE_DENORMAL_OUTPUT   3 // The ieee result is denormal (which bh flushes)
+#define CAUSE_PRODUCT_REALIGN   4 // The product loses 23 bits when realigned to the addend
+// Causes for PAIR_WH_BH:
+#define CAUSE_NAN_PAYLOAD       0 // Both are NaN, but wh has other bits set
+#define CAUSE_INF_VS_NAN        1 // bh gives Inf, wh gives NaN
+#define CAUSE_ZERO_SIGN         2 // Both are zero, but bh is -0
+#define CAUSE_DENORMAL_ROUNDING 3 // Only wh flushes to zero
+#define CAUSE_STICKY_BIT        4 // Both finite and non-zero (the shift right of r_m)
+#define CAUSE_OTHER             5 // Anything else (not expected to happen)
+
+static const char* const g_cause_names[NUM_PAIRS][NUM_CAUSES] = {
+  {"denormal-input", "product-overflow", "product-underflow", "denormal-output", "product-realign", NULL},
+  {"nan-payload", "inf-vs-nan", "zero-sign", "denormal-rounding", "sticky-bit", "other"},
+};
+
+static int cause_bh_ieee(uint32_t x, uint32_t y, uint32_t z, uint32_t ieee) {
+  int32_t x_e = (x >> 23) & 255, y_e = (y >> 23) & 255, z_e = (z >> 23) & 255;
+  if ((x_e == 0 && (x & 0x7fffff)) || (y_e == 0 && (y & 0x7fffff)) || (z_e == 0 && (z & 0x7fffff))) {
+    return CAUSE_DENORMAL_INPUT;
+  }
+  if (x_e != 255 && y_e != 255 && z_e != 255) {
+    int32_t p_e = x_e + y_e - 127; // As per p_e in fma_model_bh, after realignment
+    if (p_e >= 255) return CAUSE_PRODUCT_OVERFLOW;
+    if (p_e < 0 && x_e && y_e) return CAUSE_PRODUCT_UNDERFLOW;
+  }
+  if (!(ieee & 0x7f800000) && (ieee & 0x7fffff)) return CAUSE_DENORMAL_OUTPUT;
+  return CAUSE_PRODUCT_REALIGN;
+}
+
+static int cause_wh_bh(uint32_t bh, uint32_t wh) {
+  int bh_nan = (bh & 0x7fffffff) > 0x7f800000, wh_nan = (wh & 0x7fffffff) > 0x7f800000;
+  if (bh_nan && wh_nan) return CAUSE_NAN_PAYLOAD;
+  if (wh_nan && (bh & 0x7fffffff) == 0x7f800000) return CAUSE_INF_VS_NAN;
+  if (bh_nan || wh_nan) return CAUSE_OTHER;
+  if (!(bh & 0x7fffffff) && !(wh & 0x7fffffff)) return CAUSE_ZERO_SIGN;
+  if (!(wh & 0x7fffffff)) return CAUSE_DENORMAL_ROUNDING;
+  if (!(bh & 0x7fffffff)) return CAUSE_OTHER;
+  return CAUSE_STICKY_BIT;
+}
+
+// Bucket 0 is a distance of 0 ulp (i.e. +0 vs -0), bucket k in [1, 32] is a distance in
+// [2^(k-1), 2^k), and the last bucket is when either result is NaN.
+#define ULP_BUCKETS 34
+
+static int ulp_bucket(uint32_t a, uint32_t b) {
+  if ((a & 0x7fffffff) > 0x7f800000 || (b & 0x7fffffff) > 0x7f800000) return ULP_BUCKETS - 1;
+  int64_t oa = (a >> 31) ? -(int64_t)(a & 0x7fffffff) : (int64_t)a; // Ordered as integers
+  int64_t ob = (b >> 31) ? -(int64_t)(b & 0x7fffffff) : (int64_t)b;
+  uint64_t d = oa > ob ? oa - ob : ob - oa;
+  return d ? 64 - __builtin_clzll(d) : 0;
+}
+
+// The grid covers unbiased exponents of x * y from -256 to 255 in steps of 16, and of z from -128
+// to 127 in steps of 8 (Inf and NaN being in the last row).
+#define HEAT 32
+#define HEAT_P_MIN (-256)
+#define HEAT_P_STEP 16
+#define HEAT_Z_MIN (-128)
+#define HEAT_Z_STEP 8
+
+static int heat_cell(uint32_t x, uint32_t y, uint32_t z) {
+  int32_t p = (int32_t)((x >> 23) & 255) + (int32_t)((y >> 23) & 255) - 254;
+  int32_t e = (int32_t)((z >> 23) & 255) - 127;
+  int32_t pi = (p - HEAT_P_MIN) / HEAT_P_STEP, zi = (e - HEAT_Z_MIN) / HEAT_Z_STEP;
+  if (pi > HEAT - 1) pi = HEAT - 1;
+  if (zi > HEAT - 1) zi = HEAT - 1;
+  return zi * HEAT + pi;
+}
+
+// Section: Inputs
+
+typedef struct fma_diverge_t {
+  // Inputs: either files, or generated
+  const uint32_t* files[3];
+  int narrow;    // Generated exponents within +/- range of 1.0, otherwise random bits
+  uint32_t range;
+  uint64_t seed;
+  uint64_t count;
+  // Work distribution
+  _Atomic size_t next_unit;
+  size_t n_units;
+  fma_batch_fn ieee, bh, wh;
+} fma_diverge_t;
+
+typedef struct fma_diverge_stats_t {
+  uint64_t compared;
+  uint64_t differ[NUM_PAIRS];
+  uint64_t hist[NUM_PAIRS][NUM_CAUSES][ULP_BUCKETS];
+  uint64_t cell_total[HEAT * HEAT];
+  uint64_t cell_differ[NUM_PAIRS][NUM_CAUSES][HEAT * HEAT];
+} fma_diverge_stats_t;
+
+static uint64_t mix64(uint64_t v) { // The murmur3 finaliser, as a counter-based generator
+  v ^= v >> 33;
+  v *= 0xff51afd7ed558ccdull;
+  v ^= v >> 33;
+  v *= 0xc4ceb9fe1a85ec53ull;
+  return v ^ (v >> 33);
+}
+
+static uint32_t gen_narrow(uint32_t bits, uint32_t range) { // Sign, mantissa, and exponent within range of 1.0
+  uint32_t e = 127 - range + ((((bits >> 23) & 255) * (2 * range + 1)) >> 8);
+  return (bits & 0x807fffff) | (e << 23);
+}
+
+static void gen_inputs(const fma_diverge_t* d, uint64_t first, size_t n, uint32_t* x, uint32_t* y, uint32_t* z) {
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t k = (first + i) * 2 + d->seed * 0x9e3779b97f4a7c15ull;
+    uint64_t a = mix64(k), b = mix64(k + 1);
+    x[i] = (uint32_t)a;
+    y[i] = (uint32_t)(a >> 32);
+    z[i] = (uint32_t)b;
+    if (d->narrow) {
+      x[i] = gen_narrow(x[i], d->range);
+      y[i] = gen_narrow(y[i], d->range);
+      z[i] = gen_narrow(z[i], d->range);
+    }
+  }
+}
+
+// Section: Comparison
+
+static void compare_unit(const fma_diverge_t* d, size_t unit, uint32_t* buf, fma_diverge_stats_t* s) {
+  uint64_t first = (uint64_t)unit * FMA_DIVERGE_UNIT;
+  size_t n = d->count - first < FMA_DIVERGE_UNIT ? (size_t)(d->count - first) : FMA_DIVERGE_UNIT;
+  const uint32_t *x, *y, *z;
+  if (d->files[0]) {
+    x = d->files[0] + first, y = d->files[1] + first, z = d->files[2] + first;
+  } else {
+    gen_inputs(d, first, n, buf, buf + FMA_DIVERGE_UNIT, buf + 2 * FMA_DIVERGE_UNIT);
+    x = buf, y = buf + FMA_DIVERGE_UNIT, z = buf + 2 * FMA_DIVERGE_UNIT;
+  }
+  uint32_t* r_ieee = buf + 3 * FMA_DIVERGE_UNIT;
+  uint32_t* r_bh = buf + 4 * FMA_DIVERGE_UNIT;
+  uint32_t* r_wh = buf + 5 * FMA_DIVERGE_UNIT;
+  d->ieee(x, y, z, r_ieee, n);
+  d->bh(x, y, z, r_bh, n);
+  d->wh(x, y, z, r_wh, n);
+  for (size_t i = 0; i < n; ++i) {
+    int cell = heat_cell(x[i], y[i], z[i]);
+    s->cell_total[cell] += 1;
+    if (r_bh[i] != r_ieee[i]) {
+      int cause = cause_bh_ieee(x[i], y[i], z[i], r_ieee[i]);
+      s->differ[PAIR_BH_IEEE] += 1;
+      s->hist[PAIR_BH_IEEE][cause][ulp_bucket(r_bh[i], r_ieee[i])] += 1;
+      s->cell_differ[PAIR_BH_IEEE][cause][cell] += 1;
+    }
+    if (r_wh[i] != r_bh[i]) {
+      int cause = cause_wh_bh(r_bh[i], r_wh[i]);
+      s->differ[PAIR_WH_BH] += 1;
+      s->hist[PAIR_WH_BH][cause][ulp_bucket(r_wh[i], r_bh[i])] += 1;
+      s->cell_differ[PAIR_WH_BH][cause][cell] += 1;
+    }
+  }
+  s->compared += n;
+}
+
+typedef struct fma_diverge_thread_t {
+  fma_diverge_t* d;
+  fma_diverge_stats_t* stats;
+} fma_diverge_thread_t;
+
+static void* compare_thread_main(void* arg) {
+  fma_diverge_thread_t* t = (fma_diverge_thread_t*)arg;
+  uint32_t* buf = malloc(sizeof(uint32_t) * 6 * FMA_DIVERGE_UNIT);
+  if (!buf) return NULL; // Other threads will do the work instead
+  size_t u;
+  while ((u = atomic_fetch_add_explicit(&t->d->next_unit, 1, memory_order_relaxed)) < t->d->n_units) {
+    compare_unit(t->d, u, buf, t->stats);
+  }
+  free(buf);
+  return NULL;
+}
+
+// Section: Reporting
+
+static void report_histograms(const fma_diverge_stats_t* s) {
+  // Buckets merged for printing: 0, 1, 2-3, 4-255, 256-65535, >= 65536, NaN
+  static const int first_bucket[] = {0, 1, 2, 3, 9, 17, ULP_BUCKETS - 1, ULP_BUCKETS};
+  for (int p = 0; p < NUM_PAIRS; ++p) {
+    printf("\n%s: %llu differ (%.4f%%)\n", g_pair_names[p], (unsigned long long)s->differ[p],
+      s->compared ? 100.0 * s->differ[p] / s->compared : 0.0);
+    printf("%-18s %14s %9s %12s %12s %12s %12s %12s %12s %12s\n", "cause", "count", "%", "0 ulp", "1 ulp",
+      "2-3 ulp", "4-255", "256-65535", ">= 65536", "NaN");
+    for (int c = 0; c < NUM_CAUSES && g_cause_names[p][c]; ++c) {
+      uint64_t total = 0;
+      for (int b = 0; b < ULP_BUCKETS; ++b) total += s->hist[p][c][b];
+      printf("%-18s %14llu %9.4f", g_cause_names[p][c], (unsigned long long)total,
+        s->compared ? 100.0 * total / s->compared : 0.0);
+      for (int col = 0; col < 7; ++col) {
+        uint64_t sum = 0;
+        for (int b = first_bucket[col]; b < first_bucket[col + 1]; ++b) sum += s->hist[p][c][b];
+        printf(" %12llu", (unsigned long long)sum);
+      }
+      printf("\n");
+    }
+  }
+}
+
+static void report_heatmap(const fma_diverge_stats_t* s, int p) {
+  printf("\n%s: fraction of triples which differ, by exponent of x * y (across) and of z (down)\n", g_pair_names[p]);
+  printf("(blank: no triples, '.': none differ, '1' to '9': up to 10%% to 90%%, '#': over 90%%)\n");
+  for (int zi = HEAT - 1; zi >= 0; --zi) {
+    printf("%5d |", HEAT_Z_MIN + zi * HEAT_Z_STEP);
+    for (int pi = 0; pi < HEAT; ++pi) {
+      int cell = zi * HEAT + pi;
+      uint64_t total = s->cell_total[cell], differ = 0;
+      for (int c = 0; c < NUM_CAUSES; ++c) differ += s->cell_differ[p][c][cell];
+      char ch = ' ';
+      if (total) {
+        double frac = (double)differ / total;
+        ch = !differ ? '.' : frac > 0.9 ? '#' : (char)('1' + (int)(frac * 10));
+      }
+      printf(" %c", ch);
+    }
+    printf("\n");
+  }
+  printf("      +");
+  for (int pi = 0; pi < HEAT; ++pi) printf("--");
+  printf("\n       ");
+  for (int pi = 0; pi < HEAT; pi += 4) printf("%-8d", HEAT_P_MIN + pi * HEAT_P_STEP);
+  printf("\n");
+}
+
+static int write_csv(const fma_diverge_stats_t* s, const char* prefix) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s_hist.csv", prefix);
+  FILE* f = fopen(path, "w");
+  if (!f) return -1;
+  fprintf(f, "pair,cause,ulp_min,ulp_max,count\n");
+  for (int p = 0; p < NUM_PAIRS; ++p) {
+    for (int c = 0; c < NUM_CAUSES && g_cause_names[p][c]; ++c) {
+      for (int b = 0; b < ULP_BUCKETS; ++b) {
+        if (b == ULP_BUCKETS - 1) {
+          fprintf(f, "%s,%s,nan,nan,", g_pair_ids[p], g_cause_names[p][c]);
+        } else {
+          fprintf(f, "%s,%s,%llu,%llu,", g_pair_ids[p], g_cause_names[p][c],
+            b ? 1ull << (b - 1) : 0ull, b ? (1ull << b) - 1 : 0ull);
+        }
+        fprintf(f, "%llu\n", (unsigned long long)s->hist[p][c][b]);
+      }
+    }
+  }
+  if (fclose(f)) return -1;
+
+  snprintf(path, sizeof(path), "%s_heatmap.csv", prefix);
+  f = fopen(path, "w");
+  if (!f) return -1;
+  fprintf(f, "pair,cause,p_exp_min,z_exp_min,differ,total\n");
+  for (int p = 0; p < NUM_PAIRS; ++p) {
+    for (int c = 0; c < NUM_CAUSES && g_cause_names[p][c]; ++c) {
+      for (int cell = 0; cell < HEAT * HEAT; ++cell) {
+        if (!s->cell_total[cell]) continue;
+        fprintf(f, "%s,%s,%d,%d,%llu,%llu\n", g_pair_ids[p], g_cause_names[p][c],
+          HEAT_P_MIN + (cell % HEAT) * HEAT_P_STEP, HEAT_Z_MIN + (cell / HEAT) * HEAT_Z_STEP,
+          (unsigned long long)s->cell_differ[p][c][cell], (unsigned long long)s->cell_total[cell]);
+      }
+    }
+  }
+  return fclose(f) ? -1 : 0;
+}
+
+// Section: Main
+
+static const uint32_t* map_file(const char* path, uint64_t* count) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat st;
+  void* p = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) return NULL;
+  madvise(p, st.st_size, MADV_SEQUENTIAL);
+  *count = (uint64_t)st.st_size / sizeof(uint32_t);
+  return (const uint32_t*)p;
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "Usage: %s [-t THREADS] [-o PREFIX] [-n MILLIONS] [-s SEED] [-g bits|narrow] [-e RANGE]\n", argv0);
+  fprintf(stderr, "       %s [-t THREADS] [-o PREFIX] X.bin Y.bin Z.bin\n", argv0);
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  double millions = 100;
+  const char* prefix = NULL;
+  fma_diverge_t d = {.narrow = 1, .range = 16, .seed = (uint64_t)time(NULL)};
+  int opt;
+  while ((opt = getopt(argc, argv, "t:o:n:s:g:e:h")) != -1) {
+    char* end;
+    errno = 0;
+    switch (opt) {
+    case 't': threads = strtol(optarg, &end, 0); if (*end || threads < 1 || threads > 1024) usage(argv[0]); break;
+    case 'o': prefix = optarg; break;
+    case 'n': millions = strtod(optarg, &end); if (*end || !(millions > 0) || millions > 1e9) usage(argv[0]); break;
+    case 's': d.seed = strtoull(optarg, &end, 0); if (*end || errno) usage(argv[0]); break;
+    case 'g':
+      if (!strcmp(optarg, "bits")) d.narrow = 0;
+      else if (!strcmp(optarg, "narrow")) d.narrow = 1;
+      else usage(argv[0]);
+      break;
+    case 'e': d.range = (uint32_t)strtoul(optarg, &end, 0); if (*end || d.range > 126) usage(argv[0]); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind == argc - 3) {
+    uint64_t counts[3];
+    for (int i = 0; i < 3; ++i) {
+      d.files[i] = map_file(argv[optind + i], &counts[i]);
+      if (!d.files[i]) {
+        fprintf(stderr, "Cannot read %s: %s\n", argv[optind + i], errno ? strerror(errno) : "empty file");
+        return 2;
+      }
+    }
+    if (counts[0] != counts[1] || counts[0] != counts[2]) {
+      fprintf(stderr, "X, Y, and Z must contain the same number of FP32 values\n");
+      return 2;
+    }
+    d.count = counts[0];
+  } else if (optind == argc) {
+    d.count = (uint64_t)(millions * 1e6);
+  } else {
+    usage(argv[0]);
+  }
+  int isa = fma_batch_isa();
+  d.ieee = fma_model_ieee_batch_variant(isa);
+  d.bh = fma_model_bh_batch_variant(isa);
+  d.wh = fma_model_wh_batch_variant(isa);
+  d.n_units = (d.count + FMA_DIVERGE_UNIT - 1) / FMA_DIVERGE_UNIT;
+  atomic_init(&d.next_unit, 0);
+  if ((uint64_t)threads > d.n_units) threads = d.n_units ? (long)d.n_units : 1;
+
+  fma_diverge_thread_t* ts = calloc(threads, sizeof(*ts));
+  pthread_t* workers = calloc(threads, sizeof(*workers));
+  if (!ts || !workers) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  for (long i = 0; i < threads; ++i) {
+    ts[i].d = &d;
+    ts[i].stats = calloc(1, sizeof(fma_diverge_stats_t));
+    if (!ts[i].stats) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+  }
+  if (d.files[0]) {
+    printf("Comparing %llu triples from files on %ld threads\n", (unsigned long long)d.count, threads);
+  } else if (d.narrow) {
+    printf("Comparing %llu triples with exponents within 2^+/-%u on %ld threads (seed %llu)\n",
+      (unsigned long long)d.count, d.range, threads, (unsigned long long)d.seed);
+  } else {
+    printf("Comparing %llu triples of random bits on %ld threads (seed %llu)\n",
+      (unsigned long long)d.count, threads, (unsigned long long)d.seed);
+  }
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  long started = 0;
+  while (started < threads - 1 && pthread_create(&workers[started], NULL, compare_thread_main, &ts[started + 1]) == 0) ++started;
+  compare_thread_main(&ts[0]);
+  for (long i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+
+  fma_diverge_stats_t* s = ts[0].stats; // Merge the others into the first
+  for (long i = 1; i < threads; ++i) {
+    const uint64_t* src = (const uint64_t*)ts[i].stats;
+    uint64_t* dst = (uint64_t*)s;
+    for (size_t k = 0; k < sizeof(*s) / sizeof(uint64_t); ++k) dst[k] += src[k];
+  }
+  if (s->compared != d.count) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  printf("%.2f seconds, %.1f million triples per second\n", secs, s->compared / secs * 1e-6);
+  report_histograms(s);
+  for (int p = 0; p < NUM_PAIRS; ++p) report_heatmap(s, p);
+  if (prefix && write_csv(s, prefix)) {
+    fprintf(stderr, "Cannot write %s_*.csv: %s\n", prefix, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,224 @@
+/*
+ * SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Header-only C++17 version of the models in fma.c, as a single constexpr function template.
+ * The three models in fma.c differ in three independent respects, each of which is a policy:
+ * 1) Denormals: gradual underflow (IEEE754), flushed after rounding with the sign preserved
+ *    (Blackhole), or flushed both before and after rounding with the sign discarded (Wormhole).
+ * 2) Realign: the addend is realigned to the product and added with a 64-bit adder (IEEE754), or
+ *    the product is realigned to the addend and added with a 32-bit adder (Blackhole, Wormhole).
+ * 3) NaNs: NaN results are the canonical NaN (IEEE754, Blackhole), or are formed from the sign of
+ *    the product or addend, and can then have mantissa bits leak in (Wormhole).
+ *
+ * fma_models::fma_model<fma_models::Arch::Wormhole>(x, y, z) is bit-identical to fma_model_wh(x,
+ * y, z), and similarly for Arch::Blackhole and Arch::IEEE. Other combinations of policies can be
+ * used via fma_models::fma_model_with<fma_models::Policy<...>>, for exploring the consequences of
+ * each difference in isolation. As everything is constexpr, results can be computed at compile time:
+ *
+ *   static_assert(fma_models::fma_model<fma_models::Arch::Wormhole>(0x7f800000, 0, 0) == 0x7f800001);
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+
+namespace fma_models {
+
+enum class Denormals { Gradual, FlushKeepSign, FlushDiscardSign };
+enum class Realign { AddendToProduct, ProductToAddend };
+enum class NaNs { Canonical, Wormhole };
+
+template <Denormals D, Realign R, NaNs N>
+struct Policy {
+  static constexpr Denormals denormals = D;
+  static constexpr Realign realign = R;
+  static constexpr NaNs nans = N;
+};
+
+enum class Arch { IEEE, Blackhole, Wormhole };
+
+template <Arch A> struct ArchPolicy;
+template <> struct ArchPolicy<Arch::IEEE> { using type = Policy<Denormals::Gradual, Realign::AddendToProduct, NaNs::Canonical>; };
+template <> struct ArchPolicy<Arch::Blackhole> { using type = Policy<Denormals::FlushKeepSign, Realign::ProductToAddend, NaNs::Canonical>; };
+template <> struct ArchPolicy<Arch::Wormhole> { using type = Policy<Denormals::FlushDiscardSign, Realign::ProductToAddend, NaNs::Wormhole>; };
+
+namespace detail {
+
+struct Unpacked {
+  int32_t e;  // (biased) exponent
+  uint64_t m; // mantissa (including implicit bit)
+};
+
+template <Denormals D>
+constexpr Unpacked unpack(uint32_t v) {
+  Unpacked u = {int32_t((v >> 23) & 255), (v & 0x7fffff) ^ 0x800000};
+  if (u.e == 0) {
+    if constexpr (D == Denormals::Gradual) { // convert denormal to something closer to normal
+      u.m ^= 0x800000;
+      u.e = 9 - __builtin_clz(uint32_t(u.m) | 1);
+      u.m <<= 1 - u.e;
+    } else { // flush denormals
+      u.m = 0;
+    }
+  }
+  return u;
+}
+
+// Shifts right by s, with any bits shifted out being ORed into the lowest bit. For the semi
+// variant, nothing is ORed in when the result is zero.
+template <bool Semi, typename T>
+constexpr T sticky_shift(T var, int32_t s) {
+  if (s >= int32_t(sizeof(T) * 8)) return Semi ? 0 : (var != 0);
+  T orig = var;
+  var >>= s;
+  if (!Semi || var) var |= ((T)(var << s) != orig);
+  return var;
+}
+
+template <typename T>
+constexpr int32_t clz(T v) {
+  if constexpr (sizeof(T) == 8) return __builtin_clzll(v); else return __builtin_clz(v);
+}
+
+} // namespace detail
+
+template <class P>
+constexpr uint32_t fma_model_with(uint32_t x, uint32_t y, uint32_t z) noexcept { // Compute x * y + z
+  constexpr bool to_addend = P::realign == Realign::ProductToAddend;
+  constexpr bool discard_sign = P::denormals == Denormals::FlushDiscardSign;
+  using adder_t = std::conditional_t<to_addend, uint32_t, uint64_t>;
+
+  // Unpack inputs
+  auto [x_e, x_m] = detail::unpack<P::denormals>(x);
+  auto [y_e, y_m] = detail::unpack<P::denormals>(y);
+  auto [z_e, z_m] = detail::unpack<P::denormals>(z);
+  uint32_t z_sign = z & 0x80000000;
+
+  // p = x * y
+  uint32_t p_sign = (x ^ y) & 0x80000000;
+  uint64_t p_m = x_m * y_m;
+  int32_t p_e = x_e + y_e - 23 - 127;
+
+  // Add three extra bits of precision (aka. G, R, S bits)
+  p_m <<= 3, z_m <<= 3;
+
+  if constexpr (to_addend) { // Realign p_m to match z_m (removing 23 bits)
+    p_m = (p_m >> 23) | ((p_m & 0x7fffff) != 0);
+    p_e += 23;
+  }
+
+  // Handle NaN or Inf input, or (x * y) Inf if it is known yet
+  // With NaNs::Wormhole, NaN results aren't returned immediately; some mantissa bits can subsequently leak in
+  uint32_t nan_result = 0;
+  bool p_inf = to_addend && p_e >= 255;
+  if (x_e == 255 || y_e == 255 || p_inf || z_e == 255) {
+    bool invalid_mul = (x_e == 255 && (x_m != 0x800000 || y_m == 0)) // x NaN or x Inf times y zero
+                    || (y_e == 255 && (y_m != 0x800000 || x_m == 0)); // y NaN or y Inf times x zero
+    if constexpr (P::nans == NaNs::Canonical) {
+      if (invalid_mul
+      ||  (z_e == 255 && z_m != 0x4000000) // z NaN
+      ||  (z_e == 255 && (x_e == 255 || y_e == 255) && (z_sign != p_sign))) { // z Inf and (x * y) Inf and signs differ
+        return 0x7fc00000; // NaN output
+      }
+    } else {
+      if (invalid_mul
+      ||  (z_e == 255 && z_m == 0x4000000 && (x_e == 255 || y_e == 255 || p_inf) && (z_sign != p_sign))) { // z Inf and (x * y) Inf and signs differ
+        nan_result = p_sign | 0x7f800001;
+      } else if (z_e == 255 && z_m != 0x4000000) { // z NaN
+        nan_result = z_sign | 0x7f800001;
+      }
+    }
+    if (!nan_result) {
+      if (z_e == 255) { // z Inf
+        return z; // Inf output
+      } else { // (x * y) Inf
+        return p_sign | 0x7f800000; // Inf output
+      }
+    }
+    if (p_e > 255) p_e = 255;
+  }
+  // The result when r == 0 or is flushed to zero: p_sign & z_sign is correct for IEEE754
+  uint32_t zero_result = nan_result ? nan_result : discard_sign ? 0 : z_sign & p_sign;
+
+  if constexpr (!to_addend) { // Realign z_m to match p_m (adding 23 bits)
+    z_m <<= 23;
+    z_e -= 23;
+  }
+
+  // Shortcut if p == 0, or if the multiply on its own would underflow
+  if (p_m == 0 || (to_addend && p_e < 0)) {
+    if (nan_result) {
+      p_m = 0, p_e = 0;
+    } else {
+      return z_m ? z : zero_result;
+    }
+  }
+
+  // r = z + p
+  adder_t pa = adder_t(p_m), za = adder_t(z_m);
+  int32_t r_e = p_e > z_e ? p_e : z_e;
+  if (p_e < r_e) pa = detail::sticky_shift<to_addend>(pa, r_e - p_e); // Discard low bits from p_m
+  if (z_e < r_e) za = detail::sticky_shift<to_addend>(za, r_e - z_e); // Discard low bits from z_m
+  uint32_t r_sign = pa >= za ? p_sign : z_sign;
+  if (z_sign != r_sign) za = ~za;
+  if (p_sign != r_sign) pa = ~pa;
+  adder_t r_m = za + pa + (p_sign != z_sign);
+
+  // Shortcut if r == 0
+  if (r_m == 0) return zero_result;
+
+  // Normalise result to 1 one bit then 26 fractional bits
+  int32_t n = int32_t(sizeof(adder_t) * 8 - 27) - detail::clz(r_m);
+  r_e += n;
+  if (r_e >= 255) return nan_result ? nan_result : (r_sign | 0x7f800000); // Inf
+  if constexpr (P::denormals == Denormals::Gradual) {
+    if (r_e <= 0) { // Denorm or zero
+      n += 1 - r_e;
+      r_e = 0;
+    }
+    if (n <= 0) r_m <<= -n; else r_m = detail::sticky_shift<false>(r_m, n);
+  } else if constexpr (P::denormals == Denormals::FlushKeepSign) {
+    if (r_e <= 0) { // Denorm or zero
+      n += 1;
+      r_e = 0;
+    }
+    if (n <= 0) r_m <<= -n; else r_m = (r_m >> n) | ((r_m & adder_t(n | 1)) != 0);
+  } else {
+    if (r_e < 0) return zero_result; // Flush blatant denormals (before rounding, discarding sign)
+    if (n <= 0) r_m <<= -n; else r_m = (r_m >> n) | (r_m & 1);
+  }
+
+  // Start reassembling result
+  uint32_t r = (uint32_t(r_e) << 23) + ((uint32_t(r_m) >> 3) & 0x7fffff);
+
+  // Round to nearest even
+  r += (((r_m & 7) + (r & 1)) > 4);
+
+  // Flush denormals (after rounding)
+  if constexpr (P::denormals != Denormals::Gradual) {
+    if (!(r >> 23)) return discard_sign ? zero_result : r_sign;
+  }
+
+  return (nan_result ? nan_result : r_sign) | r;
+}
+
+template <Arch A>
+constexpr uint32_t fma_model(uint32_t x, uint32_t y, uint32_t z) noexcept {
+  return fma_model_with<typename ArchPolicy<A>::type>(x, y, z);
+}
+
+// Known answers, one for each way in which the architectures differ.
+static_assert(fma_model<Arch::IEEE>(0x3f800000, 0x3f800000, 0x3f800000) == 0x40000000); // 1 * 1 + 1 == 2
+static_assert(fma_model<Arch::IEEE>(0x00800000, 0x3f000000, 0) == 0x00400000); // Denormal result
+static_assert(fma_model<Arch::Blackhole>(0x00800000, 0x3f000000, 0) == 0); // Flushed
+static_assert(fma_model<Arch::Blackhole>(0x80800000, 0x3f000000, 0) == 0x80000000); // Flushed, keeping the sign
+static_assert(fma_model<Arch::Wormhole>(0x80800000, 0x3f000000, 0) == 0); // Flushed, discarding the sign
+static_assert(fma_model<Arch::IEEE>(0x7f800000, 0, 0) == 0x7fc00000); // Inf * 0 is the canonical NaN
+static_assert(fma_model<Arch::Wormhole>(0x7f800000, 0, 0) == 0x7f800001); // Not so on Wormhole
+static_assert(fma_model<Arch::IEEE>(0x3f800001, 0x3f7fffff, 0xbf800000) == 0x337ffffe); // (1 + 2^-23) * (1 - 2^-24) - 1
+static_assert(fma_model<Arch::Blackhole>(0x3f800001, 0x3f7fffff, 0xbf800000) == 0x33400000); // Product realigned to the addend
+
+} // namespace fma_models
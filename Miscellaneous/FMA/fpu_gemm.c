@@ -0,0 +1,369 @@
+/*
+ * SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Model of the Wormhole Tensix Matrix Unit (FPU) floating-point MVMUL computation, as one 16-term
+ * dot product (fpu_dot16_model_wh) and as a whole matrix multiply (fpu_gemm_model_wh), plus a
+ * cache-blocked multithreaded vectorised matrix multiply (fpu_gemm_wh) giving identical results.
+ *
+ * The MVMUL functional model is only a rough guide to the hardware's floating-point behaviour, so
+ * this file pins down one precise reading of it: each fidelity phase of each MVMUL computes the
+ * 16 products exactly, sums them into a zero-initialised accumulator in order (k = 0 first), and
+ * then adds that sum to Dst, with every addition rounded to FP32 precision using round to nearest
+ * ties to even. Every input and every result is interpreted as per the Matrix Unit (FPU) columns
+ * of FloatBitPatterns.md: denormals are zero, exponent 255 is an ordinary exponent, results
+ * smaller than 2^-126 (after rounding) are flushed to zero, and results too large for exponent 255
+ * saturate to the largest magnitude.
+ *
+ * fpu_gemm_wh uses host FP32 arithmetic, which agrees with the above whenever the input exponents
+ * are within a range such that no result can be denormal, infinite, or needing exponent 255. It
+ * checks this while packing the inputs, and falls back to fpu_gemm_model_wh's arithmetic
+ * otherwise.
+ */
+
+#ifndef FPU_GEMM_SUFFIX
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "fma_batch.c"
+
+// Values for the fmt argument. This is the SrcAStyle of the MVMUL functional model, and applies
+// to both SrcA and SrcB.
+#define FPU_FMT_BF16 0 // Operands are FP32 bit patterns, of which the low 16 bits are ignored
+#define FPU_FMT_TF32 1 // Operands are FP32 bit patterns, of which the low 13 bits are ignored
+#define FPU_FMT_FP16 2 // Operands are FP16 bit patterns, in the low 16 bits
+
+// Section: Scalar model
+
+// An operand as the FP32 bit pattern of ReadBF16 / ReadTF32 / ReadFP16, with denormals flushed.
+static uint32_t fpu_src_fp32(uint32_t x, int fmt) {
+  if (fmt == FPU_FMT_FP16) {
+    uint32_t sign = (x >> 15) & 1, exp = (x >> 10) & 0x1f, man = x & 0x3ff;
+    if (exp == 0) return sign << 31;
+    return (sign << 31) | ((exp + 112) << 23) | (man << 13);
+  }
+  x &= fmt == FPU_FMT_BF16 ? 0xffff0000u : 0xffffe000u;
+  if (!(x & 0x7f800000u)) x &= 0x80000000u;
+  return x;
+}
+
+// The sign, exponent, and selected mantissa bits of an FP32 bit pattern (with the implicit 1 bit
+// only when `implicit` is set), as the double of equal value.
+static double fpu_bits_value(uint32_t x, uint32_t man_mask, int implicit) {
+  uint32_t exp = (x >> 23) & 0xff;
+  if (exp == 0) return x >> 31 ? -0.0 : 0.0;
+  uint64_t man = (uint64_t)(x & man_mask) << 29;
+  uint64_t bits = ((uint64_t)(x >> 31) << 63) | ((uint64_t)(exp - 127 + 1023) << 52) | man;
+  double v, one = 0;
+  memcpy(&v, &bits, sizeof(v));
+  if (!implicit) { // Subtract the implicit 1 bit back off again
+    bits &= 0xfff0000000000000ull;
+    memcpy(&one, &bits, sizeof(one));
+  }
+  return v - one;
+}
+
+// SrcAFidelityBits and SrcBFidelityBits, applied to the output of fpu_src_fp32.
+static double fpu_srca_value(uint32_t x, unsigned phase) {
+  return phase & 1 ? fpu_bits_value(x, 0x0007c000u, 0) : fpu_bits_value(x, 0x00780000u, 1);
+}
+
+static double fpu_srcb_value(uint32_t x, unsigned phase) {
+  return phase & 2 ? fpu_bits_value(x, 0x0001e000u, 0) : fpu_bits_value(x, 0x007e0000u, 1);
+}
+
+// Rounds x to FP32 precision as described at the top of this file. Both x and the result are
+// doubles, as exponent 255 (and the products of such values) are beyond the range of float.
+static double fpu_round(double x) {
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  uint64_t sign = bits & 0x8000000000000000ull, mag = bits ^ sign;
+  if (mag != 0) {
+    mag += 0x0fffffffull + ((mag >> 29) & 1);
+    mag &= ~0x1fffffffull;
+    int exp = (int)(mag >> 52) - 1023 + 127;
+    if (exp < 1) mag = 0;
+    else if (exp > 255) mag = ((uint64_t)(255 - 127 + 1023) << 52) | (0x7fffffull << 29);
+  }
+  bits = sign | mag;
+  memcpy(&x, &bits, sizeof(x));
+  return x;
+}
+
+static double fpu_dst_value(uint32_t d) {
+  return fpu_bits_value(d, 0x007fffffu, 1);
+}
+
+// The FP32 bit pattern of a value returned by fpu_round.
+static uint32_t fpu_dst_bits(double x) {
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  uint32_t sign = (uint32_t)(bits >> 63) << 31;
+  if (!(bits << 1)) return sign;
+  return sign | (((uint32_t)((bits >> 52) & 0x7ff) - 1023 + 127) << 23) | ((uint32_t)(bits >> 29) & 0x7fffffu);
+}
+
+// One fidelity phase of one element of MVMUL with FP32 Dst: returns dst plus the dot product of
+// b[0 ... k-1] and a[0], a[a_stride], ..., a[(k-1) * a_stride], for k <= 16 (with the remaining
+// products as though SrcA and SrcB were zero).
+uint32_t fpu_dot16_model_wh(const uint32_t* b, const uint32_t* a, size_t a_stride, size_t k, uint32_t dst, int fmt, unsigned phase) {
+  double x = 0;
+  for (size_t i = 0; i < k; ++i) {
+    double bv = fpu_srcb_value(fpu_src_fp32(b[i], fmt), phase);
+    double av = fpu_srca_value(fpu_src_fp32(a[i * a_stride], fmt), phase);
+    x = fpu_round(x + bv * av); // The product has at most 12 significant bits, so is exact
+  }
+  return fpu_dst_bits(fpu_round(fpu_dst_value(dst) + x));
+}
+
+// d[m][n] += b[m][k] @ a[k][n], done as per a sequence of MVMULs: for each group of 16 values of
+// k in increasing order, one MVMUL for each of phases 0 through num_phases - 1 in turn. Matrices
+// are row-major. Returns 0 on success, or -1 if fmt or num_phases are invalid.
+int fpu_gemm_model_wh(int fmt, unsigned num_phases, size_t m, size_t n, size_t k, const uint32_t* b, const uint32_t* a, uint32_t* d) {
+  if (fmt < FPU_FMT_BF16 || fmt > FPU_FMT_FP16 || num_phases < 1 || num_phases > 4) return -1;
+  for (size_t i = 0; i < m; ++i) {
+    for (size_t j = 0; j < n; ++j) {
+      uint32_t acc = d[i * n + j];
+      for (size_t kc = 0; kc < k; kc += 16) {
+        size_t len = k - kc < 16 ? k - kc : 16;
+        for (unsigned phase = 0; phase < num_phases; ++phase) {
+          acc = fpu_dot16_model_wh(b + i * k + kc, a + kc * n + j, n, len, acc, fmt, phase);
+        }
+      }
+      d[i * n + j] = acc;
+    }
+  }
+  return 0;
+}
+
+// Section: Blocked matrix multiply
+
+// Nonzero operand exponents within 2^-48 ... 2^48 keep every product a multiple of 2^-115 and below
+// 2^98, so (with at most 2^27 products per result, and Dst exponents in 2^-103 ... 2^48) no sum
+// can be denormal or reach 2^127, and host FP32 arithmetic is then exact in the same places.
+#define FPU_SAFE_EXP_MIN  (127 - 48)
+#define FPU_SAFE_EXP_MAX  (127 + 48)
+#define FPU_SAFE_DST_MIN  (127 - 103)
+#define FPU_SAFE_K_MAX    ((size_t)1 << 25) // Times four phases
+
+// Operands are packed into 16-column panels of SrcA and 8-row panels of SrcB, split by fidelity
+// phase and zero-padded, so that each 8x16 block of Dst reads both contiguously.
+typedef struct fpu_gemm_t {
+  unsigned num_phases;
+  size_t m, n, k;
+  size_t m8, n16, k16; // Rounded up
+  float* a[2];         // [n16 / 16][k16][16], for (phase & 1) == 0 and == 1
+  float* b[2];         // [m8 / 8][k16][8], for (phase & 2) == 0 and == 2
+  float* d;            // [m8][n16]
+  const uint32_t* raw_a;
+  const uint32_t* raw_b;
+  uint32_t* raw_d;
+  int fmt;
+  int safe;
+  size_t row_blocks_per_task, num_tasks;
+  _Atomic size_t next_task;
+  void (*tile_fn)(struct fpu_gemm_t* g, size_t ib, size_t jb);
+} fpu_gemm_t;
+
+static int fpu_exp_in(uint32_t x, int lo, int hi) {
+  int exp = (x >> 23) & 0xff;
+  return exp == 0 || (exp >= lo && exp <= hi);
+}
+
+static float fpu_float_of(double x, int in_range) {
+  return in_range ? (float)x : 0; // Exact when in range; when not, the floats go unused
+}
+
+static void fpu_gemm_pack(fpu_gemm_t* g) {
+  g->safe = g->k <= FPU_SAFE_K_MAX;
+  for (size_t kk = 0; kk < g->k; ++kk) {
+    for (size_t j = 0; j < g->n; ++j) {
+      uint32_t x = fpu_src_fp32(g->raw_a[kk * g->n + j], g->fmt);
+      int in_range = fpu_exp_in(x, FPU_SAFE_EXP_MIN, FPU_SAFE_EXP_MAX);
+      size_t at = ((j / 16) * g->k16 + kk) * 16 + j % 16;
+      g->a[0][at] = fpu_float_of(fpu_srca_value(x, 0), in_range);
+      g->a[1][at] = fpu_float_of(fpu_srca_value(x, 1), in_range);
+      g->safe &= in_range;
+    }
+  }
+  for (size_t i = 0; i < g->m; ++i) {
+    for (size_t kk = 0; kk < g->k; ++kk) {
+      uint32_t x = fpu_src_fp32(g->raw_b[i * g->k + kk], g->fmt);
+      int in_range = fpu_exp_in(x, FPU_SAFE_EXP_MIN, FPU_SAFE_EXP_MAX);
+      size_t at = ((i / 8) * g->k16 + kk) * 8 + i % 8;
+      g->b[0][at] = fpu_float_of(fpu_srcb_value(x, 0), in_range);
+      g->b[1][at] = fpu_float_of(fpu_srcb_value(x, 2), in_range);
+      g->safe &= in_range;
+    }
+    for (size_t j = 0; j < g->n; ++j) {
+      uint32_t x = g->raw_d[i * g->n + j];
+      g->safe &= fpu_exp_in(x, FPU_SAFE_DST_MIN, FPU_SAFE_EXP_MAX);
+      if (!(x & 0x7f800000u)) x &= 0x80000000u;
+      memcpy(&g->d[i * g->n16 + j], &x, sizeof(x));
+    }
+  }
+}
+
+// The fallback when fpu_gemm_t::safe is false.
+static void fpu_gemm_tile_model(fpu_gemm_t* g, size_t ib, size_t jb) {
+  size_t i_end = ib * 8 + 8 < g->m ? ib * 8 + 8 : g->m;
+  size_t j_end = jb * 16 + 16 < g->n ? jb * 16 + 16 : g->n;
+  for (size_t i = ib * 8; i < i_end; ++i) {
+    for (size_t j = jb * 16; j < j_end; ++j) {
+      uint32_t acc = g->raw_d[i * g->n + j];
+      for (size_t kc = 0; kc < g->k; kc += 16) {
+        size_t len = g->k - kc < 16 ? g->k - kc : 16;
+        for (unsigned phase = 0; phase < g->num_phases; ++phase) {
+          acc = fpu_dot16_model_wh(g->raw_b + i * g->k + kc, g->raw_a + kc * g->n + j, g->n, len, acc, g->fmt, phase);
+        }
+      }
+      g->raw_d[i * g->n + j] = acc;
+    }
+  }
+}
+
+#if FMA_BATCH_X86
+#define FPU_GEMM_SUFFIX avx512
+#define FPU_GEMM_ATTR __attribute__((target("avx512f")))
+#define FPU_COLS 16
+#define FPU_ROWS 8
+#include __FILE__
+#undef FPU_ROWS
+#undef FPU_COLS
+#undef FPU_GEMM_ATTR
+#undef FPU_GEMM_SUFFIX
+
+#define FPU_GEMM_SUFFIX avx2
+#define FPU_GEMM_ATTR __attribute__((target("avx2,fma")))
+#define FPU_COLS 8
+#define FPU_ROWS 4
+#include __FILE__
+#undef FPU_ROWS
+#undef FPU_COLS
+#undef FPU_GEMM_ATTR
+#undef FPU_GEMM_SUFFIX
+#endif
+
+#define FPU_GEMM_SUFFIX generic
+#define FPU_GEMM_ATTR
+#define FPU_COLS 4
+#define FPU_ROWS 4
+#include __FILE__
+#undef FPU_ROWS
+#undef FPU_COLS
+#undef FPU_GEMM_ATTR
+#undef FPU_GEMM_SUFFIX
+
+static void* fpu_gemm_thread(void* arg) {
+  fpu_gemm_t* g = (fpu_gemm_t*)arg;
+  size_t row_blocks = g->m8 / 8;
+  size_t groups = (row_blocks + g->row_blocks_per_task - 1) / g->row_blocks_per_task;
+  size_t t;
+  while ((t = atomic_fetch_add_explicit(&g->next_task, 1, memory_order_relaxed)) < g->num_tasks) {
+    // Tasks are column panels major, so that concurrent threads tend to share SrcA panels.
+    size_t jb = t / groups, ib = (t % groups) * g->row_blocks_per_task;
+    size_t ib_end = ib + g->row_blocks_per_task < row_blocks ? ib + g->row_blocks_per_task : row_blocks;
+    for (; ib < ib_end; ++ib) g->tile_fn(g, ib, jb);
+  }
+  return NULL;
+}
+
+// As per fpu_gemm_model_wh, with identical results, but using up to `threads` threads (0 meaning
+// one per core). Returns 0 on success, or -1 if the arguments are invalid or memory runs out.
+int fpu_gemm_wh(int fmt, unsigned num_phases, size_t m, size_t n, size_t k, const uint32_t* b, const uint32_t* a, uint32_t* d, unsigned threads) {
+  if (fmt < FPU_FMT_BF16 || fmt > FPU_FMT_FP16 || num_phases < 1 || num_phases > 4) return -1;
+  if (m == 0 || n == 0 || k == 0) return 0; // Nothing to add, so Dst (including any denormals) is unchanged
+  fpu_gemm_t g = {.num_phases = num_phases, .m = m, .n = n, .k = k, .raw_a = a, .raw_b = b, .raw_d = d, .fmt = fmt};
+  g.m8 = (m + 7) & ~(size_t)7;
+  g.n16 = (n + 15) & ~(size_t)15;
+  g.k16 = (k + 15) & ~(size_t)15;
+  g.a[0] = calloc(g.n16 * g.k16 * 2, sizeof(float));
+  g.b[0] = calloc(g.m8 * g.k16 * 2, sizeof(float));
+  g.d = calloc(g.m8 * g.n16, sizeof(float));
+  int ok = g.a[0] && g.b[0] && g.d;
+  if (ok) {
+    g.a[1] = g.a[0] + g.n16 * g.k16;
+    g.b[1] = g.b[0] + g.m8 * g.k16;
+    fpu_gemm_pack(&g);
+    int isa = fma_batch_isa();
+#if FMA_BATCH_X86
+    g.tile_fn = !g.safe ? fpu_gemm_tile_model
+      : isa == FMA_ISA_AVX512 ? fpu_gemm_tile_avx512 : isa == FMA_ISA_AVX2 ? fpu_gemm_tile_avx2 : fpu_gemm_tile_generic;
+#else
+    (void)isa;
+    g.tile_fn = !g.safe ? fpu_gemm_tile_model : fpu_gemm_tile_generic;
+#endif
+
+    if (threads == 0) {
+      long cores = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = cores > 0 ? (unsigned)cores : 1;
+    }
+    g.row_blocks_per_task = 16;
+    g.num_tasks = (g.n16 / 16) * ((g.m8 / 8 + g.row_blocks_per_task - 1) / g.row_blocks_per_task);
+    if (threads > g.num_tasks) threads = (unsigned)g.num_tasks;
+    pthread_t* workers = threads > 1 ? calloc(threads - 1, sizeof(*workers)) : NULL;
+    unsigned started = 0;
+    if (workers) {
+      while (started < threads - 1 && pthread_create(&workers[started], NULL, fpu_gemm_thread, &g) == 0) ++started;
+    }
+    fpu_gemm_thread(&g);
+    for (unsigned i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+    free(workers);
+
+    if (g.safe) {
+      for (size_t i = 0; i < m; ++i) memcpy(d + i * n, g.d + i * g.n16, n * sizeof(float));
+    }
+  }
+  free(g.a[0]);
+  free(g.b[0]);
+  free(g.d);
+  return ok ? 0 : -1;
+}
+
+#else // Included from above, with FPU_GEMM_SUFFIX, FPU_GEMM_ATTR, FPU_COLS, and FPU_ROWS defined.
+
+#define fpu_vf FMA_CAT(fpu_vf_, FPU_GEMM_SUFFIX)
+
+typedef float fpu_vf __attribute__((vector_size(FPU_COLS * 4)));
+
+// One 8x16 block of Dst, as strips of FPU_ROWS rows by FPU_COLS columns, each of which stays in
+// registers (along with its 16-term sums) for the whole of k. Every product is exact, so whether
+// or not the compiler fuses the multiply and add makes no difference to the result.
+FPU_GEMM_ATTR
+static void FMA_CAT(fpu_gemm_tile_, FPU_GEMM_SUFFIX)(fpu_gemm_t* g, size_t ib, size_t jb) {
+  for (unsigned row = 0; row < 8; row += FPU_ROWS) {
+    for (unsigned col = 0; col < 16; col += FPU_COLS) {
+      fpu_vf acc[FPU_ROWS];
+      float* dp = g->d + (ib * 8 + row) * g->n16 + jb * 16 + col;
+#pragma GCC unroll 8
+      for (unsigned i = 0; i < FPU_ROWS; ++i) memcpy(&acc[i], dp + i * g->n16, sizeof(fpu_vf));
+      const float* ap[2] = {g->a[0] + jb * g->k16 * 16 + col, g->a[1] + jb * g->k16 * 16 + col};
+      const float* bp[2] = {g->b[0] + ib * g->k16 * 8 + row, g->b[1] + ib * g->k16 * 8 + row};
+      for (size_t kc = 0; kc < g->k16; kc += 16) {
+        for (unsigned phase = 0; phase < g->num_phases; ++phase) {
+          const float* a = ap[phase & 1];
+          const float* b = bp[phase >> 1];
+          fpu_vf x[FPU_ROWS] = {0};
+#pragma GCC unroll 16
+          for (unsigned kk = 0; kk < 16; ++kk) {
+            fpu_vf av;
+            memcpy(&av, a + kk * 16, sizeof(av));
+#pragma GCC unroll 8
+            for (unsigned i = 0; i < FPU_ROWS; ++i) x[i] += b[kk * 8 + i] * av;
+          }
+#pragma GCC unroll 8
+          for (unsigned i = 0; i < FPU_ROWS; ++i) acc[i] += x[i];
+        }
+        ap[0] += 16 * 16, ap[1] += 16 * 16;
+        bp[0] += 16 * 8, bp[1] += 16 * 8;
+      }
+#pragma GCC unroll 8
+      for (unsigned i = 0; i < FPU_ROWS; ++i) memcpy(dp + i * g->n16, &acc[i], sizeof(fpu_vf));
+    }
+  }
+}
+
+#undef fpu_vf
+#endif
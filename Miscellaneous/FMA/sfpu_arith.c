@@ -0,0 +1,657 @@
+/*
+ * SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Bit-perfect models of the arithmetic instructions of the Tensix Vector Unit (SFPU) on Wormhole
+ * and Blackhole. The MAD-based instructions (SFPMAD, SFPADD, SFPMUL, SFPADDI, SFPMULI, SFPLUT,
+ * SFPLUTFP32) are built on fma_model_wh / fma_model_bh from fma.c. Each model operates on the
+ * value of one lane: register selection, lane enables, and the SFPMAD_MOD1_INDIRECT_VA /
+ * SFPMAD_MOD1_INDIRECT_VD modes are left to the caller. Where an
+ * instruction can set LaneFlags, the model takes a pointer to the lane's flag, which should be
+ * NULL if the instruction would not set flags (i.e. when VD >= 8).
+ *
+ * Every model also has a _batch version, applying it to n lanes' worth of values at once. The
+ * batch versions of the MAD-based instructions use the vector implementations in fma_batch.c.
+ */
+
+#include "fma_batch.c"
+
+// Section: Shared definitions
+
+// Values for Mod1 of SFPMAD and friends:
+#define SFPMAD_MOD1_NEGATE_VB   1 // Blackhole only
+#define SFPMAD_MOD1_NEGATE_VC   2 // Blackhole only
+#define SFPMAD_MOD1_INDIRECT_VA 4
+#define SFPMAD_MOD1_INDIRECT_VD 8
+
+// Values for Mod1 of SFPMUL24 (Blackhole only):
+#define SFPMUL24_MOD1_UPPER        1
+#define SFPMUL24_MOD1_INDIRECT_VA  4
+#define SFPMUL24_MOD1_INDIRECT_VD  8
+
+// Values for Mod0 of SFPLUT:
+#define SFPLUT_MOD0_SGN_RETAIN  4
+#define SFPLUT_MOD0_INDIRECT_VD 8
+
+// Values for Mod1 of SFPLUTFP32 (note that FP16_3ENTRY_TABLE includes INDIRECT_VD):
+#define SFPLUTFP32_MOD1_FP32_3ENTRY_TABLE   0
+#define SFPLUTFP32_MOD1_FP16_3ENTRY_TABLE  10
+#define SFPLUTFP32_MOD1_FP16_6ENTRY_TABLE1  2
+#define SFPLUTFP32_MOD1_FP16_6ENTRY_TABLE2  3
+#define SFPLUTFP32_MOD1_SGN_RETAIN          4
+#define SFPLUTFP32_MOD1_INDIRECT_VD         8
+
+// Values for Mod1 of SFPARECIP (Blackhole only):
+#define SFPARECIP_MOD1_RECIP      0
+#define SFPARECIP_MOD1_COND_RECIP 1
+#define SFPARECIP_MOD1_EXP        2
+
+// Values for Mod1 of SFPDIVP2:
+#define SFPDIVP2_MOD1_ADD 1
+
+// Values for Mod1 of SFPEXEXP:
+#define SFPEXEXP_MOD1_NODEBIAS        1
+#define SFPEXEXP_MOD1_SET_CC_SGN_EXP  2
+#define SFPEXEXP_MOD1_SET_CC_COMP_EXP 8
+
+// Values for Mod1 of SFPSETEXP:
+#define SFPSETEXP_MOD1_ARG_IMM      1
+#define SFPSETEXP_MOD1_ARG_EXPONENT 2
+
+// Values for Mod1 of SFPSETMAN:
+#define SFPSETMAN_MOD1_ARG_IMM 1
+
+// Values for Mod1 of SFPIADD:
+#define SFPIADD_MOD1_ARG_LREG_DST        0
+#define SFPIADD_MOD1_ARG_IMM             1
+#define SFPIADD_MOD1_ARG_2SCOMP_LREG_DST 2
+#define SFPIADD_MOD1_CC_LT0              0
+#define SFPIADD_MOD1_CC_NONE             4
+#define SFPIADD_MOD1_CC_GTE0             8
+
+// Values for Mod1 of SFPCAST (the latter two are Blackhole only):
+#define SFPCAST_MOD1_SM32_TO_FP32_RNE 0
+#define SFPCAST_MOD1_SM32_TO_FP32_RNS 1
+#define SFPCAST_MOD1_INT32_ABS        2
+#define SFPCAST_MOD1_INT32_SM32       3
+
+// Values for Mod1 of SFPSTOCHRND (the Mod1 argument of the models also includes UseImm5 << 3):
+#define SFPSTOCHRND_MOD1_FP32_TO_FP16A  0
+#define SFPSTOCHRND_MOD1_FP32_TO_FP16B  1
+#define SFPSTOCHRND_MOD1_FP32_TO_UINT8  2
+#define SFPSTOCHRND_MOD1_FP32_TO_INT8   3
+#define SFPSTOCHRND_MOD1_INT32_TO_UINT8 4
+#define SFPSTOCHRND_MOD1_INT32_TO_INT8  5
+#define SFPSTOCHRND_MOD1_FP32_TO_UINT16 6
+#define SFPSTOCHRND_MOD1_FP32_TO_INT16  7
+#define SFPSTOCHRND_MOD1_USE_IMM5       8
+
+// Values for RoundingMode of SFPSTOCHRND (Wormhole only has the first two):
+#define SFPSTOCHRND_RND_NEAREST 0
+#define SFPSTOCHRND_RND_STOCH   1
+#define SFPSTOCHRND_RND_ZERO    2
+
+#define SFPU_FP32_ONE  0x3f800000 // LReg[10]
+#define SFPU_FP32_ZERO 0x00000000 // LReg[9]
+
+uint32_t sfpu_prng_advance(uint32_t* state) { // One lane of the hardware PRNG; returns the value used by stochastic rounding
+  uint32_t result = *state;
+  uint32_t taps = __builtin_popcount(result & 0x80200003);
+  *state = (~taps << 31) | (result >> 1);
+  return result;
+}
+
+static uint32_t sfpu_bf16_to_fp32(uint16_t x) {
+  return (uint32_t)x << 16;
+}
+
+// Applies `batch` to (x, y, z), where each operand is either an array or (if NULL) the
+// corresponding constant, and then has its sign bit toggled by the corresponding xor.
+static void sfpu_mad_batch(fma_batch_fn batch, const uint32_t* x, uint32_t x_imm, uint32_t x_xor,
+    const uint32_t* y, uint32_t y_imm, uint32_t y_xor, const uint32_t* z, uint32_t z_imm, uint32_t z_xor,
+    uint32_t* out, size_t n) {
+  if (x && y && z && !(x_xor | y_xor | z_xor)) {
+    batch(x, y, z, out, n);
+    return;
+  }
+  enum { CHUNK = 256 };
+  uint32_t tx[CHUNK], ty[CHUNK], tz[CHUNK];
+  for (size_t i = 0; i < n; i += CHUNK) {
+    size_t m = n - i < CHUNK ? n - i : CHUNK;
+    for (size_t j = 0; j < m; ++j) {
+      tx[j] = (x ? x[i + j] : x_imm) ^ x_xor;
+      ty[j] = (y ? y[i + j] : y_imm) ^ y_xor;
+      tz[j] = (z ? z[i + j] : z_imm) ^ z_xor;
+    }
+    batch(tx, ty, tz, out + i, m);
+  }
+}
+
+// Section: MAD sub-unit, Blackhole
+
+// SFPMAD: a * b + c, with optional negation of b and/or c.
+uint32_t sfpmad_model_bh(uint32_t a, uint32_t b, uint32_t c, unsigned mod1) {
+  if (mod1 & SFPMAD_MOD1_NEGATE_VB) b ^= 0x80000000;
+  if (mod1 & SFPMAD_MOD1_NEGATE_VC) c ^= 0x80000000;
+  return fma_model_bh(a, b, c);
+}
+
+// SFPADD: SFPMAD with VA == 10, i.e. 1.0 * b + c.
+uint32_t sfpadd_model_bh(uint32_t b, uint32_t c, unsigned mod1) {
+  return sfpmad_model_bh(SFPU_FP32_ONE, b, c, mod1);
+}
+
+// SFPMUL: SFPMAD with VC == 9, i.e. a * b + 0. Set SFPMAD_MOD1_NEGATE_VC to instead add -0,
+// which preserves the sign of a negative zero product.
+uint32_t sfpmul_model_bh(uint32_t a, uint32_t b, unsigned mod1) {
+  return sfpmad_model_bh(a, b, SFPU_FP32_ZERO, mod1);
+}
+
+// SFPADDI: BF16 immediate * 1.0 + c.
+uint32_t sfpaddi_model_bh(uint16_t imm16, uint32_t c, unsigned mod1) {
+  if (mod1 & SFPMAD_MOD1_NEGATE_VC) c ^= 0x80000000;
+  return fma_model_bh(sfpu_bf16_to_fp32(imm16), SFPU_FP32_ONE, c);
+}
+
+// SFPMULI: BF16 immediate * c + 0.
+uint32_t sfpmuli_model_bh(uint16_t imm16, uint32_t c, unsigned mod1) {
+  if (mod1 & SFPMAD_MOD1_NEGATE_VC) c ^= 0x80000000;
+  return fma_model_bh(sfpu_bf16_to_fp32(imm16), c, SFPU_FP32_ZERO);
+}
+
+// SFPMUL24: low or high 23 bits of the product of two 23-bit integers, then subjected to an
+// exotic shift/add-like operation with c (which is a no-op if c is zero, i.e. VC == 9).
+uint32_t sfpmul24_model_bh(uint32_t a, uint32_t b, uint32_t c, unsigned mod1) {
+  uint32_t p_m;
+  if (mod1 & SFPMUL24_MOD1_UPPER) {
+    p_m = ((a & 0x7fffffull) * (b & 0x7fffffull)) >> 23;
+  } else {
+    p_m = (a * b) & 0x7fffff;
+  }
+  unsigned z_e = (c >> 23) & 0xff;
+  if (z_e) {
+    unsigned p_e = 129;
+    unsigned r_e = p_e > z_e ? p_e : z_e;
+    unsigned s = (r_e - z_e) & 31;
+    uint32_t z_m = (1u << 23) + (c & 0x7fffff);
+    uint32_t z_m_grs = z_m << 3;
+    p_m >>= (r_e - p_e) & 31;
+    if ((z_m = z_m_grs >> s)) {
+      p_m += z_m;
+      p_m += (((z_m << s) ^ z_m_grs) > 0xffff) << 16;
+      p_m &= 0x7fffff;
+    }
+  }
+  return p_m;
+}
+
+void sfpmad_model_bh_batch(const uint32_t* a, const uint32_t* b, const uint32_t* c, uint32_t* out, size_t n, unsigned mod1) {
+  sfpu_mad_batch(fma_model_bh_batch, a, 0, 0, b, 0, (mod1 & SFPMAD_MOD1_NEGATE_VB) ? 0x80000000 : 0,
+    c, 0, (mod1 & SFPMAD_MOD1_NEGATE_VC) ? 0x80000000 : 0, out, n);
+}
+
+void sfpadd_model_bh_batch(const uint32_t* b, const uint32_t* c, uint32_t* out, size_t n, unsigned mod1) {
+  sfpu_mad_batch(fma_model_bh_batch, NULL, SFPU_FP32_ONE, 0, b, 0, (mod1 & SFPMAD_MOD1_NEGATE_VB) ? 0x80000000 : 0,
+    c, 0, (mod1 & SFPMAD_MOD1_NEGATE_VC) ? 0x80000000 : 0, out, n);
+}
+
+void sfpmul_model_bh_batch(const uint32_t* a, const uint32_t* b, uint32_t* out, size_t n, unsigned mod1) {
+  sfpu_mad_batch(fma_model_bh_batch, a, 0, 0, b, 0, (mod1 & SFPMAD_MOD1_NEGATE_VB) ? 0x80000000 : 0,
+    NULL, SFPU_FP32_ZERO, (mod1 & SFPMAD_MOD1_NEGATE_VC) ? 0x80000000 : 0, out, n);
+}
+
+void sfpaddi_model_bh_batch(uint16_t imm16, const uint32_t* c, uint32_t* out, size_t n, unsigned mod1) {
+  sfpu_mad_batch(fma_model_bh_batch, NULL, sfpu_bf16_to_fp32(imm16), 0, NULL, SFPU_FP32_ONE, 0,
+    c, 0, (mod1 & SFPMAD_MOD1_NEGATE_VC) ? 0x80000000 : 0, out, n);
+}
+
+void sfpmuli_model_bh_batch(uint16_t imm16, const uint32_t* c, uint32_t* out, size_t n, unsigned mod1) {
+  sfpu_mad_batch(fma_model_bh_batch, NULL, sfpu_bf16_to_fp32(imm16), 0, c, 0, (mod1 & SFPMAD_MOD1_NEGATE_VC) ? 0x80000000 : 0,
+    NULL, SFPU_FP32_ZERO, 0, out, n);
+}
+
+void sfpmul24_model_bh_batch(const uint32_t* a, const uint32_t* b, const uint32_t* c, uint32_t* out, size_t n, unsigned mod1) {
+  for (size_t i = 0; i < n; ++i) out[i] = sfpmul24_model_bh(a[i], b[i], c[i], mod1);
+}
+
+// Section: MAD sub-unit, Wormhole
+
+// Wormhole has no negation flags and no SFPMUL24; otherwise as per Blackhole.
+uint32_t sfpmad_model_wh(uint32_t a, uint32_t b, uint32_t c) {
+  return fma_model_wh(a, b, c);
+}
+
+uint32_t sfpadd_model_wh(uint32_t b, uint32_t c) {
+  return fma_model_wh(SFPU_FP32_ONE, b, c);
+}
+
+uint32_t sfpmul_model_wh(uint32_t a, uint32_t b) {
+  return fma_model_wh(a, b, SFPU_FP32_ZERO);
+}
+
+uint32_t sfpaddi_model_wh(uint16_t imm16, uint32_t c) {
+  return fma_model_wh(sfpu_bf16_to_fp32(imm16), SFPU_FP32_ONE, c);
+}
+
+uint32_t sfpmuli_model_wh(uint16_t imm16, uint32_t c) {
+  return fma_model_wh(sfpu_bf16_to_fp32(imm16), c, SFPU_FP32_ZERO);
+}
+
+void sfpmad_model_wh_batch(const uint32_t* a, const uint32_t* b, const uint32_t* c, uint32_t* out, size_t n) {
+  fma_model_wh_batch(a, b, c, out, n);
+}
+
+void sfpadd_model_wh_batch(const uint32_t* b, const uint32_t* c, uint32_t* out, size_t n) {
+  sfpu_mad_batch(fma_model_wh_batch, NULL, SFPU_FP32_ONE, 0, b, 0, 0, c, 0, 0, out, n);
+}
+
+void sfpmul_model_wh_batch(const uint32_t* a, const uint32_t* b, uint32_t* out, size_t n) {
+  sfpu_mad_batch(fma_model_wh_batch, a, 0, 0, b, 0, 0, NULL, SFPU_FP32_ZERO, 0, out, n);
+}
+
+void sfpaddi_model_wh_batch(uint16_t imm16, const uint32_t* c, uint32_t* out, size_t n) {
+  sfpu_mad_batch(fma_model_wh_batch, NULL, sfpu_bf16_to_fp32(imm16), 0, NULL, SFPU_FP32_ONE, 0, c, 0, 0, out, n);
+}
+
+void sfpmuli_model_wh_batch(uint16_t imm16, const uint32_t* c, uint32_t* out, size_t n) {
+  sfpu_mad_batch(fma_model_wh_batch, NULL, sfpu_bf16_to_fp32(imm16), 0, c, 0, 0, NULL, SFPU_FP32_ZERO, 0, out, n);
+}
+
+// Section: MAD sub-unit, LUT instructions
+
+// SFPLUT and SFPLUTFP32 compute a * Abs(LReg[3]) + c, with a and c chosen from LReg[0] through
+// LReg[6] based on Abs(LReg[3]). The models take `lreg` pointing at the lane's values of LReg[0]
+// through LReg[6] (SFPLUT only uses LReg[0] through LReg[3]), and return the value for VD.
+// SFPLUT_MOD0_INDIRECT_VD / SFPLUTFP32_MOD1_INDIRECT_VD are left to the caller, as for SFPMAD.
+
+static uint32_t sfpu_lut8_to_fp32(uint8_t x) {
+  if (x == 0xff) return 0;
+  uint32_t sign = x >> 7;
+  uint32_t exp = (x >> 4) & 7;
+  uint32_t man = x & 0xf;
+  return (sign << 31) | ((127 - exp) << 23) | (man << 19);
+}
+
+static uint32_t sfpu_lut16_to_fp32(uint16_t x) {
+  uint32_t sign = x >> 15;
+  uint32_t exp = (x >> 10) & 0x1f;
+  uint32_t man = x & 0x3ff;
+  return (sign << 31) | ((exp == 0x1f ? 0 : 112 + exp) << 23) | (man << 13);
+}
+
+static unsigned sfplut_index(uint32_t b) { // b is Abs(LReg[3]); NaN compares as >= 2.0
+  return b < 0x3f800000 ? 0 : b < 0x40000000 ? 1 : 2;
+}
+
+static void sfplut_operands(const uint32_t* lreg, uint32_t* a, uint32_t* c) {
+  uint32_t coeffs = lreg[sfplut_index(lreg[3] & 0x7fffffff)];
+  *a = sfpu_lut8_to_fp32(coeffs >> 8);
+  *c = sfpu_lut8_to_fp32(coeffs);
+}
+
+static void sfplutfp32_operands(const uint32_t* lreg, unsigned mod1, uint32_t* a, uint32_t* c) {
+  uint32_t b = lreg[3] & 0x7fffffff;
+  unsigned i = sfplut_index(b);
+  if (!(mod1 & SFPLUTFP32_MOD1_FP16_6ENTRY_TABLE1)) {
+    *a = lreg[i];
+    *c = lreg[4 + i];
+  } else if ((mod1 & SFPLUTFP32_MOD1_FP16_3ENTRY_TABLE) == SFPLUTFP32_MOD1_FP16_3ENTRY_TABLE) {
+    *a = sfpu_lut16_to_fp32(lreg[i] >> 16);
+    *c = sfpu_lut16_to_fp32(lreg[i]);
+  } else {
+    uint32_t cut = (mod1 & SFPLUTFP32_MOD1_FP16_6ENTRY_TABLE2) == SFPLUTFP32_MOD1_FP16_6ENTRY_TABLE2 ? 0x40800000 : 0x40400000;
+    unsigned j = b < 0x3f000000 ? 0 : b < 0x3f800000 ? 16 : b < 0x3fc00000 ? 0 : b < 0x40000000 ? 16 : b < cut ? 0 : 16;
+    *a = sfpu_lut16_to_fp32(lreg[i] >> j);
+    *c = sfpu_lut16_to_fp32(lreg[4 + i] >> j);
+  }
+}
+
+static uint32_t sfplut_sign(uint32_t d, uint32_t l3, int sgn_retain) {
+  return sgn_retain ? (d & 0x7fffffff) | (l3 & 0x80000000) : d;
+}
+
+uint32_t sfplut_model_bh(const uint32_t* lreg, unsigned mod0) {
+  uint32_t a, c;
+  sfplut_operands(lreg, &a, &c);
+  return sfplut_sign(fma_model_bh(a, lreg[3] & 0x7fffffff, c), lreg[3], mod0 & SFPLUT_MOD0_SGN_RETAIN);
+}
+
+uint32_t sfplut_model_wh(const uint32_t* lreg, unsigned mod0) {
+  uint32_t a, c;
+  sfplut_operands(lreg, &a, &c);
+  return sfplut_sign(fma_model_wh(a, lreg[3] & 0x7fffffff, c), lreg[3], mod0 & SFPLUT_MOD0_SGN_RETAIN);
+}
+
+uint32_t sfplutfp32_model_bh(const uint32_t* lreg, unsigned mod1) {
+  uint32_t a, c;
+  sfplutfp32_operands(lreg, mod1, &a, &c);
+  return sfplut_sign(fma_model_bh(a, lreg[3] & 0x7fffffff, c), lreg[3], mod1 & SFPLUTFP32_MOD1_SGN_RETAIN);
+}
+
+uint32_t sfplutfp32_model_wh(const uint32_t* lreg, unsigned mod1) {
+  uint32_t a, c;
+  sfplutfp32_operands(lreg, mod1, &a, &c);
+  return sfplut_sign(fma_model_wh(a, lreg[3] & 0x7fffffff, c), lreg[3], mod1 & SFPLUTFP32_MOD1_SGN_RETAIN);
+}
+
+// The batch versions take `lreg[i]` pointing at n values of LReg[i], for i from 0 to 6 (SFPLUT
+// only uses the first four, so the others can be NULL).
+static void sfplut_batch(fma_batch_fn batch, int fp32, const uint32_t* const* lreg, uint32_t* out, size_t n, unsigned mod) {
+  enum { CHUNK = 256 };
+  uint32_t ta[CHUNK], tb[CHUNK], tc[CHUNK];
+  int sgn_retain = mod & (fp32 ? SFPLUTFP32_MOD1_SGN_RETAIN : SFPLUT_MOD0_SGN_RETAIN);
+  for (size_t i = 0; i < n; i += CHUNK) {
+    size_t m = n - i < CHUNK ? n - i : CHUNK;
+    for (size_t j = 0; j < m; ++j) {
+      uint32_t lane[7];
+      for (unsigned k = 0; k < (fp32 ? 7u : 4u); ++k) lane[k] = lreg[k][i + j];
+      if (fp32) sfplutfp32_operands(lane, mod, &ta[j], &tc[j]); else sfplut_operands(lane, &ta[j], &tc[j]);
+      tb[j] = lane[3] & 0x7fffffff;
+    }
+    batch(ta, tb, tc, out + i, m);
+    if (sgn_retain) {
+      for (size_t j = 0; j < m; ++j) out[i + j] = sfplut_sign(out[i + j], lreg[3][i + j], 1);
+    }
+  }
+}
+
+void sfplut_model_bh_batch(const uint32_t* const* lreg, uint32_t* out, size_t n, unsigned mod0) {
+  sfplut_batch(fma_model_bh_batch, 0, lreg, out, n, mod0);
+}
+
+void sfplut_model_wh_batch(const uint32_t* const* lreg, uint32_t* out, size_t n, unsigned mod0) {
+  sfplut_batch(fma_model_wh_batch, 0, lreg, out, n, mod0);
+}
+
+void sfplutfp32_model_bh_batch(const uint32_t* const* lreg, uint32_t* out, size_t n, unsigned mod1) {
+  sfplut_batch(fma_model_bh_batch, 1, lreg, out, n, mod1);
+}
+
+void sfplutfp32_model_wh_batch(const uint32_t* const* lreg, uint32_t* out, size_t n, unsigned mod1) {
+  sfplut_batch(fma_model_wh_batch, 1, lreg, out, n, mod1);
+}
+
+// Section: Simple sub-unit, Blackhole
+
+static uint32_t sfpu_approx_recip(uint32_t x) { // x is non-negative FP32
+  static const uint8_t lut[128] = {
+    127, 125, 123, 121, 119, 117, 116, 114, 112, 110, 109, 107, 105, 104, 102, 100, 99, 97, 96, 94, 93, 91, 90, 88,
+    87, 85, 84, 83, 81, 80, 79, 77, 76, 75, 74, 72, 71, 70, 69, 68, 66, 65, 64, 63, 62, 61, 60, 59,
+    58, 57, 56, 55, 54, 53, 52, 51, 50, 49, 48, 47, 46, 45, 44, 43, 42, 41, 40, 40, 39, 38, 37, 36,
+    35, 35, 34, 33, 32, 31, 31, 30, 29, 28, 28, 27, 26, 25, 25, 24, 23, 23, 22, 21, 21, 20, 19, 19,
+    18, 17, 17, 16, 15, 15, 14, 14, 13, 12, 12, 11, 11, 10, 9, 9, 8, 8, 7, 7, 6, 5, 5, 4,
+    4, 3, 3, 2, 2, 1, 1, 0,
+  };
+
+  if (x < 0x00800000) { // x < 2**-126
+    return 0x7f800000; // Inf
+  } else if (x < 0x7e800000) { // x < 2**126
+    return ((253 - (x >> 23)) << 23) | ((uint32_t)lut[(x >> 16) & 0x7f] << 16);
+  } else {
+    return 0;
+  }
+}
+
+static uint32_t sfpu_approx_exp(uint32_t x) { // x is non-negative FP32
+  static const uint8_t lut[896] = {
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 6, 6, 6, 6,
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+    6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 7, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 10, 10, 10, 10, 10,
+    10, 10, 10, 10, 10, 10, 10, 10, 10, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+    12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 13, 13, 13, 13, 13, 13, 13, 13, 13,
+    13, 13, 13, 13, 13, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+    17, 17, 17, 17, 17, 17, 17, 18, 18, 18, 18, 18, 18, 18, 19, 19, 19, 19, 19, 19, 19, 20, 20, 20,
+    20, 20, 20, 20, 21, 21, 21, 21, 21, 21, 21, 22, 22, 22, 22, 22, 22, 22, 23, 23, 23, 23, 23, 23,
+    24, 24, 24, 24, 24, 24, 24, 25, 25, 25, 25, 25, 25, 25, 26, 26, 26, 26, 26, 26, 27, 27, 27, 27,
+    27, 27, 27, 28, 28, 28, 28, 28, 28, 28, 29, 29, 29, 29, 29, 29, 30, 30, 30, 30, 30, 30, 30, 31,
+    31, 31, 31, 31, 31, 32, 32, 32, 32, 32, 32, 33, 33, 33, 33, 33, 33, 33, 34, 34, 34, 34, 34, 34,
+    35, 35, 35, 35, 35, 35, 36, 36, 36, 36, 36, 37, 37, 37, 38, 38, 38, 39, 39, 39, 40, 40, 40, 41,
+    41, 41, 42, 42, 42, 43, 43, 43, 44, 44, 44, 45, 45, 45, 46, 46, 46, 47, 47, 47, 48, 48, 49, 49,
+    49, 50, 50, 50, 51, 51, 51, 52, 52, 52, 53, 53, 53, 54, 54, 54, 55, 55, 56, 56, 56, 57, 57, 57,
+    58, 58, 58, 59, 59, 60, 60, 60, 61, 61, 61, 62, 62, 63, 63, 63, 64, 64, 64, 65, 65, 66, 66, 66,
+    67, 67, 67, 68, 68, 69, 69, 69, 70, 70, 71, 71, 71, 72, 72, 72, 73, 73, 74, 74, 74, 75, 75, 76,
+    76, 76, 77, 77, 78, 78, 78, 79, 79, 80, 80, 80, 81, 81, 82, 82, 83, 83, 84, 85, 86, 87, 88, 88,
+    89, 90, 91, 92, 93, 94, 94, 95, 96, 97, 98, 99, 100, 101, 101, 102, 103, 104, 105, 106, 107, 108, 109, 110,
+    111, 112, 113, 113, 114, 115, 116, 117, 118, 119, 120, 121, 122, 123, 124, 125, 126, 127, 0, 0, 1, 1, 2, 2,
+    3, 3, 4, 4, 5, 5, 6, 6, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 14, 15, 15,
+    16, 16, 17, 17, 18, 19, 19, 20, 20, 21, 21, 22, 23, 23, 24, 24, 25, 26, 26, 27, 27, 28, 29, 29,
+    30, 31, 31, 32, 32, 33, 34, 34, 35, 36, 36, 37, 38, 38, 39, 39, 40, 41, 41, 42, 43, 43, 44, 45,
+    45, 47, 48, 50, 51, 52, 54, 55, 57, 58, 60, 61, 63, 64, 66, 67, 69, 70, 72, 73, 75, 76, 78, 80,
+    81, 83, 85, 86, 88, 90, 91, 93, 95, 97, 98, 100, 102, 104, 106, 107, 109, 111, 113, 115, 117, 119, 121, 123,
+    125, 127, 128, 129, 130, 131, 132, 133, 134, 135, 136, 137, 139, 140, 141, 142, 143, 144, 145, 146, 147, 149, 150, 151,
+    152, 153, 155, 156, 157, 158, 159, 161, 162, 163, 165, 166, 167, 168, 170, 171, 172, 174, 175, 177, 178, 179, 181, 182,
+    184, 185, 187, 188, 189, 191, 192, 194, 196, 197, 199, 200, 202, 203, 205, 207, 208, 210, 211, 213, 215, 216, 218, 220,
+    222, 223, 225, 227, 229, 230, 232, 234,
+  };
+
+  if (x < 0x00800000) { // x < 2**-126
+    return 0x3f800000; // 1.0
+  } else if (x < 0x3c800000) { // x < 0.015625
+    return 0x3f810000 | (uint16_t)x;
+  } else if (x < 0x3f320000) { // x < 0.6953125
+    return 0x3f800000 | ((uint32_t)lut[(x >> 16) - 0x3c80] << 16) | (uint16_t)x;
+  } else if (x < 0x40000000) { // x < 2
+    return 0x40000000 | ((uint32_t)lut[(x >> 16) - 0x3c80] << 16) | (uint16_t)x;
+  } else {
+    return 0x40800000 | (uint16_t)x;
+  }
+}
+
+// SFPARECIP: approximate 1/c or e^c. For SFPARECIP_MOD1_COND_RECIP, b is LReg[VB] and the
+// result is c unchanged unless b is negative.
+uint32_t sfparecip_model_bh(uint32_t c, uint32_t b, unsigned mod1) {
+  uint32_t sign = c & 0x80000000u;
+  switch (mod1) {
+  case SFPARECIP_MOD1_RECIP:
+    return sign + sfpu_approx_recip(c - sign);
+  case SFPARECIP_MOD1_COND_RECIP:
+    return (int32_t)b < 0 ? sfpu_approx_recip(c - sign) : c;
+  case SFPARECIP_MOD1_EXP:
+  default:
+    return sign + sfpu_approx_exp(c - sign);
+  }
+}
+
+void sfparecip_model_bh_batch(const uint32_t* c, const uint32_t* b, uint32_t* out, size_t n, unsigned mod1) {
+  for (size_t i = 0; i < n; ++i) out[i] = sfparecip_model_bh(c[i], b ? b[i] : 0, mod1);
+}
+
+// Section: Simple sub-unit, Wormhole and Blackhole
+
+// SFPDIVP2: replace the exponent with imm8, or (with SFPDIVP2_MOD1_ADD) add imm8 to it modulo 256.
+uint32_t sfpdivp2_model(uint32_t c, uint8_t imm8, unsigned mod1) {
+  uint32_t exp = (c >> 23) & 0xff;
+  if (mod1 & SFPDIVP2_MOD1_ADD) {
+    if (exp != 255) exp = (exp + imm8) & 0xff; // Infinity and NaN left unchanged
+  } else {
+    exp = imm8;
+  }
+  return (c & 0x807fffff) | (exp << 23);
+}
+
+// SFPEXEXP: extract the exponent as a two's complement integer, optionally setting flags.
+uint32_t sfpexexp_model(uint32_t c, unsigned mod1, uint8_t* lane_flags) {
+  int32_t bias = mod1 & SFPEXEXP_MOD1_NODEBIAS ? 0 : 127;
+  int32_t d = (int32_t)((c >> 23) & 0xff) - bias;
+  if (lane_flags) {
+    if (mod1 & SFPEXEXP_MOD1_SET_CC_SGN_EXP) *lane_flags = d < 0;
+    if (mod1 & SFPEXEXP_MOD1_SET_CC_COMP_EXP) *lane_flags = !*lane_flags;
+  }
+  return (uint32_t)d;
+}
+
+// SFPSETEXP: replace the exponent of c with imm8, the exponent of b, or the low 8 bits of b.
+uint32_t sfpsetexp_model(uint32_t c, uint32_t b, uint8_t imm8, unsigned mod1) {
+  uint32_t exp;
+  if (mod1 & SFPSETEXP_MOD1_ARG_IMM) {
+    exp = imm8;
+  } else if (mod1 & SFPSETEXP_MOD1_ARG_EXPONENT) {
+    exp = (b >> 23) & 0xff;
+  } else {
+    exp = b & 0xff;
+  }
+  return (c & 0x807fffff) | (exp << 23);
+}
+
+// SFPSETMAN: replace the mantissa of c with imm12 << 11, or the low 23 bits of b.
+uint32_t sfpsetman_model(uint32_t c, uint32_t b, uint16_t imm12, unsigned mod1) {
+  uint32_t man = mod1 & SFPSETMAN_MOD1_ARG_IMM ? ((uint32_t)(imm12 & 0xfff) << 11) : (b & 0x7fffff);
+  return (c & 0xff800000) | man;
+}
+
+// SFPIADD: c + b, c - b, or c + sign-extended imm12, optionally setting flags.
+uint32_t sfpiadd_model(uint32_t c, uint32_t b, uint16_t imm12, unsigned mod1, uint8_t* lane_flags) {
+  uint32_t d;
+  if (mod1 & SFPIADD_MOD1_ARG_IMM) {
+    d = c + (uint32_t)((int32_t)((uint32_t)imm12 << 20) >> 20);
+  } else if (mod1 & SFPIADD_MOD1_ARG_2SCOMP_LREG_DST) {
+    d = c - b;
+  } else {
+    d = c + b;
+  }
+  if (lane_flags) {
+    if (!(mod1 & SFPIADD_MOD1_CC_NONE)) *lane_flags = (int32_t)d < 0;
+    if (mod1 & SFPIADD_MOD1_CC_GTE0) *lane_flags = !*lane_flags;
+  }
+  return d;
+}
+
+// SFPCAST: sign-magnitude integer to FP32 with round to nearest even, or stochastic rounding
+// using `prng` (the value which the lane's AdvancePRNG would return, see sfpu_prng_advance).
+// Wormhole only has this mode, and treats any Mod1 with bit 0 set as stochastic.
+uint32_t sfpcast_model_wh(uint32_t c, unsigned mod1, uint32_t prng) {
+  uint32_t sign = c & 0x80000000u;
+  uint32_t mag = c & 0x7fffffffu;
+  uint32_t lz = mag ? __builtin_clz(mag) : 157;
+  uint32_t norm = mag << (lz & 31);
+  uint32_t d = sign + ((157 - lz) << 23) + (norm >> 8);
+  if (mod1 & SFPCAST_MOD1_SM32_TO_FP32_RNS) {
+    if ((norm & 0xfe) > ((prng >> 9) & 0xfe)) d += 1;
+  } else {
+    if ((norm & 0x80) && (norm & 0x17f)) d += 1;
+  }
+  return d;
+}
+
+// Blackhole adds two's complement to sign-magnitude conversion, and two's complement absolute
+// value (with -2147483648 unchanged).
+uint32_t sfpcast_model_bh(uint32_t c, unsigned mod1, uint32_t prng) {
+  switch (mod1 & 3) {
+  case SFPCAST_MOD1_INT32_SM32: {
+    uint32_t sign = c & 0x80000000u;
+    return sign | (sign ? -c : c); }
+  case SFPCAST_MOD1_INT32_ABS:
+    return c >= 0x80000000u ? -c : c;
+  default:
+    return sfpcast_model_wh(c, mod1, prng);
+  }
+}
+
+// SFPSTOCHRND, in all three flavours, with `prng` being the value which the lane's AdvancePRNG
+// returns (the PRNG advances regardless of rounding mode). On Wormhole, RoundingMode is a single
+// bit, and the model is the same as on Blackhole.
+uint32_t sfpstochrnd_model_bh(uint32_t c, uint32_t b, unsigned rounding_mode, uint8_t imm5, unsigned mod1, uint32_t prng) {
+  uint32_t prng_bits = prng & 0x7fffff;
+  if (rounding_mode == SFPSTOCHRND_RND_NEAREST) prng_bits = 0x400000;
+  else if (rounding_mode == SFPSTOCHRND_RND_ZERO) prng_bits = 0x7fffff;
+  switch (mod1 & 7) {
+  case SFPSTOCHRND_MOD1_FP32_TO_FP16A:
+  case SFPSTOCHRND_MOD1_FP32_TO_FP16B: {
+    uint32_t exp = (c >> 23) & 0xff;
+    if (exp == 0) return 0;
+    if (exp == 255) return c & 0xff800000u;
+    unsigned discard = (mod1 & 7) == SFPSTOCHRND_MOD1_FP32_TO_FP16A ? 13 : 16;
+    uint32_t discarded = c & ((1u << discard) - 1);
+    c -= discarded;
+    if (discarded >= (prng_bits >> (23 - discard))) c += 1u << discard;
+    return c; }
+  case SFPSTOCHRND_MOD1_INT32_TO_UINT8:
+  case SFPSTOCHRND_MOD1_INT32_TO_INT8: {
+    uint32_t sign = c & 0x80000000u;
+    uint64_t mag = (uint64_t)(c & 0x7fffffffu) << 23;
+    mag >>= mod1 & SFPSTOCHRND_MOD1_USE_IMM5 ? (imm5 & 31) : (b & 31);
+    mag = (mag >> 23) + ((mag & 0x7fffff) >= prng_bits);
+    if ((mod1 & 7) == SFPSTOCHRND_MOD1_INT32_TO_UINT8) {
+      if (mag > 255) mag = 255;
+      sign = 0;
+    } else {
+      if (mag > 127) mag = 127;
+      if (mag == 0) sign = 0;
+    }
+    return sign + (uint32_t)mag; }
+  default: {
+    int keep_sign = mod1 & 1;
+    uint32_t max_mag = (mod1 & 7) == SFPSTOCHRND_MOD1_FP32_TO_INT8 ? 127 : (mod1 & 7) == SFPSTOCHRND_MOD1_FP32_TO_UINT8 ? 255
+      : (mod1 & 7) == SFPSTOCHRND_MOD1_FP32_TO_INT16 ? 32767 : 65535;
+    uint32_t sign = keep_sign ? c & 0x80000000u : 0;
+    int32_t exp = (int32_t)((c >> 23) & 0xff) - 127;
+    uint64_t mag;
+    if (exp < -1) {
+      mag = 0;
+      sign = 0;
+    } else if (exp >= 16) {
+      mag = max_mag;
+    } else {
+      mag = 0x800000 | (c & 0x7fffff);
+      mag = exp >= 0 ? mag << exp : mag >> -exp;
+      mag = (mag >> 23) + ((mag & 0x7fffff) >= prng_bits);
+      if (mag > max_mag) mag = max_mag;
+      if (mag == 0) sign = 0;
+    }
+    return sign + (uint32_t)mag; }
+  }
+}
+
+uint32_t sfpstochrnd_model_wh(uint32_t c, uint32_t b, int stochastic_rounding, uint8_t imm5, unsigned mod1, uint32_t prng) {
+  return sfpstochrnd_model_bh(c, b, stochastic_rounding ? SFPSTOCHRND_RND_STOCH : SFPSTOCHRND_RND_NEAREST, imm5, mod1, prng);
+}
+
+void sfpdivp2_model_batch(const uint32_t* c, uint32_t* out, size_t n, uint8_t imm8, unsigned mod1) {
+  for (size_t i = 0; i < n; ++i) out[i] = sfpdivp2_model(c[i], imm8, mod1);
+}
+
+void sfpexexp_model_batch(const uint32_t* c, uint32_t* out, size_t n, unsigned mod1, uint8_t* lane_flags) {
+  for (size_t i = 0; i < n; ++i) out[i] = sfpexexp_model(c[i], mod1, lane_flags ? lane_flags + i : NULL);
+}
+
+void sfpsetexp_model_batch(const uint32_t* c, const uint32_t* b, uint32_t* out, size_t n, uint8_t imm8, unsigned mod1) {
+  for (size_t i = 0; i < n; ++i) out[i] = sfpsetexp_model(c[i], b ? b[i] : 0, imm8, mod1);
+}
+
+void sfpsetman_model_batch(const uint32_t* c, const uint32_t* b, uint32_t* out, size_t n, uint16_t imm12, unsigned mod1) {
+  for (size_t i = 0; i < n; ++i) out[i] = sfpsetman_model(c[i], b ? b[i] : 0, imm12, mod1);
+}
+
+void sfpiadd_model_batch(const uint32_t* c, const uint32_t* b, uint32_t* out, size_t n, uint16_t imm12, unsigned mod1, uint8_t* lane_flags) {
+  for (size_t i = 0; i < n; ++i) out[i] = sfpiadd_model(c[i], b ? b[i] : 0, imm12, mod1, lane_flags ? lane_flags + i : NULL);
+}
+
+// For the batch versions of SFPCAST, `prng` is only used for stochastic rounding, and can otherwise be NULL.
+void sfpcast_model_wh_batch(const uint32_t* c, uint32_t* out, size_t n, unsigned mod1, const uint32_t* prng) {
+  for (size_t i = 0; i < n; ++i) out[i] = sfpcast_model_wh(c[i], mod1, prng ? prng[i] : 0);
+}
+
+void sfpcast_model_bh_batch(const uint32_t* c, uint32_t* out, size_t n, unsigned mod1, const uint32_t* prng) {
+  for (size_t i = 0; i < n; ++i) out[i] = sfpcast_model_bh(c[i], mod1, prng ? prng[i] : 0);
+}
+
+// For the batch versions of SFPSTOCHRND, `b` is only used by the INT32_TO_ flavours without
+// SFPSTOCHRND_MOD1_USE_IMM5, and `prng` only by stochastic rounding; either can otherwise be NULL.
+void sfpstochrnd_model_bh_batch(const uint32_t* c, const uint32_t* b, uint32_t* out, size_t n, unsigned rounding_mode, uint8_t imm5, unsigned mod1, const uint32_t* prng) {
+  for (size_t i = 0; i < n; ++i) out[i] = sfpstochrnd_model_bh(c[i], b ? b[i] : 0, rounding_mode, imm5, mod1, prng ? prng[i] : 0);
+}
+
+void sfpstochrnd_model_wh_batch(const uint32_t* c, const uint32_t* b, uint32_t* out, size_t n, int stochastic_rounding, uint8_t imm5, unsigned mod1, const uint32_t* prng) {
+  for (size_t i = 0; i < n; ++i) out[i] = sfpstochrnd_model_wh(c[i], b ? b[i] : 0, stochastic_rounding, imm5, mod1, prng ? prng[i] : 0);
+}
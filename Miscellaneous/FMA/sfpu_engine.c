@@ -0,0 +1,959 @@
+/*
+ * SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Execution engine for Vector Unit (SFPU) instruction streams, running over many Dst tiles.
+ *
+ * Each tile gets its own copy of the Vector Unit state: LReg[0] through LReg[15] held as
+ * LReg[i][Lane] (so each register is 32 contiguous lanes), per-lane LaneFlags,
+ * UseLaneFlagsForLaneEnable, and FlagStack, the per-lane PRNG, and the Dst RWC. The program is run
+ * from start to finish against each tile's Dst storage, with tiles spread across threads. Each
+ * instruction executes across all 32 lanes at once: the MAD-based instructions go through the
+ * batch models in sfpu_arith.c (and thus through the vector implementations in fma_batch.c), and
+ * most of the others are written as loops over the lanes without branches, which GCC vectorises
+ * at -O2. The exceptions, which still go lane by lane, are SFPLOAD / SFPSTORE, SFPSWAP,
+ * SFPTRANSP, SFPSHFT2, SFPEXEXP, SFPIADD, and the instructions which advance the PRNG.
+ *
+ * The instruction semantics are those of the functional models in TensixCoprocessor/SFP*.md, for
+ * either Wormhole or Blackhole, with the following simplifications:
+ * - All LaneConfig fields are zero, and SFPCONFIG / SFPLOADMACRO / LReg[16] are not modelled
+ *   (LReg[11] through LReg[14] are instead taken from sfpu_config_t).
+ * - The only RWC is Dst, which SFPLOAD / SFPSTORE advance by a per-AddrMod increment from
+ *   sfpu_config_t, and which can be set or incremented by two pseudo-instructions standing in
+ *   for SETRWC / INCRWC. DEST_TARGET_REG_CFG_MATH_Offset, DEST_REGW_BASE_Base, and the Sp RWC
+ *   are all zero (so MOD0_FMT_INT32_ALL never moves the stack pointer).
+ * - Dst remapping and swizzling are disabled, so Adj16 is the identity.
+ * - Undefined behaviour (such as pushing to a full FlagStack) is reported by sfpu_engine_check
+ *   where it can be seen statically, and otherwise does something arbitrary but memory-safe.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "sfpu_arith.c"
+
+// Section: Instructions
+
+// Values for sfpu_insn_t::op:
+#define SFPU_OP_SFPNOP       0
+#define SFPU_OP_SFPLOAD      1
+#define SFPU_OP_SFPLOADI     2
+#define SFPU_OP_SFPSTORE     3
+#define SFPU_OP_SFPMAD       4 // Also SFPADD and SFPMUL, which are identical
+#define SFPU_OP_SFPADDI      5
+#define SFPU_OP_SFPMULI      6
+#define SFPU_OP_SFPMUL24     7 // Blackhole only
+#define SFPU_OP_SFPARECIP    8 // Blackhole only
+#define SFPU_OP_SFPDIVP2     9
+#define SFPU_OP_SFPEXEXP    10
+#define SFPU_OP_SFPSETEXP   11
+#define SFPU_OP_SFPSETMAN   12
+#define SFPU_OP_SFPSETSGN   13
+#define SFPU_OP_SFPIADD     14
+#define SFPU_OP_SFPCAST     15
+#define SFPU_OP_SFPABS      16
+#define SFPU_OP_SFPAND      17
+#define SFPU_OP_SFPOR       18
+#define SFPU_OP_SFPXOR      19
+#define SFPU_OP_SFPNOT      20
+#define SFPU_OP_SFPMOV      21
+#define SFPU_OP_SFPSETCC    22
+#define SFPU_OP_SFPENCC     23
+#define SFPU_OP_SFPPUSHC    24
+#define SFPU_OP_SFPPOPC     25
+#define SFPU_OP_SFPCOMPC    26
+#define SFPU_OP_SFPSWAP     27
+#define SFPU_OP_SFPTRANSP   28
+#define SFPU_OP_SFPSHFT2    29
+#define SFPU_OP_SFPSTOCHRND 30
+#define SFPU_OP_SFPLUT      31
+#define SFPU_OP_SFPLUTFP32  32
+#define SFPU_OP_DST_RWC_SET 33 // Pseudo-instruction: RWC Dst = Imm
+#define SFPU_OP_DST_RWC_INC 34 // Pseudo-instruction: RWC Dst += Imm
+#define SFPU_NUM_OPS        35
+
+typedef struct sfpu_insn_t {
+  uint8_t op;
+  uint8_t va, vb, vc, vd;
+  uint8_t mod;      // Mod0 or Mod1
+  uint8_t addr_mod; // SFPLOAD / SFPSTORE only
+  uint16_t imm;     // Imm1 / Imm2 / Imm8 / Imm10 / Imm12 / Imm16, depending on op (or Imm5 << 2 | RoundingMode)
+} sfpu_insn_t;
+
+// Initializers for sfpu_insn_t, taking the same arguments in the same order as the
+// corresponding TT_ macros, so that existing instruction sequences can be transcribed directly.
+#define SFPU_SFPNOP()                                 {SFPU_OP_SFPNOP, 0, 0, 0, 0, 0, 0, 0}
+#define SFPU_SFPLOAD(VD, Mod0, AddrMod, Imm10)        {SFPU_OP_SFPLOAD, 0, 0, 0, (VD), (Mod0), (AddrMod), (Imm10)}
+#define SFPU_SFPLOADI(VD, Mod0, Imm16)                {SFPU_OP_SFPLOADI, 0, 0, 0, (VD), (Mod0), 0, (Imm16)}
+#define SFPU_SFPSTORE(VD, Mod0, AddrMod, Imm10)       {SFPU_OP_SFPSTORE, 0, 0, 0, (VD), (Mod0), (AddrMod), (Imm10)}
+#define SFPU_SFPMAD(VA, VB, VC, VD, Mod1)             {SFPU_OP_SFPMAD, (VA), (VB), (VC), (VD), (Mod1), 0, 0}
+#define SFPU_SFPADD(VA, VB, VC, VD, Mod1)             {SFPU_OP_SFPMAD, (VA), (VB), (VC), (VD), (Mod1), 0, 0}
+#define SFPU_SFPMUL(VA, VB, VC, VD, Mod1)             {SFPU_OP_SFPMAD, (VA), (VB), (VC), (VD), (Mod1), 0, 0}
+#define SFPU_SFPADDI(Imm16, VD, Mod1)                 {SFPU_OP_SFPADDI, 0, 0, (VD), (VD), (Mod1), 0, (Imm16)}
+#define SFPU_SFPMULI(Imm16, VD, Mod1)                 {SFPU_OP_SFPMULI, 0, 0, (VD), (VD), (Mod1), 0, (Imm16)}
+#define SFPU_SFPMUL24(VA, VB, VC, VD, Mod1)           {SFPU_OP_SFPMUL24, (VA), (VB), (VC), (VD), (Mod1), 0, 0}
+#define SFPU_SFPARECIP(VB, VC, VD, Mod1)              {SFPU_OP_SFPARECIP, 0, (VB), (VC), (VD), (Mod1), 0, 0}
+#define SFPU_SFPDIVP2(Imm8, VC, VD, Mod1)             {SFPU_OP_SFPDIVP2, 0, 0, (VC), (VD), (Mod1), 0, (Imm8)}
+#define SFPU_SFPEXEXP(Zero, VC, VD, Mod1)             {SFPU_OP_SFPEXEXP, 0, 0, (VC), (VD), (Mod1), 0, (Zero)}
+#define SFPU_SFPSETEXP(Imm8, VC, VD, Mod1)            {SFPU_OP_SFPSETEXP, 0, (VD), (VC), (VD), (Mod1), 0, (Imm8)}
+#define SFPU_SFPSETMAN(Imm12, VC, VD, Mod1)           {SFPU_OP_SFPSETMAN, 0, (VD), (VC), (VD), (Mod1), 0, (Imm12)}
+#define SFPU_SFPSETSGN(Imm1, VC, VD, Mod1)            {SFPU_OP_SFPSETSGN, 0, (VD), (VC), (VD), (Mod1), 0, (Imm1)}
+#define SFPU_SFPIADD(Imm12, VC, VD, Mod1)             {SFPU_OP_SFPIADD, 0, (VD), (VC), (VD), (Mod1), 0, (Imm12)}
+#define SFPU_SFPCAST(VC, VD, Mod1)                    {SFPU_OP_SFPCAST, 0, 0, (VC), (VD), (Mod1), 0, 0}
+#define SFPU_SFPABS(Zero, VC, VD, Mod1)               {SFPU_OP_SFPABS, 0, 0, (VC), (VD), (Mod1), 0, (Zero)}
+#define SFPU_SFPAND(VB, VC, VD, Mod1)                 {SFPU_OP_SFPAND, 0, (VB), (VC), (VD), (Mod1), 0, 0}
+#define SFPU_SFPOR(VB, VC, VD, Mod1)                  {SFPU_OP_SFPOR, 0, (VB), (VC), (VD), (Mod1), 0, 0}
+#define SFPU_SFPXOR(Zero, VC, VD, Zero2)              {SFPU_OP_SFPXOR, 0, (VD), (VC), (VD), (Zero2), 0, (Zero)}
+#define SFPU_SFPNOT(Zero, VC, VD, Zero2)              {SFPU_OP_SFPNOT, 0, 0, (VC), (VD), (Zero2), 0, (Zero)}
+#define SFPU_SFPMOV(Zero, VC, VD, Mod1)               {SFPU_OP_SFPMOV, 0, 0, (VC), (VD), (Mod1), 0, (Zero)}
+#define SFPU_SFPSETCC(Imm1, VC, VD, Mod1)             {SFPU_OP_SFPSETCC, 0, 0, (VC), (VD), (Mod1), 0, (Imm1)}
+#define SFPU_SFPENCC(Imm2, Zero, VD, Mod1)            {SFPU_OP_SFPENCC, 0, 0, (Zero), (VD), (Mod1), 0, (Imm2)}
+#define SFPU_SFPPUSHC(Zero, Zero2, VD, Mod1)          {SFPU_OP_SFPPUSHC, 0, 0, (Zero2), (VD), (Mod1), 0, (Zero)}
+#define SFPU_SFPPOPC(Zero, Zero2, VD, Mod1)           {SFPU_OP_SFPPOPC, 0, 0, (Zero2), (VD), (Mod1), 0, (Zero)}
+#define SFPU_SFPCOMPC(Zero, Zero2, VD, Zero3)         {SFPU_OP_SFPCOMPC, 0, 0, (Zero2), (VD), (Zero3), 0, (Zero)}
+#define SFPU_SFPSWAP(Zero, VC, VD, Mod1)              {SFPU_OP_SFPSWAP, 0, 0, (VC), (VD), (Mod1), 0, (Zero)}
+#define SFPU_SFPTRANSP(Zero, Zero2, VD, Zero3)        {SFPU_OP_SFPTRANSP, 0, 0, (Zero2), (VD), (Zero3), 0, (Zero)}
+#define SFPU_SFPSHFT2(VBOrImm12, VC, VD, Mod1)        {SFPU_OP_SFPSHFT2, 0, (VBOrImm12) & 15, (VC), (VD), (Mod1), 0, (VBOrImm12)}
+#define SFPU_SFP_STOCH_RND(RoundingMode, Imm5, VB, VC, VD, Mod1) {SFPU_OP_SFPSTOCHRND, 0, (VB), (VC), (VD), (Mod1), 0, ((Imm5) << 2) | (RoundingMode)}
+#define SFPU_SFPLUT(VD, Mod0, Zero)                   {SFPU_OP_SFPLUT, 0, 0, 0, (VD), (Mod0), 0, (Zero)}
+#define SFPU_SFPLUTFP32(VD, Mod1)                     {SFPU_OP_SFPLUTFP32, 0, 0, 0, (VD), (Mod1), 0, 0}
+#define SFPU_DST_RWC_SET(Value)                       {SFPU_OP_DST_RWC_SET, 0, 0, 0, 0, 0, 0, (Value)}
+#define SFPU_DST_RWC_INC(Incr)                        {SFPU_OP_DST_RWC_INC, 0, 0, 0, 0, 0, 0, (Incr)}
+
+// Values for Mod0 of SFPLOAD and SFPSTORE:
+#define MOD0_FMT_SRCB      0
+#define MOD0_FMT_FP16      1
+#define MOD0_FMT_BF16      2
+#define MOD0_FMT_FP32      3
+#define MOD0_FMT_INT32     4
+#define MOD0_FMT_INT8      5
+#define MOD0_FMT_UINT16    6
+#define MOD0_FMT_HI16      7
+#define MOD0_FMT_INT16     8
+#define MOD0_FMT_LO16      9
+#define MOD0_FMT_INT32_ALL 10
+#define MOD0_FMT_ZERO      11
+#define MOD0_FMT_INT32_SM  12
+#define MOD0_FMT_INT8_COMP 13
+#define MOD0_FMT_LO16_ONLY 14
+#define MOD0_FMT_HI16_ONLY 15
+
+// Values for Mod0 of SFPLOADI:
+#define SFPLOADI_MOD0_FLOATB 0
+#define SFPLOADI_MOD0_FLOATA 1
+#define SFPLOADI_MOD0_USHORT 2
+#define SFPLOADI_MOD0_SHORT  4
+#define SFPLOADI_MOD0_UPPER  8
+#define SFPLOADI_MOD0_LOWER  10
+
+// Values for Mod1 of SFPSETSGN, SFPABS, SFPAND, SFPOR, SFPMOV:
+#define SFPSETSGN_MOD1_ARG_IMM        1
+#define SFPABS_MOD1_FLOAT             1
+#define SFPAND_MOD1_USE_VB            1 // Blackhole only
+#define SFPOR_MOD1_USE_VB             1 // Blackhole only
+#define SFPMOV_MOD1_NEGATE            1
+#define SFPMOV_MOD1_ALL_LANES_ENABLED 2
+#define SFPMOV_MOD1_FROM_SPECIAL      8
+
+// Values for Mod1 of SFPSETCC:
+#define SFPSETCC_MOD1_LREG_LT0  0
+#define SFPSETCC_MOD1_IMM_BIT0  1
+#define SFPSETCC_MOD1_LREG_NE0  2
+#define SFPSETCC_MOD1_LREG_GTE0 4
+#define SFPSETCC_MOD1_LREG_EQ0  6
+#define SFPSETCC_MOD1_CLEAR     8
+
+// Values for Mod1 and Imm2 of SFPENCC:
+#define SFPENCC_MOD1_EC 1
+#define SFPENCC_MOD1_EI 2
+#define SFPENCC_MOD1_RI 8
+#define SFPENCC_IMM2_E  1
+#define SFPENCC_IMM2_R  2
+
+// Values for Mod1 of SFPSWAP:
+#define SFPSWAP_MOD1_SWAP               0
+#define SFPSWAP_MOD1_VEC_MIN_MAX        1
+#define SFPSWAP_MOD1_SUBVEC_MIN01_MAX23 2
+#define SFPSWAP_MOD1_SUBVEC_MIN02_MAX13 3
+#define SFPSWAP_MOD1_SUBVEC_MIN03_MAX12 4
+#define SFPSWAP_MOD1_SUBVEC_MIN0_MAX123 5
+#define SFPSWAP_MOD1_SUBVEC_MIN1_MAX023 6
+#define SFPSWAP_MOD1_SUBVEC_MIN2_MAX013 7
+#define SFPSWAP_MOD1_SUBVEC_MIN3_MAX012 8
+
+// Values for Mod1 of SFPSHFT2:
+#define SFPSHFT2_MOD1_COPY4                     0
+#define SFPSHFT2_MOD1_SUBVEC_CHAINED_COPY4      1
+#define SFPSHFT2_MOD1_SUBVEC_SHFLROR1_AND_COPY4 2
+#define SFPSHFT2_MOD1_SUBVEC_SHFLROR1           3
+#define SFPSHFT2_MOD1_SUBVEC_SHFLSHR1           4
+#define SFPSHFT2_MOD1_SHFT_LREG                 5
+#define SFPSHFT2_MOD1_SHFT_IMM                  6
+
+// Section: Engine state
+
+#define SFPU_LANES 32
+#define SFPU_FLAG_STACK_DEPTH 8
+
+// Values for sfpu_config_t::arch:
+#define SFPU_ARCH_WH 0
+#define SFPU_ARCH_BH 1
+
+typedef struct sfpu_config_t {
+  int arch;                        // SFPU_ARCH_WH or SFPU_ARCH_BH
+  unsigned tile_rows;              // Rows of Dst16b per tile (a multiple of 16); Dst addresses wrap around within a tile
+  uint8_t srcb_mod0;               // What MOD0_FMT_SRCB resolves to: MOD0_FMT_FP32, MOD0_FMT_BF16, or MOD0_FMT_FP16
+  uint16_t addr_mod_dst_incr[8];   // Added to RWC Dst by SFPLOAD / SFPSTORE, indexed by AddrMod
+  uint32_t lreg_config[4][8];      // Initial contents of LReg[11] through LReg[14], broadcast from 8 lanes to 32
+  uint32_t prng_seed;              // Each tile's PRNG state is derived from this and the tile index
+} sfpu_config_t;
+
+typedef struct sfpu_state_t {
+  uint32_t lreg[16][SFPU_LANES];
+  uint8_t flags[SFPU_LANES];       // LaneFlags
+  uint8_t use_flags[SFPU_LANES];   // UseLaneFlagsForLaneEnable
+  uint8_t stack_flags[SFPU_FLAG_STACK_DEPTH][SFPU_LANES];
+  uint8_t stack_use_flags[SFPU_FLAG_STACK_DEPTH][SFPU_LANES];
+  unsigned stack_size;             // The same in all lanes, as SFPPUSHC / SFPPOPC ignore lane enables
+  uint32_t prng[SFPU_LANES];
+  uint32_t shfl_vc0[SFPU_LANES];   // Wormhole only; see SFPSHFT2_MOD1_SUBVEC_SHFLSHR1
+  uint16_t dst_rwc;                // 10 bits
+  uint16_t* dst;                   // DstBits[tile_rows][16] for this tile
+  const sfpu_config_t* cfg;
+} sfpu_state_t;
+
+void sfpu_state_init(sfpu_state_t* s, const sfpu_config_t* cfg, uint16_t* dst, size_t tile_index) {
+  memset(s, 0, sizeof(*s));
+  s->cfg = cfg;
+  s->dst = dst;
+  for (unsigned lane = 0; lane < SFPU_LANES; ++lane) {
+    s->lreg[8][lane] = 0x3f56594b; // 0.8373
+    s->lreg[9][lane] = 0;
+    s->lreg[10][lane] = 0x3f800000; // 1.0
+    for (unsigned i = 0; i < 4; ++i) s->lreg[11 + i][lane] = cfg->lreg_config[i][lane & 7];
+    s->lreg[15][lane] = lane * 2;
+    uint64_t z = (cfg->prng_seed + 0x9e3779b97f4a7c15ull * (tile_index * SFPU_LANES + lane + 1));
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    s->prng[lane] = (uint32_t)(z ^ (z >> 31));
+  }
+}
+
+// Section: Dst
+
+static unsigned sfpu_adj32(unsigned row) {
+  row &= 0x3ff;
+  return ((row & 0x1f8) << 1) | (row & 0x207);
+}
+
+static uint16_t* sfpu_dst16(const sfpu_state_t* s, unsigned row, unsigned col) {
+  return &s->dst[(row % s->cfg->tile_rows) * 16 + col];
+}
+
+static uint32_t sfpu_dst32_read(const sfpu_state_t* s, unsigned row, unsigned col) {
+  unsigned r = sfpu_adj32(row) % s->cfg->tile_rows;
+  return ((uint32_t)s->dst[r * 16 + col] << 16) | s->dst[(r + 8) * 16 + col];
+}
+
+static void sfpu_dst32_write(const sfpu_state_t* s, unsigned row, unsigned col, uint32_t x) {
+  unsigned r = sfpu_adj32(row) % s->cfg->tile_rows;
+  s->dst[r * 16 + col] = x >> 16;
+  s->dst[(r + 8) * 16 + col] = (uint16_t)x;
+}
+
+static uint16_t sfpu_bf16_shuffle(uint16_t x) { // Sign,Exp,Man to Sign,Man,Exp
+  return (x & 0x8000) | ((x & 0x007f) << 8) | ((x & 0x7f80) >> 7);
+}
+
+static uint16_t sfpu_bf16_unshuffle(uint16_t x) { // Sign,Man,Exp to Sign,Exp,Man
+  return (x & 0x8000) | ((x & 0x00ff) << 7) | ((x & 0x7f00) >> 8);
+}
+
+static uint32_t sfpu_fp32_shuffle(uint32_t x) {
+  return ((uint32_t)sfpu_bf16_shuffle(x >> 16) << 16) | (x & 0xffff);
+}
+
+static uint32_t sfpu_fp32_unshuffle(uint32_t x) {
+  return ((uint32_t)sfpu_bf16_unshuffle(x >> 16) << 16) | (x & 0xffff);
+}
+
+static uint16_t sfpu_fp16_shuffle(uint16_t x) { // Sign,Exp,Man to Sign,Man,Exp
+  return (x & 0x8000) | ((x & 0x03ff) << 5) | ((x & 0x7c00) >> 10);
+}
+
+// Dst32b[row][col] of a tile, in conventional FP32 / integer bit layout. Use these to put
+// data into tiles before sfpu_engine_run and to get results back out.
+void sfpu_dst_write32(uint16_t* tile, unsigned tile_rows, unsigned row, unsigned col, uint32_t x) {
+  sfpu_config_t cfg = {.tile_rows = tile_rows};
+  sfpu_state_t s = {.dst = tile, .cfg = &cfg};
+  sfpu_dst32_write(&s, row, col, sfpu_fp32_shuffle(x));
+}
+
+uint32_t sfpu_dst_read32(uint16_t* tile, unsigned tile_rows, unsigned row, unsigned col) {
+  sfpu_config_t cfg = {.tile_rows = tile_rows};
+  sfpu_state_t s = {.dst = tile, .cfg = &cfg};
+  return sfpu_fp32_unshuffle(sfpu_dst32_read(&s, row, col));
+}
+
+// Section: Execution
+
+// The per-lane flags and enables are all 0 or 1, so that they can be combined with bitwise
+// operations, and loops over lanes can be written without branches (which lets GCC vectorise them).
+static void sfpu_lane_enabled(const sfpu_state_t* s, uint8_t* en) {
+  for (unsigned lane = 0; lane < SFPU_LANES; ++lane) en[lane] = (s->use_flags[lane] ^ 1) | s->flags[lane];
+}
+
+static void sfpu_write(sfpu_state_t* s, unsigned vd, const uint32_t* r, const uint8_t* en) {
+  if (vd >= 8) return;
+  uint32_t* d = s->lreg[vd];
+  for (unsigned lane = 0; lane < SFPU_LANES; ++lane) {
+    uint32_t m = -(uint32_t)en[lane];
+    d[lane] = (r[lane] & m) | (d[lane] & ~m);
+  }
+}
+
+static void sfpu_write_maybe_indirect(sfpu_state_t* s, unsigned vd, int indirect, const uint32_t* r, const uint8_t* en) {
+  if (!indirect) {
+    sfpu_write(s, vd, r, en);
+    return;
+  }
+  for (unsigned lane = 0; lane < SFPU_LANES; ++lane) {
+    unsigned v = s->lreg[7][lane] & 15;
+    if (en[lane] && v < 8) s->lreg[v][lane] = r[lane];
+  }
+}
+
+static const uint32_t* sfpu_read_maybe_indirect(const sfpu_state_t* s, unsigned va, int indirect, uint32_t* tmp) {
+  if (!indirect) return s->lreg[va];
+  for (unsigned lane = 0; lane < SFPU_LANES; ++lane) tmp[lane] = s->lreg[s->lreg[7][lane] & 15][lane];
+  return tmp;
+}
+
+static unsigned sfpu_resolve_mod0(const sfpu_state_t* s, unsigned mod0) {
+  return mod0 == MOD0_FMT_SRCB ? s->cfg->srcb_mod0 : mod0;
+}
+
+static unsigned sfpu_dst_addr(sfpu_state_t* s, const sfpu_insn_t* in, unsigned mod0) {
+  // With Sp and the various base registers all zero, both architectures agree on this.
+  unsigned addr = in->imm + (mod0 == MOD0_FMT_INT32_ALL ? (s->dst_rwc & 3u) : s->dst_rwc);
+  s->dst_rwc = (s->dst_rwc + s->cfg->addr_mod_dst_incr[in->addr_mod & 7]) & 0x3ff;
+  return addr & 0x3ff;
+}
+
+// SFPLOAD and SFPSTORE touch four rows of Dst, with lanes 8 * i through 8 * i + 7 in row i.
+// These are the starts of each row, both as Dst16b and as the high and low halves of Dst32b,
+// so that the per-lane loops don't need to wrap every address within the tile.
+typedef struct sfpu_dst_rows_t {
+  uint16_t* row16[4];
+  uint16_t* hi32[4];
+  uint16_t* lo32[4];
+} sfpu_dst_rows_t;
+
+static void sfpu_dst_rows(const sfpu_state_t* s, unsigned addr, sfpu_dst_rows_t* rows) {
+  for (unsigned i = 0; i < 4; ++i) {
+    unsigned row = (addr & ~3u) + i;
+    unsigned r = sfpu_adj32(row) % s->cfg->tile_rows;
+    rows->row16[i] = sfpu_dst16(s, row, 0);
+    rows->hi32[i] = &s->dst[r * 16];
+    rows->lo32[i] = &s->dst[(r + 8) * 16];
+  }
+}
+
+static uint32_t sfpu_sign_mag_to_twos_comp(uint32_t x) {
+  uint32_t mag = x & 0x7fffffff;
+  return x & 0x80000000 ? -mag : mag;
+}
+
+static uint32_t sfpu_twos_comp_to_sign_mag(uint32_t x) {
+  uint32_t sign = x & 0x80000000;
+  uint32_t mag = sign ? -x : x;
+  return sign | (mag & 0x7fffffff);
+}
+
+static void sfpu_exec_load(sfpu_state_t* s, const sfpu_insn_t* in, const uint8_t* en) {
+  unsigned mod0 = sfpu_resolve_mod0(s, in->mod);
+  unsigned addr = sfpu_dst_addr(s, in, mod0);
+  if (in->vd >= 8) return;
+  int wh = s->cfg->arch == SFPU_ARCH_WH;
+  uint32_t* d = s->lreg[in->vd];
+  sfpu_dst_rows_t rows;
+  sfpu_dst_rows(s, addr, &rows);
+  for (unsigned lane = 0; lane < SFPU_LANES; ++lane) {
+    if (!en[lane] && mod0 != MOD0_FMT_INT32_ALL) continue;
+    unsigned col = (lane & 7) * 2 + ((addr & 2) ? 1 : 0);
+    uint16_t* d16 = rows.row16[lane / 8] + col;
+    uint32_t d32 = ((uint32_t)rows.hi32[lane / 8][col] << 16) | rows.lo32[lane / 8][col];
+    uint32_t x;
+    switch (mod0) {
+    case MOD0_FMT_FP16: {
+      uint32_t h = *d16, exp = h & 0x1f;
+      if (exp != 0) exp += 112;
+      x = ((h >> 15) << 31) | (exp << 23) | (((h >> 5) & 0x3ff) << 13);
+      break; }
+    case MOD0_FMT_BF16: x = (uint32_t)sfpu_bf16_unshuffle(*d16) << 16; break;
+    case MOD0_FMT_FP32:
+    case MOD0_FMT_INT32:
+    case MOD0_FMT_INT32_ALL: x = sfpu_fp32_unshuffle(d32); break;
+    case MOD0_FMT_INT32_SM:
+      x = sfpu_fp32_unshuffle(d32);
+      if (wh) x = sfpu_sign_mag_to_twos_comp(x);
+      break;
+    case MOD0_FMT_INT8: {
+      uint32_t h = *d16;
+      x = ((h >> 15) << 31) | ((h >> 5) & (wh ? 0x7f : 0xff));
+      break; }
+    case MOD0_FMT_INT8_COMP: {
+      uint32_t h = *d16;
+      x = ((h >> 15) << 31) | ((h >> 5) & 0x3ff);
+      if (wh) x = sfpu_sign_mag_to_twos_comp(x);
+      break; }
+    case MOD0_FMT_LO16_ONLY: x = (d[lane] & 0xffff0000) | *d16; break;
+    case MOD0_FMT_HI16_ONLY: x = ((uint32_t)*d16 << 16) | (d[lane] & 0x0000ffff); break;
+    case MOD0_FMT_INT16: {
+      uint32_t h = *d16;
+      x = ((h >> 15) << 31) | (h & 0x7fff);
+      break; }
+    case MOD0_FMT_UINT16:
+    case MOD0_FMT_LO16: x = *d16; break;
+    case MOD0_FMT_HI16: x = (uint32_t)*d16 << 16; break;
+    default: x = 0; break; // MOD0_FMT_ZERO
+    }
+    d[lane] = x;
+  }
+}
+
+static uint16_t sfpu_to_fp16(uint32_t x) { // Flush underflow, saturate overflow, truncate
+  uint32_t sign = x >> 31;
+  int32_t exp = (int32_t)((x >> 23) & 0xff) - 112;
+  uint32_t man = x & 0x7fffff;
+  if (exp <= 0) {
+    exp = 0;
+    man = 0;
+  } else if (exp > 31) {
+    exp = 31;
+    man = 0x7fffff;
+  }
+  return (sign << 15) | ((uint32_t)exp << 10) | (man >> 13);
+}
+
+static uint32_t sfpu_flush_denormal(uint32_t x) {
+  return (x & 0x7f800000) ? x : (x & 0x80000000);
+}
+
+static uint16_t sfpu_sign_mag11_to_fp16(uint32_t x) {
+  return ((x >> 31) << 15) | (16 << 10) | (x & 0x3ff);
+}
+
+static void sfpu_store32(uint16_t* hi, uint16_t* lo, uint32_t x) {
+  *hi = x >> 16;
+  *lo = (uint16_t)x;
+}
+
+static void sfpu_exec_store(sfpu_state_t* s, const sfpu_insn_t* in, const uint8_t* en) {
+  unsigned mod0 = sfpu_resolve_mod0(s, in->mod);
+  unsigned addr = sfpu_dst_addr(s, in, mod0);
+  if (in->vd >= 12) return;
+  int wh = s->cfg->arch == SFPU_ARCH_WH;
+  const uint32_t* d = s->lreg[in->vd];
+  sfpu_dst_rows_t rows;
+  sfpu_dst_rows(s, addr, &rows);
+  for (unsigned lane = 0; lane < SFPU_LANES; ++lane) {
+    if (!en[lane] && mod0 != MOD0_FMT_INT32_ALL) continue;
+    unsigned col = (lane & 7) * 2 + ((addr & 2) ? 1 : 0);
+    uint16_t* d16 = rows.row16[lane / 8] + col;
+    uint16_t* hi = rows.hi32[lane / 8] + col;
+    uint16_t* lo = rows.lo32[lane / 8] + col;
+    uint32_t x = d[lane];
+    switch (mod0) {
+    case MOD0_FMT_FP16: *d16 = sfpu_fp16_shuffle(sfpu_to_fp16(x)); break;
+    case MOD0_FMT_BF16: *d16 = sfpu_bf16_shuffle(sfpu_flush_denormal(x) >> 16); break;
+    case MOD0_FMT_FP32: sfpu_store32(hi, lo, sfpu_fp32_shuffle(wh ? x : sfpu_flush_denormal(x))); break;
+    case MOD0_FMT_INT32:
+    case MOD0_FMT_INT32_ALL: sfpu_store32(hi, lo, sfpu_fp32_shuffle(x)); break;
+    case MOD0_FMT_INT32_SM: sfpu_store32(hi, lo, sfpu_fp32_shuffle(wh ? sfpu_twos_comp_to_sign_mag(x) : x)); break;
+    case MOD0_FMT_INT8: *d16 = sfpu_fp16_shuffle(sfpu_sign_mag11_to_fp16(x)); break;
+    case MOD0_FMT_INT8_COMP:
+      *d16 = sfpu_fp16_shuffle(sfpu_sign_mag11_to_fp16(wh ? sfpu_twos_comp_to_sign_mag(x) : x));
+      break;
+    case MOD0_FMT_LO16_ONLY:
+    case MOD0_FMT_UINT16: *d16 = x & 0xffff; break;
+    case MOD0_FMT_HI16_ONLY: *d16 = x >> 16; break;
+    case MOD0_FMT_INT16: *d16 = ((x >> 31) << 15) | (x & 0x7fff); break;
+    case MOD0_FMT_LO16: sfpu_store32(hi, lo, (x << 16) | (x >> 16)); break;
+    case MOD0_FMT_HI16: sfpu_store32(hi, lo, x); break;
+    default: *d16 = 0; break; // MOD0_FMT_ZERO
+    }
+  }
+}
+
+static int sfpu_boolean_op(unsigned mod1, int a, int b) {
+  switch (mod1) {
+  case  1: return        b;
+  case  2: return       !b;
+  case  3: return  a &&  b;
+  case  4: return  a ||  b;
+  case  5: return  a && !b;
+  case  6: return  a || !b;
+  case  7: return !a &&  b;
+  case  8: return !a ||  b;
+  case  9: return !a && !b;
+  case 10: return !a || !b;
+  case 11: return  a !=  b;
+  default: return  a ==  b;
+  }
+}
+
+// dst[lane] = sfpu_boolean_op(mod1, a[lane], b[lane]) for every lane, via the op's truth table
+static void sfpu_boolean_op_lanes(unsigned mod1, uint8_t* dst, const uint8_t* a, const uint8_t* b) {
+  uint8_t t00 = sfpu_boolean_op(mod1, 0, 0), t01 = sfpu_boolean_op(mod1, 0, 1);
+  uint8_t t10 = sfpu_boolean_op(mod1, 1, 0), t11 = sfpu_boolean_op(mod1, 1, 1);
+  uint8_t r[SFPU_LANES]; // dst can be a or b
+  for (unsigned lane = 0; lane < SFPU_LANES; ++lane) {
+    uint8_t x = a[lane], y = b[lane];
+    r[lane] = (x & y & t11) | (x & (y ^ 1) & t10) | ((x ^ 1) & y & t01) | ((x ^ 1) & (y ^ 1) & t00);
+  }
+  memcpy(dst, r, SFPU_LANES);
+}
+
+static void sfpu_exec_pushc(sfpu_state_t* s, unsigned mod1) {
+  if (mod1 == 0 || s->cfg->arch == SFPU_ARCH_WH) { // Plain push
+    if (s->stack_size >= SFPU_FLAG_STACK_DEPTH) return; // Undefined behaviour
+    memcpy(s->stack_flags[s->stack_size], s->flags, SFPU_LANES);
+    memcpy(s->stack_use_flags[s->stack_size], s->use_flags, SFPU_LANES);
+    s->stack_size += 1;
+    return;
+  }
+  if (s->stack_size == 0) return; // Undefined behaviour
+  uint8_t* top_flags = s->stack_flags[s->stack_size - 1];
+  uint8_t* top_use = s->stack_use_flags[s->stack_size - 1];
+  if (mod1 <= 12) {
+    memcpy(top_use, s->use_flags, SFPU_LANES);
+    sfpu_boolean_op_lanes(mod1, top_flags, top_flags, s->flags);
+  } else if (mod1 == 13) {
+    for (unsigned lane = 0; lane < SFPU_LANES; ++lane) s->flags[lane] ^= 1;
+    memcpy(top_use, s->use_flags, SFPU_LANES);
+    memcpy(top_flags, s->flags, SFPU_LANES);
+  } else {
+    memset(top_use, 1, SFPU_LANES);
+    memset(top_flags, mod1 == 14, SFPU_LANES);
+  }
+}
+
+static void sfpu_exec_popc(sfpu_state_t* s, unsigned mod1) {
+  uint8_t top_flags[SFPU_LANES] = {0}, top_use[SFPU_LANES] = {0};
+  if (s->stack_size) {
+    memcpy(top_flags, s->stack_flags[s->stack_size - 1], SFPU_LANES);
+    memcpy(top_use, s->stack_use_flags[s->stack_size - 1], SFPU_LANES);
+  }
+  if (mod1 == 0) {
+    if (s->stack_size) s->stack_size -= 1; // Otherwise undefined behaviour
+  } else if (s->stack_size == SFPU_FLAG_STACK_DEPTH && s->cfg->arch == SFPU_ARCH_WH) {
+    // Hardware bug: the bottom of the stack gets overwritten with the top.
+    memcpy(s->stack_flags[0], top_flags, SFPU_LANES);
+    memcpy(s->stack_use_flags[0], top_use, SFPU_LANES);
+  }
+  if (mod1 == 0) {
+    memcpy(s->use_flags, top_use, SFPU_LANES);
+    memcpy(s->flags, top_flags, SFPU_LANES);
+  } else if (mod1 <= 12) {
+    memcpy(s->use_flags, top_use, SFPU_LANES);
+    sfpu_boolean_op_lanes(mod1, s->flags, s->flags, top_flags);
+  } else if (mod1 == 13) {
+    for (unsigned lane = 0; lane < SFPU_LANES; ++lane) s->flags[lane] ^= 1;
+  } else {
+    memset(s->use_flags, 1, SFPU_LANES);
+    memset(s->flags, mod1 == 14, SFPU_LANES);
+  }
+}
+
+static int sfpu_sign_mag_is_smaller(uint32_t c, uint32_t d) {
+  c ^= (uint32_t)((int32_t)c >> 30) >> 1;
+  d ^= (uint32_t)((int32_t)d >> 30) >> 1;
+  return (int32_t)c < (int32_t)d;
+}
+
+static void sfpu_exec_swap(sfpu_state_t* s, const sfpu_insn_t* in, const uint8_t* en) {
+  static const uint32_t vd_gets_min[9] = {
+    0, 0xffffffffu, 0x0000ffffu, 0x00ff00ffu, 0xff0000ffu, 0x000000ffu, 0x0000ff00u, 0x00ff0000u, 0xff000000u
+  };
+  if (in->vd >= 12) return;
+  uint32_t mask = in->mod < 9 ? vd_gets_min[in->mod] : 0;
+  uint32_t always = in->mod == SFPSWAP_MOD1_SWAP;
+  uint32_t new_vc[SFPU_LANES], new_vd[SFPU_LANES];
+  for (unsigned lane = 0; lane < SFPU_LANES; ++lane) {
+    uint32_t vc = s->lreg[in->vc][lane], vd = s->lreg[in->vd][lane];
+    uint32_t swap = always | ((uint32_t)sfpu_sign_mag_is_smaller(vc, vd) ^ ((mask >> lane) & 1) ^ 1);
+    uint32_t m = -(swap & en[lane]);
+    new_vc[lane] = (vd & m) | (vc & ~m);
+    new_vd[lane] = (vc & m) | (vd & ~m);
+  }
+  if (in->vc < 8) memcpy(s->lreg[in->vc], new_vc, sizeof(new_vc));
+  if (in->vd < 8) memcpy(s->lreg[in->vd], new_vd, sizeof(new_vd));
+}
+
+static void sfpu_exec_transp(sfpu_state_t* s, const uint8_t* en) {
+  for (unsigned base = 0; base < 8; base += 4) {
+    for (unsigned col = 0; col < 8; ++col) {
+      for (unsigned i = 0; i < 4; ++i) {
+        for (unsigned j = 0; j < i; ++j) {
+          uint32_t ij = s->lreg[base + i][j * 8 + col];
+          uint32_t ji = s->lreg[base + j][i * 8 + col];
+          if (en[j * 8 + col]) s->lreg[base + i][j * 8 + col] = ji;
+          if (en[i * 8 + col]) s->lreg[base + j][i * 8 + col] = ij;
+        }
+      }
+    }
+  }
+}
+
+static void sfpu_exec_shft2(sfpu_state_t* s, const sfpu_insn_t* in, const uint8_t* en) {
+  uint32_t v0[SFPU_LANES], vc[SFPU_LANES], r[SFPU_LANES];
+  int wh = s->cfg->arch == SFPU_ARCH_WH;
+  switch (in->mod) {
+  case SFPSHFT2_MOD1_COPY4:
+  case SFPSHFT2_MOD1_SUBVEC_CHAINED_COPY4:
+  case SFPSHFT2_MOD1_SUBVEC_SHFLROR1_AND_COPY4:
+    if (in->vd >= 12) return;
+    memcpy(v0, s->lreg[0], sizeof(v0));
+    memcpy(vc, s->lreg[in->vc], sizeof(vc));
+    if (in->mod == SFPSHFT2_MOD1_SUBVEC_SHFLROR1_AND_COPY4) memcpy(s->shfl_vc0, vc, sizeof(vc));
+    for (unsigned lane = 0; lane < SFPU_LANES; ++lane) {
+      if (!en[lane]) continue;
+      s->lreg[0][lane] = s->lreg[1][lane];
+      s->lreg[1][lane] = s->lreg[2][lane];
+      s->lreg[2][lane] = s->lreg[3][lane];
+      if (in->mod == SFPSHFT2_MOD1_COPY4) {
+        s->lreg[3][lane] = 0;
+      } else if (in->mod == SFPSHFT2_MOD1_SUBVEC_CHAINED_COPY4) {
+        s->lreg[3][lane] = lane < 24 ? v0[lane + 8] : 0;
+      } else {
+        s->lreg[3][lane] = lane & 7 ? vc[lane - 1] : vc[lane + 7];
+      }
+    }
+    break;
+  case SFPSHFT2_MOD1_SUBVEC_SHFLROR1:
+    if (in->vd >= 12) return;
+    memcpy(vc, s->lreg[in->vc], sizeof(vc));
+    memcpy(s->shfl_vc0, vc, sizeof(vc));
+    for (unsigned lane = 0; lane < SFPU_LANES; ++lane) r[lane] = lane & 7 ? vc[lane - 1] : vc[lane + 7];
+    sfpu_write(s, in->vd, r, en);
+    break;
+  case SFPSHFT2_MOD1_SUBVEC_SHFLSHR1:
+    memcpy(vc, s->lreg[in->vc], sizeof(vc));
+    for (unsigned lane = 0; lane < SFPU_LANES; ++lane) {
+      // On Wormhole, the lane which should become zero instead comes from the most recent SFPSHFT2_MOD1_SUBVEC_SHFLROR1(_AND_COPY4).
+      r[lane] = lane & 7 ? vc[lane - 1] : wh ? s->shfl_vc0[lane + 7] : 0;
+    }
+    sfpu_write(s, in->vd, r, en);
+    break;
+  case SFPSHFT2_MOD1_SHFT_LREG:
+  case SFPSHFT2_MOD1_SHFT_IMM: {
+    int32_t imm12 = (int32_t)((uint32_t)in->imm << 20) >> 20;
+    for (unsigned lane = 0; lane < SFPU_LANES; ++lane) {
+      int32_t amount = in->mod == SFPSHFT2_MOD1_SHFT_LREG ? (int32_t)s->lreg[in->vc][lane] : imm12;
+      uint32_t b = s->lreg[in->vb][lane];
+      r[lane] = amount >= 0 ? b << (amount & 31) : b >> ((-amount) & 31);
+    }
+    sfpu_write(s, in->vd, r, en);
+    break; }
+  }
+}
+
+static void sfpu_exec_insn(sfpu_state_t* s, const sfpu_insn_t* in) {
+  uint8_t en[SFPU_LANES];
+  uint32_t r[SFPU_LANES], tmp[SFPU_LANES];
+  int bh = s->cfg->arch == SFPU_ARCH_BH;
+  unsigned vd = in->vd, mod1 = in->mod;
+  const uint32_t* c = s->lreg[in->vc];
+  const uint32_t* b = s->lreg[in->vb];
+  sfpu_lane_enabled(s, en);
+  switch (in->op) {
+  case SFPU_OP_SFPLOAD: sfpu_exec_load(s, in, en); break;
+  case SFPU_OP_SFPSTORE: sfpu_exec_store(s, in, en); break;
+  case SFPU_OP_SFPLOADI: {
+    if (vd >= 8) break;
+    uint32_t imm = in->imm, keep = 0, value; // Each lane gets value | (its old value & keep)
+    switch (in->mod) {
+    case SFPLOADI_MOD0_FLOATB: value = imm << 16; break;
+    case SFPLOADI_MOD0_FLOATA: value = ((imm >> 15) << 31) | ((((imm >> 10) & 0x1f) + 112) << 23) | ((imm & 0x3ff) << 13); break;
+    case SFPLOADI_MOD0_USHORT: value = imm; break;
+    case SFPLOADI_MOD0_SHORT: value = (uint32_t)(int32_t)(int16_t)imm; break;
+    case SFPLOADI_MOD0_UPPER: value = imm << 16, keep = 0x0000ffff; break;
+    default: value = imm, keep = 0xffff0000; break; // SFPLOADI_MOD0_LOWER
+    }
+    for (unsigned lane = 0; lane < SFPU_LANES; ++lane) r[lane] = value | (s->lreg[vd][lane] & keep);
+    sfpu_write(s, vd, r, en);
+    break; }
+  case SFPU_OP_SFPMAD: {
+    if (vd >= 12) break;
+    const uint32_t* a = sfpu_read_maybe_indirect(s, in->va, mod1 & SFPMAD_MOD1_INDIRECT_VA, tmp);
+    if (bh) {
+      sfpmad_model_bh_batch(a, b, c, r, SFPU_LANES, mod1);
+    } else {
+      sfpmad_model_wh_batch(a, b, c, r, SFPU_LANES);
+    }
+    sfpu_write_maybe_indirect(s, vd, mod1 & SFPMAD_MOD1_INDIRECT_VD, r, en);
+    break; }
+  case SFPU_OP_SFPLUT:
+  case SFPU_OP_SFPLUTFP32: {
+    if (vd >= 12) break;
+    const uint32_t* lreg[7];
+    for (unsigned i = 0; i < 7; ++i) lreg[i] = s->lreg[i];
+    if (in->op == SFPU_OP_SFPLUT) {
+      if (bh) sfplut_model_bh_batch(lreg, r, SFPU_LANES, mod1); else sfplut_model_wh_batch(lreg, r, SFPU_LANES, mod1);
+    } else {
+      if (bh) sfplutfp32_model_bh_batch(lreg, r, SFPU_LANES, mod1); else sfplutfp32_model_wh_batch(lreg, r, SFPU_LANES, mod1);
+    }
+    sfpu_write_maybe_indirect(s, vd, mod1 & SFPLUT_MOD0_INDIRECT_VD, r, en);
+    break; }
+  case SFPU_OP_SFPADDI:
+  case SFPU_OP_SFPMULI:
+    if (vd >= 12) break;
+    if (in->op == SFPU_OP_SFPADDI) {
+      if (bh) sfpaddi_model_bh_batch(in->imm, c, r, SFPU_LANES, mod1); else sfpaddi_model_wh_batch(in->imm, c, r, SFPU_LANES);
+    } else {
+      if (bh) sfpmuli_model_bh_batch(in->imm, c, r, SFPU_LANES, mod1); else sfpmuli_model_wh_batch(in->imm, c, r, SFPU_LANES);
+    }
+    sfpu_write_maybe_indirect(s, vd, mod1 & SFPMAD_MOD1_INDIRECT_VD, r, en);
+    break;
+  case SFPU_OP_SFPMUL24: {
+    if (vd >= 12) break;
+    const uint32_t* a = sfpu_read_maybe_indirect(s, in->va, mod1 & SFPMUL24_MOD1_INDIRECT_VA, tmp);
+    sfpmul24_model_bh_batch(a, b, c, r, SFPU_LANES, mod1);
+    sfpu_write_maybe_indirect(s, vd, mod1 & SFPMUL24_MOD1_INDIRECT_VD, r, en);
+    break; }
+  case SFPU_OP_SFPARECIP:
+    sfparecip_model_bh_batch(c, b, r, SFPU_LANES, mod1);
+    sfpu_write(s, vd, r, en);
+    break;
+  case SFPU_OP_SFPDIVP2:
+    sfpdivp2_model_batch(c, r, SFPU_LANES, in->imm, mod1);
+    sfpu_write(s, vd, r, en);
+    break;
+  case SFPU_OP_SFPEXEXP:
+  case SFPU_OP_SFPIADD:
+    if (vd >= 8) break;
+    for (unsigned lane = 0; lane < SFPU_LANES; ++lane) {
+      if (!en[lane]) continue;
+      if (in->op == SFPU_OP_SFPEXEXP) {
+        s->lreg[vd][lane] = sfpexexp_model(c[lane], mod1, &s->flags[lane]);
+      } else {
+        s->lreg[vd][lane] = sfpiadd_model(c[lane], b[lane], in->imm, mod1, &s->flags[lane]);
+      }
+    }
+    break;
+  case SFPU_OP_SFPSETEXP:
+    sfpsetexp_model_batch(c, b, r, SFPU_LANES, in->imm, mod1);
+    sfpu_write(s, vd, r, en);
+    break;
+  case SFPU_OP_SFPSETMAN:
+    sfpsetman_model_batch(c, b, r, SFPU_LANES, in->imm, mod1);
+    sfpu_write(s, vd, r, en);
+    break;
+  case SFPU_OP_SFPSETSGN: {
+    uint32_t sign_imm = mod1 & SFPSETSGN_MOD1_ARG_IMM ? (uint32_t)(in->imm & 1) << 31 : 0;
+    uint32_t sign_vb = mod1 & SFPSETSGN_MOD1_ARG_IMM ? 0 : 0x80000000;
+    for (unsigned lane = 0; lane < SFPU_LANES; ++lane) r[lane] = sign_imm | (b[lane] & sign_vb) | (c[lane] & 0x7fffffff);
+    sfpu_write(s, vd, r, en);
+    break; }
+  case SFPU_OP_SFPCAST: {
+    if (vd >= 12) break;
+    int stochastic = bh ? (mod1 & 3) == SFPCAST_MOD1_SM32_TO_FP32_RNS : (mod1 & 1);
+    for (unsigned lane = 0; lane < SFPU_LANES; ++lane) {
+      uint32_t prng = en[lane] && stochastic ? sfpu_prng_advance(&s->prng[lane]) : 0;
+      r[lane] = bh ? sfpcast_model_bh(c[lane], mod1, prng) : sfpcast_model_wh(c[lane], mod1, prng);
+    }
+    sfpu_write(s, vd, r, en);
+    break; }
+  case SFPU_OP_SFPSTOCHRND:
+    if (vd >= 12) break;
+    for (unsigned lane = 0; lane < SFPU_LANES; ++lane) {
+      uint32_t prng = en[lane] ? sfpu_prng_advance(&s->prng[lane]) : 0;
+      unsigned rounding_mode = in->imm & 3;
+      uint8_t imm5 = (in->imm >> 2) & 31;
+      r[lane] = bh ? sfpstochrnd_model_bh(c[lane], b[lane], rounding_mode, imm5, mod1, prng)
+        : sfpstochrnd_model_wh(c[lane], b[lane], rounding_mode, imm5, mod1, prng);
+    }
+    sfpu_write(s, vd, r, en);
+    break;
+  case SFPU_OP_SFPABS:
+    for (unsigned lane = 0; lane < SFPU_LANES; ++lane) {
+      uint32_t x = c[lane];
+      if (x >= 0x80000000u) {
+        if (!(mod1 & SFPABS_MOD1_FLOAT)) x = -x;
+        else if (x <= 0xff800000u) x &= 0x7fffffffu; // -NaN is left as-is
+      }
+      r[lane] = x;
+    }
+    sfpu_write(s, vd, r, en);
+    break;
+  case SFPU_OP_SFPAND:
+  case SFPU_OP_SFPOR: {
+    const uint32_t* vb = s->lreg[bh && (mod1 & SFPAND_MOD1_USE_VB) ? in->vb : vd];
+    uint32_t or_mask = in->op == SFPU_OP_SFPOR ? 0xffffffff : 0; // a | b == (a & b) | (a ^ b)
+    for (unsigned lane = 0; lane < SFPU_LANES; ++lane) r[lane] = (vb[lane] & c[lane]) | ((vb[lane] ^ c[lane]) & or_mask);
+    sfpu_write(s, vd, r, en);
+    break; }
+  case SFPU_OP_SFPXOR:
+    for (unsigned lane = 0; lane < SFPU_LANES; ++lane) r[lane] = b[lane] ^ c[lane];
+    sfpu_write(s, vd, r, en);
+    break;
+  case SFPU_OP_SFPNOT:
+    for (unsigned lane = 0; lane < SFPU_LANES; ++lane) r[lane] = ~c[lane];
+    sfpu_write(s, vd, r, en);
+    break;
+  case SFPU_OP_SFPMOV:
+    if (vd >= 12) break;
+    if (mod1 == SFPMOV_MOD1_ALL_LANES_ENABLED) memset(en, 1, sizeof(en));
+    if (mod1 & SFPMOV_MOD1_FROM_SPECIAL) {
+      // LoadMacroConfig and LaneConfig are not modelled, and read as zero.
+      for (unsigned lane = 0; lane < SFPU_LANES; ++lane) r[lane] = in->vc == 9 && en[lane] ? sfpu_prng_advance(&s->prng[lane]) : 0;
+    } else {
+      uint32_t negate = mod1 & SFPMOV_MOD1_NEGATE ? 0x80000000 : 0;
+      for (unsigned lane = 0; lane < SFPU_LANES; ++lane) r[lane] = c[lane] ^ negate;
+    }
+    sfpu_write(s, vd, r, en);
+    break;
+  case SFPU_OP_SFPSETCC: {
+    if (vd >= 12) break;
+    // Every Mod1 is either CLEAR, IMM_BIT0, or one of the four comparisons against zero.
+    uint8_t cond[SFPU_LANES];
+    if (mod1 & SFPSETCC_MOD1_CLEAR) {
+      memset(cond, 0, sizeof(cond));
+    } else if (mod1 & SFPSETCC_MOD1_IMM_BIT0) {
+      memset(cond, in->imm & 1, sizeof(cond));
+    } else {
+      uint8_t invert = mod1 == SFPSETCC_MOD1_LREG_GTE0 || mod1 == SFPSETCC_MOD1_LREG_EQ0;
+      if (mod1 == SFPSETCC_MOD1_LREG_NE0 || mod1 == SFPSETCC_MOD1_LREG_EQ0) {
+        for (unsigned lane = 0; lane < SFPU_LANES; ++lane) cond[lane] = (c[lane] != 0) ^ invert;
+      } else {
+        for (unsigned lane = 0; lane < SFPU_LANES; ++lane) cond[lane] = (c[lane] >> 31) ^ invert;
+      }
+    }
+    for (unsigned lane = 0; lane < SFPU_LANES; ++lane) {
+      s->flags[lane] = (en[lane] & s->use_flags[lane] & cond[lane]) | ((en[lane] ^ 1) & s->flags[lane]);
+    }
+    break; }
+  case SFPU_OP_SFPENCC:
+    if (vd >= 12) break;
+    if (mod1 & SFPENCC_MOD1_EI) {
+      memset(s->use_flags, (in->imm & SFPENCC_IMM2_E) != 0, SFPU_LANES);
+    } else if (mod1 & SFPENCC_MOD1_EC) {
+      for (unsigned lane = 0; lane < SFPU_LANES; ++lane) s->use_flags[lane] ^= 1;
+    }
+    memset(s->flags, mod1 & SFPENCC_MOD1_RI ? (in->imm & SFPENCC_IMM2_R) != 0 : 1, SFPU_LANES);
+    break;
+  case SFPU_OP_SFPPUSHC: if (vd < 12) sfpu_exec_pushc(s, mod1); break;
+  case SFPU_OP_SFPPOPC: if (vd < 12) sfpu_exec_popc(s, mod1); break;
+  case SFPU_OP_SFPCOMPC:
+    if (vd >= 12) break;
+    if (s->stack_size) {
+      uint8_t top[SFPU_LANES];
+      for (unsigned lane = 0; lane < SFPU_LANES; ++lane) top[lane] = s->stack_use_flags[s->stack_size - 1][lane] & s->stack_flags[s->stack_size - 1][lane];
+      for (unsigned lane = 0; lane < SFPU_LANES; ++lane) s->flags[lane] = top[lane] & s->use_flags[lane] & (s->flags[lane] ^ 1);
+    } else {
+      for (unsigned lane = 0; lane < SFPU_LANES; ++lane) s->flags[lane] = s->use_flags[lane] & (s->flags[lane] ^ 1);
+    }
+    break;
+  case SFPU_OP_SFPSWAP: sfpu_exec_swap(s, in, en); break;
+  case SFPU_OP_SFPTRANSP: if (vd < 12) sfpu_exec_transp(s, en); break;
+  case SFPU_OP_SFPSHFT2: sfpu_exec_shft2(s, in, en); break;
+  case SFPU_OP_DST_RWC_SET: s->dst_rwc = in->imm & 0x3ff; break;
+  case SFPU_OP_DST_RWC_INC: s->dst_rwc = (s->dst_rwc + in->imm) & 0x3ff; break;
+  default: break; // SFPU_OP_SFPNOP
+  }
+}
+
+void sfpu_engine_exec(sfpu_state_t* s, const sfpu_insn_t* prog, size_t n) {
+  for (size_t i = 0; i < n; ++i) sfpu_exec_insn(s, prog + i);
+}
+
+// Section: Running over many tiles
+
+// Returns NULL if the configuration and program are valid, otherwise a description of the problem.
+const char* sfpu_engine_check(const sfpu_config_t* cfg, const sfpu_insn_t* prog, size_t n) {
+  static _Thread_local char msg[128];
+  if (cfg->arch != SFPU_ARCH_WH && cfg->arch != SFPU_ARCH_BH) return "Unknown arch";
+  if (cfg->tile_rows == 0 || cfg->tile_rows % 16 || cfg->tile_rows > 1024) return "tile_rows must be a multiple of 16 between 16 and 1024";
+  if (cfg->srcb_mod0 != MOD0_FMT_FP32 && cfg->srcb_mod0 != MOD0_FMT_BF16 && cfg->srcb_mod0 != MOD0_FMT_FP16) {
+    return "srcb_mod0 must be MOD0_FMT_FP32, MOD0_FMT_BF16, or MOD0_FMT_FP16";
+  }
+  unsigned stack_size = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const sfpu_insn_t* in = prog + i;
+    const char* problem = NULL;
+    if (in->op >= SFPU_NUM_OPS) {
+      problem = "unknown op";
+    } else if ((in->va | in->vb | in->vc | in->vd | in->mod) > 15 || in->addr_mod > 7) {
+      problem = "field out of range";
+    } else if (cfg->arch == SFPU_ARCH_WH && (in->op == SFPU_OP_SFPMUL24 || in->op == SFPU_OP_SFPARECIP)) {
+      problem = "instruction does not exist on Wormhole";
+    } else if (in->op == SFPU_OP_SFPSTOCHRND && (in->imm & 3) > (cfg->arch == SFPU_ARCH_WH ? SFPSTOCHRND_RND_STOCH : SFPSTOCHRND_RND_ZERO)) {
+      problem = "undefined SFPSTOCHRND RoundingMode";
+    } else if (in->op == SFPU_OP_SFPLOADI && in->mod != SFPLOADI_MOD0_FLOATB && in->mod != SFPLOADI_MOD0_FLOATA
+      && in->mod != SFPLOADI_MOD0_USHORT && in->mod != SFPLOADI_MOD0_SHORT && in->mod != SFPLOADI_MOD0_UPPER && in->mod != SFPLOADI_MOD0_LOWER) {
+      problem = "undefined SFPLOADI Mod0";
+    } else if (in->op == SFPU_OP_SFPPUSHC && in->vd < 12) {
+      if (in->mod == 0 || cfg->arch == SFPU_ARCH_WH) {
+        if (stack_size >= SFPU_FLAG_STACK_DEPTH) problem = "SFPPUSHC with full FlagStack";
+        else stack_size += 1;
+      } else if (stack_size == 0) {
+        problem = "SFPPUSHC with Mod1 != 0 and empty FlagStack";
+      }
+    } else if (in->op == SFPU_OP_SFPPOPC && in->vd < 12 && in->mod == 0) {
+      if (stack_size == 0) problem = "SFPPOPC with empty FlagStack";
+      else stack_size -= 1;
+    }
+    if (problem) {
+      snprintf(msg, sizeof(msg), "Instruction %zu: %s", i, problem);
+      return msg;
+    }
+  }
+  return NULL;
+}
+
+typedef struct sfpu_run_t {
+  const sfpu_config_t* cfg;
+  const sfpu_insn_t* prog;
+  size_t n;
+  uint16_t* tiles;
+  size_t n_tiles;
+  _Atomic size_t next_tile;
+} sfpu_run_t;
+
+static void* sfpu_run_thread(void* arg) {
+  sfpu_run_t* run = (sfpu_run_t*)arg;
+  sfpu_state_t s;
+  size_t t;
+  while ((t = atomic_fetch_add_explicit(&run->next_tile, 1, memory_order_relaxed)) < run->n_tiles) {
+    sfpu_state_init(&s, run->cfg, run->tiles + t * run->cfg->tile_rows * 16, t);
+    sfpu_engine_exec(&s, run->prog, run->n);
+  }
+  return NULL;
+}
+
+// Runs `prog` over each of `n_tiles` tiles, where tile i is DstBits[cfg->tile_rows][16] starting
+// at tiles + i * cfg->tile_rows * 16, using up to `threads` threads (0 meaning one per core).
+// Every tile starts from fresh Vector Unit state, so results do not depend on the thread count.
+// Returns 0 on success, or -1 (with nothing run) if sfpu_engine_check finds a problem.
+int sfpu_engine_run(const sfpu_config_t* cfg, const sfpu_insn_t* prog, size_t n, uint16_t* tiles, size_t n_tiles, unsigned threads) {
+  if (sfpu_engine_check(cfg, prog, n)) return -1;
+  if (threads == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cores > 0 ? (unsigned)cores : 1;
+  }
+  if (threads > n_tiles) threads = n_tiles ? (unsigned)n_tiles : 1;
+  sfpu_run_t run = {cfg, prog, n, tiles, n_tiles, 0};
+  pthread_t* workers = threads > 1 ? calloc(threads - 1, sizeof(*workers)) : NULL;
+  unsigned started = 0;
+  if (workers) {
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, sfpu_run_thread, &run) == 0) ++started;
+  }
+  sfpu_run_thread(&run);
+  for (unsigned i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+  free(workers);
+  return 0;
+}
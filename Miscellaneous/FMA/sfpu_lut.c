@@ -0,0 +1,254 @@
+/*
+ * SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Evaluation of SFPLUT / SFPLUTFP32 approximations over arrays, and exhaustive sweeps comparing
+ * them against a reference function. An sfpu_lut_t describes one LUT instruction along with the
+ * contents of LReg[0] through LReg[6] (other than LReg[3], which is the input) in every lane.
+ * Results are bit-identical to sfplut_model_* / sfplutfp32_model_*, but as the table is the same
+ * in every lane, the up to six (a, c) coefficient pairs are decoded once, and then the a * b + c
+ * for all inputs goes through the vectorised fma_model_*_batch.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "sfpu_arith.c"
+
+typedef struct sfpu_lut_t {
+  int blackhole;     // Otherwise Wormhole
+  int fp32;          // SFPLUTFP32, otherwise SFPLUT
+  unsigned mod;      // Mod1 of SFPLUTFP32 or Mod0 of SFPLUT (INDIRECT_VD is ignored)
+  uint32_t lreg[7];  // LReg[0] through LReg[6]; lreg[3] is ignored
+} sfpu_lut_t;
+
+// Section: Evaluation
+
+// Abs(LReg[3]) is in segment k when it is >= the first k of these bounds; this covers every
+// split made by either instruction. The last bound is 3.0 or 4.0, depending on Mod1.
+#define SFPU_LUT_SEGMENTS 6
+
+typedef struct sfpu_lut_decoded_t {
+  uint32_t bound[SFPU_LUT_SEGMENTS - 1];
+  uint32_t a[SFPU_LUT_SEGMENTS], c[SFPU_LUT_SEGMENTS];
+  int sgn_retain;
+  fma_batch_fn batch;
+} sfpu_lut_decoded_t;
+
+static void sfpu_lut_decode(const sfpu_lut_t* lut, sfpu_lut_decoded_t* dec) {
+  int table2 = lut->fp32 && (lut->mod & SFPLUTFP32_MOD1_FP16_6ENTRY_TABLE2) == SFPLUTFP32_MOD1_FP16_6ENTRY_TABLE2;
+  const uint32_t bound[SFPU_LUT_SEGMENTS - 1] = {0x3f000000, 0x3f800000, 0x3fc00000, 0x40000000, table2 ? 0x40800000 : 0x40400000};
+  uint32_t lreg[7];
+  memcpy(lreg, lut->lreg, sizeof(lreg));
+  for (unsigned k = 0; k < SFPU_LUT_SEGMENTS; ++k) {
+    lreg[3] = k ? bound[k - 1] : 0; // Any value in the segment selects the same coefficients
+    if (k) dec->bound[k - 1] = bound[k - 1];
+    if (lut->fp32) sfplutfp32_operands(lreg, lut->mod, &dec->a[k], &dec->c[k]); else sfplut_operands(lreg, &dec->a[k], &dec->c[k]);
+  }
+  dec->sgn_retain = lut->mod & (lut->fp32 ? SFPLUTFP32_MOD1_SGN_RETAIN : SFPLUT_MOD0_SGN_RETAIN);
+  dec->batch = lut->blackhole ? fma_model_bh_batch : fma_model_wh_batch;
+}
+
+static void sfpu_lut_eval_decoded(const sfpu_lut_decoded_t* dec, const uint32_t* x, uint32_t* out, size_t n) {
+  enum { CHUNK = 1024 };
+  uint32_t ta[CHUNK], tb[CHUNK], tc[CHUNK];
+  for (size_t i = 0; i < n; i += CHUNK) {
+    size_t m = n - i < CHUNK ? n - i : CHUNK;
+    for (size_t j = 0; j < m; ++j) {
+      uint32_t b = x[i + j] & 0x7fffffff;
+      unsigned k = 0;
+      for (unsigned s = 0; s < SFPU_LUT_SEGMENTS - 1; ++s) k += b >= dec->bound[s];
+      ta[j] = dec->a[k];
+      tb[j] = b;
+      tc[j] = dec->c[k];
+    }
+    dec->batch(ta, tb, tc, out + i, m);
+    if (dec->sgn_retain) {
+      for (size_t j = 0; j < m; ++j) out[i + j] = sfplut_sign(out[i + j], x[i + j], 1);
+    }
+  }
+}
+
+// Sets out[i] to the result of the LUT instruction with x[i] in LReg[3].
+void sfpu_lut_eval(const sfpu_lut_t* lut, const uint32_t* x, uint32_t* out, size_t n) {
+  sfpu_lut_decoded_t dec;
+  sfpu_lut_decode(lut, &dec);
+  sfpu_lut_eval_decoded(&dec, x, out, n);
+}
+
+// Section: Reference functions
+
+// A reference function sets y[i] to the exact value being approximated at x[i].
+typedef void (*sfpu_lut_ref_fn)(const float* x, double* y, size_t n, void* ctx);
+
+void sfpu_lut_ref_exp(const float* x, double* y, size_t n, void* ctx) {
+  (void)ctx;
+  for (size_t i = 0; i < n; ++i) y[i] = exp(x[i]);
+}
+
+void sfpu_lut_ref_sigmoid(const float* x, double* y, size_t n, void* ctx) {
+  (void)ctx;
+  for (size_t i = 0; i < n; ++i) y[i] = 1 / (1 + exp(-(double)x[i]));
+}
+
+void sfpu_lut_ref_gelu(const float* x, double* y, size_t n, void* ctx) {
+  (void)ctx;
+  for (size_t i = 0; i < n; ++i) y[i] = 0.5 * x[i] * (1 + erf(x[i] * 0.70710678118654752440));
+}
+
+void sfpu_lut_ref_recip(const float* x, double* y, size_t n, void* ctx) {
+  (void)ctx;
+  for (size_t i = 0; i < n; ++i) y[i] = 1 / (double)x[i];
+}
+
+// Section: Sweeps
+
+typedef struct sfpu_lut_report_t {
+  uint64_t compared;       // Inputs where the reference is finite
+  uint64_t skipped;        // Inputs where the reference is NaN or infinite
+  uint64_t nonfinite;      // Compared inputs where the LUT result is NaN or infinite
+  uint64_t exact;          // Compared inputs where the LUT result is the reference rounded to FP32
+  double max_ulp;          // Largest error, over compared inputs with a finite LUT result
+  uint32_t max_ulp_input;  // The first input with that error
+  uint32_t max_ulp_output;
+  double max_ulp_reference;
+  double mean_ulp;         // Over compared inputs with a finite LUT result
+} sfpu_lut_report_t;
+
+// Error of the FP32 bit pattern d against r, in units of the FP32 ULP at r (where that ULP is
+// at least 2^-149, so that values flushed to zero are measured in units of FP32 denormals).
+static double sfpu_lut_ulp_error(uint32_t d, double r) {
+  float f;
+  memcpy(&f, &d, sizeof(f));
+  uint64_t bits;
+  memcpy(&bits, &r, sizeof(bits));
+  int64_t e = (int64_t)((bits >> 52) & 0x7ff) - 1023; // Exponent of r, or -1023 for zero / denormal
+  if (e < -126) e = -126;
+  uint64_t inv_ulp_bits = (uint64_t)(1023 + 23 - e) << 52; // 2^(23 - e), i.e. 1 / ULP
+  double inv_ulp;
+  memcpy(&inv_ulp, &inv_ulp_bits, sizeof(inv_ulp));
+  return fabs((double)f - r) * inv_ulp;
+}
+
+typedef struct sfpu_lut_sweep_t {
+  sfpu_lut_decoded_t dec;
+  sfpu_lut_ref_fn ref;
+  void* ctx;
+  uint64_t first, count;
+  size_t n_units;
+  _Atomic size_t next_unit;
+  sfpu_lut_report_t* unit_reports; // One per unit, combined in order at the end
+  double* unit_sums;
+} sfpu_lut_sweep_t;
+
+enum { SFPU_LUT_UNIT = 1 << 16, SFPU_LUT_CHUNK = 1024 };
+
+static void sfpu_lut_sweep_unit(const sfpu_lut_sweep_t* sw, size_t unit, sfpu_lut_report_t* rep, double* sum) {
+  uint32_t x[SFPU_LUT_CHUNK], d[SFPU_LUT_CHUNK];
+  float xf[SFPU_LUT_CHUNK];
+  double y[SFPU_LUT_CHUNK];
+  uint64_t start = unit * (uint64_t)SFPU_LUT_UNIT;
+  uint64_t end = start + SFPU_LUT_UNIT < sw->count ? start + SFPU_LUT_UNIT : sw->count;
+  memset(rep, 0, sizeof(*rep));
+  *sum = 0;
+  int have_max = 0;
+  for (uint64_t i = start; i < end; i += SFPU_LUT_CHUNK) {
+    size_t m = end - i < SFPU_LUT_CHUNK ? end - i : SFPU_LUT_CHUNK;
+    for (size_t j = 0; j < m; ++j) x[j] = (uint32_t)(sw->first + i + j);
+    memcpy(xf, x, m * sizeof(*x));
+    sfpu_lut_eval_decoded(&sw->dec, x, d, m);
+    sw->ref(xf, y, m, sw->ctx);
+    for (size_t j = 0; j < m; ++j) {
+      if (!isfinite(y[j])) {
+        ++rep->skipped;
+        continue;
+      }
+      ++rep->compared;
+      if (((d[j] >> 23) & 0xff) == 0xff) {
+        ++rep->nonfinite;
+        continue;
+      }
+      float rf = (float)y[j];
+      uint32_t r32;
+      memcpy(&r32, &rf, sizeof(r32));
+      rep->exact += d[j] == r32;
+      double err = sfpu_lut_ulp_error(d[j], y[j]);
+      *sum += err;
+      if (!have_max || err > rep->max_ulp) {
+        have_max = 1;
+        rep->max_ulp = err;
+        rep->max_ulp_input = x[j];
+        rep->max_ulp_output = d[j];
+        rep->max_ulp_reference = y[j];
+      }
+    }
+  }
+}
+
+static void* sfpu_lut_sweep_thread(void* arg) {
+  sfpu_lut_sweep_t* sw = (sfpu_lut_sweep_t*)arg;
+  size_t u;
+  while ((u = atomic_fetch_add_explicit(&sw->next_unit, 1, memory_order_relaxed)) < sw->n_units) {
+    sfpu_lut_sweep_unit(sw, u, &sw->unit_reports[u], &sw->unit_sums[u]);
+  }
+  return NULL;
+}
+
+// Evaluates the LUT instruction for every FP32 bit pattern from `first` to `last` inclusive (so
+// 0 and 0xffffffff for all 2^32 of them) and compares each result against `ref`, which is called
+// with `ctx` and batches of inputs. Uses up to `threads` threads (0 meaning one per core); the
+// report does not depend on the thread count. Returns 0 on success, or -1 if out of memory.
+// Each input costs roughly 20 to 50 ns of CPU time, so all 2^32 of them take a few core-minutes.
+int sfpu_lut_sweep(const sfpu_lut_t* lut, sfpu_lut_ref_fn ref, void* ctx, uint32_t first, uint32_t last, unsigned threads, sfpu_lut_report_t* report) {
+  sfpu_lut_sweep_t sw = {.ref = ref, .ctx = ctx, .first = first, .count = (uint64_t)last - first + 1};
+  if (last < first) sw.count = 0;
+  sfpu_lut_decode(lut, &sw.dec);
+  sw.n_units = (sw.count + SFPU_LUT_UNIT - 1) / SFPU_LUT_UNIT;
+  sw.unit_reports = calloc(sw.n_units + 1, sizeof(*sw.unit_reports));
+  sw.unit_sums = calloc(sw.n_units + 1, sizeof(*sw.unit_sums));
+  if (!sw.unit_reports || !sw.unit_sums) {
+    free(sw.unit_reports);
+    free(sw.unit_sums);
+    return -1;
+  }
+  if (threads == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cores > 0 ? (unsigned)cores : 1;
+  }
+  if (threads > sw.n_units) threads = sw.n_units ? (unsigned)sw.n_units : 1;
+  pthread_t* workers = threads > 1 ? calloc(threads - 1, sizeof(*workers)) : NULL;
+  unsigned started = 0;
+  if (workers) {
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, sfpu_lut_sweep_thread, &sw) == 0) ++started;
+  }
+  sfpu_lut_sweep_thread(&sw);
+  for (unsigned i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+  free(workers);
+
+  sfpu_lut_report_t r = {0};
+  double sum = 0;
+  int have_max = 0;
+  for (size_t u = 0; u < sw.n_units; ++u) {
+    const sfpu_lut_report_t* ur = &sw.unit_reports[u];
+    if (ur->compared > ur->nonfinite && (!have_max || ur->max_ulp > r.max_ulp)) {
+      have_max = 1;
+      r.max_ulp = ur->max_ulp;
+      r.max_ulp_input = ur->max_ulp_input;
+      r.max_ulp_output = ur->max_ulp_output;
+      r.max_ulp_reference = ur->max_ulp_reference;
+    }
+    r.compared += ur->compared;
+    r.skipped += ur->skipped;
+    r.nonfinite += ur->nonfinite;
+    r.exact += ur->exact;
+    sum += sw.unit_sums[u];
+  }
+  if (r.compared > r.nonfinite) r.mean_ulp = sum / (double)(r.compared - r.nonfinite);
+  *report = r;
+  free(sw.unit_reports);
+  free(sw.unit_sums);
+  return 0;
+}
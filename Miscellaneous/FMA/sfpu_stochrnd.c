@@ -0,0 +1,402 @@
+/*
+ * SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Array conversions from FP32 to BF16, FP16, and (unsigned) 8-bit / 16-bit integers, with results
+ * bit-identical to SFPSTOCHRND (as modelled by sfpstochrnd_model_bh in sfpu_arith.c) followed by
+ * the appropriate conversion to the narrower type.
+ *
+ * The random bits come from a sfpu_stochrnd_rng_t, which is either:
+ * - SFPU_STOCHRND_RNG_HARDWARE: the 32 lanes of the Vector Unit PRNG, with element p of the
+ *   overall stream handled by lane p % 32, as though each group of 32 elements were one
+ *   SFPSTOCHRND instruction with all lanes enabled. This reproduces the hardware's random bits
+ *   exactly, but (like the hardware) the statistical properties are poor.
+ * - SFPU_STOCHRND_RNG_COUNTER: a keyed hash of the seed and the element's position in the stream.
+ *   This is not what the hardware does, but has much better statistical properties.
+ * Either way, the random bits depend only on the position in the stream, so the work can be split
+ * across threads (or calls) in any manner without changing the results.
+ *
+ * The conversions are written once using GCC vector extensions, with 32 lanes to match the
+ * Vector Unit, and this file includes itself to compile them for AVX-512, AVX2, and baseline x86.
+ */
+
+#ifndef SFPU_STOCHRND_SUFFIX
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "sfpu_arith.c"
+
+// Values for sfpu_stochrnd_rng_t::kind:
+#define SFPU_STOCHRND_RNG_HARDWARE 0
+#define SFPU_STOCHRND_RNG_COUNTER  1
+
+typedef struct sfpu_stochrnd_rng_t {
+  int kind;
+  uint32_t lane_state[32]; // SFPU_STOCHRND_RNG_HARDWARE: state of each lane's AdvancePRNG
+  uint32_t seed;           // SFPU_STOCHRND_RNG_COUNTER
+  uint64_t position;       // Number of elements consumed so far
+} sfpu_stochrnd_rng_t;
+
+// Values for the `to` argument of sfpu_stochrnd_convert, with the type of the output array:
+#define SFPU_STOCHRND_TO_BF16   0 // uint16_t; SFPSTOCHRND_MOD1_FP32_TO_FP16B then the high 16 bits
+#define SFPU_STOCHRND_TO_FP16   1 // uint16_t; SFPSTOCHRND_MOD1_FP32_TO_FP16A then SFPSTORE MOD0_FMT_FP16
+#define SFPU_STOCHRND_TO_INT8   2 // int8_t; SFPSTOCHRND_MOD1_FP32_TO_INT8 then sign-magnitude to two's complement
+#define SFPU_STOCHRND_TO_UINT8  3 // uint8_t; SFPSTOCHRND_MOD1_FP32_TO_UINT8
+#define SFPU_STOCHRND_TO_INT16  4 // int16_t; SFPSTOCHRND_MOD1_FP32_TO_INT16 then sign-magnitude to two's complement
+#define SFPU_STOCHRND_TO_UINT16 5 // uint16_t; SFPSTOCHRND_MOD1_FP32_TO_UINT16
+#define SFPU_STOCHRND_NUM_TO    6
+
+static const uint8_t sfpu_stochrnd_mod1[SFPU_STOCHRND_NUM_TO] = {
+  SFPSTOCHRND_MOD1_FP32_TO_FP16B, SFPSTOCHRND_MOD1_FP32_TO_FP16A, SFPSTOCHRND_MOD1_FP32_TO_INT8,
+  SFPSTOCHRND_MOD1_FP32_TO_UINT8, SFPSTOCHRND_MOD1_FP32_TO_INT16, SFPSTOCHRND_MOD1_FP32_TO_UINT16,
+};
+static const uint8_t sfpu_stochrnd_out_size[SFPU_STOCHRND_NUM_TO] = {2, 2, 1, 1, 2, 2};
+
+// Section: Random bits
+
+// Jumping the hardware PRNG ahead: each step is x -> L(x) ^ 0x80000000 for a linear map L over
+// GF(2), so any number of steps is another such affine map, and can be found by repeated squaring.
+typedef struct sfpu_prng_affine_t {
+  uint32_t col[32]; // L(1 << j)
+  uint32_t k;
+} sfpu_prng_affine_t;
+
+static uint32_t sfpu_prng_affine_linear(const sfpu_prng_affine_t* f, uint32_t x) {
+  uint32_t r = 0;
+  for (; x; x &= x - 1) r ^= f->col[__builtin_ctz(x)];
+  return r;
+}
+
+static void sfpu_prng_affine_compose(sfpu_prng_affine_t* out, const sfpu_prng_affine_t* f, const sfpu_prng_affine_t* g) { // out = f after g
+  sfpu_prng_affine_t r;
+  for (unsigned j = 0; j < 32; ++j) r.col[j] = sfpu_prng_affine_linear(f, g->col[j]);
+  r.k = sfpu_prng_affine_linear(f, g->k) ^ f->k;
+  *out = r;
+}
+
+// Equivalent to calling sfpu_prng_advance `steps` times.
+void sfpu_prng_jump(uint32_t* state, uint64_t steps) {
+  sfpu_prng_affine_t step, acc;
+  for (unsigned j = 0; j < 32; ++j) {
+    uint32_t x = 1u << j;
+    step.col[j] = ((uint32_t)__builtin_parity(x & 0x80200003) << 31) | (x >> 1);
+    acc.col[j] = x;
+  }
+  step.k = 0x80000000u;
+  acc.k = 0;
+  for (; steps; steps >>= 1) {
+    if (steps & 1) sfpu_prng_affine_compose(&acc, &step, &acc);
+    sfpu_prng_affine_compose(&step, &step, &step);
+  }
+  *state = sfpu_prng_affine_linear(&acc, *state) ^ acc.k;
+}
+
+static uint32_t sfpu_stochrnd_mix(uint32_t x) { // A bijection with good avalanche behaviour
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+// The two keys used for positions `hi << 32` through `(hi << 32) + 0xffffffff`.
+static void sfpu_stochrnd_keys(uint32_t seed, uint32_t hi, uint32_t* k0, uint32_t* k1) {
+  *k0 = sfpu_stochrnd_mix(seed ^ sfpu_stochrnd_mix(hi + 0x9e3779b9u));
+  *k1 = sfpu_stochrnd_mix(*k0 + 0x6a09e667u);
+}
+
+static uint32_t sfpu_stochrnd_counter_value(uint32_t seed, uint64_t position) {
+  uint32_t k0, k1;
+  sfpu_stochrnd_keys(seed, (uint32_t)(position >> 32), &k0, &k1);
+  return sfpu_stochrnd_mix(sfpu_stochrnd_mix((uint32_t)position ^ k0) ^ k1);
+}
+
+// Advances the stream by n elements without converting anything.
+void sfpu_stochrnd_rng_skip(sfpu_stochrnd_rng_t* rng, uint64_t n) {
+  if (rng->kind == SFPU_STOCHRND_RNG_HARDWARE) {
+    for (unsigned i = 0; i < 32; ++i) {
+      unsigned lane = (rng->position + i) % 32;
+      sfpu_prng_jump(&rng->lane_state[lane], n / 32 + (i < n % 32));
+    }
+  }
+  rng->position += n;
+}
+
+// The random value for the next element, advancing the stream by one.
+static uint32_t sfpu_stochrnd_next(sfpu_stochrnd_rng_t* rng) {
+  uint64_t p = rng->position++;
+  if (rng->kind == SFPU_STOCHRND_RNG_HARDWARE) return sfpu_prng_advance(&rng->lane_state[p % 32]);
+  return sfpu_stochrnd_counter_value(rng->seed, p);
+}
+
+// Section: Conversions
+
+static uint16_t sfpu_stochrnd_fp16_bits(uint32_t x) { // As per SFPSTORE MOD0_FMT_FP16, before shuffling
+  uint32_t sign = x >> 31;
+  int32_t exp = (int32_t)((x >> 23) & 0xff) - 112;
+  uint32_t man = (x >> 13) & 0x3ff;
+  if (exp <= 0) exp = 0, man = 0;
+  else if (exp > 31) exp = 31, man = 0x3ff;
+  return (sign << 15) | ((uint32_t)exp << 10) | man;
+}
+
+static void sfpu_stochrnd_store_one(int to, void* out, size_t i, uint32_t r) {
+  switch (to) {
+  case SFPU_STOCHRND_TO_BF16: ((uint16_t*)out)[i] = r >> 16; break;
+  case SFPU_STOCHRND_TO_FP16: ((uint16_t*)out)[i] = sfpu_stochrnd_fp16_bits(r); break;
+  case SFPU_STOCHRND_TO_INT8: ((int8_t*)out)[i] = (int8_t)(r >> 31 ? -(int32_t)(r & 0x7fffffff) : (int32_t)r); break;
+  case SFPU_STOCHRND_TO_UINT8: ((uint8_t*)out)[i] = (uint8_t)r; break;
+  case SFPU_STOCHRND_TO_INT16: ((int16_t*)out)[i] = (int16_t)(r >> 31 ? -(int32_t)(r & 0x7fffffff) : (int32_t)r); break;
+  default: ((uint16_t*)out)[i] = (uint16_t)r; break; // SFPU_STOCHRND_TO_UINT16
+  }
+}
+
+static void sfpu_stochrnd_scalar(int to, const uint32_t* in, void* out, size_t n, unsigned rounding_mode, sfpu_stochrnd_rng_t* rng) {
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t prng = sfpu_stochrnd_next(rng);
+    sfpu_stochrnd_store_one(to, out, i, sfpstochrnd_model_bh(in[i], 0, rounding_mode, 0, sfpu_stochrnd_mod1[to], prng));
+  }
+}
+
+// Each block function converts 32 * num_blocks elements, starting at a position which is a
+// multiple of 32, and advances rng accordingly.
+typedef void (*sfpu_stochrnd_blocks_fn)(int to, const uint32_t* in, void* out, size_t num_blocks, unsigned rounding_mode, sfpu_stochrnd_rng_t* rng);
+
+#if FMA_BATCH_X86
+#define SFPU_STOCHRND_SUFFIX avx512
+#define SFPU_STOCHRND_LANES 16
+#define SFPU_STOCHRND_ATTR __attribute__((target("avx512f")))
+#include __FILE__
+#undef SFPU_STOCHRND_ATTR
+#undef SFPU_STOCHRND_LANES
+#undef SFPU_STOCHRND_SUFFIX
+
+#define SFPU_STOCHRND_SUFFIX avx2
+#define SFPU_STOCHRND_LANES 8
+#define SFPU_STOCHRND_ATTR __attribute__((target("avx2")))
+#include __FILE__
+#undef SFPU_STOCHRND_ATTR
+#undef SFPU_STOCHRND_LANES
+#undef SFPU_STOCHRND_SUFFIX
+#endif
+
+#define SFPU_STOCHRND_SUFFIX generic
+#define SFPU_STOCHRND_LANES 4
+#define SFPU_STOCHRND_ATTR
+#include __FILE__
+#undef SFPU_STOCHRND_ATTR
+#undef SFPU_STOCHRND_LANES
+#undef SFPU_STOCHRND_SUFFIX
+
+sfpu_stochrnd_blocks_fn sfpu_stochrnd_blocks_variant(int isa) {
+#if FMA_BATCH_X86
+  return isa == FMA_ISA_AVX512 ? sfpu_stochrnd_blocks_avx512 : isa == FMA_ISA_AVX2 ? sfpu_stochrnd_blocks_avx2 : sfpu_stochrnd_blocks_generic;
+#else
+  (void)isa;
+  return sfpu_stochrnd_blocks_generic;
+#endif
+}
+
+// Converts n elements, handling a misaligned start or end one element at a time.
+static void sfpu_stochrnd_range(sfpu_stochrnd_blocks_fn blocks, int to, const uint32_t* in, void* out, size_t n, unsigned rounding_mode, sfpu_stochrnd_rng_t* rng) {
+  size_t head = (32 - rng->position % 32) % 32;
+  if (head > n) head = n;
+  sfpu_stochrnd_scalar(to, in, out, head, rounding_mode, rng);
+  size_t size = sfpu_stochrnd_out_size[to];
+  size_t num_blocks = (n - head) / 32;
+  blocks(to, in + head, (char*)out + head * size, num_blocks, rounding_mode, rng);
+  size_t done = head + num_blocks * 32;
+  sfpu_stochrnd_scalar(to, in + done, (char*)out + done * size, n - done, rounding_mode, rng);
+}
+
+typedef struct sfpu_stochrnd_job_t {
+  sfpu_stochrnd_blocks_fn blocks;
+  int to;
+  const uint32_t* in;
+  void* out;
+  size_t n;
+  unsigned rounding_mode;
+  sfpu_stochrnd_rng_t rng;
+} sfpu_stochrnd_job_t;
+
+static void* sfpu_stochrnd_thread(void* arg) {
+  sfpu_stochrnd_job_t* job = (sfpu_stochrnd_job_t*)arg;
+  sfpu_stochrnd_range(job->blocks, job->to, job->in, job->out, job->n, job->rounding_mode, &job->rng);
+  return NULL;
+}
+
+// Converts in[0 ... n-1] (FP32 bit patterns) into out, using SFPSTOCHRND with the given rounding
+// mode, and taking random bits from rng (which is advanced by n). Uses up to `threads` threads (0
+// meaning one per core), without affecting the results. Returns 0 on success, or -1 if `to` or
+// `rounding_mode` are invalid. Note that Wormhole does not have SFPSTOCHRND_RND_ZERO.
+int sfpu_stochrnd_convert(int to, const uint32_t* in, void* out, size_t n, unsigned rounding_mode, sfpu_stochrnd_rng_t* rng, unsigned threads) {
+  if (to < 0 || to >= SFPU_STOCHRND_NUM_TO || rounding_mode > SFPSTOCHRND_RND_ZERO) return -1;
+  sfpu_stochrnd_blocks_fn blocks = sfpu_stochrnd_blocks_variant(fma_batch_isa());
+  if (threads == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cores > 0 ? (unsigned)cores : 1;
+  }
+  enum { MIN_PER_THREAD = 1 << 16 };
+  if (threads > n / MIN_PER_THREAD) threads = n / MIN_PER_THREAD ? (unsigned)(n / MIN_PER_THREAD) : 1;
+  sfpu_stochrnd_job_t* jobs = threads > 1 ? calloc(threads, sizeof(*jobs)) : NULL;
+  if (!jobs) {
+    sfpu_stochrnd_range(blocks, to, in, out, n, rounding_mode, rng);
+    return 0;
+  }
+  // Contiguous ranges, each a multiple of 32 elements long (other than the last), with each job
+  // getting a copy of rng skipped ahead to the start of its range.
+  size_t per = (n / threads + 31) & ~(size_t)31, start = 0, size = sfpu_stochrnd_out_size[to];
+  pthread_t* workers = calloc(threads, sizeof(*workers));
+  unsigned started = 0;
+  for (unsigned t = 0; t < threads && start < n; ++t) {
+    sfpu_stochrnd_job_t* job = &jobs[t];
+    size_t len = t == threads - 1 || n - start < per ? n - start : per;
+    *job = (sfpu_stochrnd_job_t){blocks, to, in + start, (char*)out + start * size, len, rounding_mode, *rng};
+    sfpu_stochrnd_rng_skip(&job->rng, start);
+    if (t == 0 || !workers || pthread_create(&workers[started], NULL, sfpu_stochrnd_thread, job) != 0) {
+      sfpu_stochrnd_thread(job);
+    } else {
+      ++started;
+    }
+    start += len;
+  }
+  for (unsigned i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+  free(workers);
+  free(jobs);
+  sfpu_stochrnd_rng_skip(rng, n);
+  return 0;
+}
+
+#else // Included from above, with SFPU_STOCHRND_SUFFIX, SFPU_STOCHRND_LANES, and SFPU_STOCHRND_ATTR defined.
+
+// Vectors of the native width, so each 32-element block is 32 / SFPU_STOCHRND_LANES of them.
+#define sfpu_vu FMA_CAT(sfpu_stochrnd_vu_, SFPU_STOCHRND_SUFFIX)
+#define sfpu_vi FMA_CAT(sfpu_stochrnd_vi_, SFPU_STOCHRND_SUFFIX)
+#define sfpu_vu16 FMA_CAT(sfpu_stochrnd_vu16_, SFPU_STOCHRND_SUFFIX)
+#define sfpu_vu8 FMA_CAT(sfpu_stochrnd_vu8_, SFPU_STOCHRND_SUFFIX)
+#define sfpu_vec_convert FMA_CAT(sfpu_stochrnd_vec_convert_, SFPU_STOCHRND_SUFFIX)
+#define sfpu_vec_blocks FMA_CAT(sfpu_stochrnd_vec_blocks_, SFPU_STOCHRND_SUFFIX)
+#define SFPU_VECS (32 / SFPU_STOCHRND_LANES)
+
+typedef uint32_t sfpu_vu __attribute__((vector_size(SFPU_STOCHRND_LANES * 4)));
+typedef int32_t sfpu_vi __attribute__((vector_size(SFPU_STOCHRND_LANES * 4)));
+typedef uint16_t sfpu_vu16 __attribute__((vector_size(SFPU_STOCHRND_LANES * 2)));
+typedef uint8_t sfpu_vu8 __attribute__((vector_size(SFPU_STOCHRND_LANES)));
+
+// Vector versions of sfpu_stochrnd_mix and of sfpstochrnd_model_bh's FP32_TO_ flavours. Comparisons
+// give all-ones for true, so are turned into 0 / 1 by negation, and used as masks by sfpu_vsel.
+#define sfpu_vmix(v) ({ \
+    sfpu_vu x_ = (v); \
+    x_ ^= x_ >> 16; \
+    x_ *= 0x7feb352du; \
+    x_ ^= x_ >> 15; \
+    x_ *= 0x846ca68bu; \
+    x_ ^ (x_ >> 16); \
+  })
+#define sfpu_vsel(mask, a, b) (((a) & (sfpu_vu)(mask)) | ((b) & ~(sfpu_vu)(mask)))
+#define sfpu_vdup(x) ((sfpu_vu){0} + (x))
+
+static inline __attribute__((always_inline)) SFPU_STOCHRND_ATTR
+void sfpu_vec_convert(int to, sfpu_vu c, sfpu_vu bits, void* out) {
+  if (to == SFPU_STOCHRND_TO_BF16 || to == SFPU_STOCHRND_TO_FP16) {
+    unsigned discard = to == SFPU_STOCHRND_TO_FP16 ? 13 : 16;
+    sfpu_vu exp = (c >> 23) & 0xff;
+    sfpu_vu discarded = c & ((1u << discard) - 1);
+    sfpu_vu r = c - discarded + ((sfpu_vu)-(sfpu_vi)(discarded >= (bits >> (23 - discard))) << discard);
+    r = sfpu_vsel(exp == 0, sfpu_vdup(0), r);
+    r = sfpu_vsel(exp == 255, c & 0xff800000u, r);
+    if (to == SFPU_STOCHRND_TO_FP16) {
+      sfpu_vi e = (sfpu_vi)((r >> 23) & 0xff) - 112;
+      sfpu_vu man = (r >> 13) & 0x3ff;
+      man = sfpu_vsel(e <= 0, sfpu_vdup(0), sfpu_vsel(e > 31, sfpu_vdup(0x3ff), man));
+      sfpu_vu ue = sfpu_vsel(e <= 0, sfpu_vdup(0), sfpu_vsel(e > 31, sfpu_vdup(31), (sfpu_vu)e));
+      r = ((r >> 31) << 31) | (ue << 26) | (man << 16);
+    }
+    sfpu_vu16 h = __builtin_convertvector(r >> 16, sfpu_vu16);
+    memcpy(out, &h, sizeof(h));
+  } else {
+    uint32_t max_mag = to == SFPU_STOCHRND_TO_INT8 ? 127 : to == SFPU_STOCHRND_TO_UINT8 ? 255 : to == SFPU_STOCHRND_TO_INT16 ? 32767 : 65535;
+    sfpu_vi e = (sfpu_vi)((c >> 23) & 0xff) - 127;
+    sfpu_vi ec = (sfpu_vi)sfpu_vsel(e < -1, sfpu_vdup(-1), sfpu_vsel(e > 15, sfpu_vdup(15), (sfpu_vu)e));
+    sfpu_vu m = 0x800000 | (c & 0x7fffff);
+    // With mag = m shifted left by ec as in the model: mag >> 23 and mag & 0x7fffff respectively.
+    sfpu_vu int_part = m >> (sfpu_vu)(23 - ec);
+    sfpu_vu frac = (m << (sfpu_vu)(ec + 9)) >> 9;
+    sfpu_vu mag = int_part + (sfpu_vu)-(sfpu_vi)(frac >= bits);
+    mag = sfpu_vsel(mag > max_mag, sfpu_vdup(max_mag), mag);
+    mag = sfpu_vsel(e < -1, sfpu_vdup(0), sfpu_vsel(e >= 16, sfpu_vdup(max_mag), mag));
+    if (to == SFPU_STOCHRND_TO_INT8 || to == SFPU_STOCHRND_TO_INT16) {
+      mag = sfpu_vsel((sfpu_vi)c < 0, -mag, mag); // The sign is dropped for zero either way
+    }
+    if (to == SFPU_STOCHRND_TO_INT8 || to == SFPU_STOCHRND_TO_UINT8) {
+      // Via 16 bits, as GCC packs that way rather than element by element.
+      sfpu_vu16 h = __builtin_convertvector(mag & 0xff, sfpu_vu16);
+      sfpu_vu8 b = __builtin_convertvector(h, sfpu_vu8);
+      memcpy(out, &b, sizeof(b));
+    } else {
+      sfpu_vu16 h = __builtin_convertvector(mag, sfpu_vu16);
+      memcpy(out, &h, sizeof(h));
+    }
+  }
+}
+
+static inline __attribute__((always_inline)) SFPU_STOCHRND_ATTR
+void sfpu_vec_blocks(int to, const uint32_t* in, void* out, size_t num_blocks, unsigned rounding_mode, sfpu_stochrnd_rng_t* rng) {
+  size_t out_size = sfpu_stochrnd_out_size[to];
+  int hardware = rng->kind == SFPU_STOCHRND_RNG_HARDWARE;
+  uint64_t position = rng->position;
+  sfpu_vu state[SFPU_VECS], lane;
+  memcpy(state, rng->lane_state, sizeof(state));
+  for (unsigned i = 0; i < SFPU_STOCHRND_LANES; ++i) lane[i] = i;
+  uint32_t k0, k1;
+  sfpu_stochrnd_keys(rng->seed, (uint32_t)(position >> 32), &k0, &k1);
+  for (size_t blk = 0; blk < num_blocks; ++blk, position += 32) {
+    if (!hardware && !(uint32_t)position) sfpu_stochrnd_keys(rng->seed, (uint32_t)(position >> 32), &k0, &k1);
+#pragma GCC unroll 8
+    for (unsigned j = 0; j < SFPU_VECS; ++j) {
+      sfpu_vu prng;
+      if (hardware) {
+        prng = state[j];
+        sfpu_vu taps = prng ^ (prng >> 1) ^ (prng >> 21) ^ (prng >> 31);
+        state[j] = (~taps << 31) | (prng >> 1);
+      } else {
+        prng = sfpu_vmix(sfpu_vmix((lane + ((uint32_t)position + j * SFPU_STOCHRND_LANES)) ^ k0) ^ k1);
+      }
+      sfpu_vu bits = rounding_mode == SFPSTOCHRND_RND_NEAREST ? sfpu_vdup(0x400000)
+        : rounding_mode == SFPSTOCHRND_RND_ZERO ? sfpu_vdup(0x7fffff) : prng & 0x7fffff;
+      size_t i = blk * 32 + j * SFPU_STOCHRND_LANES;
+      sfpu_vu c;
+      memcpy(&c, in + i, sizeof(c));
+      sfpu_vec_convert(to, c, bits, (char*)out + i * out_size);
+    }
+  }
+  memcpy(rng->lane_state, state, sizeof(state));
+  rng->position = position;
+}
+
+// Specialised for each conversion.
+SFPU_STOCHRND_ATTR
+static void FMA_CAT(sfpu_stochrnd_blocks_, SFPU_STOCHRND_SUFFIX)(int to, const uint32_t* in, void* out, size_t num_blocks, unsigned rounding_mode, sfpu_stochrnd_rng_t* rng) {
+  switch (to) {
+  case SFPU_STOCHRND_TO_BF16: sfpu_vec_blocks(SFPU_STOCHRND_TO_BF16, in, out, num_blocks, rounding_mode, rng); break;
+  case SFPU_STOCHRND_TO_FP16: sfpu_vec_blocks(SFPU_STOCHRND_TO_FP16, in, out, num_blocks, rounding_mode, rng); break;
+  case SFPU_STOCHRND_TO_INT8: sfpu_vec_blocks(SFPU_STOCHRND_TO_INT8, in, out, num_blocks, rounding_mode, rng); break;
+  case SFPU_STOCHRND_TO_UINT8: sfpu_vec_blocks(SFPU_STOCHRND_TO_UINT8, in, out, num_blocks, rounding_mode, rng); break;
+  case SFPU_STOCHRND_TO_INT16: sfpu_vec_blocks(SFPU_STOCHRND_TO_INT16, in, out, num_blocks, rounding_mode, rng); break;
+  default: sfpu_vec_blocks(SFPU_STOCHRND_TO_UINT16, in, out, num_blocks, rounding_mode, rng); break;
+  }
+}
+
+#undef sfpu_vdup
+#undef sfpu_vsel
+#undef sfpu_vmix
+#undef SFPU_VECS
+#undef sfpu_vec_blocks
+#undef sfpu_vec_convert
+#undef sfpu_vu8
+#undef sfpu_vu16
+#undef sfpu_vi
+#undef sfpu_vu
+#endif